@@ -14,6 +14,10 @@ local macro = common.macro
 local pfunction = common.pfunction
 local ast = import "ast"
 local lpeg = import "lpeg"
+local list = import "list"
+local utf8 = require "utf8"
+local ustring = import "ustring"
+local casefold = import "casefold"
 
 local locale = common.locale
 
@@ -106,21 +110,66 @@ local function macro_findall(...)
    return ast.repetition.new{min=1, exp=find, cooked=false, sourceref=exp.sourceref}
 end
 
--- TODO: rewrite this with utf8 support (without relying on every literal being valid utf8)
+-- Case folding for ci.  Two characters are the same, ignoring case, when they have the same
+-- Unicode simple case folding.  The equivalence classes are built from the fold table on first
+-- use.
+local case_classes = false
+
+local function build_case_classes()
+   case_classes = {}
+   for cp, folded in pairs(casefold) do
+      if not case_classes[folded] then case_classes[folded] = {folded}; end
+      table.insert(case_classes[folded], cp)
+   end
+   for _, class in pairs(case_classes) do table.sort(class); end
+end
+
+-- Return the list of characters equal to char ignoring case, or nil when there are none other
+-- than char itself.  A byte that is not valid utf-8 has no other case.
+local function case_variants(char)
+   local ok, cp = pcall(utf8.codepoint, char)
+   if not (ok and (utf8.char(cp)==char)) then return nil; end
+   if not case_classes then build_case_classes(); end
+   local class = case_classes[casefold[cp] or cp]
+   if not class then return nil; end
+   local chars = {}
+   for i, cp in ipairs(class) do chars[i] = utf8.char(cp); end
+   return chars
+end
+
+-- Each character of a literal that has other cases becomes a character set of its case
+-- variants, which compiles to one set test (or a small byte-range automaton for utf-8), and the
+-- runs of characters in between stay literal.  E.g. "ibm-1" becomes {[Ii] [Bb] [Mm] "-1"}.
 local function macro_case_insensitive(...)
    local args = {...}
    if #args~=1 then error("ci takes one argument, " .. tostring(#args) .. " given"); end
    local exp = args[1]
    local function xform_literal(exp)
-      local lc, uc = string.lower(exp.value), string.upper(exp.value)
-      local chars = list.new()
-      for i = 1, #exp.value do
-	 local upper_lower_choices =
-	    { ast.literal.new{value=uc:sub(i,i), sourceref=exp.sourceref},
-	      ast.literal.new{value=lc:sub(i,i), sourceref=exp.sourceref} }
-	 table.insert(chars, ast.choice.new{exps=upper_lower_choices, sourceref=exp.sourceref})
+      local sref = exp.sourceref
+      local str = ustring.unescape_string(exp.value)
+      -- The compiler reports an invalid escape sequence in the original literal
+      if not str then return exp; end
+      local exps = list.new()
+      local run = {}
+      local function end_run()
+	 if run[1] then
+	    local value = table.concat(run):gsub('[\\"]', '\\%0')
+	    table.insert(exps, ast.literal.new{value=value, sourceref=sref})
+	    run = {}
+	 end
+      end
+      for _, char in ipairs(ustring.explode(str)) do
+	 local variants = case_variants(char)
+	 if variants then
+	    end_run()
+	    local cexp = ast.cs_list.new{chars=variants, complement=false, sourceref=sref}
+	    table.insert(exps, ast.bracket.new{cexp=cexp, complement=false, sourceref=sref})
+	 else
+	    table.insert(run, char)
+	 end
       end
-      return ast.raw.new{exp=ast.sequence.new{exps=chars, sourceref=exp.sourceref}, sourceref=exp.sourceref}
+      end_run()
+      return ast.raw.new{exp=ast.sequence.new{exps=exps, sourceref=sref}, sourceref=sref}
    end
    return ast.visit_expressions(exp, ast.literal.is, xform_literal)
 end
@@ -56,6 +56,56 @@ local function import_dependencies(en, a, msgs)
    return all_ok
 end
 
+local function pattern_expression(args)
+   if args.fixed_strings then
+      -- FUTURE: rosie.expr.literal(arg[2])
+      return '"' .. args.pattern:gsub('"', '\\"') .. '"'
+   else
+      return args.pattern
+   end
+end
+
+-- Return a choice of the literal strings in the file (one per line, ignoring empty lines), or
+-- nil and an error message.  The ast is built directly, because a choice of many thousands of
+-- strings is too deeply nested for the parser.
+local function fixed_strings_ast(filename)
+   local f, msg = io.open(filename, "r")
+   if not f then return nil, msg; end
+   local sref = common.source.new{text="", origin=common.loadrequest.new{filename=filename}}
+   local exps = {}
+   for line in f:lines() do
+      line = line:gsub("\r$", "")
+      if #line > 0 then
+	 local value = line:gsub('[\\"]', '\\%0')
+	 table.insert(exps, ast.literal.new{value=value, sourceref=sref})
+      end
+   end
+   f:close()
+   if #exps == 0 then return nil, "no strings found in " .. filename; end
+   if #exps == 1 then return exps[1]; end
+   return ast.choice.new{exps=exps, sourceref=sref}
+end
+
+-- Return the text of the expression that setup_engine compiles, for use by other engines that
+-- have replayed the history of en.  For grep, the (cooked) expression is an argument to findall,
+-- as in setup_engine.  There is no text for the strings of --fixed-file.
+function p.pattern_source(args)
+   if args.fixed_file then return nil; end
+   local expression = pattern_expression(args)
+   if (args.command=="grep") then
+      return "findall:(" .. expression .. ")"
+   end
+   return expression
+end
+
+-- The list of capture names given with --captures, or nil
+function p.capture_names(args)
+   if not args.captures then return nil; end
+   local names = {}
+   for name in args.captures:gmatch("[^,%s]+") do table.insert(names, name); end
+   return names
+end
+
 function p.setup_engine(en, args)
    -- (1a) Load whatever is specified in ~/.rosierc ???
 
@@ -101,20 +151,30 @@ function p.setup_engine(en, args)
    end
    -- (2) Compile the expression
    local compiled_pattern
-   if args.pattern then
-      local expression
-      if args.fixed_strings then
-	 -- FUTURE: rosie.expr.literal(arg[2])
-	 expression = '"' .. args.pattern:gsub('"', '\\"') .. '"'
+   if args.fixed_file and args.pattern then
+      -- There is no pattern argument, so the first argument is the first input file
+      if (#args.filename == 1) and (args.filename[1] == "-") then
+	 args.filename = {args.pattern}
       else
-	 expression = args.pattern
+	 table.insert(args.filename, 1, args.pattern)
       end
+      args.pattern = nil
+   end
+   if args.pattern or args.fixed_file then
       local errs = {}
-
-      local AST = en.compiler.parse_expression(common.source.new{text=expression}, errs)
-      if not AST then
-	 write_error(table.concat(map(violation.tostring, errs), "\n"), "\n")
-	 return p.ERROR_RESULT
+      local AST, msg
+      if args.fixed_file then
+	 AST, msg = fixed_strings_ast(args.fixed_file)
+	 if not AST then
+	    write_error("Cannot read fixed strings: ", msg, "\n")
+	    return p.ERROR_USAGE
+	 end
+      else
+	 AST = en.compiler.parse_expression(common.source.new{text=pattern_expression(args)}, errs)
+	 if not AST then
+	    write_error(table.concat(map(violation.tostring, errs), "\n"), "\n")
+	    return p.ERROR_RESULT
+	 end
       end
 
       if (args.command=="grep") then
@@ -129,7 +189,7 @@ function p.setup_engine(en, args)
       -- Nothing to do if the automated import fails, because the user may have included an
       -- --rpl option with an "import ... as" statement, or an "import foo/bar/baz".
       local ok, errs
-      compiled_pattern, errs = en:compile(AST)
+      compiled_pattern, errs = en:compile(AST, p.capture_names(args))
       if not compiled_pattern then
 	 write_error(table.concat(map(violation.tostring, errs), "\n"), "\n")
 	 return p.ERROR_RESULT
@@ -48,10 +48,17 @@ function match.process_pattern_against_file(rosie, en, args, compiled_pattern, i
    
    local default_encoder = (args.command=="grep") and "line" or "color"
    local encoder = ((args.encoder ~= "default") and args.encoder) or default_encoder
+   -- With --count, no output file is opened, even with --all, so the lines are only counted, and
+   -- the pattern is matched without its captures (because the 'bool' encoder does not use them).
+   if args.count then
+      encoder = "bool"
+      outfilename, errfilename = nil, nil
+   end
    
    local ok, msg = readable_file(infilename)
    local printable_infilename = (infilename ~= "") and infilename or "stdin"
-   if (args.verbose) or (#args.filename > 1) then
+   local show_filename = (args.verbose) or (#args.filename > 1)
+   if show_filename and (not args.count) then
       if ok then io.write(printable_infilename, ":\n"); end    -- print name of file before its output
    end
    if not ok then
@@ -61,15 +68,42 @@ function match.process_pattern_against_file(rosie, en, args, compiled_pattern, i
    
    -- Iterate through the lines in the input file
    local match_function = (args.command=="trace") and en.tracefile or en.matchfile
-   local trace_style = (args.verbose and "full" or "condensed")
+   local trace_style = (args.stream and "stream") or (args.verbose and "full" or "condensed")
+   if args.max_nodes then rosie.env.trace.max_nodes = (args.max_nodes > 0) and args.max_nodes; end
 
-   local ok, cin, cout, cerr =
-      pcall(match_function, en, compiled_pattern,
-	    infilename, outfilename, errfilename,
-	    (args.command=="trace") and trace_style or encoder,
-	    args.wholefile)
+   local ok, cin, cout, cerr
+   local source = cli_common.pattern_source(args)
+   local profiler = args.profile and {profile=rosie.env.profile.new(), rate=args.profile_rate or 1}
+   if args.threads and source and (args.command~="trace") and (not args.wholefile) and (not profiler) then
+      -- The lines are matched by a pool of engines (created by rosie.c) which replay the
+      -- history of en, and then compile the same expression.
+      ok, cin, cout, cerr =
+	 pcall(cli_parallel_matchfile, args.threads, en.history, source,
+	       infilename, outfilename, errfilename, encoder, cli_common.capture_names(args))
+   else
+      ok, cin, cout, cerr =
+	 pcall(match_function, en, compiled_pattern,
+	       infilename, outfilename, errfilename,
+	       (args.command=="trace") and trace_style or encoder,
+	       args.wholefile,
+	       profiler)
+   end
 
    if not ok then write_error(cin, "\n"); return; end	-- cin is error message (a string) in this case
+
+   if args.count and cin then
+      if show_filename then io.write(printable_infilename, ":"); end
+      io.write(tostring(cout), "\n")
+   end
+
+   if profiler then
+      local profile = rosie.env.profile
+      if args.profile_format == "folded" then
+	 write_error(profile.folded(profiler.profile), "\n")
+      else
+	 write_error(profile.report(profiler.profile), "\n")
+      end
+   end
    
    -- (6) Print summary
    if args.verbose then
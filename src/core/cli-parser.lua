@@ -124,14 +124,67 @@ function p.create(rosie)
       cmd:flag("-F --fixed-strings", "Interpret the pattern as a fixed string, not an RPL pattern")
       :default(false)
       :action("store_true")
+      cmd:option("--fixed-file", "Match any of the fixed strings (one per line) in a file, "
+		 .. "in place of the pattern argument")
+      :args(1)
+      :target("fixed_file")			      -- args.fixed_file
+      :default(false)
 
       -- match/trace/grep arguments (required options)
-      cmd:argument("pattern", "RPL pattern")
+      cmd:argument("pattern", "RPL pattern (omitted with --fixed-file)")
+      :args("?")				      -- checked in cli.lua
       cmd:argument("filename", "Input filename")
       :args("+")
       :default("-")			      -- in case no filenames are passed, default to stdin
       :defmode("arg")			      -- needed to make the default work
    end
+   for _, cmd in ipairs{cmd_match, cmd_grep} do
+      cmd:flag("-c --count", "Output only the number of matching lines in each input file "
+	       .. "(--all is ignored)")
+      :default(false)
+      :action("store_true")
+      cmd:option("--captures", "Output only the captures with these names (comma-separated), "
+		 .. "under the top-level match")
+      :args(1)
+      :target("captures")			      -- args.captures
+      cmd:option("--threads", "Match the input lines in parallel using N threads (0 means one per cpu)")
+      :convert(function(a)
+		  local n = tonumber(a)
+		  if n and (n >= 0) and (math.floor(n) == n) then return n; end
+		  return nil
+	       end)
+      :args(1)
+      :target("threads")			      -- args.threads
+   end
+   cmd_match:flag("--profile", "Report how much matching time is spent in each pattern (to stderr)")
+   :default(false)
+   :action("store_true")
+   cmd_match:option("--profile-rate", "Profile every Nth input line (default 1)")
+   :convert(function(a)
+	       local n = tonumber(a)
+	       if n and (n >= 1) and (math.floor(n) == n) then return n; end
+	       return nil
+	    end)
+   :args(1)
+   :target("profile_rate")			      -- args.profile_rate
+   cmd_match:option("--profile-format", "Profile output, one of: report, folded (for flame graphs)")
+   :convert(function(a)
+	       if (a == "report") or (a == "folded") then return a; end
+	       return nil
+	    end)
+   :args(1)
+   :target("profile_format")			      -- args.profile_format
+   cmd_trace:flag("--stream", "Write a compact trace as it is computed (for long inputs)")
+   :default(false)
+   :action("store_true")
+   cmd_trace:option("--max-nodes", "Expand at most N steps of the trace of each input (0 for no limit)")
+   :convert(function(a)
+	       local n = tonumber(a)
+	       if n and (n >= 0) and (math.floor(n) == n) then return n; end
+	       return nil
+	    end)
+   :args(1)
+   :target("max_nodes")				      -- args.max_nodes
    return parser
 end
 
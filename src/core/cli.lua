@@ -125,6 +125,7 @@ local function run(args)
       local common = assert(rosie.env.common)			    -- TODO: MOVE THIS!
       local ast = assert(rosie.env.ast)				    -- TODO: MOVE THIS!
       local expand = assert(rosie.env.expand)			    -- TODO: MOVE THIS!
+      local optimize = assert(rosie.env.optimize)		    -- TODO: MOVE THIS!
       local violation = assert(rosie.env.violation)		    -- TODO: MOVE THIS!
       local errs = {}
       local cl_engine = assert(cli_engine) --create_cl_engine()
@@ -147,6 +148,16 @@ local function run(args)
       else
 	 print(string.format("Expands to:     %s", representation))
       end
+      local oa = optimize.expression(aa, cl_engine.env)
+      representation = ast.tostring(oa, true)
+      if ast.sequence.is(oa) then
+	 print(string.format("Optimizes to:   {%s}", representation))
+      else
+	 print(string.format("Optimizes to:   %s", representation))
+      end
+      -- The sizes are estimated from the ast (see optimize.size), not counted in the compiled peg
+      print(string.format("Size (est.):    %d before optimizing, %d after",
+			  optimize.size(aa), optimize.size(oa)))
       return
    end
    
@@ -189,6 +200,18 @@ local function run(args)
       end
    end
    
+   if (args.command=="match") or (args.command=="trace") or (args.command=="grep") then
+      -- The pattern argument is optional only because --fixed-file takes its place
+      if (not args.pattern) and (not args.fixed_file) then
+	 parser:error("missing argument 'pattern'")
+      end
+      -- The pool engines compile the pattern from its source text, and there is none for the
+      -- strings of --fixed-file (see cli_common.pattern_source)
+      if args.fixed_file and args.threads then
+	 parser:error("option '--threads' cannot be used with '--fixed-file'")
+      end
+   end
+
    local compiled_pattern = cli_common.setup_engine(en, args);
    if type(compiled_pattern)=="number" then -- return the error
       return compiled_pattern
@@ -323,4 +323,26 @@ function co.match(match, input, colors)
    return table.concat(tbl)
 end
 
+-- The color database in the form used by the C color encoder: each pattern name (or "pkg.*", or
+-- "*") is mapped to the escape sequence that starts its color.  It is compiled once for each
+-- colors setting.
+local function colordb1(colors)
+   local db = (colors and db_from_colors(colors)) or co.colormap
+   local sgr = {}
+   for name, color_spec in pairs(db) do
+      sgr[name] = "\027[" .. table.concat(color_spec_to_numbers(color_spec), ";") .. "m"
+   end
+   return common.rencode.colordb(sgr)
+end
+
+local colordb = memoize(colordb1)
+
+-- Color the byte-encoded match m of input, in C when possible
+function co.encode(m, input, colors)
+   if common.native_encoders then
+      return common.rencode.color(m, input, colordb(colors or false))
+   end
+   return co.match(common.byte_to_lua(m, input), input, colors)
+end
+
 return co
@@ -249,6 +249,16 @@ local function insert_input_text(m, input)
    return m
 end
 
+-- Return false when the string input, from start, contains none of the literals in prefilter,
+-- so that it cannot match the pattern whose prefilter it is.
+function common.prefilter_pass(prefilter, input, start)
+   if (not prefilter) or (type(input)~="string") then return true; end
+   for _, lit in ipairs(prefilter) do
+      if input:find(lit, start, true) then return true; end
+   end
+   return false
+end
+
 function common.match(peg, input, start, rmatch_encoder, fn_encoder, parms, total_time, lpegvm_time)
    local m, leftover, abend, t1, t2 = peg:rmatch(input, start, rmatch_encoder, total_time, lpegvm_time)
    if m==0 then return false, start, abend, t1, t2; end
@@ -367,9 +377,12 @@ common.pattern =
 		    peg=NIL;		 -- lpeg pattern
 		    exported=true;	 -- true when the binding to this pattern is exported
 		    uncap=false;	 -- peg without the top-level capture
+		    label=false;	 -- name of the top-level capture, when uncap is set
 		    alias=false;	 -- is this an alias or not
 		    ast=false;		 -- ast that generated this pattern, for pattern debugging
 		    extra=false;	 -- extra info that depends on node type
+		    prefilter=false;	 -- literals of which a match must contain one (see compile.lua)
+		    nocap=false;	 -- peg with only the top-level capture, built when needed
 --                  source=unspecified;  -- source (rpl filename and line)
   }
 )
@@ -455,7 +468,14 @@ end
 -- Output encoding functions
 ----------------------------------------------------------------------------------------
 
+-- The rencode module from librosie decodes the byte encoding in C (see encode.c).  When it is not
+-- available, the match is decoded by lpeg, and the text of each node is inserted here.
+local rencode_ok, rencode = pcall(require, "rencode")
+common.rencode = (rencode_ok and type(rencode)=="table") and rencode
+common.native_encoders = common.rencode and true
+
 function common.byte_to_lua(m, input)
+   if common.native_encoders then return rencode.default(m, input); end
    return insert_input_text(lpeg.decode(m), input)
 end
 
@@ -484,7 +504,7 @@ common.encoder_table =
    setmetatable({ line = {common.LINE_ENCODING, identity_fn},
 		  json = {common.JSON_ENCODING, identity_fn},
 		  byte = {common.BYTE_ENCODING, identity_fn},
-		  bool = {common.LINE_ENCODING, function(...) return match_without_data end},
+		  bool = {common.LINE_ENCODING, function(...) return match_without_data end, true},
 		  default = {common.BYTE_ENCODING, common.byte_to_lua},
 	       },
 	     {__index = function(...) return error_encoder end})
@@ -494,14 +514,19 @@ function common.encoder_returns_userdata(encoder)
    return fn and (fn[2] == identity_fn) and true
 end
 
-function common.add_encoder(name, rmatch_arg, fn)
+-- When optional_without_data is true, the encoder reports only whether there was a match (like
+-- 'bool'), so the captures are not needed, and the pattern is matched without them (see
+-- nocap_peg in engine_module.lua).
+function common.add_encoder(name, rmatch_arg, fn, optional_without_data)
    assert(rmatch_arg and fn, "bad arg to add_encoder")
-   common.encoder_table[name] = {rmatch_arg, fn}
+   common.encoder_table[name] = {rmatch_arg, fn, optional_without_data or nil}
 end
 
+-- Returns the rmatch encoder, the Lua function that processes its output, and true when the
+-- encoder does not use the match data.
 function common.lookup_encoder(name)
    local entry = common.encoder_table[name]
-   return entry[1], entry[2]
+   return entry[1], entry[2], entry[3]
 end
 
 -- Do not want to depend at all on the process or thread's locale setting.  This
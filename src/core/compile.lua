@@ -32,6 +32,8 @@ local recordtype = require "recordtype"
 parent = recordtype.parent
 local environment = require "environment"
 local expand = require "expand"
+local optimize = require "optimize"
+local pkgcache = require "pkgcache"
 
 local function raise_error(msg, a)
    return violation.raise(violation.compile.new{who='compiler',
@@ -253,8 +255,63 @@ local function sequence(a, env, prefix, messages)
    return a.pat
 end
 
+-- A choice of many literals (e.g. a keyword list) compiles into a trie instead of a chain of
+-- alternatives, so that the cost of matching depends on the length of the input, not on the
+-- number of literals.  At each node of the trie, the alternatives are the bytes that continue
+-- some literal, which lpeg tests with a jump on the next byte.
+local TRIE_MIN = 16				    -- fewest literals for a trie
+
+-- Return a peg for the node of a trie that matches as the ordered choice of the literals would.
+-- Limit is the position (in the choice) of the first literal that has already matched, and no
+-- literal in a later position can win.
+local function trie_peg(node, limit)
+   if node.term and (node.term < limit) then limit = node.term; end
+   local bytes = {}
+   for b, child in pairs(node.children) do
+      if child.first < limit then table.insert(bytes, b); end
+   end
+   table.sort(bytes)
+   local peg = P(false)
+   for _, b in ipairs(bytes) do
+      peg = peg + (P(string.char(b)) * trie_peg(node.children[b], limit))
+   end
+   -- Any literal that ends here wins over the longer ones that come after it in the choice
+   if node.term and (node.term == limit) then peg = peg + P(true); end
+   return peg
+end
+
+-- Return true when a is a choice of at least TRIE_MIN literals
+local function is_literal_choice(a)
+   if #a.exps < TRIE_MIN then return false; end
+   for _, exp in ipairs(a.exps) do
+      if not ast.literal.is(exp) then return false; end
+   end
+   return true
+end
+
+-- Return a trie peg for a choice of literals that have been compiled
+local function literal_choice(a)
+   local root = {children={}, first=1}
+   for i, exp in ipairs(a.exps) do
+      local str = ustring.unescape_string(exp.value)
+      local node = root
+      for j = 1, #str do
+	 local b = str:byte(j)
+	 if not node.children[b] then node.children[b] = {children={}, first=i}; end
+	 node = node.children[b]
+      end
+      node.term = node.term or i
+   end
+   return trie_peg(root, math.huge)
+end
+
 local function choice(a, env, prefix, messages)
 --   assert(#a.exps > 0, "empty choice?")
+   if is_literal_choice(a) then
+      for _, exp in ipairs(a.exps) do expression(exp, env, prefix, messages); end
+      a.pat = pattern.new{name="choice", peg=literal_choice(a), ast=a}
+      return a.pat
+   end
    local peg = expression(a.exps[1], env, prefix, messages).peg
    for i = 2, #a.exps do
       peg = peg + expression(a.exps[i], env, prefix, messages).peg
@@ -320,17 +377,206 @@ local function cs_named(a, env, prefix, messages)
    return a.pat
 end
 
--- FUTURE optimization: The multi-byte chars can be organized by common prefix. 
-local function utf8_range_to_peg(cp1, cp2)
-   local peg = lpeg.P(false)
-   for cp = cp1, cp2 do
-      local char = utf8.char(cp)
-      if not char then return nil, "invalid unicode codepoint: " .. tostring(cp); end
-      peg = peg + lpeg.P(char)
+---------------------------------------------------------------------------------------------------
+-- Character sets
+---------------------------------------------------------------------------------------------------
+
+-- A character set is compiled into a set of single bytes, which lpeg tests with one instruction,
+-- and a byte-range automaton for the multi-byte utf-8 characters.  The codepoints of the set are
+-- collected as a list of ranges, which are merged and then split (as in RE2) into sequences of
+-- byte ranges, such as [\xE1-\xEF][\x80-\xBF][\x80-\xBF].  Sequences that start with the same
+-- byte range share one test of that range.  Every alternative matches exactly one character,
+-- whose length is given by its first byte, so the order of those alternatives does not matter.
+--
+-- That is not true of single bytes from \x80 to \xFF, which are prefixes of multi-byte
+-- characters, nor of "characters" that are not valid utf-8, which are matched as literals.  When
+-- such a byte or literal could compete with another non-ascii alternative, the set is compiled
+-- instead as an ordered choice of its items, in the order in which they were written.
+
+local utf8_max = {0x7F, 0x7FF, 0xFFFF, 0x1FFFFF, 0x3FFFFFF, 0x7FFFFFFF}
+
+local function new_charset()
+   return {bytes={}, ranges={}, others={}, items={}, high=false}
+end
+
+-- Add the codepoints cp1 to cp2 (inclusive) to the bytes and ranges of cs
+local function charset_add_codepoints(cs, cp1, cp2)
+   if cp1 <= 0x7F then
+      for b = cp1, math.min(cp2, 0x7F) do cs.bytes[b] = true; end
+      cp1 = 0x80
+   end
+   if cp1 <= cp2 then table.insert(cs.ranges, {cp1, cp2}); end
+end
+
+-- Add the codepoints cp1 to cp2 (inclusive) to cs
+local function charset_add_range(cs, cp1, cp2)
+   table.insert(cs.items, {cp1, cp2})
+   charset_add_codepoints(cs, cp1, cp2)
+end
+
+-- Add the bytes b1 to b2 (inclusive) to cs
+local function charset_add_bytes(cs, b1, b2)
+   table.insert(cs.items, {bytes=string.char(b1, b2)})
+   for b = b1, b2 do cs.bytes[b] = true; end
+   cs.high = cs.high or (b2 > 0x7F)
+end
+
+-- Add the (pseudo-)character char to cs.  A char that is not the utf-8 encoding of one codepoint
+-- is matched as a literal.
+local function charset_add_char(cs, char)
+   if #char==1 then
+      return charset_add_bytes(cs, char:byte(1), char:byte(1))
+   end
+   table.insert(cs.items, char)
+   local ok, cp = pcall(utf8.codepoint, char)
+   if ok and (utf8.char(cp)==char) then
+      charset_add_codepoints(cs, cp, cp)
+   else
+      table.insert(cs.others, char)
+   end
+end
+
+-- Append to seqs the byte range sequences that match the codepoints from lo to hi, which are
+-- encoded by the same number of bytes or more.
+local function utf8_byte_ranges(lo, hi, seqs)
+   for n = 1, #utf8_max - 1 do
+      local max = utf8_max[n]
+      if (lo <= max) and (hi > max) then
+	 utf8_byte_ranges(lo, max, seqs)
+	 return utf8_byte_ranges(max+1, hi, seqs)
+      end
+   end
+   for i = 1, #utf8_max - 1 do
+      local m = (1 << (6*i)) - 1
+      if (lo & ~m) ~= (hi & ~m) then
+	 if (lo & m) ~= 0 then
+	    utf8_byte_ranges(lo, lo | m, seqs)
+	    return utf8_byte_ranges((lo | m) + 1, hi, seqs)
+	 end
+	 if (hi & m) ~= m then
+	    utf8_byte_ranges(lo, (hi & ~m) - 1, seqs)
+	    return utf8_byte_ranges(hi & ~m, hi, seqs)
+	 end
+      end
+   end
+   local s, e = utf8.char(lo), utf8.char(hi)
+   local seq = {}
+   for i = 1, #s do seq[i] = {s:byte(i), e:byte(i)}; end
+   table.insert(seqs, seq)
+end
+
+-- Return a peg for the byte range sequences, which all have the same ranges before position ix
+local function byte_ranges_to_peg(seqs, ix)
+   local groups, keys = {}, {}
+   for _, seq in ipairs(seqs) do
+      local key = seq[ix][1] * 256 + seq[ix][2]
+      if not groups[key] then
+	 groups[key] = {}
+	 table.insert(keys, key)
+      end
+      table.insert(groups[key], seq)
+   end
+   table.sort(keys)
+   local peg = P(false)
+   for _, key in ipairs(keys) do
+      local group = groups[key]
+      local test = R(string.char(key // 256, key % 256))
+      if #group[1] == ix then
+	 peg = peg + test
+      else
+	 peg = peg + (test * byte_ranges_to_peg(group, ix+1))
+      end
+   end
+   return peg
+end
+
+-- Return true if the alternatives for cs must be tried in the order in which they were written
+local function charset_is_ordered(cs)
+   return ((cs.others[1] ~= nil) and (cs.items[2] ~= nil)) or (cs.high and (cs.ranges[1] ~= nil))
+end
+
+local charset_to_peg
+
+local function ordered_charset_to_peg(cs)
+   local peg = P(false)
+   for _, item in ipairs(cs.items) do
+      if type(item)=="string" then
+	 peg = peg + P(item)
+      elseif item.bytes then
+	 peg = peg + R(item.bytes)
+      elseif item.set then
+	 peg = peg + item.set
+      else
+	 local one = new_charset()
+	 charset_add_codepoints(one, item[1], item[2])
+	 peg = peg + charset_to_peg(one)
+      end
+   end
+   return peg
+end
+
+function charset_to_peg(cs)
+   if charset_is_ordered(cs) then return ordered_charset_to_peg(cs); end
+   local peg = P(false)
+   if cs.ranges[1] then
+      -- Merge the ranges that overlap or touch
+      table.sort(cs.ranges, function(r1, r2) return r1[1] < r2[1]; end)
+      local merged = {}
+      for _, r in ipairs(cs.ranges) do
+	 local last = merged[#merged]
+	 if last and (r[1] <= last[2] + 1) then
+	    last[2] = math.max(last[2], r[2])
+	 else
+	    table.insert(merged, {r[1], r[2]})
+	 end
+      end
+      local seqs = {}
+      for _, r in ipairs(merged) do utf8_byte_ranges(r[1], r[2], seqs); end
+      peg = byte_ranges_to_peg(seqs, 1)
    end
+   for _, char in ipairs(cs.others) do peg = peg + P(char); end
+   local bytes = {}
+   for b in pairs(cs.bytes) do table.insert(bytes, string.char(b)); end
+   if bytes[1] then peg = peg + S(table.concat(bytes)); end
    return peg
 end
 
+-- Add to cs the characters of the character set expression a, and return true, or return false
+-- if a is not a simple character set.
+local function charset_add(cs, a)
+   if a.complement then
+      return false
+   elseif ast.cs_list.is(a) then
+      for _, char in ipairs(a.chars) do charset_add_char(cs, char); end
+   elseif ast.cs_range.is(a) and (#a.first==1) and (#a.last==1) then
+      -- An invalid range is left to cs_range, which reports the error
+      if a.first:byte(1) >= a.last:byte(1) then return false; end
+      charset_add_bytes(cs, a.first:byte(1), a.last:byte(1))
+   elseif ast.cs_range.is(a) then
+      local ok1, cp1 = pcall(utf8.codepoint, a.first)
+      local ok2, cp2 = pcall(utf8.codepoint, a.last)
+      if not (ok1 and ok2 and (cp1 < cp2)) then return false; end
+      charset_add_range(cs, cp1, cp2)
+   elseif ast.cs_named.is(a) and locale[a.name] then
+      table.insert(cs.items, {set=locale[a.name]})
+      for b = 0, 255 do
+	 if locale[a.name]:match(string.char(b)) then
+	    cs.bytes[b] = true
+	    cs.high = cs.high or (b > 0x7F)
+	 end
+      end
+   elseif ast.bracket.is(a) then
+      return charset_add(cs, a.cexp)
+   elseif ast.choice.is(a) then
+      for _, exp in ipairs(a.exps) do
+	 if not charset_add(cs, exp) then return false; end
+      end
+   else
+      return false
+   end
+   return true
+end
+
 local function cs_range(a, env, prefix, messages)
    local dot = lookup_builtin('.', env, a)
    local c1, c2 = a.first, a.last
@@ -363,28 +609,23 @@ local function cs_range(a, env, prefix, messages)
       if cp1 == cp2 then
 	 raise_error("character range contains only one character", a)
       end
-      local peg, msg = utf8_range_to_peg(cp1, cp2)
-      if not peg then raise_error(msg, a); end
+      local cs = new_charset()
+      charset_add_range(cs, cp1, cp2)
+      local peg = charset_to_peg(cs)
       a.pat = pattern.new{name="cs_range", peg=(a.complement and (dot-peg)) or peg, ast=a}
       return a.pat
    end
 end
 
--- FUTURE optimization: The multi-byte chars can be organized by common prefix. 
--- Note that this approach works for non-UTF8 characters as well.  
-local function utf8_charlist_to_peg(chars)
-   local peg = lpeg.P(false)
-   for _, char in ipairs(chars) do
+function cs_list(a, env, prefix, messages)
+   local dot = lookup_builtin('.', env, a)
+   local cs = new_charset()
+   for _, char in ipairs(a.chars) do
       -- Length 1 is enforced by ustring.explode, called during ast creation:
 --      assert(ustring.len(char)==1)	
-      peg = peg + lpeg.P(char)
+      charset_add_char(cs, char)
    end
-   return peg
-end
-
-function cs_list(a, env, prefix, messages)
-   local dot = lookup_builtin('.', env, a)
-   local alternatives = utf8_charlist_to_peg(a.chars)
+   local alternatives = charset_to_peg(cs)
    a.pat = pattern.new{name="cs_list",
 		      peg=(a.complement and (dot-alternatives) or alternatives),
 		      ast=a}
@@ -404,8 +645,16 @@ function bracket(a, env, prefix, messages)
 	 return bracket(new, env, prefix, messages)
       end
    else
-      local p = expression(a.cexp, env, prefix, messages)
-      a.pat = pattern.new{name="bracket", peg=((a.complement and (dot-p.peg)) or p.peg), ast=a}
+      -- A union of simple character sets is compiled as one set, and its members are not
+      -- compiled on their own (so the trace of the bracket does not show them).
+      local cs = new_charset()
+      local peg
+      if ast.choice.is(a.cexp) and charset_add(cs, a.cexp) then
+	 peg = charset_to_peg(cs)
+      else
+	 peg = expression(a.cexp, env, prefix, messages).peg
+      end
+      a.pat = pattern.new{name="bracket", peg=((a.complement and (dot-peg)) or peg), ast=a}
       return a.pat
    end
 end
@@ -429,6 +678,7 @@ local function wrap_pattern(pat, name, optional_force_flag)
       pat.uncap = pat.peg
       pat.peg = common.match_node_wrap(pat.peg, name)
    end
+   pat.label = name
 end
 
 local function throw_grammar_error(a, message)
@@ -532,6 +782,139 @@ local function matches_empty(peg)
    return (not ok) and msg:find("loop body may accept empty string")
 end
 
+---------------------------------------------------------------------------------------------------
+-- Search loops
+---------------------------------------------------------------------------------------------------
+
+-- The find, findall, and keepto macros search for exp with the loop {!exp .}*, which tries exp
+-- at every character position.  When the bytes that can begin a match of exp are known, the
+-- loop can instead skip over all other bytes with an lpeg span, which is a tight loop in the
+-- vm, and try exp only at the remaining positions.  The first byte of a utf-8 character is never
+-- a continuation byte (0x80-0xBF), and neither is a byte that '.' consumes on its own.  So as
+-- long as no continuation byte can begin a match, the positions where exp is tried are exactly
+-- the ones where the original loop would have found a match, and the loop stops at the same
+-- position with the same captures.
+
+-- Return a table of the bytes that can begin a match of a, and a flag that is true when a can
+-- match the empty string.  Return nil when unknown.  Active holds the nodes being analyzed, to
+-- stop the recursion through recursive references.
+local function first_bytes(a, active)
+   if active[a] then return nil; end
+   active[a] = true
+   local set, nullable = {}, false
+   local function add(s) for b in pairs(s) do set[b] = true; end; end
+   local function add_peg(peg)
+      for b = 0, 255 do
+	 if peg:match(string.char(b)) then set[b] = true; end
+      end
+   end
+   if ast.literal.is(a) then
+      local str = ustring.unescape_string(a.value)
+      if (not str) then set = nil
+      elseif #str==0 then nullable = true
+      else set[str:byte(1)] = true; end
+   elseif ast.sequence.is(a) then
+      nullable = true
+      for _, exp in ipairs(a.exps) do
+	 local s, n = first_bytes(exp, active)
+	 if not s then set = nil; break; end
+	 add(s)
+	 if not n then nullable = false; break; end
+      end
+   elseif ast.choice.is(a) then
+      for _, exp in ipairs(a.exps) do
+	 local s, n = first_bytes(exp, active)
+	 if not s then set = nil; break; end
+	 add(s)
+	 nullable = nullable or n
+      end
+   elseif ast.and_exp.is(a) then
+      set, nullable = first_bytes(a.exps[#a.exps], active)
+   elseif ast.predicate.is(a) then
+      nullable = true
+   elseif ast.atleast.is(a) or ast.atmost.is(a) then
+      set, nullable = first_bytes(a.exp, active)
+      if ast.atmost.is(a) or (a.min == 0) then nullable = true; end
+   elseif ast.bracket.is(a) then
+      if a.complement then set = nil
+      else set, nullable = first_bytes(a.cexp, active); end
+   elseif ast.cs_list.is(a) then
+      if a.complement then set = nil
+      else for _, char in ipairs(a.chars) do set[char:byte(1)] = true; end; end
+   elseif ast.cs_range.is(a) then
+      if a.complement then set = nil
+      else for b = a.first:byte(1), a.last:byte(1) do set[b] = true; end; end
+   elseif ast.cs_named.is(a) then
+      if a.complement or (not locale[a.name]) then set = nil
+      else add_peg(locale[a.name]); end
+   elseif ast.cs_intersection.is(a) then
+      set, nullable = first_bytes(a.cexps[1], active)
+   elseif ast.cs_difference.is(a) then
+      set, nullable = first_bytes(a.first, active)
+   elseif ast.ref.is(a) and (not a.packagename) and (a.localname == common.any_char_identifier) then
+      for b = 0, 255 do set[b] = true; end
+   elseif ast.ref.is(a) and (not a.packagename) and (a.localname == common.boundary_identifier) then
+      add_peg(locale.space)
+      nullable = true
+   elseif ast.ref.is(a) and (not a.packagename) and
+          ((a.localname == common.end_of_input_identifier) or
+	   (a.localname == common.start_of_input_identifier)) then
+      nullable = true
+   elseif ast.ref.is(a) and a.pat and a.pat.ast then
+      set, nullable = first_bytes(a.pat.ast, active)
+   else
+      set = nil
+   end
+   active[a] = nil
+   return set, nullable
+end
+
+-- Return the literal that every match of a starts with, or nil
+local function leading_literal(a, active)
+   if active[a] then return nil; end
+   active[a] = true
+   local lit
+   if ast.literal.is(a) then
+      lit = ustring.unescape_string(a.value)
+   elseif ast.sequence.is(a) then
+      lit = a.exps[1] and leading_literal(a.exps[1], active)
+   elseif ast.atleast.is(a) then
+      if a.min > 0 then lit = leading_literal(a.exp, active); end
+   elseif ast.ref.is(a) and a.pat and a.pat.ast then
+      lit = leading_literal(a.pat.ast, active)
+   end
+   active[a] = nil
+   if lit and (#lit > 0) then return lit; end
+   return nil
+end
+
+-- If a is the loop {!exp .}* then return a peg for a that skips over the bytes that cannot begin
+-- a match of exp, else nil.  Epeg is the compiled loop body {!exp .}.
+local function search_loop(a, epeg)
+   if not (ast.atleast.is(a) and (a.min == 0) and ast.sequence.is(a.exp)) then return nil; end
+   local exps = a.exp.exps
+   if not ((#exps == 2) and
+	   ast.predicate.is(exps[1]) and (exps[1].type == "negation") and
+	   ast.ref.is(exps[2]) and exps[2].pat and (exps[2].pat.peg == common.utf8_char_peg)) then
+      return nil
+   end
+   local ok, set, nullable = pcall(first_bytes, exps[1].exp, {})
+   if (not ok) or (not set) or nullable then return nil; end
+   local chars = {}
+   for b in pairs(set) do
+      if (b >= 0x80) and (b <= 0xBF) then return nil; end
+      table.insert(chars, string.char(b))
+   end
+   local skip = (1 - S(table.concat(chars)))^0
+   local body = epeg
+   local lit = leading_literal(exps[1].exp, {})
+   if lit and (#lit > 1) then
+      -- Check for the literal before trying exp, which may open captures
+      body = (-P(lit) * common.utf8_char_peg) + epeg
+   end
+   return skip * (body * skip)^0
+end
+
 local function rep(a, env, prefix, messages)
    local epat = expression(a.exp, env, prefix, messages)
    local epeg = epat.peg
@@ -539,6 +922,11 @@ local function rep(a, env, prefix, messages)
       raise_error("pattern being repeated can match the empty string", a)
    end
    a.exp.pat = epat
+   local search = search_loop(a, epeg)
+   if search then
+      a.pat = pattern.new{name="atleast", peg=search, ast=a}
+      return a.pat
+   end
    if ast.atleast.is(a) then
       a.pat = pattern.new{name="atleast", peg=(epeg)^(a.min), ast=a}
    elseif ast.atmost.is(a) then
@@ -554,7 +942,8 @@ local function ref(a, env, prefix, messages)
    local name = common.compose_id{a.packagename, a.localname}
    if (not pat) then raise_error("unbound identifier: " .. name, a); end
    check_pattern(pat, a)
-   a.pat = pattern.new{name=a.localname, peg=pat.peg, alias=pat.alias, ast=pat.ast, uncap=pat.uncap}
+   a.pat = pattern.new{name=a.localname, peg=pat.peg, alias=pat.alias, ast=pat.ast,
+		       uncap=pat.uncap, label=pat.label}
    return a.pat
 end
 
@@ -664,11 +1053,202 @@ local function compile_expression(exp, env, prefix, messages)
    return value
 end
 
+---------------------------------------------------------------------------------------------------
+-- Required literals
+---------------------------------------------------------------------------------------------------
+
+-- An input can only match an expression if it contains certain literals.  E.g. every match of
+-- {"GET" ~ path} contains "GET", and every match of {"http" / "ftp"} contains "http" or "ftp".
+-- The analysis below finds such a set of literals (a "clause", of which at least one must occur
+-- in the input), so that an input containing none of them can be rejected without running the
+-- matching vm (see the prefilter in common.lua and in librosie).  The analysis is conservative:
+-- when in doubt (e.g. a repetition that may be empty, a negation, a built-in or cached pattern
+-- that has no ast, or a recursive rule), an expression requires nothing.
+
+local PREFILTER_MAX = 8				    -- most literals in a clause
+
+-- A better clause has a longer shortest literal (which is less likely to occur by chance), then
+-- fewer literals (which are faster to search for).
+local function better_clause(c1, c2)
+   if not c2 then return c1; end
+   if not c1 then return c2; end
+   local min1, min2 = math.huge, math.huge
+   for _, lit in ipairs(c1) do min1 = math.min(min1, #lit); end
+   for _, lit in ipairs(c2) do min2 = math.min(min2, #lit); end
+   if (min1 > min2) or ((min1 == min2) and (#c1 <= #c2)) then return c1; end
+   return c2
+end
+
+-- Return the best clause for a, or nil.  When a is inside a grammar, rules maps the names of
+-- the grammar rules to their expressions.  Active holds the nodes being analyzed, to stop the
+-- recursion through recursive rules, and memo holds the results for nodes outside of grammars,
+-- which are often reached through many references.
+local function required(a, rules, active, memo)
+   if active[a] then return nil; end
+   if (not rules) and (memo[a] ~= nil) then return memo[a] or nil; end
+   active[a] = true
+   local clause
+   if ast.literal.is(a) then
+      local str = ustring.unescape_string(a.value)
+      if str and (#str > 0) then clause = {str}; end
+   elseif ast.sequence.is(a) or ast.and_exp.is(a) then
+      for _, exp in ipairs(a.exps) do
+	 clause = better_clause(clause, required(exp, rules, active, memo))
+      end
+   elseif ast.choice.is(a) then
+      local seen = {}
+      clause = {}
+      for _, exp in ipairs(a.exps) do
+	 local alt = required(exp, rules, active, memo)
+	 if not alt then clause = nil; break; end
+	 for _, lit in ipairs(alt) do
+	    if not seen[lit] then table.insert(clause, lit); seen[lit] = true; end
+	 end
+      end
+      if clause and (#clause > PREFILTER_MAX) then clause = nil; end
+   elseif ast.atleast.is(a) then
+      if a.min > 0 then clause = required(a.exp, rules, active, memo); end
+   elseif ast.predicate.is(a) then
+      if a.type=="lookahead" then clause = required(a.exp, rules, active, memo); end
+   elseif ast.bracket.is(a) then
+      if not a.complement then clause = required(a.cexp, rules, active, memo); end
+   elseif ast.cs_list.is(a) then
+      if (not a.complement) and (#a.chars > 0) and (#a.chars <= PREFILTER_MAX) then
+	 clause = a.chars
+      end
+   elseif ast.grammar.is(a) then
+      local grammar_rules = setmetatable({}, {__index = rules})
+      for _, rule in ipairs(a.public_rules) do grammar_rules[rule.ref.localname] = rule.exp; end
+      for _, rule in ipairs(a.private_rules) do grammar_rules[rule.ref.localname] = rule.exp; end
+      clause = required(a.public_rules[1].exp, grammar_rules, active, memo)
+   elseif ast.ref.is(a) then
+      if a.pat and a.pat.ast then
+	 -- The referent was compiled outside of any grammar
+	 clause = required(a.pat.ast, nil, active, memo)
+      elseif rules and (not a.packagename) and rules[a.localname] then
+	 clause = required(rules[a.localname], rules, active, memo)
+      end
+   end
+   active[a] = nil
+   if not rules then memo[a] = clause or false; end
+   return clause
+end
+
+-- Return a list of literals, one of which every match of the expression a must contain, or
+-- false if there is no such list.
+function c2.required_literals(a)
+   local ok, clause = pcall(required, a, nil, {}, {})
+   return (ok and clause) or false
+end
+
+---------------------------------------------------------------------------------------------------
+-- Capture projection
+---------------------------------------------------------------------------------------------------
+
+-- A client that needs only some of the captures in a match (e.g. net.ipv4 and ts.rfc3339 out of
+-- all.things) can compile an expression with a list of capture names to keep.  Every other
+-- binding is then matched as if it were an alias, so the vm does not record its capture and the
+-- encoders do not output it.  The pegs are rebuilt from the ast, bottom up, using the uncaptured
+-- peg (pat.uncap) of each binding that is not kept.  A rebuilt peg is built with the same
+-- operators as the original, so it matches exactly the same inputs.
+--
+-- A pattern loaded from a .rplc file has no ast, so its module is compiled again from source
+-- (see pkgcache.lua) and the ast of the same pattern is used.  The captures inside a built-in
+-- pattern are kept, as are the captures made by functions like message.
+
+local project_node				    -- forward reference
+
+local function pattern_ast(pat)
+   if pat.ast then return pat.ast; end
+   local source_pat = pkgcache.source_pattern(pat.uncap) or pkgcache.source_pattern(pat.peg)
+   return source_pat and source_pat.ast
+end
+
+-- Return the peg for pat with only the captures named in keep, or nil when that is pat.peg.
+-- With force, the top-level capture is kept, even if its name is not in keep.
+local function project_pattern(pat, keep, memo, force)
+   local a = pattern_ast(pat)
+   local inner = a and project_node(a, keep, memo)
+   local label = pat.label
+   if force and (not label) and a and ast.grammar.is(a) then
+      -- The top-level capture of a grammar is made by its start rule, which may also be
+      -- referenced recursively.  Only the outermost one is kept.
+      label = a.public_rules[1].exp.pat.label
+      if (not label) or keep[label] then return inner; end
+      return inner and common.match_node_wrap(inner, label)
+   end
+   if not label then return inner; end
+   if force or keep[label] then
+      return inner and common.match_node_wrap(inner, label)
+   end
+   return inner or pat.uncap or nil
+end
+
+local function project_grammar(a, keep, memo)
+   local rules = append(list.from(a.public_rules), list.from(a.private_rules))
+   local t, changed = {}, false
+   for _, rule in ipairs(rules) do
+      local pat = rule.exp.pat
+      local peg = project_pattern(pat, keep, memo)
+      t[rule.ref.localname] = peg or pat.peg
+      changed = changed or (peg ~= nil)
+   end
+   if not changed then return nil; end
+   t[1] = rules[1].ref.localname		    -- first rule is start rule
+   return P(t)
+end
+
+-- Return the peg for the compiled node a with only the captures named in keep, or nil when that
+-- is a.pat.peg.  Memo holds the result for each node (false when unchanged).
+function project_node(a, keep, memo)
+   if memo[a] ~= nil then return memo[a] or nil; end
+   local peg
+   if not pattern.is(a.pat) then
+      peg = nil
+   elseif ast.sequence.is(a) or ast.choice.is(a) or ast.and_exp.is(a) then
+      local pegs, changed = {}, false
+      for i, exp in ipairs(a.exps) do
+	 local p = project_node(exp, keep, memo)
+	 pegs[i] = p or exp.pat.peg
+	 changed = changed or (p ~= nil)
+      end
+      if changed then
+	 if ast.and_exp.is(a) then
+	    peg = pegs[#pegs]
+	    for i = #pegs-1, 1, -1 do peg = #pegs[i] * peg; end
+	 else
+	    peg = pegs[1]
+	    for i = 2, #pegs do
+	       peg = (ast.sequence.is(a) and (peg * pegs[i])) or (peg + pegs[i])
+	    end
+	 end
+      end
+   elseif ast.predicate.is(a) then
+      -- A lookbehind cannot contain captures
+      local p = (a.type ~= "lookbehind") and project_node(a.exp, keep, memo)
+      if p then peg = ((a.type == "lookahead") and #p) or (- p); end
+   elseif ast.atleast.is(a) or ast.atmost.is(a) then
+      local p = project_node(a.exp, keep, memo)
+      if p then
+	 peg = search_loop(a, p) or (ast.atleast.is(a) and p^(a.min)) or p^(-a.max)
+      end
+   elseif ast.ref.is(a) then
+      peg = project_pattern(a.pat, keep, memo)
+   elseif ast.grammar.is(a) then
+      peg = project_grammar(a, keep, memo)
+   end
+   memo[a] = peg or false
+   return peg
+end
+
 -- 'c2.compile_expression' compiles a top-level expression for matching.  If the expression is
 -- simply a reference, the match output will have the name of the referenced pattern.  If the
 -- expression is a reference to an alias, or if the expression is not a reference at all, then the
--- match output will have the name "*" (meaning "anonymous") at the top level.
-function c2.compile_expression(a, env, messages)
+-- match output will have the name "*" (meaning "anonymous") at the top level.  When a list of
+-- capture names is given, the match output has only those captures (see capture projection,
+-- above), under the top-level one.
+function c2.compile_expression(a, env, messages, optional_captures)
+   a = optimize.expression(a, env)
    local pat = compile_expression(a, env, nil, messages)
    if not pat then return false; end		    -- error will be in messages
    if pat and (not pattern.is(pat)) then
@@ -678,18 +1258,36 @@ function c2.compile_expression(a, env, messages)
 		   violation.compile.new{who='expression compiler', message=msg, ast=a})
       return false
    end
-   local peg, name = pat.peg, pat.name
+   local keep
+   if optional_captures then
+      keep = {}
+      for _, name in ipairs(optional_captures) do keep[name] = true; end
+   end
    if ast.ref.is(a) then
       if pat.alias then
-	 pat.peg = common.match_node_wrap(pat.peg, "*")
+	 pat.uncap = (keep and project_pattern(pat, keep, {})) or pat.peg
+	 pat.peg = common.match_node_wrap(pat.uncap, "*")
+	 pat.label = "*"
+      elseif keep then
+	 pat.peg = project_pattern(pat, keep, {}, true) or pat.peg
       end
    else -- not a reference
       wrap_pattern(pat, "*", true)		    -- force wrap, even if pat is a grammar
+      if keep then pat.peg = project_pattern(pat, keep, {}, true) or pat.peg; end
    end
    pat.alias = false
+   pat.prefilter = c2.required_literals(a)
    return pat
 end
 
+-- Return a peg that matches the same inputs as pat, which was made by c2.compile_expression, but
+-- makes only the top-level capture.  An output encoder that only reports whether there was a
+-- match (e.g. 'bool') uses this peg, because the vm does less work when it records fewer
+-- captures.  The top-level capture is kept so that a match is never mistaken for a failure.
+function c2.strip_captures(pat)
+   return project_pattern(pat, {}, {}, true) or pat.peg
+end
+
 ---------------------------------------------------------------------------------------------------
 -- Compile block
 ---------------------------------------------------------------------------------------------------
@@ -727,7 +1325,7 @@ function compile_statements(stmts, pkgenv, prefix, messages)
    local uncompiled = {}
    for _, b in ipairs(stmts) do
       local ref, exp = b.ref, b.exp
-      local pat = compile_expression(exp, pkgenv, prefix, messages)
+      local pat = compile_expression(optimize.expression(exp, pkgenv), pkgenv, prefix, messages)
       if not pat then return false; end 	    -- error is in messages
       if novalue.is(pat) then
 	 table.insert(uncompiled, b)
@@ -32,7 +32,9 @@
 --   the rpl_string has "file semantics", i.e. it can be a module.
 --   returns success code and a list of violation objects
 -- 
--- e:compile(expression) compiles the rpl expression
+-- e:compile(expression, optional_captures) compiles the rpl expression
+--   optional_captures is a list of capture names; when given, the matches contain only those
+--   captures (and the top-level one), and the other bindings are matched as if they were aliases
 --   returns an rplx object or nil, and a list of violation objects
 --   API only: instead of the rplx object, returns the (string) id of an rplx object with
 --   indefinite extent; 
@@ -53,9 +55,14 @@
 --   returns ok, match or nil, leftover, time
 --      where ok means "successful compile", and if not ok then match is a table of messages
 -- 
--- e:trace(expression, input, optional_start) like match, but generates a trace of the entire matching process
+-- e:trace(expression, input, optional_start, style, optional_writer) like match, but generates a trace of the entire matching process
 --   ??? API only: expression can be an rplx id, in which case that compiled expression is used
 --   returns a trace object
+--   with style "stream", the trace lines are passed to optional_writer as they are computed
+-- 
+-- e:profile(expression, input, optional_start, optional_profile) like match, but attributes the
+--   matching time to the bindings that are matched (see profile.lua)
+--   returns ok, profile (a new one if optional_profile is not given), match (true/false), nextpos
 -- 
 -- e:output(optional_formatter) sets or returns the formatter (a function)
 --   an engine calls formatter on each successful match result;
@@ -83,6 +90,7 @@ local lpeg = require "lpeg"
 local recordtype = require "recordtype"
 local common = require "common"
 local match = common.match
+local prefilter_pass = common.prefilter_pass
 local pfunction = common.pfunction
 local macro = common.macro
 local environment = require "environment"
@@ -91,15 +99,20 @@ local writer = require "writer"
 local loadpkg = require "loadpkg"
 local co = require "color"
 local trace = require "trace"
+local profile = require "profile"
 local rcfile = require "rcfile"
+local pkgcache = require "pkgcache"
 
 local engine, rplx				    -- forward reference
 local engine_error				    -- forward reference
+local catch_up					    -- forward reference
 
 ----------------------------------------------------------------------------------------
 
-local function compile_expression(e, input)
-   local messages = {}
+local function compile_expression(e, input, optional_captures)
+   local ok, messages = catch_up(e)
+   if not ok then return false, messages; end
+   messages = {}
    local ast = input
    if type(input)=="string" then
       ast = e.compiler.parse_expression(common.source.new{text=input}, messages)
@@ -112,11 +125,18 @@ local function compile_expression(e, input)
    ast = e.compiler.expand_expression(ast, e.env, messages)
    -- Errors will be in messages table
    if not ast then return false, messages; end
-   local pat = e.compiler.compile_expression(ast, e.env, messages)
+   local pat = e.compiler.compile_expression(ast, e.env, messages, optional_captures)
    if not pat then return false, messages; end
    return rplx.new(e, pat), messages
 end
 
+-- An engine records the operations that changed its environment or its configuration, so that
+-- another engine (e.g. in another Lua state) can be brought to the same state by replaying
+-- them.  Each entry is a list of strings and booleans, with false in place of nil.
+local function record(e, ...)
+   table.insert(e.history, {...})
+end
+
 local function really_load(e, source, origin)
    local messages = {}
    local ok, pkgname, env = loadpkg.source(e.compiler,
@@ -140,13 +160,15 @@ local function really_load(e, source, origin)
 end
 
 local function load(e, input, fullpath)
+   local ok, messages = catch_up(e)
+   if not ok then return false, nil, messages; end
    local origin = (fullpath and common.loadrequest.new{filename=fullpath}) or nil
-   return really_load(e, input, origin)
+   local ok, pkgname, messages = really_load(e, input, origin)
+   if ok then record(e, "load", input, fullpath or false); end
+   return ok, pkgname, messages
 end
 
--- Force a reloading of the imported package, as opposed to e:load('import foo') which will not
--- re-load a package that is already loaded.
-local function import(e, packagename, as_name)
+local function really_import(e, packagename, as_name)
    local messages = {}
    local ok, pkgname = loadpkg.import(e.compiler,
 			     e.pkgtable,
@@ -158,6 +180,43 @@ local function import(e, packagename, as_name)
    return ok, pkgname, messages
 end
 
+-- Force a reloading of the imported package, as opposed to e:load('import foo') which will not
+-- re-load a package that is already loaded.
+local function import(e, packagename, as_name)
+   local ok, messages = catch_up(e)
+   if not ok then return false, nil, messages; end
+   local pkgname
+   ok, pkgname, messages = really_import(e, packagename, as_name)
+   if ok then record(e, "import", packagename, as_name or false); end
+   return ok, pkgname, messages
+end
+
+-- An engine made by a lazy replay (see below) defers its loads and imports until its
+-- environment is first needed.  Each deferred operation is run with the libpath that was in
+-- effect when it was recorded.  It is already in the history, so it is not recorded again.
+function catch_up(e)
+   local pending = e.pending
+   if not pending then return true; end
+   e.pending = false
+   local libpath = e.libpath.value
+   for _, op in ipairs(pending) do
+      local ok, _, messages
+      e.libpath.value = op.libpath
+      if op[1]=="load" then
+	 local origin = op[3] and common.loadrequest.new{filename=op[3]}
+	 ok, _, messages = really_load(e, op[2], origin or nil)
+      else
+	 ok, _, messages = really_import(e, op[2], op[3] or nil)
+      end
+      if not ok then
+	 e.libpath.value = libpath
+	 return false, messages
+      end
+   end
+   e.libpath.value = libpath
+   return true
+end
+
 local function get_file_contents(e, filename, nosearch)
   if nosearch or util.absolutepath(filename) then
      local data, msg = util.readfile(filename)
@@ -183,8 +242,29 @@ local function loadfile(e, filename)
    return ok, pkgname, messages
 end
 
+-- Make an rplx object for a peg that was compiled by another engine (see rosie_rplx_share in
+-- librosie).  There is no ast for the peg, so the rplx can be used for matching but not for
+-- tracing.  The prefilter (see compile.lua) is that of the original pattern, if any.
+local function attach(e, peg, name, prefilter)
+   assert(lpeg.type(peg)=="pattern")
+   return rplx.new(e, common.pattern.new{name=name or "*", peg=peg, prefilter=prefilter or false})
+end
+
 ----------------------------------------------------------------------------------------
 
+-- An output encoder that reports only whether there was a match (e.g. 'bool', see
+-- common.add_encoder) does not use the captures, so it matches a copy of the peg that makes
+-- only the top-level capture (see strip_captures in compile.lua).  The copy is made the first
+-- time it is needed, and kept in the pattern.
+local function nocap_peg(r)
+   local pat = r.pattern
+   if not pat.nocap then
+      local strip = r.engine.compiler.strip_captures
+      pat.nocap = (strip and strip(pat)) or pat.peg
+   end
+   return pat.nocap
+end
+
 -- N.B. The _match code is essentially duplicated (for speed, to avoid a function call) in
 -- process_input_file (below).  There's still room for optimizations, e.g.
 --   Create a closure over the encode function to avoid looking it up in e.
@@ -192,8 +272,11 @@ end
 --   Close over the peg itself to avoid looking it up in pat.
 local function _match(rplx_exp, input, start, encoder, total_time_accum, lpegvm_time_accum)
    encoder = encoder or "default"
-   local rmatch_encoder, fn_encoder = common.lookup_encoder(encoder)
-   return match(rplx_exp.pattern.peg,
+   if not prefilter_pass(rplx_exp.pattern.prefilter, input, start) then
+      return false, start, false, total_time_accum or 0, lpegvm_time_accum or 0
+   end
+   local rmatch_encoder, fn_encoder, without_data = common.lookup_encoder(encoder)
+   return match((without_data and nocap_peg(rplx_exp)) or rplx_exp.pattern.peg,
 		input,
 		start,
 		rmatch_encoder,
@@ -203,8 +286,13 @@ local function _match(rplx_exp, input, start, encoder, total_time_accum, lpegvm_
 		lpegvm_time_accum)
 end
 
-local function _trace(r, input, start, style)
-   return trace.expression(r, input, start, style)
+local function _trace(r, input, start, style, writer)
+   return trace.expression(r, input, start, style, writer)
+end
+
+local function _profile(r, input, start, p)
+   p = p or profile.new()
+   return p, profile.expression(r, input, start, p)
 end
    
 -- Returns matches, leftover, total match time, total spent in lpeg vm
@@ -232,8 +320,12 @@ local function engine_match(e, expression, input, start, encoder, t0, t1)
    return engine_match_trace(e, _match, expression, input, start, encoder, t0, t1)
 end
 
-local function engine_trace(e, expression, input, start, style)
-   return engine_match_trace(e, _trace, expression, input, start, style)
+local function engine_trace(e, expression, input, start, style, writer)
+   return engine_match_trace(e, _trace, expression, input, start, style, writer)
+end
+
+local function engine_profile(e, expression, input, start, p)
+   return engine_match_trace(e, _profile, expression, input, start, p)
 end
 
 -- Cmatch optimizes the engine's 'match' function for the case where:
@@ -250,9 +342,10 @@ local function Cmatch(compiled_exp, input, start, encoder, total_time_accum, lpe
    assert(type(encoder) == "string")
 --   assert(type(total_time_accum) == "number")
 --   assert(type(lpegvm_time_accum) == "number")
-   local rmatch_encoder, fn_encoder = common.lookup_encoder(encoder)
+   local rmatch_encoder, fn_encoder, without_data = common.lookup_encoder(encoder)
+   local peg = (without_data and nocap_peg(compiled_exp)) or compiled_exp.pattern.peg
    local m, leftover, abend, t1, t2 =
-      (compiled_exp.pattern.peg):rmatch(input, start, rmatch_encoder, total_time_accum, lpegvm_time_accum)
+      peg:rmatch(input, start, rmatch_encoder, total_time_accum, lpegvm_time_accum)
    if m==0 then return m, start, abend, t1, t2; end
    local parms = compiled_exp.engine.encoder_parms
    return fn_encoder(m, input, start, parms), leftover, abend, t1, t2
@@ -262,28 +355,35 @@ end
 
 local process_input_file = {}
 
+-- An outfilename or errfilename of nil means that no file is opened (and nil is returned for it)
 local function open3(e, infilename, outfilename, errfilename)
    if type(infilename)~="string" then return nil, tostring(infilename)
-   elseif type(outfilename)~="string" then return nil, tostring(outfilename)
-   elseif type(errfilename)~="string" then return nil, tostring(errfilename)
+   elseif outfilename and type(outfilename)~="string" then return nil, tostring(outfilename)
+   elseif errfilename and type(errfilename)~="string" then return nil, tostring(errfilename)
    end
    local infile, outfile, errfile, msg
    if #infilename==0 then infile = io.stdin;
    else
       infile, msg = io.open(infilename, "r");
       if not infile then return nil, infilename; end; end
-   if #outfilename==0 then outfile = io.stdout
+   if not outfilename then outfile = nil
+   elseif #outfilename==0 then outfile = io.stdout
    else
       outfile, msg = io.open(outfilename, "w");
       if not outfile then return nil, outfilename; end; end
-   if #errfilename==0 then errfile = io.stderr;
+   if not errfilename then errfile = nil
+   elseif #errfilename==0 then errfile = io.stderr;
    else
       errfile, msg = io.open(errfilename, "w");
       if not errfile then return nil, errfilename; end; end
    return infile, outfile, errfile
 end
 
-local function engine_process_file(e, expression, op, infilename, outfilename, errfilename, encoder, wholefileflag)
+-- When profiler is given, it is a table {profile=<profile>, rate=<n>}, and every nth input line
+-- is also profiled (see profile.lua).  When outfilename (or errfilename) is nil, the matches (or
+-- the lines that did not match) are counted but not written.  With no output file, the matches
+-- are made with the 'bool' encoder, which does not need the captures.
+local function engine_process_file(e, expression, op, infilename, outfilename, errfilename, encoder, wholefileflag, profiler)
    local r, msgs
    if engine_module.rplx.is(expression) then
       r = expression
@@ -295,12 +395,15 @@ local function engine_process_file(e, expression, op, infilename, outfilename, e
    local trace_flag = (op == "trace")
    local trace_style = encoder
    if trace_flag then encoder = "none"; end
+   if (not outfilename) and (not trace_flag) then encoder = "bool"; end
    -- This set of simple optimizations almost doubles performance of the loop through the file
    -- (below) in cases where there are many lines to process.
-   local rmatch_encoder, fn_encoder = common.lookup_encoder(encoder)
+   local rmatch_encoder, fn_encoder, without_data = common.lookup_encoder(encoder)
    local parms = common.attribute_table_to_table(e.encoder_parms)
-   local peg = r.pattern.peg			    -- optimization
+   local peg = (without_data and nocap_peg(r)) or r.pattern.peg -- optimization
+   local prefilter = r.pattern.prefilter
    local matcher = function(input)
+		      if not prefilter_pass(prefilter, input, 1) then return false, 1; end
 		      return match(peg, input, 1, rmatch_encoder, fn_encoder, parms)
 		   end                              -- FUTURE: inline this for performance
 
@@ -318,8 +421,12 @@ local function engine_process_file(e, expression, op, infilename, outfilename, e
    else
       nextline = infile:lines();
    end
-   local o_write_prim, e_write = outfile.write, errfile.write
-   if common.encoder_returns_userdata(encoder) then
+   local discard = function() end
+   local o_write_prim = outfile and outfile.write or discard
+   local e_write = errfile and errfile.write or discard
+   if not outfile then
+      o_write = discard
+   elseif common.encoder_returns_userdata(encoder) then
       o_write = function(handle, m)
 		   lpeg.writedata(handle, m)
 		   o_write_prim(handle, '\n')
@@ -329,13 +436,20 @@ local function engine_process_file(e, expression, op, infilename, outfilename, e
 		   o_write_prim(handle, m, '\n')
 		end
    end
+   local trace_writer
+   if trace_style == "stream" then
+      trace_writer = function(line) o_write_prim(outfile, line, '\n') end
+   end
    local ok, l = pcall(nextline);
    if not ok then e:error(l); end
    local _, m, leftover, trace_string
    local m, leftover
    while l do
-      if trace_flag then _, _, trace_string = e:trace(expression, l, 1, trace_style); end
+      if trace_flag then _, _, trace_string = e:trace(r, l, 1, trace_style, trace_writer); end
       m, leftover = matcher(l);		  -- What to do with leftover?  User might want to see it.
+      if profiler and ((inlines % profiler.rate) == 0) then
+	 profile.expression(r, l, 1, profiler.profile)
+      end
       if trace_string then o_write(outfile, trace_string, "\n"); end
       if m then
 	 o_write(outfile, m);
@@ -348,12 +462,14 @@ local function engine_process_file(e, expression, op, infilename, outfilename, e
       inlines = inlines + 1
       l = nextline(); 
    end -- while
-   infile:close(); outfile:close(); errfile:close();
+   infile:close()
+   if outfile then outfile:close(); end
+   if errfile then errfile:close(); end
    return inlines, outlines, errlines
 end
 
-function process_input_file.match(e, expression, infilename, outfilename, errfilename, encoder, wholefileflag)
-   return engine_process_file(e, expression, "match", infilename, outfilename, errfilename, encoder, wholefileflag)
+function process_input_file.match(e, expression, infilename, outfilename, errfilename, encoder, wholefileflag, profiler)
+   return engine_process_file(e, expression, "match", infilename, outfilename, errfilename, encoder, wholefileflag, profiler)
 end
 
 function process_input_file.trace(e, expression, infilename, outfilename, errfilename, trace_style, wholefileflag )
@@ -434,6 +550,7 @@ local function config(en)
    table.insert(config, rpl_version)
    if en.libpath then table.insert(config, en.libpath); end
    if en.rcfile then table.insert(config, en.rcfile); end
+   for _, attr in ipairs(pkgcache.attributes()) do table.insert(config, attr); end
    return config, ((#en.encoder_parms > 0) and en.encoder_parms) or nil
 end
 
@@ -455,6 +572,40 @@ local function set_encoder_parm(self, parm_name, parm_value, set_by)
 					set_by,
 					"parameter that is passed to an output encoder"))
    end
+   record(self, "encoder_parm", parm_name, parm_value, set_by)
+   return true
+end
+
+local function set_libpath(self, newlibpath, set_by)
+   self.libpath.value = newlibpath;
+   self.libpath.set_by = set_by;
+   record(self, "libpath", newlibpath, set_by)
+end
+
+-- Bring engine e to the state recorded in the history of another engine.  Returns true, or
+-- false and the messages from the first operation that failed.  When lazily is true, the loads
+-- and imports are deferred until e first needs its environment, e.g. to compile an expression.
+local function replay(e, history, lazily)
+   for _, op in ipairs(history) do
+      local kind = op[1]
+      if kind=="libpath" then
+	 set_libpath(e, op[2], op[3])
+      elseif kind=="encoder_parm" then
+	 set_encoder_parm(e, op[2], op[3], op[4])
+      elseif lazily and (kind=="load" or kind=="import") then
+	 record(e, kind, op[2], op[3])
+	 e.pending = e.pending or {}
+	 table.insert(e.pending, {kind, op[2], op[3], libpath=e.libpath.value})
+      elseif kind=="load" then
+	 local ok, _, messages = load(e, op[2], op[3] or nil)
+	 if not ok then return false, messages; end
+      elseif kind=="import" then
+	 local ok, _, messages = import(e, op[2], op[3] or nil)
+	 if not ok then return false, messages; end
+      else
+	 engine_error(e, "unknown operation in engine history: " .. tostring(kind))
+      end
+   end
    return true
 end
 
@@ -475,6 +626,7 @@ local function create_engine(name, compiler, searchpath)
       env=environment.new(environment.make_standard_prelude()),
       pkgtable=new_package_table,
       encoder_parms = common.create_attribute_table(),
+      history = {},
    }
 end
 
@@ -495,18 +647,17 @@ engine =
 		     load=load,
 		     loadfile=loadfile,
 		     import=import,
-		     set_libpath = function(self, newlibpath, set_by)
-				      self.libpath.value = newlibpath;
-				      self.libpath.set_by = set_by;
-				   end,
+		     set_libpath = set_libpath,
 		     get_libpath = function(self)
 				      return self.libpath.value, self.libpath.set_by
 				   end,
 		     libpath=false,
 
 		     compile=compile_expression,
+		     attach=attach,
 		     match=engine_match,
 		     trace=engine_trace,
+		     profile=engine_profile,
 
 		     matchfile = process_input_file.match,
 		     tracefile = process_input_file.trace,
@@ -520,6 +671,10 @@ engine =
 		     execute_rcfile = execute_rcfile,
 
 		     config = config, -- return an attribute table for this engine
+
+		     history = false, -- list of operations that can be replayed
+		     replay = replay,
+		     pending = false, -- loads and imports deferred by a lazy replay
 		  },
 		  create_engine
 	       )
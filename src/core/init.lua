@@ -110,9 +110,13 @@ local function load_all()
    builtins = import("builtins")
    environment = import("environment")
    expand = import("expand")
+   optimize = import("optimize")
    compile = import("compile")
+   pkgcache = import("pkgcache")
+   pkgcache.rosie_version = ROSIE_VERSION
    loadpkg = import("loadpkg")
    trace = import("trace")
+   profile = import("profile")
    rcfile = import("rcfile")
    engine_module = import("engine_module")
    engine = engine_module.engine
@@ -156,6 +160,7 @@ function create_core_engine()
 			   parse_expression = core_expression_parser,
 			   expand_expression = compile.expand_expression,
 			   compile_expression = compile.compile_expression,
+			   strip_captures = compile.strip_captures,
 		        }
    -- Create a core engine that loads/compiles rpl 0.0
    local NEWCORE_ENGINE = engine.new("NEW RPL core engine", COREcompiler2, ROSIE_LIBDIR)
@@ -185,6 +190,7 @@ function create_rpl_1_1_engine(e)
 	         parse_expression = compile.make_parse_expression(rplx_expression),
 	         expand_expression = compile.expand_expression,
 	         compile_expression = compile.compile_expression,
+	         strip_captures = compile.strip_captures,
 	   }
 
    local c2engine = engine.new("NEW RPL 1.1 engine (c2)", compiler2, ROSIE_LIBDIR)
@@ -218,6 +224,7 @@ function create_rpl_1_2_engine(e)
 	parse_expression = compile.make_parse_expression(rplx_expression),
 	expand_expression = compile.expand_expression,
 	compile_expression = compile.compile_expression,
+	strip_captures = compile.strip_captures,
      }
 
    local c3engine = engine.new("NEW RPL 1.2 engine (c3)", compiler3, ROSIE_LIBDIR)
@@ -266,7 +273,7 @@ load_all()
 
 common.add_encoder("color", common.BYTE_ENCODING,
 		   function(m, input, start, parms)
-		      return color.match(common.byte_to_lua(m, input), input, parms.colors)
+		      return color.encode(m, input, parms.colors)
 		   end)
 common.add_encoder("matches", common.BYTE_ENCODING,
 		   function(m, input, start)
@@ -11,6 +11,7 @@ local environment = require "environment"
 local builtins = require "builtins"
 local common = require "common"
 local violation = require "violation"
+local pkgcache = require "pkgcache"
 
 -- Here is the bare beginnings of some compiler profiling:
 local PROFILE = false
@@ -118,6 +119,7 @@ local function compile(compiler, a, env, source_record, messages)
 end
 
 local load_dependencies;
+local import_one;
 
 local function parse_block(compiler, source_record, messages)
 
@@ -187,7 +189,8 @@ function loadpkg.source(compiler, pkgtable, top_level_env, searchpath, source, o
    end
 end
 
-local function import_from_source(compiler, pkgtable, searchpath, source_record, loadinglist, messages)
+-- When nocache is true, no .rplc file is written.
+local function import_from_source(compiler, pkgtable, searchpath, source_record, loadinglist, messages, nocache)
    local t0
    if PROFILE then
       profile_println("importing (parsing) ", tostring(source_record.origin and source_record.origin.filename))
@@ -224,6 +227,19 @@ local function import_from_source(compiler, pkgtable, searchpath, source_record,
    if PROFILE then
       profile_println("time = ", time(t0), "ms")
    end
+   local deps, names = {}, {}
+   for _, ideclist in ipairs(a.block_ideclists or {}) do
+      for _, decl in ipairs(ideclist.idecls) do
+	 local _, pkgenv = common.pkgtableref(pkgtable, decl.importpath, decl.prefix)
+	 table.insert(deps, {importpath=decl.importpath,
+			     prefix=decl.prefix or false,
+			     key=pkgcache.key(pkgenv)})
+      end
+   end
+   for _, b in ipairs(a.stmts) do table.insert(names, b.ref.localname); end
+   if not nocache then
+      pkgcache.write(compiler, origin, src, origin.packagename, env, names, deps)
+   end
    common.pkgtableset(pkgtable, origin.importpath, origin.prefix, origin.packagename, env)
    return true, origin.packagename, env
 end
@@ -278,6 +294,7 @@ local function import_builtin(importpath, pkgtable, source_record, messages)
    if pkgname then 
       assert(environment.is(env))
       common.pkgtableset(pkgtable, importpath, origin.prefix, pkgname, env)
+      pkgcache.set_key(env, "builtin:" .. importpath)
       return true, pkgname, env
    end
    local msg = "built-in package not found: " .. importpath
@@ -285,11 +302,54 @@ local function import_builtin(importpath, pkgtable, source_record, messages)
    return false
 end
 
+-- Instantiate a package from its .rplc file (see pkgcache.lua), after importing the packages it
+-- depends on.  Returns false if there is no valid .rplc file for the module in source_record.
+local function import_from_cache(compiler, pkgtable, searchpath, source_record, loadinglist)
+   local origin = source_record.origin
+   local entry = pkgcache.read(compiler, origin.filename, source_record.text, origin.prefix)
+   if not entry then return false; end
+   local envs = {}
+   for i, dep in ipairs(entry.deps) do
+      local sref = common.source.new{text=source_record.text,
+				     origin=common.loadrequest.new{importpath=dep.importpath,
+								   prefix=dep.prefix or nil},
+				     parent=source_record}
+      -- Errors are reported when the module is compiled from source instead
+      local ok, pkgname, pkgenv = import_one(compiler, pkgtable, searchpath, sref, loadinglist, {})
+      if (not ok) or (pkgcache.key(pkgenv)~=dep.key) then return false; end
+      envs[i] = pkgenv
+      dep.prefix = dep.prefix or pkgname
+   end
+   local bindings = pkgcache.bindings(entry)
+   if not bindings then return false; end
+   origin.packagename = entry.packagename
+   local env = environment.new(environment.make_standard_prelude())
+   env.origin = origin
+   for i, dep in ipairs(entry.deps) do create_package_bindings(dep.prefix, envs[i], env); end
+   for name, pat in pairs(bindings) do env:bind(name, pat); end
+   pkgcache.set_key(env, entry.key)
+   pkgcache.set_source(env, bindings,
+		       function()
+			  -- Compile the module again, in a package table of its own
+			  local sref = common.source.new{
+			     text=source_record.text,
+			     origin=common.loadrequest.new{importpath=origin.importpath,
+							   prefix=origin.prefix,
+							   filename=origin.filename},
+			     parent=source_record.parent}
+			  local ok, _, srcenv = import_from_source(compiler,
+								   environment.new_package_table(),
+								   searchpath, sref, {}, {}, true)
+			  return ok and srcenv
+		       end)
+   common.pkgtableset(pkgtable, origin.importpath, origin.prefix, origin.packagename, env)
+   return true, origin.packagename, env
+end
+
 local function import_one_force(compiler, pkgtable, searchpath, source_record, loadinglist, messages)
    local origin = assert(source_record.origin)
    common.note("load: looking for ", origin.importpath)
-   -- FUTURE: Next, look for a compiled version of the file to load
-   -- Finally, look for a source file to compile and load
+   -- Look for the source file, which is needed to validate a compiled version of it
    local src, fullpath = find_module_source(compiler, pkgtable, searchpath, source_record, loadinglist, messages)
    if not src then return false; end 		    -- message already in 'messages'
    if builtins.is_builtin_package(origin.importpath, fullpath) then
@@ -303,10 +363,20 @@ local function import_one_force(compiler, pkgtable, searchpath, source_record, l
 								packagename=nil,
 								filename=fullpath},
 			          parent=source_record}
+   if pkgcache.enabled then
+      -- Next, look for a compiled version of the file to load
+      local ok, pkgname, env = import_from_cache(compiler, pkgtable, searchpath, sref, loadinglist)
+      pkgcache.count(ok)
+      if ok then
+	 common.note("load: loaded ", origin.importpath, " from compiled package file")
+	 return true, pkgname, env
+      end
+   end
+   -- Finally, compile the source file and load it
    return import_from_source(compiler, pkgtable, searchpath, sref, loadinglist, messages)
 end
 
-local function import_one(compiler, pkgtable, searchpath, source_record, loadinglist, messages)
+function import_one(compiler, pkgtable, searchpath, source_record, loadinglist, messages)
    local origin = assert(source_record.origin)
    -- First, look in the pkgtable to see if this pkg has been loaded already
    local pkgname, pkgenv = common.pkgtableref(pkgtable, origin.importpath, origin.prefix)
@@ -0,0 +1,494 @@
+-- -*- Mode: Lua; -*-
+--
+-- optimize.lua   Rewrite expanded ASTs into equivalent ones that compile to smaller pegs
+--
+-- © Copyright IBM Corporation 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+-- The optimizer runs between syntax expansion and compilation:
+--
+--    parse --> convert to ast --> syntax expand --> optimize --> compile
+--
+-- Every rewrite preserves the match result AND the match output (captures), so it must not
+-- reorder alternatives of a choice when that could change which one matches.  The rewrites are:
+--
+--   1. Inline small aliases: a reference to an alias that is bound to a literal or a small
+--      character set expression is replaced by a copy of that expression.  These contain no
+--      references, so they mean the same thing in any environment, and an alias has no capture.
+--   2. Fuse adjacent literals in a sequence, e.g. {"ab" "cd"} ==> "abcd".
+--   3. Factor a common prefix out of adjacent alternatives of a choice, e.g.
+--      {A B} / {A C} ==> {A {B / C}}.  This holds for any A in a PEG (whereas it does not hold
+--      for a common suffix), and it saves re-matching A after B fails.  Literals that start
+--      with the same characters are split, e.g. {"http:" x} / {"https:" y} ==>
+--      {"http" {{":" x} / {"s:" y}}}.  No alternative is allowed to become empty.
+--   4. Merge adjacent alternatives that each match exactly one character into one character
+--      set, e.g. "a" / [0-9] / "-" ==> [[a][0-9][-]], which compiles to a single set test.
+--      The alternatives must not mix single bytes 0x80-0xFF with multi-byte characters, since
+--      then two alternatives could match different lengths at the same position.
+--
+-- Grammars, and the arguments of functions, are left alone.  A choice of literals only is
+-- left alone (unless it merges into one character set), because the compiler turns a long one
+-- into a trie, which already shares prefixes.
+--
+-- New nodes are created wherever something changes; the input AST is not modified.
+
+local optimize = {}
+
+local ast = require "ast"
+local common = require "common"
+local ustring = require "ustring"
+local recordtype = require "recordtype"
+local parent = recordtype.parent
+local utf8 = require "utf8"
+
+optimize.enabled = true
+
+local INLINE_MAX = 8				    -- most nodes in an inlined alias
+
+---------------------------------------------------------------------------------------------------
+-- Utilities
+---------------------------------------------------------------------------------------------------
+
+-- Remove the one-element sequences that syntax expansion wraps around expressions
+local function unwrap(a)
+   while ast.sequence.is(a) and (#a.exps == 1) do a = a.exps[1]; end
+   return a
+end
+
+-- Return the list of elements of a, viewed as a sequence
+local function elements(a)
+   a = unwrap(a)
+   if ast.sequence.is(a) then return a.exps; end
+   return {a}
+end
+
+local function make_sequence(exps, sref)
+   if #exps == 1 then return exps[1]; end
+   return ast.sequence.new{exps=exps, sourceref=sref}
+end
+
+local function literal_string(a)
+   return ast.literal.is(a) and ustring.unescape_string(a.value)
+end
+
+local function make_literal(str, sref)
+   return ast.literal.new{value=str:gsub('[\\"]', '\\%0'), sourceref=sref}
+end
+
+-- Structural equality.  Two equal expressions compile to the same peg when they are in the
+-- same environment (which is the case for the alternatives of one choice).
+local function equal(a, b)
+   if a == b then return true; end
+   local kind = parent(a)
+   if kind ~= parent(b) then return false; end
+   if kind == ast.literal then
+      local s1, s2 = literal_string(a), literal_string(b)
+      return (s1 ~= nil) and (s1 == s2)
+   elseif kind == ast.ref then
+      return (a.localname == b.localname) and (a.packagename == b.packagename)
+   elseif (kind == ast.sequence) or (kind == ast.choice) or (kind == ast.and_exp) then
+      if #a.exps ~= #b.exps then return false; end
+      for i = 1, #a.exps do
+	 if not equal(a.exps[i], b.exps[i]) then return false; end
+      end
+      return true
+   elseif kind == ast.predicate then
+      return (a.type == b.type) and equal(a.exp, b.exp)
+   elseif kind == ast.atleast then
+      return (a.min == b.min) and equal(a.exp, b.exp)
+   elseif kind == ast.atmost then
+      return (a.max == b.max) and equal(a.exp, b.exp)
+   elseif kind == ast.bracket then
+      return (a.complement == b.complement) and equal(a.cexp, b.cexp)
+   elseif kind == ast.cs_named then
+      return (a.complement == b.complement) and (a.name == b.name)
+   elseif kind == ast.cs_range then
+      return (a.complement == b.complement) and (a.first == b.first) and (a.last == b.last)
+   elseif kind == ast.cs_list then
+      if (a.complement ~= b.complement) or (#a.chars ~= #b.chars) then return false; end
+      for i = 1, #a.chars do
+	 if a.chars[i] ~= b.chars[i] then return false; end
+      end
+      return true
+   end
+   return false
+end
+
+---------------------------------------------------------------------------------------------------
+-- Inlining
+---------------------------------------------------------------------------------------------------
+
+-- Return the number of nodes in a when a is a literal or a character set expression, else nil
+local function leaf_size(a)
+   a = unwrap(a)
+   if ast.literal.is(a) or ast.cs_list.is(a) or ast.cs_range.is(a) or ast.cs_named.is(a) then
+      return 1
+   elseif ast.bracket.is(a) then
+      local n = leaf_size(a.cexp)
+      return n and (n + 1)
+   elseif ast.choice.is(a) then
+      local total = 1
+      for _, exp in ipairs(a.exps) do
+	 local n = leaf_size(exp)
+	 if not n then return nil; end
+	 total = total + n
+      end
+      return total
+   end
+   return nil
+end
+
+local function copy_leaf(a)
+   a = unwrap(a)
+   if ast.literal.is(a) then
+      return ast.literal.new{value=a.value, sourceref=a.sourceref}
+   elseif ast.cs_list.is(a) then
+      return ast.cs_list.new{chars=a.chars, complement=a.complement, sourceref=a.sourceref}
+   elseif ast.cs_range.is(a) then
+      return ast.cs_range.new{first=a.first, last=a.last, complement=a.complement,
+			      sourceref=a.sourceref}
+   elseif ast.cs_named.is(a) then
+      return ast.cs_named.new{name=a.name, complement=a.complement, sourceref=a.sourceref}
+   elseif ast.bracket.is(a) then
+      return ast.bracket.new{cexp=copy_leaf(a.cexp), complement=a.complement,
+			     sourceref=a.sourceref}
+   else
+      assert(ast.choice.is(a))
+      local exps = {}
+      for i, exp in ipairs(a.exps) do exps[i] = copy_leaf(exp); end
+      return ast.choice.new{exps=exps, sourceref=a.sourceref}
+   end
+end
+
+-- Return the expression to use in place of the reference a
+local function inline(a, env)
+   local ok, pat = pcall(env.lookup, env, a.localname, a.packagename)
+   if ok and common.pattern.is(pat) and pat.alias and pat.ast and (pat.ast ~= a) then
+      local n = leaf_size(pat.ast)
+      if n and (n <= INLINE_MAX) then return copy_leaf(pat.ast); end
+   end
+   return a
+end
+
+---------------------------------------------------------------------------------------------------
+-- Merging single characters into character sets
+---------------------------------------------------------------------------------------------------
+
+-- Every expression that matches exactly one character is in one of three classes: "ascii"
+-- (one byte below 0x80), "byte" (one byte), or "utf8" (one valid utf-8 character).  Ascii
+-- expressions can be merged with either of the others.
+
+local function merge_class(c1, c2)
+   if not (c1 and c2) then return nil; end
+   if c1 == "ascii" then return c2; end
+   if (c2 == "ascii") or (c1 == c2) then return c1; end
+   return nil
+end
+
+local function char_class(char)
+   if #char == 1 then return (char:byte(1) < 0x80) and "ascii" or "byte"; end
+   local ok, cp = pcall(utf8.codepoint, char)
+   if ok and (utf8.char(cp) == char) then return "utf8"; end
+   return nil
+end
+
+local named_classes = {}
+
+local function named_class(name)
+   local peg = common.locale[name]
+   if not peg then return nil; end
+   if not named_classes[name] then
+      named_classes[name] = "ascii"
+      for b = 0x80, 0xFF do
+	 if peg:match(string.char(b)) then named_classes[name] = "byte"; break; end
+      end
+   end
+   return named_classes[name]
+end
+
+-- Return the class of a, when a matches exactly one character, else nil
+local function set_class(a)
+   a = unwrap(a)
+   if ast.literal.is(a) then
+      local str = literal_string(a)
+      if str and (#str > 0) and (ustring.len(str) == 1) then return char_class(str); end
+   elseif ast.bracket.is(a) then
+      if not a.complement then return set_class(a.cexp); end
+   elseif ast.cs_list.is(a) then
+      if (not a.complement) and (#a.chars > 0) then
+	 local class = "ascii"
+	 for _, char in ipairs(a.chars) do class = merge_class(class, char_class(char)); end
+	 return class
+      end
+   elseif ast.cs_range.is(a) then
+      if a.complement then return nil; end
+      if (#a.first == 1) and (#a.last == 1) then
+	 return merge_class(char_class(a.first), char_class(a.last))
+      end
+      return "utf8"
+   elseif ast.cs_named.is(a) then
+      if not a.complement then return named_class(a.name); end
+   elseif ast.choice.is(a) then
+      local class = "ascii"
+      for _, exp in ipairs(a.exps) do class = merge_class(class, set_class(exp)); end
+      return class
+   end
+   return nil
+end
+
+local function as_charset(a)
+   a = unwrap(a)
+   if ast.literal.is(a) then
+      return ast.cs_list.new{chars={literal_string(a)}, complement=false, sourceref=a.sourceref}
+   end
+   return a
+end
+
+-- Merge each run of adjacent alternatives that match one character (of compatible classes)
+local function merge_sets(alts, sref)
+   local result = {}
+   local i = 1
+   while i <= #alts do
+      local class = set_class(alts[i])
+      local j = i
+      while class and alts[j+1] and merge_class(class, set_class(alts[j+1])) do
+	 j = j + 1
+	 class = merge_class(class, set_class(alts[j]))
+      end
+      if j > i then
+	 local items = {}
+	 for k = i, j do table.insert(items, as_charset(alts[k])); end
+	 table.insert(result,
+		      ast.bracket.new{cexp=ast.choice.new{exps=items, sourceref=sref},
+				      complement=false,
+				      sourceref=sref})
+      else
+	 table.insert(result, alts[i])
+      end
+      i = j + 1
+   end
+   return result
+end
+
+---------------------------------------------------------------------------------------------------
+-- Factoring common prefixes out of choices
+---------------------------------------------------------------------------------------------------
+
+local function first_char(a)
+   local str = literal_string(a)
+   return str and (#str > 0) and ustring.explode(str)[1]
+end
+
+-- Two alternatives can share a prefix when their first elements are equal, or are literals
+-- that start with the same character
+local function same_head(a, b)
+   local c1, c2 = first_char(a), first_char(b)
+   if c1 or c2 then return c1 == c2; end
+   return equal(a, b)
+end
+
+local factor_choice
+
+-- Factor the common prefix out of alts[i..j], which all start with the same head
+local function factor_run(alts, i, j, sref)
+   local lists = {}
+   for k = i, j do lists[k-i+1] = elements(alts[k]); end
+   -- Split the leading literals at their longest common prefix
+   if literal_string(lists[1][1]) then
+      local chars = ustring.explode(literal_string(lists[1][1]))
+      local n = #chars
+      for k = 2, #lists do
+	 local other = ustring.explode(literal_string(lists[k][1]))
+	 local m = 0
+	 while (m < n) and (chars[m+1] == other[m+1]) do m = m + 1; end
+	 n = m
+      end
+      local prefix = table.concat(chars, "", 1, n)
+      for k, list in ipairs(lists) do
+	 local head = list[1]
+	 local rest = literal_string(head):sub(#prefix + 1)
+	 local new = {make_literal(prefix, head.sourceref)}
+	 if #rest > 0 then table.insert(new, make_literal(rest, head.sourceref)); end
+	 table.move(list, 2, #list, #new + 1, new)
+	 lists[k] = new
+      end
+   end
+   -- The prefix must leave at least one element in every alternative
+   local n = math.huge
+   for _, list in ipairs(lists) do n = math.min(n, #list - 1); end
+   for k = 2, #lists do
+      local m = 0
+      while (m < n) and equal(lists[1][m+1], lists[k][m+1]) do m = m + 1; end
+      n = m
+   end
+   if n == 0 then
+      local unchanged = {}
+      for k = i, j do table.insert(unchanged, alts[k]); end
+      return unchanged
+   end
+   local rests = {}
+   for k, list in ipairs(lists) do
+      rests[k] = make_sequence(table.move(list, n + 1, #list, 1, {}), sref)
+   end
+   local exps = table.move(lists[1], 1, n, 1, {})
+   table.insert(exps, make_sequence(factor_choice(rests, sref), sref))
+   return {ast.sequence.new{exps=exps, sourceref=sref}}
+end
+
+-- Return the alternatives after factoring and merging, or a one-element list
+function factor_choice(alts, sref)
+   local result = {}
+   local i = 1
+   while i <= #alts do
+      local j = i
+      while alts[j+1] and same_head(elements(alts[i])[1], elements(alts[j+1])[1]) do
+	 j = j + 1
+      end
+      if j > i then
+	 for _, exp in ipairs(factor_run(alts, i, j, sref)) do table.insert(result, exp); end
+      else
+	 table.insert(result, alts[i])
+      end
+      i = j + 1
+   end
+   result = merge_sets(result, sref)
+   if #result == 1 then return result; end
+   return {ast.choice.new{exps=result, sourceref=sref}}
+end
+
+---------------------------------------------------------------------------------------------------
+-- Rewriting
+---------------------------------------------------------------------------------------------------
+
+local rewrite
+
+local function rewrite_sequence(a, env, memo)
+   local exps, changed = {}, false
+   for _, exp in ipairs(a.exps) do
+      local new = rewrite(exp, env, memo)
+      local last = exps[#exps]
+      local s1, s2 = last and literal_string(unwrap(last)), literal_string(unwrap(new))
+      if s1 and s2 then
+	 exps[#exps] = make_literal(s1 .. s2, unwrap(last).sourceref)
+	 changed = true
+      else
+	 table.insert(exps, new)
+	 changed = changed or (new ~= exp)
+      end
+   end
+   if not changed then return a; end
+   return ast.sequence.new{exps=exps, sourceref=a.sourceref}
+end
+
+local function same_list(l1, l2)
+   if #l1 ~= #l2 then return false; end
+   for i = 1, #l1 do
+      if l1[i] ~= l2[i] then return false; end
+   end
+   return true
+end
+
+local function rewrite_choice(a, env, memo)
+   -- Ordered choice is associative, so nested choices are flattened first
+   local alts, all_literals = {}, true
+   for _, exp in ipairs(a.exps) do
+      local new = rewrite(exp, env, memo)
+      local exps = ast.choice.is(unwrap(new)) and unwrap(new).exps or {new}
+      for _, alt in ipairs(exps) do
+	 table.insert(alts, alt)
+	 all_literals = all_literals and (literal_string(unwrap(alt)) ~= nil)
+      end
+   end
+   local result
+   if all_literals then
+      result = merge_sets(alts, a.sourceref)
+      if #result > 1 then result = alts; end
+   else
+      result = factor_choice(alts, a.sourceref)
+      if ast.choice.is(result[1]) then result = result[1].exps; end
+   end
+   if #result == 1 then return result[1]; end
+   if same_list(result, a.exps) then return a; end
+   return ast.choice.new{exps=result, sourceref=a.sourceref}
+end
+
+function rewrite(a, env, memo)
+   if memo[a] then return memo[a]; end
+   local new = a
+   if ast.sequence.is(a) then
+      new = rewrite_sequence(a, env, memo)
+   elseif ast.choice.is(a) then
+      new = rewrite_choice(a, env, memo)
+   elseif ast.and_exp.is(a) then
+      local exps, changed = {}, false
+      for i, exp in ipairs(a.exps) do
+	 exps[i] = rewrite(exp, env, memo)
+	 changed = changed or (exps[i] ~= exp)
+      end
+      if changed then new = ast.and_exp.new{exps=exps, sourceref=a.sourceref}; end
+   elseif ast.predicate.is(a) then
+      local exp = rewrite(a.exp, env, memo)
+      if exp ~= a.exp then
+	 new = ast.predicate.new{type=a.type, exp=exp, sourceref=a.sourceref}
+      end
+   elseif ast.atleast.is(a) then
+      local exp = rewrite(a.exp, env, memo)
+      if exp ~= a.exp then new = ast.atleast.new{min=a.min, exp=exp, sourceref=a.sourceref}; end
+   elseif ast.atmost.is(a) then
+      local exp = rewrite(a.exp, env, memo)
+      if exp ~= a.exp then new = ast.atmost.new{max=a.max, exp=exp, sourceref=a.sourceref}; end
+   elseif ast.ref.is(a) then
+      new = inline(a, env)
+   end
+   memo[a] = new
+   return new
+end
+
+-- Return an optimized version of the expanded expression a, which is compiled in env.  The
+-- result is a reference (or a grammar) exactly when a is one, because the compiler names the
+-- captures of those differently.
+function optimize.expression(a, env)
+   if (not optimize.enabled) or ast.ref.is(a) or ast.grammar.is(a) then return a; end
+   local ok, new = pcall(rewrite, a, env, {})
+   if not ok then
+      common.note("optimizer failed, using unoptimized expression: ", tostring(new))
+      return a
+   end
+   if ast.ref.is(new) or ast.grammar.is(new) then
+      new = ast.sequence.new{exps={new}, sourceref=a.sourceref}
+   end
+   return new
+end
+
+---------------------------------------------------------------------------------------------------
+-- Size
+---------------------------------------------------------------------------------------------------
+
+-- Estimate the size of a from its ast, in rough units of matching vm instructions: one per byte of
+-- a literal, one per character set, two for each alternative after the first in a choice, and so
+-- on.  A reference counts as one (a call), whatever its size.  This is not a count of the
+-- instructions in the compiled peg.
+function optimize.size(a)
+   if ast.literal.is(a) then
+      local str = literal_string(a)
+      return math.max(1, str and #str or 1)
+   elseif ast.sequence.is(a) then
+      local n = 0
+      for _, exp in ipairs(a.exps) do n = n + optimize.size(exp); end
+      return n
+   elseif ast.choice.is(a) or ast.and_exp.is(a) then
+      local n = 0
+      for _, exp in ipairs(a.exps) do n = n + optimize.size(exp); end
+      return n + 2 * (#a.exps - 1)
+   elseif ast.predicate.is(a) then
+      return optimize.size(a.exp) + 2
+   elseif ast.atleast.is(a) then
+      return optimize.size(a.exp) * (a.min + 1) + 2
+   elseif ast.atmost.is(a) then
+      return (optimize.size(a.exp) + 2) * a.max
+   end
+   return 1
+end
+
+return optimize
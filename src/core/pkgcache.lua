@@ -0,0 +1,247 @@
+-- -*- Mode: Lua; -*-
+--
+-- pkgcache.lua   cache of compiled packages, kept in .rplc files
+--
+-- © Copyright Jamie A. Jennings 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+-- When a module is imported from source, the package it compiles to is saved next to the
+-- source file, e.g. rpl/net.rpl is saved as rpl/net.rplc.  A later import of the same module
+-- reads the .rplc file instead of parsing, expanding, and compiling the source, if the file
+-- is still valid.  It is valid when it was written by this version of rosie (and the same
+-- build of librosie), for the rpl version of the importing engine, from the same source text,
+-- for the same import prefix, and against the same versions of the packages that the module
+-- imports.  The last condition is checked using the cache key of each package, which is a
+-- hash of all of the above.
+--
+-- The pegs of a cached package have no ast.  They can be used for matching and in other
+-- expressions, but a trace treats a reference to one of them as it treats a reference to a
+-- built-in pattern.  When the ast of a cached pattern is needed to compile an expression that
+-- keeps only some captures (see capture projection in compile.lua), its module is compiled
+-- again from source, once.
+--
+-- Caching needs the rplc module from librosie.  When it is not available, every import is
+-- compiled from source.  A .rplc file that cannot be written (e.g. because the directory is
+-- not writable) is silently skipped.
+
+local pkgcache = {}
+
+local common = require "common"
+local util = require "util"
+local ok, rplc = pcall(require, "rplc")
+
+local FORMAT = 2
+local EXTENSION = "c"				    -- appended to the source filename
+
+pkgcache.enabled = (ok and type(rplc)=="table")
+pkgcache.rosie_version = "unknown"		    -- set by init
+pkgcache.hits = 0
+pkgcache.misses = 0
+
+-- Cache key of each package (environment) that was imported
+local keys = setmetatable({}, {__mode="k"})
+
+function pkgcache.key(env)
+   return keys[env]
+end
+
+function pkgcache.set_key(env, key)
+   keys[env] = key
+end
+
+----------------------------------------------------------------------------------------
+-- Serialization of strings, numbers, booleans, and tables of those
+----------------------------------------------------------------------------------------
+
+local T_STRING, T_INTEGER, T_FLOAT, T_TRUE, T_FALSE, T_TABLE = 1, 2, 3, 4, 5, 6
+
+local function encode(v, out)
+   local t = type(v)
+   if t=="string" then
+      table.insert(out, string.pack("=Bs4", T_STRING, v))
+   elseif t=="number" then
+      if math.type(v)=="integer" then
+	 table.insert(out, string.pack("=Bj", T_INTEGER, v))
+      else
+	 table.insert(out, string.pack("=Bn", T_FLOAT, v))
+      end
+   elseif t=="boolean" then
+      table.insert(out, string.pack("=B", (v and T_TRUE) or T_FALSE))
+   elseif t=="table" then
+      local n = 0
+      for _ in pairs(v) do n = n + 1; end
+      table.insert(out, string.pack("=BI4", T_TABLE, n))
+      for key, value in pairs(v) do
+	 encode(key, out)
+	 encode(value, out)
+      end
+   else
+      error("cannot save a value of type " .. t)
+   end
+end
+
+local function decode(s, pos)
+   local tag
+   tag, pos = string.unpack("=B", s, pos)
+   if tag==T_STRING then return string.unpack("=s4", s, pos)
+   elseif tag==T_INTEGER then return string.unpack("=j", s, pos)
+   elseif tag==T_FLOAT then return string.unpack("=n", s, pos)
+   elseif tag==T_TRUE then return true, pos
+   elseif tag==T_FALSE then return false, pos
+   elseif tag==T_TABLE then
+      local n, key, value
+      local tbl = {}
+      n, pos = string.unpack("=I4", s, pos)
+      for i = 1, n do
+	 key, pos = decode(s, pos)
+	 value, pos = decode(s, pos)
+	 tbl[key] = value
+      end
+      return tbl, pos
+   end
+   error("invalid tag in compiled package file: " .. tostring(tag))
+end
+
+----------------------------------------------------------------------------------------
+-- Reading and writing .rplc files
+----------------------------------------------------------------------------------------
+
+-- The package and name of each cached pattern, under its peg and its uncap
+local origins = setmetatable({}, {__mode="k"})
+
+-- For each cached package: a function that compiles it from source, or the resulting
+-- environment (false if that failed)
+local sources = setmetatable({}, {__mode="k"})
+
+-- Record that the patterns in bindings, which were loaded into env from a .rplc file, can be
+-- compiled from source by calling compile_source(), which returns a new environment.
+function pkgcache.set_source(env, bindings, compile_source)
+   sources[env] = compile_source
+   for name, pat in pairs(bindings) do
+      local origin = {env=env, name=name}
+      origins[pat.peg] = origin
+      if pat.uncap then origins[pat.uncap] = origin; end
+   end
+end
+
+-- Return the pattern compiled from source for the cached pattern whose peg (or uncap) is peg,
+-- or nil.
+function pkgcache.source_pattern(peg)
+   local origin = peg and origins[peg]
+   if not origin then return nil; end
+   if type(sources[origin.env])=="function" then
+      sources[origin.env] = sources[origin.env]() or false
+   end
+   local env = sources[origin.env]
+   return env and env:lookup(origin.name) or nil
+end
+
+local function header(compiler, source, prefix)
+   return {format = FORMAT,
+	   signature = rplc.signature(),
+	   rosie = pkgcache.rosie_version,
+	   rpl = tostring(compiler.version),
+	   source = rplc.hash(source),
+	   prefix = prefix or false}
+end
+
+local function make_key(hdr, deps)
+   local parts = {hdr.signature, hdr.rosie, hdr.rpl, hdr.source, tostring(hdr.prefix)}
+   for _, dep in ipairs(deps) do table.insert(parts, dep.key); end
+   return rplc.hash(table.concat(parts, "\0"))
+end
+
+-- Return the contents of a valid .rplc file for the module in 'filename', or nil.
+function pkgcache.read(compiler, filename, source, prefix)
+   if not (pkgcache.enabled and filename) then return nil; end
+   local data = util.readfile(filename .. EXTENSION)
+   if data then
+      local ok, entry = pcall(decode, data, 1)
+      if ok and type(entry)=="table" then
+	 local hdr = header(compiler, source, prefix)
+	 local valid = true
+	 for k, v in pairs(hdr) do
+	    if entry[k]~=v then valid = false; break; end
+	 end
+	 if valid then return entry; end
+      end
+   end
+   return nil
+end
+
+-- Return the pattern bindings saved in entry (see pkgcache.read), or nil if they cannot be
+-- loaded.
+function pkgcache.bindings(entry)
+   local ok, bindings = pcall(function()
+				 local bindings = {}
+				 for name, b in pairs(entry.bindings) do
+				    bindings[name] = common.pattern.new{
+				       name = b.name,
+				       peg = rplc.load(b.tree, b.ktable or nil),
+				       uncap = b.uncap_tree and rplc.load(b.uncap_tree, b.uncap_ktable or nil),
+				       label = b.label,
+				       exported = b.exported,
+				       alias = b.alias}
+				 end
+				 return bindings
+			      end)
+   return ok and bindings or nil
+end
+
+-- Count an import that did (hit) or did not find a valid .rplc file
+function pkgcache.count(hit)
+   if hit then pkgcache.hits = pkgcache.hits + 1
+   else pkgcache.misses = pkgcache.misses + 1; end
+end
+
+-- Save the pattern bindings of a package that was compiled from source, and set its cache
+-- key.  Each entry of deps is {importpath=, prefix=, key=} for an imported package.
+function pkgcache.write(compiler, origin, source, packagename, env, names, deps)
+   if not (pkgcache.enabled and origin.filename) then return; end
+   for _, dep in ipairs(deps) do
+      if not dep.key then return; end
+   end
+   local entry = header(compiler, source, origin.prefix)
+   entry.key = make_key(entry, deps)
+   entry.packagename = packagename
+   entry.deps = deps
+   entry.bindings = {}
+   keys[env] = entry.key
+   for _, name in ipairs(names) do
+      local pat = env.store[name]
+      if not common.pattern.is(pat) then return; end
+      local tree, ktable = rplc.dump(pat.peg)
+      if not tree then return; end
+      local b = {name=pat.name, tree=tree, ktable=ktable or false,
+		 exported=pat.exported, alias=pat.alias, label=pat.label}
+      if pat.uncap then
+	 b.uncap_tree, b.uncap_ktable = rplc.dump(pat.uncap)
+	 if not b.uncap_tree then return; end
+	 b.uncap_ktable = b.uncap_ktable or false
+      end
+      entry.bindings[name] = b
+   end
+   local out = {}
+   encode(entry, out)
+   -- Write to a temporary file and rename it, so that a reader never sees a partial file
+   local filename = origin.filename .. EXTENSION
+   local tmpname = string.format("%s.%x%s", filename, os.time(), tostring(out):match("0x(%x+)") or "")
+   local f = io.open(tmpname, "wb")
+   if not f then return; end
+   local ok = f:write(table.concat(out))
+   f:close()
+   if not (ok and os.rename(tmpname, filename)) then os.remove(tmpname); end
+end
+
+function pkgcache.attributes()
+   local new = common.new_attribute
+   return {new("RPLC_CACHE", (pkgcache.enabled and "on") or "off", "build",
+	       "save compiled packages in .rplc files next to their sources"),
+	   new("RPLC_HITS", pkgcache.hits, "",
+	       "number of imports loaded from .rplc files"),
+	   new("RPLC_MISSES", pkgcache.misses, "",
+	       "number of imports that found no valid .rplc file")}
+end
+
+return pkgcache
@@ -0,0 +1,304 @@
+-- -*- Mode: Lua; -*-
+--
+-- profile.lua   Attribute matching time to the named patterns (bindings) that were matched
+--
+-- © Copyright IBM Corporation 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+-- The profiler works like the tracer (see trace.lua) in that it walks the ast of the pattern
+-- being matched.  Unlike the tracer, it matches each piece of the input only once: sequences,
+-- choices, repetitions, predicates, and references are evaluated here, and only the leaves of
+-- the ast are matched by the vm.  So every leaf is matched in the context of the stack of
+-- references that led to it, and its cost is charged to the innermost binding on the stack
+-- ("self") and to each binding on the stack ("total").  The cost of a leaf is measured as time
+-- (cpu seconds) and as steps (one per attempt to match, plus one per input byte consumed).  An
+-- alternative of a choice that fails counts as a backtrack in the binding that contains the
+-- choice.
+--
+-- The leaves are literals, character sets, grammars, function applications, and references
+-- to built-in patterns or to patterns that have no ast (e.g. when loaded from a .rplc file).
+-- A grammar is profiled as one unit.  Because a leaf is matched without the captures made
+-- before it, a back-reference may match differently here than in the real match.
+--
+-- Profiling a line costs much more than matching it, so the cli profiles a sample of the input
+-- lines (every Nth one, see --profile-rate) while matching all of them as usual.
+--
+-- Usage:
+--   p = profile.new()
+--   profile.expression(r, input, start, p)   -- once for each input, where r is an rplx
+--   print(profile.report(p))                 -- ranked by self time
+--   print(profile.folded(p))                 -- folded stacks, e.g. for flamegraph.pl
+
+local profile = {}
+
+local ast = require "ast"
+local builtins = require "builtins"
+local common = require "common"
+local util = require "util"
+local pattern = common.pattern
+local match = common.match
+
+local BOOL_ENCODING, fn_BOOL_ENCODING = common.lookup_encoder("bool")
+local clock = os.clock
+
+local ROOT_NAME = "*"				    -- an expression that is not a reference
+
+function profile.new()
+   return {bindings = {},			    -- name --> stats
+	   stacks = {},				    -- "name1;name2;..." --> {time, steps}
+	   inputs = 0,
+	   tick = 0}				    -- see charge()
+end
+
+local function location(pat)
+   local sref = pat and pat.ast and pat.ast.sourceref
+   if not sref then return "" end
+   if sref == builtins.sourceref then return "built-in"; end
+   local filename = sref.origin and sref.origin.filename
+   local _, _, line_no = util.extract_source_line_from_pos(sref.text or "", sref.s or 1)
+   return (filename or "<input>") .. ":" .. tostring(line_no)
+end
+
+local function binding_stats(p, name, pat)
+   local stats = p.bindings[name]
+   if not stats then
+      stats = {name=name, location=location(pat),
+	       calls=0, matches=0, backtracks=0,
+	       self_time=0, total_time=0, self_steps=0, total_steps=0}
+      p.bindings[name] = stats
+   end
+   return stats
+end
+
+---------------------------------------------------------------------------------------------------
+-- Evaluation
+---------------------------------------------------------------------------------------------------
+
+-- The state of one profiled match: the stack of bindings (and the folded stack keys, which are
+-- built once per push), the matching pegs of the leaves, and the encoder parms.
+local function new_state(p, e)
+   return {profile=p, stack={}, keys={}, pegs={},
+	   parms=common.attribute_table_to_table(e.encoder_parms)}
+end
+
+local function push(st, stats)
+   local n = #st.stack
+   st.stack[n+1] = stats
+   st.keys[n+1] = (n == 0) and stats.name or (st.keys[n] .. ";" .. stats.name)
+   stats.calls = stats.calls + 1
+end
+
+local function pop(st, matched)
+   local n = #st.stack
+   local stats = st.stack[n]
+   st.stack[n], st.keys[n] = nil, nil
+   if matched then stats.matches = stats.matches + 1; end
+end
+
+local function charge(st, dt, steps)
+   local n = #st.stack
+   local top = st.stack[n]
+   top.self_time = top.self_time + dt
+   top.self_steps = top.self_steps + steps
+   -- A binding can be on the stack more than once (through a recursive reference), but its total
+   -- is charged only once, so each charge has its own tick
+   local p = st.profile
+   p.tick = p.tick + 1
+   for i = 1, n do
+      local stats = st.stack[i]
+      if stats.charged ~= p.tick then
+	 stats.charged = p.tick
+	 stats.total_time = stats.total_time + dt
+	 stats.total_steps = stats.total_steps + steps
+      end
+   end
+   local key = st.keys[n]
+   local entry = p.stacks[key]
+   if not entry then
+      entry = {time=0, steps=0}
+      p.stacks[key] = entry
+   end
+   entry.time = entry.time + dt
+   entry.steps = entry.steps + steps
+end
+
+-- Match the leaf a at start, and return whether it matched and the position after the match
+local function leaf(st, a, input, start)
+   local peg = st.pegs[a]
+   if not peg then
+      local pat = a.pat
+      if not pattern.is(pat) then
+	 error("Internal error: no pattern stored in ast node " .. ast.tostring(a))
+      end
+      peg = common.match_node_wrap(pat.peg, "*")
+      st.pegs[a] = peg
+   end
+   local t0 = clock()
+   local m, leftover = match(peg, input, start, BOOL_ENCODING, fn_BOOL_ENCODING, st.parms)
+   local dt = clock() - t0
+   local nextpos = #input - leftover + 1
+   charge(st, dt, 1 + (m and (nextpos - start) or 0))
+   return m and true, nextpos
+end
+
+local expression
+
+local function sequence(st, a, input, start)
+   local pos = start
+   for _, exp in ipairs(a.exps) do
+      local m, nextpos = expression(st, exp, input, pos)
+      if not m then return false, start; end
+      pos = nextpos
+   end
+   return true, pos
+end
+
+local function choice(st, a, input, start)
+   for _, exp in ipairs(a.exps) do
+      local m, nextpos = expression(st, exp, input, start)
+      if m then return true, nextpos; end
+      local top = st.stack[#st.stack]
+      top.backtracks = top.backtracks + 1
+   end
+   return false, start
+end
+
+local function atleast(st, a, input, start)
+   local count, pos = 0, start
+   while true do
+      local m, nextpos = expression(st, a.exp, input, pos)
+      if not m then break; end
+      count = count + 1
+      if nextpos == pos then break; end	    -- would loop forever
+      pos = nextpos
+   end
+   if count >= a.min then return true, pos; end
+   return false, start
+end
+
+local function atmost(st, a, input, start)
+   local pos = start
+   for i = 1, a.max do
+      local m, nextpos = expression(st, a.exp, input, pos)
+      if not m then break; end
+      pos = nextpos
+   end
+   return true, pos
+end
+
+local function predicate(st, a, input, start)
+   if a.type == "lookahead" then
+      return (expression(st, a.exp, input, start)), start
+   elseif a.type == "negation" then
+      return (not expression(st, a.exp, input, start)), start
+   end
+   return leaf(st, a, input, start)
+end
+
+local function ref(st, a, input, start)
+   local pat = a.pat
+   if (not pat) or (not pat.ast) or (pat.ast.sourceref == builtins.sourceref) then
+      return leaf(st, a, input, start)
+   end
+   local name = common.compose_id{a.packagename, a.localname}
+   push(st, binding_stats(st.profile, name, pat))
+   local m, nextpos = expression(st, pat.ast, input, start)
+   pop(st, m)
+   return m, nextpos
+end
+
+function expression(st, a, input, start)
+   if ast.sequence.is(a) then
+      return sequence(st, a, input, start)
+   elseif ast.choice.is(a) then
+      return choice(st, a, input, start)
+   elseif ast.ref.is(a) then
+      return ref(st, a, input, start)
+   elseif ast.atleast.is(a) then
+      return atleast(st, a, input, start)
+   elseif ast.atmost.is(a) then
+      return atmost(st, a, input, start)
+   elseif ast.predicate.is(a) then
+      return predicate(st, a, input, start)
+   else
+      return leaf(st, a, input, start)
+   end
+end
+
+-- Profile a match of the rplx r against input, adding the results to the profile p.  Return
+-- whether there was a match and the position after it (as found by the profiler).
+function profile.expression(r, input, start, p)
+   start = start or 1
+   assert(type(input)=="string")
+   assert(type(start)=="number")
+   assert(r.pattern and r.engine)		    -- quack
+   local a = r.pattern.ast
+   assert(a, "no ast stored for pattern")
+   local st = new_state(p, r.engine)
+   p.inputs = p.inputs + 1
+   push(st, binding_stats(p, ROOT_NAME, r.pattern))
+   local m, nextpos = expression(st, a, input, start)
+   pop(st, m)
+   return m, nextpos
+end
+
+---------------------------------------------------------------------------------------------------
+-- Output
+---------------------------------------------------------------------------------------------------
+
+local function sorted_bindings(p)
+   local ls = {}
+   for _, stats in pairs(p.bindings) do table.insert(ls, stats); end
+   table.sort(ls, function(s1, s2)
+		     if s1.self_time ~= s2.self_time then return s1.self_time > s2.self_time; end
+		     if s1.self_steps ~= s2.self_steps then return s1.self_steps > s2.self_steps; end
+		     return s1.name < s2.name
+		  end)
+   return ls
+end
+
+-- Return a table of the bindings ranked by self time, one line each, showing at most
+-- optional_max bindings
+function profile.report(p, optional_max)
+   local total_time = 0
+   for _, entry in pairs(p.stacks) do total_time = total_time + entry.time; end
+   local fmt = "%7s %10s %10s %10s %10s %9s %9s  %-s %s"
+   local lines = {string.format("Profile of %d input%s", p.inputs, (p.inputs ~= 1) and "s" or ""),
+		  string.format(fmt, "self%", "self ms", "total ms", "self steps", "tot steps",
+				"calls", "backtrack", "binding", "(location)")}
+   for i, stats in ipairs(sorted_bindings(p)) do
+      if optional_max and (i > optional_max) then break; end
+      local percent = (total_time > 0) and (100 * stats.self_time / total_time) or 0
+      table.insert(lines,
+		   string.format(fmt,
+				 string.format("%.1f", percent),
+				 string.format("%.3f", stats.self_time * 1000),
+				 string.format("%.3f", stats.total_time * 1000),
+				 tostring(stats.self_steps),
+				 tostring(stats.total_steps),
+				 tostring(stats.calls),
+				 tostring(stats.backtracks),
+				 stats.name,
+				 (stats.location ~= "") and ("(" .. stats.location .. ")") or ""))
+   end
+   return table.concat(lines, "\n")
+end
+
+-- Return the profile as folded stacks, one line per stack, e.g. "*;net.any;net.ipv4 1234".  The
+-- weight is in microseconds when the unit is "time" (the default), else it is in steps.
+function profile.folded(p, optional_unit)
+   local by_time = (optional_unit or "time") == "time"
+   local keys = {}
+   for key in pairs(p.stacks) do table.insert(keys, key); end
+   table.sort(keys)
+   local lines = {}
+   for _, key in ipairs(keys) do
+      local entry = p.stacks[key]
+      local weight = by_time and math.floor(entry.time * 1000000 + 0.5) or entry.steps
+      if weight > 0 then table.insert(lines, key .. " " .. tostring(weight)); end
+   end
+   return table.concat(lines, "\n")
+end
+
+return profile
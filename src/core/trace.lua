@@ -79,6 +79,9 @@ local function one_node_tostrings(t, is_last_node, in_seq)
    for i = 2, #t_ast_lines do
       table.insert(lines, tab(is_last_node, in_seq) .. t_ast_lines[i])
    end
+   if t.truncated then
+      table.insert(lines, tab(is_last_node, in_seq) .. "(Trace budget reached: not expanded)")
+   end
    if t.match ~= nil then
       table.insert(lines,
 		   tab(is_last_node, in_seq) ..
@@ -220,7 +223,7 @@ end
 
 -- Utility
 
-local function protected_match(peg, input, start, parms)
+local function protected_match(peg, input, start, parms, a)
    local ok, m, leftover =
       pcall(match, peg, input, start, BYTE_ENCODING, fn_BYTE_ENCODING, parms)
    if not ok then
@@ -235,6 +238,88 @@ local function protected_match(peg, input, start, parms)
    return m, leftover
 end
 
+---------------------------------------------------------------------------------------------------
+-- Trace state, memoization, and budgets
+---------------------------------------------------------------------------------------------------
+
+-- A trace is computed with a state record that holds:
+--   engine, parms: the engine that compiled the pattern, and its encoder parms
+--   pegs: the matching peg of each ast node, created once per trace
+--   memo: the result of tracing each ast node at each input position, because the same
+--         sub-expression is often traced at the same position many times, e.g. when the
+--         alternatives of a choice start with the same reference
+--   nodes, depth: the number of trace nodes created so far, and the current depth
+--   max_nodes, max_depth: the budget.  A node beyond the budget is not expanded: it has its
+--         match result but no subs, and is marked 'truncated'.
+--   writer: when set, the trace is written (by calling writer with each line) as it is
+--         computed, and no subs are kept, so only one small record per memo entry is stored
+--
+-- The default budget is below.  Either limit can be set to false to remove it.
+
+trace.max_nodes = 100000
+trace.max_depth = 500
+
+local STREAM_INPUT_MAX = 60			    -- most input chars shown per streamed node
+
+local function new_state(e, options)
+   options = options or {}
+   local max_nodes, max_depth = options.max_nodes, options.max_depth
+   if max_nodes == nil then max_nodes = trace.max_nodes; end
+   if max_depth == nil then max_depth = trace.max_depth; end
+   return {engine=e,
+	   parms=common.attribute_table_to_table(e.encoder_parms),
+	   pegs={},
+	   memo={},
+	   nodes=0,
+	   depth=0,
+	   max_nodes=max_nodes or math.huge,
+	   max_depth=max_depth or math.huge,
+	   writer=options.writer}
+end
+
+local function memo_lookup(st, a, start)
+   local by_pos = st.memo[a]
+   return by_pos and by_pos[start]
+end
+
+local function memo_store(st, a, start, result)
+   local by_pos = st.memo[a]
+   if not by_pos then
+      by_pos = {}
+      st.memo[a] = by_pos
+   end
+   by_pos[start] = result
+end
+
+-- When the node budget is used up, the loops below stop early, and return a node that is marked
+-- as truncated (with the match result that was computed before expanding it)
+local function exhausted(st)
+   return st.nodes >= st.max_nodes
+end
+
+local function truncated(a, input, start, expected, nextpos, matches)
+   return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start,
+	   truncated=true}
+end
+
+-- Record a sub-trace in the list 'matches', unless streaming
+local function add_sub(st, matches, result)
+   if not st.writer then table.insert(matches, result); end
+end
+
+local function stream_node(st, t, memoized)
+   local indent = string.rep("  ", st.depth)
+   local shown = t.input:sub(t.start, t.start + STREAM_INPUT_MAX - 1)
+   if #t.input - t.start + 1 > STREAM_INPUT_MAX then shown = shown .. "..."; end
+   local outcome
+   if t.match then outcome = "Matched " .. tostring(t.nextpos - t.start) .. " chars"
+   else outcome = "No match"; end
+   st.writer(indent .. "Expression: " .. (util.split(ast.tostring(t.ast), '\n')[1] or "") ..
+	     "  (input pos = " .. tostring(t.start) .. ") " ..
+	     left_delim .. shown .. right_delim .. "  " .. outcome ..
+	     (memoized and " (traced above)" or ""))
+end
+
 ---------------------------------------------------------------------------------------------------
 -- Trace functions for each expression type
 ---------------------------------------------------------------------------------------------------
@@ -243,28 +328,31 @@ local expression;
 
 -- Append to 'matches' a trace record for each item in 'exps' that we didn't even try to match,
 -- which are those beginning at index 'start'.
-local function append_unattempted(exps, start, matches, input, nextstart)
+local function append_unattempted(st, exps, start, matches, input, nextstart)
+   if st.writer then return; end
    for i = start, #exps do
       table.insert(matches, {ast=exps[i], input=input, start=nextstart})
    end
 end
 
-local function sequence(e, a, input, start, expected, nextpos)
+local function sequence(st, a, input, start, expected, nextpos)
    local matches = {}
    local nextstart = start
+   local n, last = 0, nil
    for _, exp in ipairs(a.exps) do
-      local result = expression(e, exp, input, nextstart)
-      table.insert(matches, result)
-      if not result.match then break
-      else nextstart = result.nextpos; end
+      if exhausted(st) then return truncated(a, input, start, expected, nextpos, matches); end
+      last = expression(st, exp, input, nextstart)
+      add_sub(st, matches, last)
+      n = n + 1
+      if not last.match then break
+      else nextstart = last.nextpos; end
    end -- for
-   local n = #matches
    if n < #a.exps then
-      append_unattempted(a.exps, n+1, matches, input, nextstart)
+      append_unattempted(st, a.exps, n+1, matches, input, nextstart)
    end
-   if (n==#a.exps) and (matches[n].match) then
+   if (n==#a.exps) and (last.match) then
       assert(expected, "sequence match differs from expected")
-      assert(matches[n].nextpos==nextpos, "sequence nextpos differs from expected")
+      assert(last.nextpos==nextpos, "sequence nextpos differs from expected")
       return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
    else
       assert(not expected, "sequence non-match differs from expected")
@@ -272,19 +360,21 @@ local function sequence(e, a, input, start, expected, nextpos)
    end
 end
 
-local function choice(e, a, input, start, expected, nextpos)
+local function choice(st, a, input, start, expected, nextpos)
    local matches = {}
+   local n, last = 0, nil
    for _, exp in ipairs(a.exps) do
-      local result = expression(e, exp, input, start)
-      table.insert(matches, result)
-      if result.match then break; end
+      if exhausted(st) then return truncated(a, input, start, expected, nextpos, matches); end
+      last = expression(st, exp, input, start)
+      add_sub(st, matches, last)
+      n = n + 1
+      if last.match then break; end
    end -- for
-   local n = #matches
    if n < #a.exps then
-      append_unattempted(a.exps, n+1, matches, input, matches[n].nextpos)
+      append_unattempted(st, a.exps, n+1, matches, input, last.nextpos)
    end
    if expected~=nil then
-      if matches[n].match then
+      if last.match then
 	 assert(expected, "choice match differs from expected")
       else
 	 assert(not expected, "choice non-match differs from expected")
@@ -293,17 +383,16 @@ local function choice(e, a, input, start, expected, nextpos)
    return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
 end
 
--- FUTURE: A qualified reference to a separately compiled module may not have an AST available
--- for debugging (unless it was compiled with debugging enabled).
+-- A reference to a pattern from a package that was loaded from a .rplc file has no AST (see
+-- pkgcache.lua), so it is traced like a reference to a built-in pattern.
 
-local function ref(e, a, input, start, expected, nextpos)
+local function ref(st, a, input, start, expected, nextpos)
    local pat = a.pat
-   assert(pat.ast, "missing ast?")
-   if pat.ast.sourceref == builtins.sourceref then
-      -- In a trace, a reference no subs if it is built-in
+   if (not pat.ast) or (pat.ast.sourceref == builtins.sourceref) then
+      -- In a trace, a reference no subs if it is built-in or has no AST
       return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
    else
-      local result = expression(e, pat.ast, input, start)
+      local result = expression(st, pat.ast, input, start)
       if expected then
 	 assert(result.match, "reference match differs from expected")
 	 assert(nextpos==result.nextpos, "reference nextpos differs from expected")
@@ -311,23 +400,27 @@ local function ref(e, a, input, start, expected, nextpos)
 	 assert(not result.match)
       end
       -- In a trace, a reference has one sub (or none, if it is built-in)
-      return {match=expected, nextpos=nextpos, ast=a, subs={result}, input=input, start=start}
+      local matches = {}
+      add_sub(st, matches, result)
+      return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
    end
 end
 
 -- Note: 'atleast' implements * when a.min==0
-local function atleast(e, a, input, start, expected, nextpos)
+local function atleast(st, a, input, start, expected, nextpos)
    local matches = {}
    local nextstart = start
+   local n, last = 0, nil
    assert(type(a.min)=="number")
    while true do
-      local result = expression(e, a.exp, input, nextstart)
-      table.insert(matches, result)
-      if not result.match then break
-      else nextstart = result.nextpos; end
+      if exhausted(st) then return truncated(a, input, start, expected, nextpos, matches); end
+      last = expression(st, a.exp, input, nextstart)
+      add_sub(st, matches, last)
+      n = n + 1
+      if not last.match then break
+      else nextstart = last.nextpos; end
    end -- while
-   local last = matches[#matches]
-   if (#matches > a.min) or (#matches==a.min and last.match) then
+   if (n > a.min) or (n==a.min and last.match) then
       assert(expected, "atleast match differs from expected")
       assert(nextstart==nextpos, "atleast nextpos differs from expected")
       return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
@@ -339,17 +432,18 @@ end
 
 -- 'atmost' always succeeds, because it matches from 0 to a.max copies of exp, and it stops trying
 -- to match after it matches a.max times.
-local function atmost(e, a, input, start, expected, nextpos)
+local function atmost(st, a, input, start, expected, nextpos)
    local matches = {}
    local nextstart = start
+   local last
    assert(type(a.max)=="number")
    for i = 1, a.max do
-      local result = expression(e, a.exp, input, nextstart)
-      table.insert(matches, result)
-      if not result.match then break
-      else nextstart = result.nextpos; end
+      if exhausted(st) then return truncated(a, input, start, expected, nextpos, matches); end
+      last = expression(st, a.exp, input, nextstart)
+      add_sub(st, matches, last)
+      if not last.match then break
+      else nextstart = last.nextpos; end
    end -- while
-   local last = matches[#matches]
    assert(expected, "atmost match differs from expected")
    if last.match then
       assert(last.nextpos==nextpos, "atmost nextpos differs from expected")
@@ -364,15 +458,12 @@ local function bracket_explanation(a, input, start, m, complement)
            " And complement is: " .. tostring(complement))
 end
 
-local function cs_simple(e, a, input, start, expected, nextpos)
+local function cs_simple(st, a, input, start, expected, nextpos)
    local complement = a.complement
    local simple = a.pat
    assert(pattern.is(simple))
    local wrapped_peg = common.match_node_wrap(simple.peg, "*")
-   local m, leftover = protected_match(wrapped_peg,
-				       input,
-				       start,
-				       common.attribute_table_to_table(e.encoder_parms))
+   local m, leftover = protected_match(wrapped_peg, input, start, st.parms, a)
    local nextstart = #input - leftover + 1
    if expected ~= nil then
       if (m and (not complement)) then
@@ -386,43 +477,32 @@ local function cs_simple(e, a, input, start, expected, nextpos)
    return {match=m, nextpos=nextpos, ast=a, input=input, start=start}
 end
 
-local function bracket(e, a, input, start, expected, nextpos)
-   local subresult_expected
-   if expected~=nil then
-      subresult_expected = (not a.complement) and expected or (not expected)
-   end
-   local result = expression(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- if ast.simple_charset_p(a.cexp) then
-   --    result = cs_simple(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- elseif ast.choice.is(a.cexp) then
-   --    result = choice(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- elseif ast.bracket.is(a.cexp) then
-   --    result = bracket(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- elseif ast.cs_intersection.is(a.cexp) then
-   --    throw("character set intersection is not implemented", a)
-   -- elseif ast.cs_difference.is(a.cexp) then
-   --    throw("character set difference is not implemented", a)
-   -- else
-   --    assert(false, "trace: unknown cexp inside bracket: " .. tostring(a.cexp))
-   -- end
---   print("*** bracket intermediate result:"); for k,v in pairs(result) do print(k,v) end
+local function bracket(st, a, input, start, expected, nextpos)
+   if not pattern.is(a.cexp.pat) then
+      -- A union of simple character sets is compiled as one set (see compile.lua)
+      return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
+   end
+   local result = expression(st, a.cexp, input, start)
+   local matched = result.match
    if a.complement then
-      result.match = not result.match
+      matched = not matched
    end
    if expected ~= nil then
-      if result.match and (not a.complement) then
+      if matched and (not a.complement) then
 	 assert(expected, "bracket match differs from expected" ..
-		bracket_explanation(a, input, start, result.match, a.complement))
-      elseif (not result.match) and (not a.complement) then
+		bracket_explanation(a, input, start, matched, a.complement))
+      elseif (not matched) and (not a.complement) then
 	 assert(not expected, "bracket non-match differs from expected" ..
-		bracket_explanation(a, input, start, result.match, a.complement))
+		bracket_explanation(a, input, start, matched, a.complement))
       end
    end -- if there is an expectation that we can check against
-   return {match=result.match, nextpos=nextpos, ast=a, subs={result}, input=input, start=start}
+   local matches = {}
+   add_sub(st, matches, result)
+   return {match=matched, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
 end
       
-local function predicate(e, a, input, start, expected, nextpos)
-   local result = expression(e, a.exp, input, start)
+local function predicate(st, a, input, start, expected, nextpos)
+   local result = expression(st, a.exp, input, start)
    if (result.match and (a.type=="lookahead")) or ((not result.match) and (a.type=="negation")) then
       assert(expected, "predicate match differs from expected")
       -- Cannot compare nextpos to result.nextpos, because 'a.exp' is NOT a predicate (so it
@@ -433,54 +513,45 @@ local function predicate(e, a, input, start, expected, nextpos)
 	     "predicate non-match differs from expected: " .. ast.tostring(a) ..
 	     " on input: " .. input:sub(start))
    end
-   return {match=expected, nextpos=nextpos, ast=a, subs={result}, input=input, start=start}
+   local matches = {}
+   add_sub(st, matches, result)
+   return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
 end
 
-local function and_exp(e, a, input, start, expected, nextpos)
+local function and_exp(st, a, input, start, expected, nextpos)
    -- TODO: 
    return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
 end
 
-local function grammar(e, a, input, start, expected, nextpos)
+local function grammar(st, a, input, start, expected, nextpos)
    -- FUTURE: Simulate a grammar using its pieces.  This will require some careful bouncing in and
    -- out of lpeg because we cannot attempt a match against an lpeg.V(rulename) peg.
    return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
 end
 
-function expression(e, a, input, start)
-   local pat = a.pat
-   if not pattern.is(pat) then
-      error("Internal error: no pattern stored in ast node " .. ast.tostring(a)
-	 .. " (found " .. tostring(pat) .. ")")
-   end
-   local peg = common.match_node_wrap(pat.peg, "*")
-   local m, leftover = protected_match(peg,
-				       input,
-				       start,
-				       common.attribute_table_to_table(e.encoder_parms))
-   local nextpos = #input-leftover+1
+local function expand_node(st, a, input, start, m, nextpos)
    if ast.literal.is(a) then
       return {match=m, nextpos=nextpos, ast=a, input=input, start=start}
    elseif ast.bracket.is(a) then
-      return bracket(e, a, input, start, m, nextpos)
+      return bracket(st, a, input, start, m, nextpos)
    elseif ast.simple_charset_p(a) then
-      return cs_simple(e, a, input, start, m, nextpos)
+      return cs_simple(st, a, input, start, m, nextpos)
    elseif ast.sequence.is(a) then
-      return sequence(e, a, input, start, m, nextpos)
+      return sequence(st, a, input, start, m, nextpos)
    elseif ast.choice.is(a) then
-      return choice(e, a, input, start, m, nextpos)
+      return choice(st, a, input, start, m, nextpos)
    elseif ast.and_exp.is(a) then
-      return and_exp(e, a, input, start, m, nextpos)
+      return and_exp(st, a, input, start, m, nextpos)
    elseif ast.ref.is(a) then
-      return ref(e, a, input, start, m, nextpos)
+      return ref(st, a, input, start, m, nextpos)
    elseif ast.atleast.is(a) then
-      return atleast(e, a, input, start, m, nextpos)
+      return atleast(st, a, input, start, m, nextpos)
    elseif ast.atmost.is(a) then
-      return atmost(e, a, input, start, m, nextpos)
+      return atmost(st, a, input, start, m, nextpos)
    elseif ast.predicate.is(a) then
-      return predicate(e, a, input, start, m, nextpos)
+      return predicate(st, a, input, start, m, nextpos)
    elseif ast.grammar.is(a) then
-      return grammar(e, a, input, start, m, nextpos)
+      return grammar(st, a, input, start, m, nextpos)
    else
       return table.concat({"Internal error: invalid ast type in trace.expression:" .. tostring(a),
 			   "Arguments to trace:",
@@ -493,7 +564,45 @@ function expression(e, a, input, start)
    end
 end
 
-function trace.internal(r, input, start)
+function expression(st, a, input, start)
+   local memoized = memo_lookup(st, a, start)
+   if memoized then
+      if st.writer then stream_node(st, memoized, true); end
+      return memoized
+   end
+   local pat = a.pat
+   if not pattern.is(pat) then
+      error("Internal error: no pattern stored in ast node " .. ast.tostring(a)
+	 .. " (found " .. tostring(pat) .. ")")
+   end
+   local peg = st.pegs[a]
+   if not peg then
+      peg = common.match_node_wrap(pat.peg, "*")
+      st.pegs[a] = peg
+   end
+   local m, leftover = protected_match(peg, input, start, st.parms, a)
+   local nextpos = #input-leftover+1
+   st.nodes = st.nodes + 1
+   local result
+   if (st.nodes > st.max_nodes) or (st.depth >= st.max_depth) then
+      result = {match=m, nextpos=nextpos, ast=a, input=input, start=start, truncated=true}
+      if st.writer then stream_node(st, result); end
+   else
+      if st.writer then
+	 stream_node(st, {match=m, nextpos=nextpos, ast=a, input=input, start=start})
+      end
+      st.depth = st.depth + 1
+      result = expand_node(st, a, input, start, m, nextpos)
+      st.depth = st.depth - 1
+   end
+   memo_store(st, a, start, result)
+   return result
+end
+
+-- Trace the match of the rplx r against input.  The optional table 'options' may contain
+-- max_nodes and max_depth (which override trace.max_nodes and trace.max_depth), and a writer
+-- function (see new_state, above).
+function trace.internal(r, input, start, options)
    start = start or 1
    assert(type(input)=="string")
    assert(type(start)=="number")
@@ -501,7 +610,7 @@ function trace.internal(r, input, start)
    assert((pcall(rawget, r.pattern, "ast")))	    -- quack: "is ast a valid key in r.pattern?"
    local a = r.pattern.ast
    assert(a, "no ast stored for pattern")
-   return expression(r.engine, a, input, start)
+   return expression(new_state(r.engine, options), a, input, start)
 end
 
 local function prep_for_export(t)
@@ -517,8 +626,18 @@ local function prep_for_export(t)
    end
 end
 
-function trace.expression(r, input, start, style)
+-- The "stream" style writes the trace as it is computed, one line per node, by calling the
+-- optional writer (which defaults to collecting the lines into the return value).  The trace
+-- tree is not kept, and a sub-expression that was already traced at the same input position is
+-- shown on one line, marked "(traced above)".
+function trace.expression(r, input, start, style, optional_writer)
    assert(type(style)=="string")
+   if style == "stream" then
+      local lines = {}
+      local writer = optional_writer or function(line) table.insert(lines, line); end
+      local tr = trace.internal(r, input, start, {writer=writer})
+      return tr.match and true or false, (not optional_writer) and table.concat(lines, "\n") or ""
+   end
    local tr = trace.internal(r, input, start)
    assert(type(tr)=="table")
    local matched = tr.match and true or false
@@ -537,5 +656,3 @@ function trace.expression(r, input, start, style)
 end
 
 return trace
-
-
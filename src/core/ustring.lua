@@ -16,9 +16,9 @@ local ESC = "\\"				    -- a single backslash
 
 
 function ustring.codepoint_len(cp)
-   if cp < 0x7F then return 1
-   elseif cp < 0x7FF then return 2
-   elseif cp < 0xFFFF then return 3
+   if cp <= 0x7F then return 1
+   elseif cp <= 0x7FF then return 2
+   elseif cp <= 0xFFFF then return 3
    else return 4
    end
 end
@@ -0,0 +1,185 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  clone.c   Benchmark of rosie_clone() against rosie_new() and import      */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "librosie.h"
+
+#define STR(literal) rosie_new_string((byte_ptr)(literal), strlen((literal)));
+
+#define E_BAD_ARG -1
+#define E_ENGINE_CREATE -3
+#define E_ENGINE_IMPORT -4
+#define E_COMPILE -5
+#define E_MATCH -6
+
+#define PACKAGE "all"
+#define EXPRESSION "all.things"
+#define INPUT "2018-03-21 12:34:56 host.example.com 10.0.0.1 \"a string\" 42"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *new_engine() {
+  str errors;
+  void *engine = rosie_new(&errors);
+  if (!engine) {
+    printf("Call to rosie_new failed.\n");
+    if (errors.ptr) printf("%.*s\n", (int) errors.len, errors.ptr);
+    exit(E_ENGINE_CREATE);
+  }
+  return engine;
+}
+
+static void import(void *engine) {
+  int ok;
+  str errors, actual_pkgname;
+  str pkgname = STR(PACKAGE);
+  int err = rosie_import(engine, &ok, &pkgname, NULL, &actual_pkgname, &errors);
+  rosie_free_string(pkgname);
+  if (actual_pkgname.ptr) rosie_free_string(actual_pkgname);
+  if (err || !ok) {
+    printf("Import of %s failed\n", PACKAGE);
+    if (errors.ptr) printf("%.*s\n", (int) errors.len, errors.ptr);
+    exit(E_ENGINE_IMPORT);
+  }
+  if (errors.ptr) rosie_free_string(errors);
+}
+
+static int compile(void *engine) {
+  int pat;
+  str errors;
+  str exp = STR(EXPRESSION);
+  int err = rosie_compile(engine, &exp, &pat, &errors);
+  rosie_free_string(exp);
+  if (err || !pat) {
+    printf("Compilation of %s failed\n", EXPRESSION);
+    if (errors.ptr) printf("%.*s\n", (int) errors.len, errors.ptr);
+    exit(E_COMPILE);
+  }
+  if (errors.ptr) rosie_free_string(errors);
+  return pat;
+}
+
+/* Return a copy of the json output of matching INPUT */
+static char *match_json(void *engine, int pat) {
+  match m;
+  char *copy;
+  str input = STR(INPUT);
+  int err = rosie_match(engine, pat, 1, "json", &input, &m);
+  rosie_free_string(input);
+  if (err || !m.data.ptr) {
+    printf("Match failed (err=%d, data.len=%d)\n", err, (int) m.data.len);
+    exit(E_MATCH);
+  }
+  copy = strndup((char *) m.data.ptr, m.data.len);
+  return copy;
+}
+
+/* Main */
+
+int main(int argc, char **argv) {
+
+  if (argc != 2) {
+    printf("Usage: %s <number of engines>\n", argv[0]);
+    exit(E_BAD_ARG);
+  }
+
+  int n = atoi(argv[1]);
+  if (n < 1) {
+    printf("Argument (number of engines) is < 1 or not a number: %s\n", argv[1]);
+    exit(E_BAD_ARG);
+  }
+
+  void **engine = calloc(n, sizeof(void *));
+  double t0, t1, t_new = 0, t_clone = 0, t_clone_waited = 0;
+  int waited = 0;
+
+  printf("Making an engine that imports %s and compiles %s\n", PACKAGE, EXPRESSION);
+  void *original = new_engine();
+  import(original);
+  int pat = compile(original);
+  char *expected = match_json(original, pat);
+
+  printf("Making %d engines with rosie_new(), then importing and compiling\n", n); fflush(NULL);
+  for (int i=0; i<n; i++) {
+    t0 = now();
+    engine[i] = new_engine();
+    import(engine[i]);
+    int p = compile(engine[i]);
+    char *m = match_json(engine[i], p);
+    t_new += now() - t0;
+    if (strcmp(m, expected)) printf("*** Engine %d gave a different match result\n", i);
+    free(m);
+  }
+  for (int i=0; i<n; i++) rosie_finalize(engine[i]);
+
+  /* The first clone starts booting a spare engine in the background */
+  str errors;
+  void *first = rosie_clone(original, &errors);
+  if (!first) {
+    printf("Call to rosie_clone failed.\n");
+    if (errors.ptr) printf("%.*s\n", (int) errors.len, errors.ptr);
+    exit(E_ENGINE_CREATE);
+  }
+  rosie_finalize(first);
+
+  printf("Making %d engines with rosie_clone()\n", n); fflush(NULL);
+  for (int i=0; i<n; i++) {
+    sleep(1);			/* let the spare engine finish booting */
+    t0 = now();
+    engine[i] = rosie_clone(original, &errors);
+    if (!engine[i]) {
+      printf("Call to rosie_clone failed.\n");
+      if (errors.ptr) printf("%.*s\n", (int) errors.len, errors.ptr);
+      exit(E_ENGINE_CREATE);
+    }
+    char *m = match_json(engine[i], pat);
+    t1 = now() - t0;
+    t_clone += t1;
+    if (strcmp(m, expected)) printf("*** Clone %d gave a different match result\n", i);
+    free(m);
+  }
+  for (int i=0; i<n; i++) rosie_finalize(engine[i]);
+
+  printf("Making %d engines with rosie_clone(), back to back\n", n); fflush(NULL);
+  for (int i=0; i<n; i++) {
+    t0 = now();
+    engine[i] = rosie_clone(original, &errors);
+    if (!engine[i]) {
+      printf("Call to rosie_clone failed.\n");
+      if (errors.ptr) printf("%.*s\n", (int) errors.len, errors.ptr);
+      exit(E_ENGINE_CREATE);
+    }
+    char *m = match_json(engine[i], pat);
+    t1 = now() - t0;
+    t_clone_waited += t1;
+    if (t1 > (t_clone / n) * 10) waited++;
+    if (strcmp(m, expected)) printf("*** Clone %d gave a different match result\n", i);
+    free(m);
+  }
+  for (int i=0; i<n; i++) rosie_finalize(engine[i]);
+
+  printf("Average time to first match, in milliseconds:\n");
+  printf("  rosie_new() + import + compile:  %8.3f\n", 1000 * t_new / n);
+  printf("  rosie_clone(), spare ready:      %8.3f\n", 1000 * t_clone / n);
+  printf("  rosie_clone(), back to back:     %8.3f  (%d of %d waited for a boot)\n",
+	 1000 * t_clone_waited / n, waited, n);
+
+  free(expected);
+  free(engine);
+  rosie_finalize(original);
+  printf("Exiting\n"); fflush(NULL);
+  exit(0);
+}
@@ -101,16 +101,18 @@ static int compile(void *engine, str expression) {
 static int r=0;
 static char *infile;
 
-static void *do_work(void *engine) {
+struct work {
+  void *engine;
+  int pat;
+};
+
+static void *do_work(void *arg) {
+  void *engine = ((struct work *)arg)->engine;
+  int pat = ((struct work *)arg)->pat;
   printf("Thread running with engine %p\n", engine); fflush(NULL);
   int cin, cout, cerr;
-  int pat;
-  str exp = STR("all.things");
   str errors;
 
-  pat = compile(engine, exp);
-  rosie_free_string(exp);
-
   char outfile[40];
   sprintf(&outfile[0], "/tmp/%p.out", engine);
   for (int i=0; i<r; i++) {
@@ -162,17 +164,31 @@ int main(int argc, char **argv) {
   printf("Input file is %s\n", infile);
 
   void **engine = calloc(n, sizeof(void *));
+  struct work *work = calloc(n, sizeof(struct work));
   pthread_t *thread = calloc(n, sizeof(pthread_t));
 
   printf("Making engines for %d threads\n", n); fflush(NULL);
   for (int i=0; i<n; i++) engine[i] = make_engine();
 
+  /* Compile the pattern once, and share it with the other engines */
+  str exp = STR("all.things");
+  for (int i=0; i<n; i++) {
+    work[i].engine = engine[i];
+    if (i > 0) {
+      int err = rosie_rplx_share(engine[0], work[0].pat, engine[i], &work[i].pat);
+      if (err) printf("rosie call failed: share compiled pattern\n");
+      if (work[i].pat) continue;
+    }
+    work[i].pat = compile(engine[i], exp);
+  }
+  rosie_free_string(exp);
+
   printf("Creating %d threads\n", n); fflush(NULL);
   for (int i=0; i<n; i++) {
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setstacksize(&attr, ROSIE_STACK_SIZE);
-    int err = pthread_create(&thread[i], &attr, do_work, engine[i]);
+    int err = pthread_create(&thread[i], &attr, do_work, &work[i]);
     printf("thread[%d] = %p\n", i, &thread[i]); fflush(NULL);
     if (err) {
       printf("Error in pthread_create(), thread #%d\n", i);
@@ -198,6 +214,7 @@ int main(int argc, char **argv) {
   for (int i=0; i<n; i++) rosie_finalize(engine[i]);
   printf("Freeing thread-related data\n");
   free(engine);
+  free(work);
   free(thread);
 
   printf("Exiting\n"); fflush(NULL);
@@ -0,0 +1,280 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  alloc.c  Part of librosie.c                                              */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Engine memory
+ *
+ * Each engine has its own Lua allocator.  Small blocks (up to
+ * ALLOC_SMALL_MAX bytes) come from size classes that are carved out of
+ * chunks of ALLOC_CHUNK bytes, and a freed small block goes back on
+ * the free list of its class.  Lua passes the size of a block whenever
+ * it frees or resizes it, so blocks need no headers.  Larger blocks
+ * come from malloc.  Chunks are only returned to the system when the
+ * engine is finalized.
+ *
+ * The footprint of an engine is the memory it holds from the system:
+ * its chunks and large blocks.  rosie_alloc_cap() sets a hard cap on
+ * the footprint.  An allocation that would exceed the cap fails, after
+ * Lua has tried a full collection to make room.  The call that needed
+ * the memory (a match, compile, load, import, or trace) then returns
+ * ERR_OUT_OF_MEMORY, and the engine remains usable.  The cap is only
+ * enforced during those calls, inside capped_pcall(), because outside
+ * of a protected call Lua would abort the process on a failed
+ * allocation.  By contrast, rosie_alloc_limit() sets a soft limit,
+ * above which a collection is done before each match.
+ *
+ * When librosie is built with HUGEPAGES=1 (on Linux), chunks are
+ * ALLOC_HUGE_SIZE bytes, and they and any block at least that large
+ * are mapped with mmap and advised to use transparent huge pages.
+ */
+
+#ifdef ALLOC_HUGEPAGES
+#include <sys/mman.h>
+#define ALLOC_HUGE_SIZE (2 * 1024 * 1024)
+#define ALLOC_CHUNK ALLOC_HUGE_SIZE
+#else
+#define ALLOC_CHUNK (64 * 1024)
+#endif
+
+#define ALLOC_ALIGN 16
+#define ALLOC_SMALL_MAX 512
+#define ALLOC_CLASSES (ALLOC_SMALL_MAX / ALLOC_ALIGN)
+
+typedef struct alloc_chunk {
+  struct alloc_chunk *next;
+} alloc_chunk;
+
+#define ALLOC_CHUNK_HEADER ALLOC_ALIGN /* keeps the blocks aligned */
+
+typedef struct engine_alloc {
+  size_t cap;			/* bytes, or 0 for no cap */
+  size_t in_use;		/* bytes in blocks that Lua holds */
+  size_t footprint;		/* bytes held from the system */
+  size_t high_water;		/* largest footprint so far */
+  int enforce_cap;		/* set by capped_pcall() */
+  uint64_t failures;		/* allocations that failed (mostly because of the cap) */
+  void *free[ALLOC_CLASSES];	/* free list of each size class */
+  alloc_chunk *chunks;
+  char *bump, *bump_end;	/* unused part of the newest chunk */
+} engine_alloc;
+
+/* ----------------------------------------------------------------------------------------
+ * Memory from the system
+ * ----------------------------------------------------------------------------------------
+ */
+
+#ifdef ALLOC_HUGEPAGES
+
+static int sys_mapped(size_t n) {
+  return (n >= ALLOC_HUGE_SIZE);
+}
+
+static size_t sys_size(size_t n) {
+  if (!sys_mapped(n)) return n;
+  return (n + ALLOC_HUGE_SIZE - 1) & ~((size_t) ALLOC_HUGE_SIZE - 1);
+}
+
+static void *sys_alloc(size_t n) {
+  void *p;
+  if (!sys_mapped(n)) return malloc(n);
+  p = mmap(NULL, sys_size(n), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+  madvise(p, sys_size(n), MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+static void sys_free(void *p, size_t n) {
+  if (sys_mapped(n)) munmap(p, sys_size(n));
+  else free(p);
+}
+
+#else
+
+#define sys_mapped(n) (FALSE)
+#define sys_size(n) (n)
+#define sys_alloc(n) malloc(n)
+#define sys_free(p, n) free(p)
+
+#endif
+
+/* ----------------------------------------------------------------------------------------
+ * Blocks
+ * ----------------------------------------------------------------------------------------
+ */
+
+static int size_class(size_t n) {
+  return (int) ((n + ALLOC_ALIGN - 1) / ALLOC_ALIGN) - 1;
+}
+
+static int alloc_room(engine_alloc *a, size_t n) {
+  return !a->cap || !a->enforce_cap || (a->footprint + n <= a->cap);
+}
+
+static void alloc_grew(engine_alloc *a, size_t n) {
+  a->footprint += n;
+  if (a->footprint > a->high_water) a->high_water = a->footprint;
+}
+
+/* Put the unused part of the newest chunk on the free lists */
+static void alloc_spill(engine_alloc *a) {
+  size_t n;
+  while ((n = a->bump_end - a->bump) >= ALLOC_ALIGN) {
+    int c = size_class(((n > ALLOC_SMALL_MAX) ? ALLOC_SMALL_MAX : n) & ~((size_t) ALLOC_ALIGN - 1));
+    *(void **) a->bump = a->free[c];
+    a->free[c] = a->bump;
+    a->bump += (c + 1) * ALLOC_ALIGN;
+  }
+}
+
+/* When force is set, the cap is ignored */
+static void *alloc_small(engine_alloc *a, int c, int force) {
+  size_t size = (c + 1) * ALLOC_ALIGN;
+  alloc_chunk *chunk;
+  void *p = a->free[c];
+  if (p) {
+    a->free[c] = *(void **) p;
+    return p;
+  }
+  if ((size_t) (a->bump_end - a->bump) < size) {
+    if (!force && !alloc_room(a, ALLOC_CHUNK)) return NULL;
+    chunk = sys_alloc(ALLOC_CHUNK);
+    if (!chunk) return NULL;
+    alloc_spill(a);
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->bump = (char *) chunk + ALLOC_CHUNK_HEADER;
+    a->bump_end = (char *) chunk + ALLOC_CHUNK;
+    alloc_grew(a, ALLOC_CHUNK);
+  }
+  p = a->bump;
+  a->bump += size;
+  return p;
+}
+
+static void *alloc_large(engine_alloc *a, size_t n, int force) {
+  void *p;
+  if (!force && !alloc_room(a, sys_size(n))) return NULL;
+  p = sys_alloc(n);
+  if (p) alloc_grew(a, sys_size(n));
+  return p;
+}
+
+static void alloc_free(engine_alloc *a, void *p, size_t n) {
+  if (n <= ALLOC_SMALL_MAX) {
+    int c = size_class(n);
+    *(void **) p = a->free[c];
+    a->free[c] = p;
+  } else {
+    sys_free(p, n);
+    a->footprint -= sys_size(n);
+  }
+}
+
+/* The lua_Alloc function of an engine.  Lua requires that shrinking a
+ * block never fails, so the cap does not apply to shrinking.  If even
+ * so there is no memory for the smaller block, the old one is kept.
+ * (Should it be a large block that is later freed as a small one, it
+ * goes on a free list, and is not returned to the system.)
+ */
+static void *engine_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  engine_alloc *a = (engine_alloc *) ud;
+  int shrink;
+  void *newp;
+  if (!ptr) osize = 0;		/* osize is then the type of object */
+  if (nsize == 0) {
+    if (ptr) {
+      alloc_free(a, ptr, osize);
+      a->in_use -= osize;
+    }
+    return NULL;
+  }
+  shrink = (ptr && (nsize <= osize));
+  if (ptr && (osize <= ALLOC_SMALL_MAX) && (nsize <= ALLOC_SMALL_MAX)
+      && (size_class(osize) == size_class(nsize))) {
+    a->in_use = a->in_use - osize + nsize;
+    return ptr;
+  }
+  if (ptr && (osize > ALLOC_SMALL_MAX) && (nsize > ALLOC_SMALL_MAX)
+      && !sys_mapped(osize) && !sys_mapped(nsize)) {
+    if (!shrink && !alloc_room(a, nsize - osize)) goto fail;
+    newp = realloc(ptr, nsize);
+    if (!newp) {
+      if (shrink) return ptr;
+      goto fail;
+    }
+    a->footprint = a->footprint - osize + nsize;
+    if (a->footprint > a->high_water) a->high_water = a->footprint;
+    a->in_use = a->in_use - osize + nsize;
+    return newp;
+  }
+  if (nsize <= ALLOC_SMALL_MAX) newp = alloc_small(a, size_class(nsize), shrink);
+  else newp = alloc_large(a, nsize, shrink);
+  if (!newp) {
+    if (shrink) return ptr;
+    goto fail;
+  }
+  if (ptr) {
+    memcpy(newp, ptr, (osize < nsize) ? osize : nsize);
+    alloc_free(a, ptr, osize);
+    a->in_use -= osize;
+  }
+  a->in_use += nsize;
+  return newp;
+
+ fail:
+  a->failures++;
+  return NULL;
+}
+
+static int engine_lua_panic(lua_State *L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+  return 0;
+}
+
+/* Like luaL_newstate(), but with an allocator of its own */
+static lua_State *engine_lua_newstate() {
+  lua_State *L;
+  engine_alloc *a = calloc(1, sizeof(engine_alloc));
+  if (!a) return NULL;
+  L = lua_newstate(engine_lua_alloc, a);
+  if (!L) {
+    free(a);
+    return NULL;
+  }
+  lua_atpanic(L, engine_lua_panic);
+  return L;
+}
+
+static engine_alloc *engine_allocator(lua_State *L) {
+  void *ud;
+  lua_getallocf(L, &ud);
+  return (engine_alloc *) ud;
+}
+
+/* Close L, and free all of its memory */
+static void engine_lua_close(lua_State *L) {
+  alloc_chunk *chunk, *next;
+  engine_alloc *a = engine_allocator(L);
+  lua_close(L);
+  for (chunk = a->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    sys_free(chunk, ALLOC_CHUNK);
+  }
+  free(a);
+}
+
+/* lua_pcall(), with the cap of the engine enforced during the call */
+static int capped_pcall(lua_State *L, int nargs, int nresults, int msgh) {
+  int t;
+  engine_alloc *a = engine_allocator(L);
+  a->enforce_cap = TRUE;
+  t = lua_pcall(L, nargs, nresults, msgh);
+  a->enforce_cap = FALSE;
+  return t;
+}
@@ -0,0 +1,197 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  async.c  Part of librosie.c                                              */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Asynchronous matching
+ *
+ * rosie_pool_submit() queues a match on the workers of a pool and
+ * returns at once, without waiting for an engine lock.  The input is
+ * copied, so the client may reuse its buffer right away.  When the
+ * match is done, the worker puts it on the completion queue of the
+ * pool, from which rosie_pool_poll() takes it.  Each completion
+ * carries the tag that the client gave to rosie_pool_submit().
+ *
+ * rosie_pool_completion_fd() returns a file descriptor that is
+ * readable whenever the completion queue is not empty, so that an
+ * event loop (select, poll, epoll, kqueue) can wait on it alongside
+ * its sockets.  It is an eventfd on Linux, and the read end of a pipe
+ * elsewhere.  The client must not read or close it.  With an
+ * edge-triggered event loop, call rosie_pool_poll() until it returns
+ * fewer completions than were asked for.
+ *
+ * The pattern of a submitted match must not be freed until the match
+ * has completed.  Completions that are never polled are freed by
+ * rosie_pool_finalize().
+ */
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+typedef struct async_job {
+  pool_job job;			/* must be first */
+  void *tag;
+  str input;			/* points into this block */
+  match match;
+  char encoder[MAX_ENCODER_NAME_LENGTH + 1];
+  struct async_job *next;	/* on the completion queue */
+} async_job;
+
+/* Make the wake fd readable.  Caller must hold p->async_lock. */
+static void async_wake(Pool *p) {
+  ssize_t r;
+  if (p->wakefd[1] < 0) return;
+#ifdef __linux__
+  uint64_t one = 1;
+  r = write(p->wakefd[1], &one, sizeof(one));
+#else
+  char one = 1;
+  r = write(p->wakefd[1], &one, sizeof(one));
+#endif
+  if (r < 0) LOGf("write to pool wake fd failed (errno = %d)\n", errno);
+}
+
+/* Make the wake fd unreadable.  Caller must hold p->async_lock. */
+static void async_unwake(Pool *p) {
+  char buf[64];
+  if (p->wakefd[0] < 0) return;
+  while (read(p->wakefd[0], buf, sizeof(buf)) > 0) ;
+}
+
+/* Called by a worker when the match is done */
+static void async_complete(Pool *p, pool_job *job) {
+  async_job *a = (async_job *) job;
+  a->next = NULL;
+  pthread_mutex_lock(&p->async_lock);
+  if (p->completed_tail) {
+    p->completed_tail->next = a;
+  } else {
+    p->completed = a;
+    async_wake(p);
+  }
+  p->completed_tail = a;
+  pthread_mutex_unlock(&p->async_lock);
+}
+
+/* Called by rosie_pool_finalize() after the workers have stopped */
+static void async_finalize(Pool *p) {
+  async_job *a, *next;
+  for (a = p->completed; a; a = next) {
+    next = a->next;
+    if (a->match.data.ptr) rosie_free_string(a->match.data);
+    free(a);
+  }
+  if (p->wakefd[0] >= 0) close(p->wakefd[0]);
+  if (p->wakefd[1] != p->wakefd[0]) close(p->wakefd[1]);
+  pthread_mutex_destroy(&p->async_lock);
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Exported functions
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Set *fd to a file descriptor that is readable while completions
+ * are waiting to be polled.  Always the same fd for a given pool.
+ */
+EXPORT
+int rosie_pool_completion_fd(Pool *p, int *fd) {
+  int r = SUCCESS;
+  pthread_mutex_lock(&p->async_lock);
+  if (p->wakefd[0] < 0) {
+#ifdef __linux__
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd >= 0) p->wakefd[0] = p->wakefd[1] = efd;
+#else
+    int fds[2];
+    if (pipe(fds) == 0) {
+      for (int i = 0; i < 2; i++) {
+	fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+      }
+      p->wakefd[0] = fds[0];
+      p->wakefd[1] = fds[1];
+    }
+#endif
+    if (p->wakefd[0] < 0) {
+      LOGf("cannot create pool wake fd (errno = %d)\n", errno);
+      r = ERR_SYSCALL_FAILED;
+    } else if (p->completed) {
+      async_wake(p);
+    }
+  }
+  *fd = p->wakefd[0];
+  pthread_mutex_unlock(&p->async_lock);
+  return r;
+}
+
+/* Queue a match of input against pat, and return without waiting for
+ * it.  The tag is returned with the completion.
+ */
+EXPORT
+int rosie_pool_submit(Pool *p, int pat, int start, char *encoder, str *input, void *tag) {
+  int r;
+  async_job *a = calloc(1, sizeof(async_job) + input->len);
+  if (!a) return ERR_OUT_OF_MEMORY;
+  a->tag = tag;
+  a->input.ptr = (byte_ptr) (a + 1);
+  a->input.len = input->len;
+  memcpy(a->input.ptr, input->ptr, input->len);
+  a->job.kind = POOL_JOB_MATCH;
+  a->job.pats = pool_pats(p, pat);
+  a->job.encoder = a->encoder;
+  a->job.start = start;
+  a->job.input = &a->input;
+  a->job.match = &a->match;
+  a->job.complete = async_complete;
+  if (!a->job.pats) {
+    set_match_error(&a->match, ERR_NO_PATTERN);
+    async_complete(p, &a->job);
+    return SUCCESS;
+  }
+  if (strlen(encoder) > MAX_ENCODER_NAME_LENGTH) {
+    set_match_error(&a->match, ERR_NO_ENCODER);
+    async_complete(p, &a->job);
+    return SUCCESS;
+  }
+  strcpy(a->encoder, encoder);
+  r = pool_submit(p, &a->job);
+  if (r != SUCCESS) free(a);
+  return r;
+}
+
+/* Take up to max completions from the queue, without blocking, and
+ * set *n to how many were taken.
+ * N.B. Client must free the match data of each completion.
+ */
+EXPORT
+int rosie_pool_poll(Pool *p, int max, rosie_completion *completions, int *n) {
+  int i = 0;
+  async_job *a, *done;
+  *n = 0;
+  if (max <= 0) return SUCCESS;
+  pthread_mutex_lock(&p->async_lock);
+  done = p->completed;
+  for (a = done; a && (i < max); a = a->next, i++) {
+    completions[i].tag = a->tag;
+    completions[i].status = a->job.status;
+    completions[i].match = a->match;
+  }
+  p->completed = a;
+  if (!a) {
+    p->completed_tail = NULL;
+    async_unwake(p);
+  }
+  pthread_mutex_unlock(&p->async_lock);
+  while (done != a) {
+    async_job *next = done->next;
+    free(done);
+    done = next;
+  }
+  *n = i;
+  return SUCCESS;
+}
@@ -0,0 +1,163 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  clone.c  Part of librosie.c                                              */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Cloning engines
+ *
+ * rosie_clone() makes an independent engine with what another engine
+ * has: the same loaded and imported packages, libpath, encoder
+ * parameters, custom encoders, allocation limit and cap, and compiled
+ * patterns (under the same pattern numbers).  It avoids the two costs of making such an engine
+ * with rosie_new() followed by the same loads and imports:
+ *
+ * (1) Booting.  One engine is booted ahead of time.  rosie_clone()
+ *     takes it, and starts booting the next one in a background
+ *     thread.  Only when no spare engine is ready does a clone wait
+ *     for a boot.
+ *
+ * (2) Loading and importing.  The clone replays the history of the
+ *     original lazily (see engine.replay in engine_module.lua), so its
+ *     loads and imports run when it first compiles, loads, or imports
+ *     something.  Until then, it matches using the compiled patterns
+ *     of the original, which are shared with it (see share.c) instead
+ *     of being compiled again.
+ *
+ * Like any shared pattern, the patterns of a clone cannot be traced.
+ * A pattern that cannot be shared is absent from the clone, so that
+ * matching with its number in the clone returns ERR_NO_PATTERN.
+ */
+
+static Engine *spare_engine = NULL;
+static int spare_booting = FALSE;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *boot_spare(void *arg) {
+  str messages = rosie_string_from(NULL, 0);
+  Engine *e = rosie_new(&messages);
+  if (!e) {
+    LOG("failed to boot a spare engine for rosie_clone()\n");
+    rosie_free_string(messages);
+  }
+  pthread_mutex_lock(&spare_lock);
+  spare_engine = e;
+  spare_booting = FALSE;
+  pthread_mutex_unlock(&spare_lock);
+  return arg;
+}
+
+/* Take the spare engine, if one is ready, and start booting another */
+static Engine *take_spare_engine() {
+  Engine *e;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_mutex_lock(&spare_lock);
+  e = spare_engine;
+  spare_engine = NULL;
+  if (!spare_booting) {
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    spare_booting = (pthread_create(&thread, &attr, boot_spare, NULL) == 0);
+    pthread_attr_destroy(&attr);
+  }
+  pthread_mutex_unlock(&spare_lock);
+  return e;
+}
+
+/* Lazily replay in clone the history table at idx in fromL */
+static int clone_history(lua_State *fromL, int idx, Engine *clone) {
+  int t;
+  lua_State *L = clone->L;
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "replay");
+  CHECK_TYPE("engine.replay()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);
+  copy_value(fromL, idx, L, 0);
+  lua_pushboolean(L, TRUE);
+  t = lua_pcall(L, 3, 1, 0);
+  if ((t != LUA_OK) || !lua_toboolean(L, -1)) {
+    LOG("engine.replay() failed\n");
+    LOGstack(L);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  return SUCCESS;
+}
+
+/* Give clone, under the same numbers, the compiled patterns of e.  The
+ * other entries of the rplx table (the free list kept by luaL_ref) are
+ * copied as they are.
+ */
+static int clone_rplx_table(Engine *e, Engine *clone) {
+  int r, src, dst;
+  lua_Integer pat;
+  shared_code *sc;
+  lua_State *fromL = e->L;
+  lua_State *L = fromL;
+  get_registry(rplx_table_key);
+  src = lua_gettop(L);
+  L = clone->L;
+  get_registry(rplx_table_key);
+  dst = lua_gettop(L);
+  lua_pushnil(fromL);
+  while (lua_next(fromL, src)) {
+    if (lua_isinteger(fromL, -2)) {
+      pat = lua_tointeger(fromL, -2);
+      if (!lua_istable(fromL, -1)) {
+	copy_value(fromL, -1, L, 0);
+      } else if ((sc = share_from(e, (int) pat))) {
+	r = push_shared_rplx(clone, fromL, sc);
+	if (r != SUCCESS) return r;
+      } else {
+	LOGf("compiled pattern %d cannot be shared with the clone\n", (int) pat);
+	lua_pushboolean(L, FALSE);
+      }
+      lua_rawseti(L, dst, pat);
+    }
+    lua_settop(fromL, src + 1);	/* leave the key for lua_next */
+  }
+  return SUCCESS;
+}
+
+/* Make a new engine with the packages, configuration, and compiled
+ * patterns of engine e.  See the comment at the top of clone.c.
+ *
+ * N.B. When the return value is NULL, client must free messages
+ */
+EXPORT
+Engine *rosie_clone(Engine *e, str *messages) {
+  int t, r, limit, cap = -1;
+  lua_State *L = e->L;
+  Engine *clone = take_spare_engine();
+  if (!clone) {
+    LOG("no spare engine is ready, so booting one for rosie_clone()\n");
+    clone = rosie_new(messages);
+    if (!clone) return NULL;	/* messages already set by rosie_new */
+  }
+  ACQUIRE_ENGINE_LOCK(e);
+  ACQUIRE_ENGINE_LOCK(clone);
+  get_registry(alloc_set_limit_key);
+  limit = lua_tointeger(L, -1);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "history");
+  CHECK_TYPE("engine.history", t, LUA_TTABLE);
+  r = clone_history(L, -1, clone);
+  if (r == SUCCESS) r = clone_rplx_table(e, clone);
+  if (r == SUCCESS) r = clone_custom_encoders(e, clone);
+  lua_settop(L, 0);
+  lua_settop(clone->L, 0);
+  RELEASE_ENGINE_LOCK(clone);
+  RELEASE_ENGINE_LOCK(e);
+  if (r != SUCCESS) {
+    *messages = rosie_new_string_from_const("failed to copy the state of the engine to its clone");
+    rosie_finalize(clone);
+    return NULL;
+  }
+  if (limit) rosie_alloc_limit(clone, &limit, NULL);
+  rosie_alloc_cap(e, &cap, NULL);
+  if (cap) rosie_alloc_cap(clone, &cap, NULL);
+  LOGf("Engine %p cloned from %p\n", clone, e);
+  return clone;
+}
@@ -0,0 +1,208 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  columns.c  Part of librosie.c                                            */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Columnar output
+ *
+ * A client that loads match results into a column store would
+ * otherwise have to decode a JSON object for every match, only to
+ * pull out a few captures.  rosie_match_columns() and
+ * rosie_matchfile_columns() instead collect, for each of a list of
+ * capture names, the record number, start, end, and text of every
+ * capture of that name.  These are returned as columns: parallel
+ * arrays, plus a heap holding the text of the captures.
+ *
+ * The record number of an input is its 0-based index in the batch,
+ * or its 0-based line number in the file (lines that do not match are
+ * counted).  The start and end are 1-based positions in the record,
+ * as in the other encoders, with the end being the position after the
+ * last byte matched.  The text is the matched input, or the value of
+ * a constant capture.
+ *
+ * The columns are written in blocks.  rosie_match_columns() returns
+ * one block, and rosie_matchfile_columns() writes a block each time
+ * the columns reach about MATCHFILE_OUTBUF_SIZE bytes.  Every integer
+ * is in native byte order, and every array starts at a multiple of 4
+ * bytes from the start of the block:
+ *
+ *   block   := magic size ncols column*
+ *   magic   := the 4 bytes "RCOL"
+ *   size    := uint32, the number of bytes in the block after size
+ *   ncols   := uint32, the number of columns (one per capture name)
+ *   column  := namelen name count record start end offset heap
+ *   namelen := uint32, then that many bytes of name, padded to 4 bytes
+ *   count   := uint32, the number of captures in the column
+ *   record, start, end := int32[count]
+ *   offset  := uint32[count + 1], where the text of capture k is
+ *              heap[offset[k]] up to heap[offset[k+1]]
+ *   heap    := offset[count] bytes, padded to 4 bytes
+ */
+
+#define COLUMNS_MAGIC "RCOL"
+#define COLUMNS_PAD(n) (((n) + 3) & ~((size_t) 3))
+
+typedef struct column_array {
+  char *ptr;
+  size_t len;
+  size_t size;
+} column_array;
+
+typedef struct column {
+  const char *name;		/* owned by the caller */
+  size_t namelen;
+  uint32_t count;
+  column_array record, start, end, offset; /* offset lacks its last entry */
+  column_array heap;
+} column;
+
+typedef struct columns {
+  int ncols;
+  column *cols;
+  int32_t record;		/* the record being added */
+} columns;
+
+static int column_append(column_array *a, const void *data, size_t len) {
+  if (a->len + len > a->size) {
+    size_t newsize = a->size ? a->size : 1024;
+    while (a->len + len > newsize) newsize *= 2;
+    char *newptr = realloc(a->ptr, newsize);
+    if (!newptr) return ERR_OUT_OF_MEMORY;
+    a->ptr = newptr;
+    a->size = newsize;
+  }
+  memcpy(a->ptr + a->len, data, len);
+  a->len += len;
+  return SUCCESS;
+}
+
+/* The names must stay alive until columns_free() */
+static columns *columns_new(int ncols, char **names) {
+  columns *c = calloc(1, sizeof(columns));
+  if (!c) return NULL;
+  c->ncols = ncols;
+  c->cols = calloc(ncols ? ncols : 1, sizeof(column));
+  if (!c->cols) {
+    free(c);
+    return NULL;
+  }
+  for (int i = 0; i < ncols; i++) {
+    c->cols[i].name = names[i];
+    c->cols[i].namelen = strlen(names[i]);
+  }
+  return c;
+}
+
+static void columns_clear(columns *c) {
+  for (int i = 0; i < c->ncols; i++) {
+    column *col = &(c->cols[i]);
+    col->count = 0;
+    col->record.len = col->start.len = col->end.len = col->offset.len = col->heap.len = 0;
+  }
+}
+
+static void columns_free(columns *c) {
+  for (int i = 0; i < c->ncols; i++) {
+    column *col = &(c->cols[i]);
+    free(col->record.ptr);
+    free(col->start.ptr);
+    free(col->end.ptr);
+    free(col->offset.ptr);
+    free(col->heap.ptr);
+  }
+  free(c->cols);
+  free(c);
+}
+
+/* The number of captures in all columns */
+static size_t columns_count(columns *c) {
+  size_t n = 0;
+  for (int i = 0; i < c->ncols; i++) n += c->cols[i].count;
+  return n;
+}
+
+static int columns_visit(void *context, rosie_capture *cap) {
+  columns *c = context;
+  uint32_t offset;
+  int r;
+  for (int i = 0; i < c->ncols; i++) {
+    column *col = &(c->cols[i]);
+    if ((col->namelen != cap->name.len) || memcmp(col->name, cap->name.ptr, col->namelen)) continue;
+    if (col->heap.len + cap->text.len > UINT32_MAX) return ERR_OUT_OF_MEMORY;
+    offset = (uint32_t) col->heap.len;
+    if ((r = column_append(&col->record, &c->record, sizeof(int32_t))) ||
+	(r = column_append(&col->start, &cap->start, sizeof(int32_t))) ||
+	(r = column_append(&col->end, &cap->end, sizeof(int32_t))) ||
+	(r = column_append(&col->offset, &offset, sizeof(uint32_t))) ||
+	(r = column_append(&col->heap, cap->text.ptr, cap->text.len)))
+      return r;
+    col->count++;
+    return SUCCESS;
+  }
+  return SUCCESS;
+}
+
+/* Add the captures in the byte-encoded match data of record */
+static int columns_add(columns *c, int32_t record, str *input, const char *data, size_t len) {
+  str matchdata;
+  matchdata.ptr = (byte_ptr) data;
+  matchdata.len = len;
+  c->record = record;
+  return rosie_walk_match(input, &matchdata, columns_visit, c);
+}
+
+/* The size of the block that columns_write() would write */
+static size_t columns_size(columns *c) {
+  size_t n = 3 * sizeof(uint32_t);	/* magic, size, ncols */
+  for (int i = 0; i < c->ncols; i++) {
+    column *col = &(c->cols[i]);
+    n += 3 * sizeof(uint32_t) + COLUMNS_PAD(col->namelen) + 4 * sizeof(int32_t) * col->count;
+    n += COLUMNS_PAD(col->heap.len);
+  }
+  return n;
+}
+
+static char *write_uint32(char *dest, uint32_t n) {
+  memcpy(dest, &n, sizeof(uint32_t));
+  return dest + sizeof(uint32_t);
+}
+
+static char *write_padded(char *dest, const char *data, size_t len) {
+  if (len) memcpy(dest, data, len);
+  memset(dest + len, 0, COLUMNS_PAD(len) - len);
+  return dest + COLUMNS_PAD(len);
+}
+
+/* Write the block into dest, which holds columns_size(c) bytes */
+static void columns_write(columns *c, char *dest) {
+  size_t size = columns_size(c);
+  memcpy(dest, COLUMNS_MAGIC, 4);
+  dest = write_uint32(dest + 4, (uint32_t) (size - 2 * sizeof(uint32_t)));
+  dest = write_uint32(dest, (uint32_t) c->ncols);
+  for (int i = 0; i < c->ncols; i++) {
+    column *col = &(c->cols[i]);
+    dest = write_uint32(dest, (uint32_t) col->namelen);
+    dest = write_padded(dest, col->name, col->namelen);
+    dest = write_uint32(dest, col->count);
+    dest = write_padded(dest, col->record.ptr, col->record.len);
+    dest = write_padded(dest, col->start.ptr, col->start.len);
+    dest = write_padded(dest, col->end.ptr, col->end.len);
+    dest = write_padded(dest, col->offset.ptr, col->offset.len);
+    dest = write_uint32(dest, (uint32_t) col->heap.len); /* final offset */
+    dest = write_padded(dest, col->heap.ptr, col->heap.len);
+  }
+}
+
+/* Make a new string holding the block */
+static int columns_to_block(columns *c, str *block) {
+  size_t size = columns_size(c);
+  if (size > UINT32_MAX) return ERR_OUT_OF_MEMORY;
+  block->ptr = malloc(size);
+  if (!block->ptr) return ERR_OUT_OF_MEMORY;
+  columns_write(c, (char *) block->ptr);
+  block->len = (uint32_t) size;
+  return SUCCESS;
+}
@@ -0,0 +1,392 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  encode.c  Part of librosie.c                                             */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* The "rencode" Lua module: output encoders written in C
+ *
+ * The "default" output encoder used to decode the byte-encoded match
+ * data into a Lua table (lpeg.decode), and then copy the matched text
+ * into every node of that table (common.byte_to_lua).  The "color"
+ * encoder did the same, then walked the table in Lua, querying the
+ * color database at each node.  The functions here read the byte
+ * encoding directly: rencode.default() builds the match table in one
+ * pass, and rencode.color() writes the colored text without building
+ * a table at all, using a color database that is compiled once for
+ * each set of color assignments (see colordb in color.lua).
+ *
+ * The byte encoding, made by the byte encoder in rosie-lpeg, is a
+ * preorder serialization of the match tree, in native byte order:
+ *
+ *   node  := start name [data] node* end
+ *   start := int32, the negated 1-based start position
+ *   name  := int16 length, then that many bytes of name.  A negative
+ *            length marks a constant capture, which is followed by
+ *   data  := int16 length, then that many bytes of data
+ *   end   := int32, the 1-based position after the match
+ *
+ * Because a start is negative and an end is not, the int32 after the
+ * name (and data) of a node tells whether a sub-match comes next.
+ */
+
+typedef struct capture_reader {
+  const char *pos;
+  const char *end;
+} capture_reader;
+
+typedef struct capture_node {
+  const char *name;
+  size_t namelen;
+  const char *data;		/* constant captures only, else NULL */
+  size_t datalen;
+  int32_t s;			/* 1-based start */
+} capture_node;
+
+static int read_int32(capture_reader *r, int32_t *value) {
+  if (r->end - r->pos < (ptrdiff_t) sizeof(int32_t)) return FALSE;
+  memcpy(value, r->pos, sizeof(int32_t));
+  r->pos += sizeof(int32_t);
+  return TRUE;
+}
+
+static int read_lstring(capture_reader *r, const char **s, size_t *len, int *negative) {
+  int16_t n;
+  if (r->end - r->pos < (ptrdiff_t) sizeof(int16_t)) return FALSE;
+  memcpy(&n, r->pos, sizeof(int16_t));
+  r->pos += sizeof(int16_t);
+  *negative = (n < 0);
+  *len = (size_t) (*negative ? -n : n);
+  if ((size_t) (r->end - r->pos) < *len) return FALSE;
+  *s = r->pos;
+  r->pos += *len;
+  return TRUE;
+}
+
+/* Read the start, name, and (for a constant capture) data of a node */
+static int read_node_header(capture_reader *r, capture_node *node) {
+  int32_t s;
+  int constant, ignore;
+  if (!read_int32(r, &s) || (s >= 0)) return FALSE;
+  node->s = -s;
+  if (!read_lstring(r, &node->name, &node->namelen, &constant)) return FALSE;
+  node->data = NULL;
+  node->datalen = 0;
+  if (constant && !read_lstring(r, &node->data, &node->datalen, &ignore)) return FALSE;
+  return TRUE;
+}
+
+/* TRUE when the next item is the start of a sub-match */
+static int sub_follows(capture_reader *r) {
+  int32_t n;
+  if (r->end - r->pos < (ptrdiff_t) sizeof(int32_t)) return FALSE;
+  memcpy(&n, r->pos, sizeof(int32_t));
+  return (n < 0);
+}
+
+/* Read the sub-matches and the end position of a node whose header
+ * has been read, setting *e to the end position.
+ */
+static int skip_node_rest(capture_reader *r, int32_t *e) {
+  capture_node sub;
+  int32_t sub_e;
+  while (sub_follows(r)) {
+    if (!read_node_header(r, &sub) || !skip_node_rest(r, &sub_e)) return FALSE;
+  }
+  return read_int32(r, e) && (*e > 0);
+}
+
+/* The match data (argument idx) is an rBuffer.  The input (argument
+ * idx+1) is a Lua string or an rBuffer.
+ */
+static void check_encoder_args(lua_State *L, int idx, capture_reader *r,
+			       const char **input, size_t *inputlen) {
+  rBuffer *m = luaL_checkudata(L, idx, ROSIE_BUFFER);
+  r->pos = m->data;
+  r->end = m->data + m->n;
+  if (lua_type(L, idx + 1) == LUA_TSTRING) {
+    *input = lua_tolstring(L, idx + 1, inputlen);
+  } else {
+    rBuffer *b = luaL_checkudata(L, idx + 1, ROSIE_BUFFER);
+    *input = b->data;
+    *inputlen = b->n;
+  }
+}
+
+/* ----------------------------------------------------------------------------------------
+ * The default encoder
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Push the match table for the node whose header is in node.  The
+ * table has the same fields as the one made by common.byte_to_lua():
+ * type, s, e, data, and subs (when there are sub-matches).
+ */
+static int push_match_table(lua_State *L, capture_reader *r, capture_node *node,
+			    const char *input, size_t inputlen) {
+  capture_node sub;
+  int32_t e;
+  lua_Integer i = 0;
+  luaL_checkstack(L, 4, "match too deeply nested");
+  lua_createtable(L, 0, 5);
+  lua_pushlstring(L, node->name, node->namelen);
+  lua_setfield(L, -2, "type");
+  lua_pushinteger(L, node->s);
+  lua_setfield(L, -2, "s");
+  if (sub_follows(r)) {
+    lua_newtable(L);
+    while (sub_follows(r)) {
+      if (!read_node_header(r, &sub)) return FALSE;
+      if (!push_match_table(L, r, &sub, input, inputlen)) return FALSE;
+      lua_rawseti(L, -2, ++i);
+    }
+    lua_setfield(L, -2, "subs");
+  }
+  if (!read_int32(r, &e) || (e < node->s) || ((size_t) (e - 1) > inputlen)) return FALSE;
+  lua_pushinteger(L, e);
+  lua_setfield(L, -2, "e");
+  if (node->data)
+    lua_pushlstring(L, node->data, node->datalen);
+  else
+    lua_pushlstring(L, input + node->s - 1, e - node->s);
+  lua_setfield(L, -2, "data");
+  return TRUE;
+}
+
+/* rencode.default(m, input) returns the match table for the byte
+ * encoded match data m, or nil when m is empty (as after an abend)
+ */
+static int rencode_default(lua_State *L) {
+  capture_reader r;
+  capture_node node;
+  const char *input;
+  size_t inputlen;
+  check_encoder_args(L, 1, &r, &input, &inputlen);
+  if (r.pos == r.end) return 0;
+  if (!read_node_header(&r, &node) || !push_match_table(L, &r, &node, input, inputlen))
+    return luaL_error(L, "invalid byte-encoded match data");
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * The color encoder
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* A compiled color database maps pattern names to the ANSI (SGR)
+ * escape sequence that starts their color.  Exact names and package
+ * defaults (from "pkg.*" entries, stored without the ".*") are kept
+ * in two sorted arrays.  The entries and strings are stored in the
+ * same userdata block as the header.
+ */
+
+#define COLORDB_T "ROSIE_COLORDB"
+
+typedef struct color_entry {
+  const char *name;
+  size_t namelen;
+  const char *sgr;
+  size_t sgrlen;
+} color_entry;
+
+typedef struct colordb {
+  color_entry *exact;
+  size_t nexact;
+  color_entry *pkg;
+  size_t npkg;
+  color_entry global_default;	/* always set */
+} colordb;
+
+static int compare_entries(const void *a, const void *b) {
+  const color_entry *x = a, *y = b;
+  int c = memcmp(x->name, y->name, (x->namelen < y->namelen) ? x->namelen : y->namelen);
+  if (c) return c;
+  return (x->namelen > y->namelen) - (x->namelen < y->namelen);
+}
+
+static const color_entry *colordb_lookup(const color_entry *entries, size_t n,
+					 const char *name, size_t namelen) {
+  color_entry key;
+  if (n == 0) return NULL;
+  key.name = name;
+  key.namelen = namelen;
+  return bsearch(&key, entries, n, sizeof(color_entry), compare_entries);
+}
+
+static int is_pkg_default(const char *name, size_t len) {
+  return (len > 2) && (name[len - 2] == '.') && (name[len - 1] == '*');
+}
+
+/* rencode.colordb(t) compiles the table t, which maps pattern names
+ * (and "pkg.*" and "*") to SGR escape sequences, into a color database
+ * for rencode.color()
+ */
+static int rencode_colordb(lua_State *L) {
+  size_t n = 0, chars = 0, len;
+  size_t nexact = 0, npkg = 0;
+  const char *name, *sgr;
+  char *heap;
+  colordb *db;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    if ((lua_type(L, -2) != LUA_TSTRING) || (lua_type(L, -1) != LUA_TSTRING))
+      return luaL_error(L, "color database entries must be strings");
+    lua_tolstring(L, -2, &len);
+    chars += len;
+    lua_tolstring(L, -1, &len);
+    chars += len;
+    n++;
+    lua_pop(L, 1);
+  }
+  db = lua_newuserdata(L, sizeof(colordb) + n * sizeof(color_entry) + chars + 1);
+  db->exact = (color_entry *) (db + 1);
+  heap = (char *) (db->exact + n);
+  db->global_default.name = "";
+  db->global_default.namelen = 0;
+  db->global_default.sgr = "\033[m";	/* an empty color spec */
+  db->global_default.sgrlen = 3;
+  /* Exact entries are stored from the front of the array, and package
+     defaults from the back */
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    color_entry entry;
+    int pkg;
+    name = lua_tolstring(L, -2, &entry.namelen);
+    sgr = lua_tolstring(L, -1, &entry.sgrlen);
+    memcpy(heap, sgr, entry.sgrlen);
+    entry.sgr = heap;
+    heap += entry.sgrlen;
+    if ((entry.namelen == 1) && (name[0] == '*')) {
+      entry.name = "*";
+      db->global_default = entry;
+    } else {
+      pkg = is_pkg_default(name, entry.namelen);
+      if (pkg) entry.namelen -= 2;
+      memcpy(heap, name, entry.namelen);
+      entry.name = heap;
+      heap += entry.namelen;
+      if (pkg)
+	db->exact[n - ++npkg] = entry;
+      else
+	db->exact[nexact++] = entry;
+    }
+    lua_pop(L, 1);
+  }
+  db->nexact = nexact;
+  db->pkg = db->exact + n - npkg;
+  db->npkg = npkg;
+  qsort(db->exact, nexact, sizeof(color_entry), compare_entries);
+  qsort(db->pkg, npkg, sizeof(color_entry), compare_entries);
+  luaL_setmetatable(L, COLORDB_T);
+  return 1;
+}
+
+typedef struct color_state {
+  luaL_Buffer *b;
+  const colordb *db;
+  const char *input;
+  size_t inputlen;
+  size_t last;			/* input before this position has been written */
+} color_state;
+
+/* Write the input from the last position written up to s, then the
+ * input from s up to e in color sgr (or uncolored when sgr is NULL)
+ */
+static int color_span(color_state *cs, const color_entry *color, int32_t s, int32_t e) {
+  size_t from = (size_t) s - 1, to = (size_t) e - 1;
+  if ((e < s) || (to > cs->inputlen)) return FALSE;
+  if (from > cs->last) luaL_addlstring(cs->b, cs->input + cs->last, from - cs->last);
+  if (color) {
+    luaL_addlstring(cs->b, color->sgr, color->sgrlen);
+    luaL_addlstring(cs->b, cs->input + from, to - from);
+    luaL_addlstring(cs->b, "\033[0m", 4);
+  } else {
+    luaL_addlstring(cs->b, cs->input + from, to - from);
+  }
+  cs->last = to;
+  return TRUE;
+}
+
+/* Color the node whose header is in node, following color() in
+ * color.lua: a node whose name has a color is written in that color.
+ * Otherwise, a node with sub-matches defers to them, and a node with
+ * none is written in its package default color or the global default.
+ * A package default color carries down to the sub-matches in the same
+ * package.
+ */
+static int color_node(color_state *cs, capture_reader *r, capture_node *node,
+		      const char *pkgname, size_t pkglen, const color_entry *pkgcolor) {
+  const color_entry *c = NULL, *leafcolor;
+  const char *dot, *name = node->name;
+  size_t namelen = node->namelen;
+  capture_node sub;
+  int32_t e;
+  if ((namelen == 1) && (name[0] == '*')) namelen = 0;
+  if (namelen) c = colordb_lookup(cs->db->exact, cs->db->nexact, name, namelen);
+  if (c) {
+    return skip_node_rest(r, &e) && color_span(cs, c, node->s, e);
+  }
+  leafcolor = &cs->db->global_default;
+  dot = namelen ? memchr(name, '.', namelen) : NULL;
+  if (dot) {
+    size_t len = dot - name;
+    if (!pkgname || (len != pkglen) || memcmp(name, pkgname, len)) {
+      pkgcolor = colordb_lookup(cs->db->pkg, cs->db->npkg, name, len);
+      if (pkgcolor) {
+	pkgname = name;
+	pkglen = len;
+      }
+    }
+    if (pkgname && (len == pkglen) && !memcmp(name, pkgname, len)) leafcolor = pkgcolor;
+  }
+  if (!sub_follows(r)) {
+    return read_int32(r, &e) && color_span(cs, leafcolor, node->s, e);
+  }
+  while (sub_follows(r)) {
+    if (!read_node_header(r, &sub)) return FALSE;
+    if (!color_node(cs, r, &sub, pkgname, pkglen, pkgcolor)) return FALSE;
+  }
+  return read_int32(r, &e) && (e > 0);
+}
+
+/* rencode.color(m, input, db) returns the input with the byte encoded
+ * match m shown in the colors given by the color database db
+ */
+static int rencode_color(lua_State *L) {
+  capture_reader r;
+  capture_node node;
+  luaL_Buffer b;
+  color_state cs;
+  check_encoder_args(L, 1, &r, &cs.input, &cs.inputlen);
+  cs.db = luaL_checkudata(L, 3, COLORDB_T);
+  cs.last = 0;
+  cs.b = &b;
+  if (cs.inputlen == 0) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  luaL_buffinit(L, &b);
+  if ((r.pos != r.end) &&
+      (!read_node_header(&r, &node) || !color_node(&cs, &r, &node, NULL, 0, NULL)))
+    return luaL_error(L, "invalid byte-encoded match data");
+  if (cs.last < cs.inputlen) luaL_addlstring(&b, cs.input + cs.last, cs.inputlen - cs.last);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static const luaL_Reg rencode_functions[] = {
+  {"default", rencode_default},
+  {"color", rencode_color},
+  {"colordb", rencode_colordb},
+  {NULL, NULL}
+};
+
+int luaopen_rencode(lua_State *L) {
+  luaL_newmetatable(L, COLORDB_T);
+  lua_pop(L, 1);
+  luaL_newlib(L, rencode_functions);
+  return 1;
+}
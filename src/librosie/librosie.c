@@ -11,6 +11,10 @@
  * rosie_new() makes a new engine.  Every thread must have its own engine.
  * rosie_finalize() destroys an engine and frees its memory.
  *
+ * rosie_pool_new() makes a pool of engines, each owned by a worker
+ * thread, which any number of client threads may share.  See pool.c.
+ * rosie_pool_finalize() destroys the pool and its engines.
+ *
  * Most functions have an argument 'str *messages':
  *
  * (1) If messages->ptr is NULL after the call, then there were no
@@ -77,8 +81,10 @@ static char bootscript[MAXPATHLEN];
  * ----------------------------------------------------------------------------------------
  */
 
+/* A wait for a busy engine lock is timed (see stats.c) */
 #define ACQUIRE_ENGINE_LOCK(e) do {				    \
-    int r = pthread_mutex_lock(&((e)->lock));			    \
+    int r = pthread_mutex_trylock(&((e)->lock));		    \
+    if (r == EBUSY) r = wait_for_engine_lock(e);		    \
     if (r) {                                                        \
         fprintf(stderr, "pthread_mutex_lock failed with %d\n", r);  \
         abort();                                                    \
@@ -93,6 +99,20 @@ static char bootscript[MAXPATHLEN];
     }                                                               \
 } while (0)
 
+/* ----------------------------------------------------------------------------------------
+ * Engine memory
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "alloc.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Engine statistics
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "stats.c"
+
 /* ----------------------------------------------------------------------------------------
  * Start-up / boot functions
  * ----------------------------------------------------------------------------------------
@@ -248,13 +268,18 @@ static int strip_violation_messages(lua_State *L) {
 
 int luaopen_lpeg (lua_State *L);
 int luaopen_cjson_safe(lua_State *l);
+int luaopen_rplc(lua_State *L);
+int luaopen_rencode(lua_State *L);
 
 static lua_State *newstate() {
-  lua_State *newL = luaL_newstate();
+  lua_State *newL = engine_lua_newstate();
+  if (!newL) return NULL;
   luaL_checkversion(newL); /* Ensures several critical things needed to use Lua */
   luaL_openlibs(newL);     /* Open lua's standard libraries */
   luaL_requiref(newL, "lpeg", luaopen_lpeg, 0);
   luaL_requiref(newL, "cjson.safe", luaopen_cjson_safe, 0);
+  luaL_requiref(newL, "rplc", luaopen_rplc, 0);
+  luaL_requiref(newL, "rencode", luaopen_rencode, 0);
   return newL;
 }
   
@@ -275,8 +300,9 @@ Engine *rosie_new(str *messages) {
 
   int t;
   Engine *e = malloc(sizeof(Engine));
+  engine_stats *stats = calloc(1, sizeof(engine_stats));
   lua_State *L = newstate();
-  if (L == NULL) {
+  if ((L == NULL) || (e == NULL) || (stats == NULL)) {
     *messages = rosie_new_string_from_const("not enough memory to initialize");
     return NULL;
   }
@@ -336,6 +362,8 @@ Engine *rosie_new(str *messages) {
 
   pthread_mutex_init(&(e->lock), NULL);
   e->L = L;
+  e->stats = stats;
+  e->encoders = NULL;
 
   lua_settop(L, 0);
   LOGf("Engine %p created\n", e);
@@ -382,6 +410,30 @@ int rosie_alloc_limit (Engine *e, int *newlimit, int *usage) {
   return SUCCESS;
 }
 
+/* Set a hard cap (in KB) on the memory held by engine e (see alloc.c),
+ * or query it.
+ * A newcap of -1 means query, and 0 means no cap.  The largest
+ * footprint so far (in KB) is returned in high_water, if not NULL.
+ */
+EXPORT
+int rosie_alloc_cap(Engine *e, int *newcap, int *high_water) {
+  engine_alloc *a = engine_allocator(e->L);
+  LOGf("rosie_alloc_cap() called with int pointers %p, %p\n", newcap, high_water);
+  ACQUIRE_ENGINE_LOCK(e);
+  if (newcap) {
+    int cap = *newcap;
+    if ((cap != -1) && (cap != 0) && (cap < MIN_ALLOC_LIMIT_MB)) {
+      RELEASE_ENGINE_LOCK(e);
+      return ERR_ENGINE_CALL_FAILED;
+    }
+    if (cap == -1) *newcap = (int) (a->cap / 1024);
+    else a->cap = (size_t) cap * 1024;
+  }
+  if (high_water) *high_water = (int) (a->high_water / 1024);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
 /* N.B. Client must free retval */
 EXPORT
 int rosie_config(Engine *e, str *retval) {
@@ -473,15 +525,16 @@ int rosie_free_rplx (Engine *e, int pat) {
   ACQUIRE_ENGINE_LOCK(e);
   get_registry(rplx_table_key);
   luaL_unref(L, -1, pat);
+  stats_free_pattern(e->stats, pat);
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
 }
 
-/* N.B. Client must free messages */
-EXPORT
-int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
-  int t;
+/* Called with captures == NULL to keep all of the captures */
+static int compile(Engine *e, str *expression, int ncaptures, char **captures,
+		   int *pat, str *messages) {
+  int t, i;
   str temp_rs;
   lua_State *L = e->L;
   
@@ -514,15 +567,22 @@ int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
   get_registry(engine_key);
 
   lua_pushlstring(L, (const char *)expression->ptr, expression->len);
+  if (captures) {
+    lua_createtable(L, ncaptures, 0);
+    for (i = 0; i < ncaptures; i++) {
+      lua_pushstring(L, captures[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+  }
 
-  t = lua_pcall(L, 2, 2, 0);
+  t = capped_pcall(L, captures ? 3 : 2, 2, 0);
 
   if (t != LUA_OK) {
     LOG("compile() failed\n");
     LOGstack(L);
     lua_settop(L, 0);
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;
   }
 
   if ( !lua_toboolean(L, -2) ) {
@@ -571,8 +631,31 @@ int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
   return SUCCESS;
 }
 
-static inline void collect_if_needed(lua_State *L) {
+/* N.B. Client must free messages */
+EXPORT
+int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
+  return compile(e, expression, 0, NULL, pat, messages);
+}
+
+/* Like rosie_compile(), but the matches of the compiled pattern will
+ * contain only the captures named in captures (and the top-level
+ * capture).  Every other binding is matched as if it were an alias, so
+ * that matching does not record its capture.  The same inputs match.
+ * Captures inside built-in patterns are kept.  N.B. Client must free
+ * messages
+ */
+EXPORT
+int rosie_compile_projected(Engine *e, str *expression, int ncaptures, char **captures,
+			    int *pat, str *messages) {
+  static char *no_captures[1] = {NULL};
+  if ((ncaptures < 0) || (ncaptures && !captures)) return ERR_ENGINE_CALL_FAILED;
+  return compile(e, expression, ncaptures, captures ? captures : no_captures, pat, messages);
+}
+
+static inline void collect_if_needed(Engine *e) {
   int limit, memusg;
+  uint64_t t0;
+  lua_State *L = e->L;
   get_registry(alloc_actual_limit_key);
   limit = lua_tointeger(L, -1);	/* nil will convert to zero */
   lua_pop(L, 1);
@@ -580,7 +663,9 @@ static inline void collect_if_needed(lua_State *L) {
     memusg = lua_gc(L, LUA_GCCOUNT, 0);
     if (memusg > limit) {
       LOGf("invoking collection of %0.1f MB heap\n", memusg/1024.0);
+      t0 = now_ns();
       lua_gc(L, LUA_GCCOLLECT, 0);
+      stats_gc(e->stats, now_ns() - t0);
 #if (LOGGING)
       memusg = lua_gc(L, LUA_GCCOUNT, 0);
       LOGf("post-collection heap has %0.1f MB\n", memusg/1024.0);
@@ -594,16 +679,46 @@ static inline void collect_if_needed(lua_State *L) {
     (*(match)).data.len = (errno);    \
   } while (0);
 
-EXPORT
-int rosie_match(Engine *e, int pat, int start, char *encoder_name, str *input, match *match) {
-  int t, encoder, result_type, match_code;
-  size_t temp_len;
-  unsigned char *temp_str;
-  rBuffer *buf;
+/* ----------------------------------------------------------------------------------------
+ * Literal prefilter
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "prefilter.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Output encoders written in C (the rencode Lua module)
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "encode.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Custom output encoders
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "plugin.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Columnar output
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "columns.c"
+
+/* Match input against pat, and leave the match data on the top of the
+ * stack.  On SUCCESS, the data is an rBuffer (userdata), a Lua string,
+ * or an integer code, which is zero when there is no match, and
+ * otherwise is one of the codes that set_match_error() uses.  The
+ * caller holds the engine lock.
+ */
+static int push_match(Engine *e, int pat, int start, char *encoder_name, str *input, match *match) {
+  int t, encoder, outcome;
+  prefilter pf;
+  custom_encoder *custom;
   lua_State *L = e->L;
-  LOG("rosie_match called\n");
-  ACQUIRE_ENGINE_LOCK(e);
-  collect_if_needed(L);
+  uint64_t t0 = now_ns();
   if (!pat)
     LOGf("rosie_match() called with invalid compiled pattern reference: %d\n", pat);
   else {
@@ -611,13 +726,22 @@ int rosie_match(Engine *e, int pat, int start, char *encoder_name, str *input, m
     t = lua_rawgeti(L, -1, pat);
     if (t == LUA_TTABLE) goto have_pattern;
   }
-  set_match_error(match, ERR_NO_PATTERN);
   lua_settop(L, 0);
-  RELEASE_ENGINE_LOCK(e);
+  lua_pushinteger(L, ERR_NO_PATTERN);
   return SUCCESS;
 
 have_pattern:
 
+  prefilter_get(L, -1, &pf);
+  if (!prefilter_pass(&pf, input->ptr, input->len, start)) {
+    prefilter_no_match(match, input->len, start);
+    stats_match(e->stats, pat, input->len, match, 0, now_ns() - t0);
+    stats_prefiltered(e->stats, pf.rejected);
+    lua_settop(L, 0);
+    lua_pushinteger(L, 0);
+    return SUCCESS;
+  }
+
   /* The encoder values that do not require Lua processing have
    * non-zero codes, and take a different code path from the ones that
    * do.  When no Lua processing is needed, we can (1) use a
@@ -627,7 +751,8 @@ have_pattern:
    * Otherwise, we call the lua function rplx.Cmatch().
    */
 
-  encoder = encoder_name_to_code(encoder_name);
+  custom = find_custom_encoder(e, encoder_name);
+  encoder = encoder_name_to_code(custom ? "byte" : encoder_name);
   LOGf("in rosie_match, encoder value is %d\n", encoder);
   if (!encoder) {
     /* Path through Lua */
@@ -666,13 +791,11 @@ have_pattern:
     lua_pushinteger(L, encoder);
   }
   
-  t = lua_pcall(L, 4, 5, 0); 
+  t = capped_pcall(L, 4, 5, 0); 
   if (t != LUA_OK) {  
     LOG("match() failed\n");  
     LOGstack(L); 
-    lua_settop(L, 0); 
-    RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;  
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;
   }  
 
   (*match).tmatch = lua_tointeger(L, -1);
@@ -681,8 +804,38 @@ have_pattern:
   (*match).leftover = lua_tointeger(L, -4);
   lua_pop(L, 4);
 
-  result_type = lua_type(L, -1);
-  switch (result_type) {
+  t = lua_type(L, -1);
+  if (custom && (t == LUA_TUSERDATA)) {
+    outcome = custom_encode_to_string(L, custom, input);
+    if (outcome != SUCCESS) return outcome;
+    t = LUA_TSTRING;
+  }
+  outcome = (t == LUA_TNUMBER) ? lua_tointeger(L, -1) : -1;
+  stats_match(e->stats, pat, input->len, match, outcome, now_ns() - t0);
+  if ((t == LUA_TUSERDATA) || (t == LUA_TNUMBER)) return SUCCESS;
+  if ((t == LUA_TSTRING) && (!encoder || custom)) return SUCCESS;
+  LOGf("Invalid return type from rmatch (%d)\n", t);
+  return ERR_ENGINE_CALL_FAILED;
+}
+
+EXPORT
+int rosie_match(Engine *e, int pat, int start, char *encoder_name, str *input, match *match) {
+  int r, match_code;
+  size_t temp_len;
+  unsigned char *temp_str;
+  rBuffer *buf;
+  lua_State *L = e->L;
+  LOG("rosie_match called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(e);
+  r = push_match(e, pat, start, encoder_name, input, match);
+  if (r != SUCCESS) {
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return r;
+  }
+
+  switch (lua_type(L, -1)) {
   case LUA_TUSERDATA: {
     buf = lua_touserdata(L, -1);
     LOG("in rosie_match, match succeeded\n");
@@ -697,13 +850,6 @@ have_pattern:
     break;
   }
   case LUA_TSTRING: {
-    if (encoder) {
-      LOG("Invalid return type from rmatch (string)\n");
-      match = NULL;
-      lua_settop(L, 0);
-      RELEASE_ENGINE_LOCK(e);
-      return ERR_ENGINE_CALL_FAILED;
-    }
     /* The client does not need to manage the storage for match
      * results when they are in an rBuffer (userdata), so we do not
      * want the client to manage the storage when it has the form of a
@@ -722,21 +868,316 @@ have_pattern:
     (*match).data.ptr = rs->ptr;
     (*match).data.len = rs->len;
     break;
+  } }
+
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Matching into client memory
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* The data that rosie_match() returns lives in the engine until the
+ * next match, and a Lua string result is copied into a malloc'd
+ * string to give it that lifetime.  The functions below instead put
+ * the data where the client wants it, while the engine still holds
+ * it, so there are no lifetime rules for the client to follow.
+ */
+
+/* Get a pointer to the data on the top of the stack, or return FALSE
+ * if there is none, after setting the match error.
+ */
+static int match_data(lua_State *L, match *match, const char **data, size_t *len) {
+  rBuffer *buf;
+  switch (lua_type(L, -1)) {
+  case LUA_TUSERDATA:
+    buf = lua_touserdata(L, -1);
+    *data = buf->data;
+    *len = buf->n;
+    return TRUE;
+  case LUA_TSTRING:
+    *data = lua_tolstring(L, -1, len);
+    return TRUE;
+  default:
+    set_match_error(match, lua_tointeger(L, -1));
+    return FALSE;
+  }
+}
+
+/* The match data is copied into buffer, which has room for bufsize
+ * bytes, and match->data points into buffer.  The size of the data
+ * is returned in needed.  When it is more than bufsize, nothing is
+ * copied, and the match error is ERR_BUFFER_TOO_SMALL.  The client
+ * can then retry with a buffer of the needed size.
+ */
+EXPORT
+int rosie_match_into(Engine *e, int pat, int start, char *encoder_name, str *input, match *match,
+		     byte_ptr buffer, size_t bufsize, size_t *needed) {
+  int r;
+  size_t len;
+  const char *data;
+  lua_State *L = e->L;
+  LOG("rosie_match_into called\n");
+  *needed = 0;
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(e);
+  r = push_match(e, pat, start, encoder_name, input, match);
+  if ((r == SUCCESS) && match_data(L, match, &data, &len)) {
+    *needed = len;
+    if (len > bufsize) {
+      set_match_error(match, ERR_BUFFER_TOO_SMALL);
+    } else {
+      memcpy(buffer, data, len);
+      (*match).data.ptr = buffer;
+      (*match).data.len = len;
+    }
+  }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return r;
+}
+
+/* The match data is passed to sink, along with the client's context
+ * pointer.  The data is only valid during the call to sink, which
+ * must not call back into the same engine.  After a successful match,
+ * match->data has a NULL ptr and a len of MATCH_WITHOUT_DATA, so the
+ * client can tell a match from a failure to match (len of zero).
+ */
+EXPORT
+int rosie_match_sink(Engine *e, int pat, int start, char *encoder_name, str *input, match *match,
+		     rosie_sink sink, void *context) {
+  int r;
+  size_t len;
+  const char *data;
+  lua_State *L = e->L;
+  LOG("rosie_match_sink called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(e);
+  r = push_match(e, pat, start, encoder_name, input, match);
+  if ((r == SUCCESS) && match_data(L, match, &data, &len)) {
+    sink(context, (byte_ptr) data, len);
+    set_match_error(match, MATCH_WITHOUT_DATA);
   }
-  default: {
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return r;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Batch matching
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* When many short inputs are matched against one pattern, the fixed
+ * cost of each rosie_match() call (engine lock, rplx lookup, peg
+ * fetch, and a lua_pcall) can exceed the time spent in the matching
+ * vm.  rosie_match_batch() pays those costs once per batch.
+ *
+ * The match results are anchored in the registry, so that the data
+ * for every input in the batch remains valid until the next call to
+ * rosie_match_batch() on the same engine.  The client must not free
+ * the match data.
+ */
+
+typedef struct match_batch {
+  int encoder;			/* non-zero when no Lua processing is needed */
+  char *encoder_name;
+  custom_encoder *custom;	/* when set, encoder is the byte encoder */
+  columns *cols;		/* when set, encoder is the byte encoder */
+  int n;
+  int *starts;			/* NULL means that every match starts at 1 */
+  str *inputs;
+  match *matches;
+  int pat;
+  engine_stats *stats;
+  prefilter pf;
+} match_batch;
+
+/* Called (via lua_pcall) with this stack:
+ *   1: the matcher, which is r_match_C or rplx.Cmatch
+ *   2: the first arg to the matcher, which is the peg or the rplx
+ *   3: lightuserdata pointing to the match_batch
+ *   4: table in which the results are anchored
+ */
+static int match_batch_C(lua_State *L) {
+  int i, t;
+  size_t temp_len;
+  uint64_t t0;
+  rBuffer *buf;
+  match_batch *b = lua_touserdata(L, 3);
+  for (i = 0; i < b->n; i++) {
+    match *m = &(b->matches[i]);
+    int start = b->starts ? b->starts[i] : 1;
+    t0 = now_ns();
+    if (!prefilter_pass(&(b->pf), b->inputs[i].ptr, b->inputs[i].len, start)) {
+      prefilter_no_match(m, b->inputs[i].len, start);
+      stats_match(b->stats, b->pat, b->inputs[i].len, m, 0, now_ns() - t0);
+      continue;
+    }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    if (b->encoder) {
+      lua_pushlightuserdata(L, &(b->inputs[i]));
+      lua_pushinteger(L, start);
+      lua_pushinteger(L, b->encoder);
+    } else {
+      r_newbuffer_wrap(L, (char *)b->inputs[i].ptr, b->inputs[i].len);
+      lua_pushinteger(L, start);
+      lua_pushstring(L, b->encoder_name);
+    }
+    lua_call(L, 4, 5);
+    m->tmatch = lua_tointeger(L, -1);
+    m->ttotal = lua_tointeger(L, -2);
+    m->abend = lua_toboolean(L, -3);
+    m->leftover = lua_tointeger(L, -4);
+    lua_pop(L, 4);
     t = lua_type(L, -1);
-    LOGf("Invalid return type from rmatch (%d)\n", t);
-    match = NULL;
+    if (b->custom && (t == LUA_TUSERDATA)) {
+      int r = custom_encode_to_string(L, b->custom, &(b->inputs[i]));
+      if (r != SUCCESS) return luaL_error(L, "custom encoder %s failed (%d)", b->custom->name, r);
+      t = LUA_TSTRING;
+    }
+    stats_match(b->stats, b->pat, b->inputs[i].len, m,
+		(t == LUA_TNUMBER) ? lua_tointeger(L, -1) : -1, now_ns() - t0);
+    switch (t) {
+    case LUA_TUSERDATA: {
+      buf = lua_touserdata(L, -1);
+      m->data.ptr = (byte_ptr) buf->data;
+      m->data.len = buf->n;
+      if (b->cols) {
+	int r = columns_add(b->cols, i, &(b->inputs[i]), buf->data, buf->n);
+	if (r != SUCCESS) return luaL_error(L, "cannot add match to columns (%d)", r);
+      }
+      lua_rawseti(L, 4, i+1);
+      break;
+    }
+    case LUA_TNUMBER: {
+      set_match_error(m, lua_tointeger(L, -1));
+      lua_pop(L, 1);
+      break;
+    }
+    case LUA_TSTRING: {
+      if (b->encoder && !b->custom) return luaL_error(L, "invalid return type from rmatch (string)");
+      m->data.ptr = (byte_ptr) lua_tolstring(L, -1, &temp_len);
+      m->data.len = temp_len;
+      lua_rawseti(L, 4, i+1);
+      break;
+    }
+    default:
+      return luaL_error(L, "invalid return type from rmatch (%d)", t);
+    }
+  }
+  return 0;
+}
+
+/* When cols is not NULL, the encoder must be "byte" */
+static int match_batch_run(Engine *e, int pat, char *encoder_name, columns *cols, int n,
+			   int *starts, str *inputs, match *matches) {
+  int i, t;
+  match_batch batch;
+  lua_State *L = e->L;
+  LOGf("rosie_match_batch called with %d inputs\n", n);
+  if (n < 0) return ERR_ENGINE_CALL_FAILED;
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(e);
+  /* Release the results of the previous batch */
+  lua_pushnil(L);
+  set_registry(batch_results_key);
+  lua_settop(L, 0);
+  if (!pat)
+    LOGf("rosie_match_batch() called with invalid compiled pattern reference: %d\n", pat);
+  else {
+    get_registry(rplx_table_key);
+    t = lua_rawgeti(L, -1, pat);
+    if (t == LUA_TTABLE) goto have_pattern;
+  }
+  for (i = 0; i < n; i++) set_match_error(&matches[i], ERR_NO_PATTERN);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+
+have_pattern:
+
+  batch.custom = cols ? NULL : find_custom_encoder(e, encoder_name);
+  batch.encoder = encoder_name_to_code(batch.custom ? "byte" : encoder_name);
+  batch.encoder_name = encoder_name;
+  batch.cols = cols;
+  batch.n = n;
+  batch.starts = starts;
+  batch.inputs = inputs;
+  batch.matches = matches;
+  batch.pat = pat;
+  batch.stats = e->stats;
+  /* The rplx stays in the rplx table, so the literals stay alive */
+  prefilter_get(L, -1, &batch.pf);
+
+  /* Same two paths as rosie_match(), chosen once for the whole batch */
+  if (!batch.encoder) {
+    t = lua_getfield(L, -1, "Cmatch");
+    CHECK_TYPE("rplx.Cmatch()", t, LUA_TFUNCTION);
+    lua_replace(L, 1);
+    lua_settop(L, 2);
+  } else {
+    t = lua_getfield(L, -1, "pattern");
+    CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
+    t = lua_getfield(L, -1, "peg");
+    CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+    lua_pushcfunction(L, r_match_C);
+    lua_copy(L, -1, 1);
+    lua_copy(L, -2, 2);
+    lua_settop(L, 2);
+  }
+  lua_pushcfunction(L, match_batch_C);
+  lua_insert(L, 1);
+  lua_pushlightuserdata(L, &batch);
+  lua_createtable(L, n, 0);
+  set_registry(batch_results_key);
+
+  t = capped_pcall(L, 4, 0, 0);
+  stats_prefiltered(e->stats, batch.pf.rejected);
+  if (t != LUA_OK) {
+    LOG("match_batch() failed\n");
+    LOGstack(L);
     lua_settop(L, 0);
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;
-  } }
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;
+  }
 
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
 }
 
+EXPORT
+int rosie_match_batch(Engine *e, int pat, char *encoder_name, int n,
+		      int *starts, str *inputs, match *matches) {
+  return match_batch_run(e, pat, encoder_name, NULL, n, starts, inputs, matches);
+}
+
+/* Like rosie_match_batch() with the byte encoder, and also collect the
+ * captures named in names into one block of columns (see columns.c).
+ *
+ * N.B. Client must free block
+ */
+EXPORT
+int rosie_match_columns(Engine *e, int pat, int ncols, char **names, int n,
+			int *starts, str *inputs, match *matches, str *block) {
+  int r;
+  columns *cols;
+  (*block).ptr = NULL;
+  (*block).len = 0;
+  if (ncols < 0) return ERR_ENGINE_CALL_FAILED;
+  cols = columns_new(ncols, names);
+  if (!cols) return ERR_OUT_OF_MEMORY;
+  r = match_batch_run(e, pat, "byte", cols, n, starts, inputs, matches);
+  if (r == SUCCESS) r = columns_to_block(cols, block);
+  columns_free(cols);
+  return r;
+}
+
 /* N.B. Client must free trace */
 EXPORT
 int rosie_trace(Engine *e, int pat, int start, char *trace_style, str *input, int *matched, str *trace) {
@@ -744,7 +1185,7 @@ int rosie_trace(Engine *e, int pat, int start, char *trace_style, str *input, in
   str rs;
   lua_State *L = e->L;
   ACQUIRE_ENGINE_LOCK(e);
-  collect_if_needed(L);
+  collect_if_needed(e);
   get_registry(engine_key);
   t = lua_getfield(L, -1, "trace");
   CHECK_TYPE("engine.trace()", t, LUA_TFUNCTION);
@@ -778,13 +1219,13 @@ have_pattern:
   lua_pushinteger(L, start);	                            /* arg 4 */
   lua_pushstring(L, trace_style);                           /* arg 5 */
 
-  t = lua_pcall(L, 5, 3, 0); 
+  t = capped_pcall(L, 5, 3, 0); 
   if (t != LUA_OK) {  
     LOG("trace() failed\n");  
     LOGstack(L); 
     lua_settop(L, 0); 
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;  
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;  
   }  
 
   /* The first return value from trace indicates whether the pattern
@@ -841,7 +1282,7 @@ int rosie_load(Engine *e, int *ok, str *src, str *pkgname, str *messages) {
   lua_pushvalue(L, -2);		/* push engine object again */
   lua_pushlstring(L, (const char *)src->ptr, src->len);
 
-  t = lua_pcall(L, 2, 3, 0); 
+  t = capped_pcall(L, 2, 3, 0); 
   if (t != LUA_OK) { 
     /* Details will likely not be helpful to the user */
     LOG("engine.load() failed\n"); 
@@ -849,7 +1290,7 @@ int rosie_load(Engine *e, int *ok, str *src, str *pkgname, str *messages) {
     LOGstack(L);
     lua_settop(L, 0);
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED; 
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED; 
   } 
 
   *ok = lua_toboolean(L, -3);
@@ -896,14 +1337,14 @@ int rosie_loadfile(Engine *e, int *ok, str *fn, str *pkgname, str *messages) {
   const char *fname = lua_pushlstring(L, (const char *)fn->ptr, fn->len);
 
   LOGf("engine.loadfile(): about to load %s\n", fname);
-  t = lua_pcall(L, 2, 3, 0); 
+  t = capped_pcall(L, 2, 3, 0); 
   if (t != LUA_OK) { 
     display("Internal error: call to engine.loadfile() failed"); 
     /* Details will likely not be helpful to the user */
     LOGstack(L);
     lua_settop(L, 0);
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED; 
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED; 
   } 
 
   *ok = lua_toboolean(L, -3);
@@ -966,13 +1407,13 @@ int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname,
     lua_pushnil(L);
   }
 
-  t = lua_pcall(L, 3, 3, 0); 
+  t = capped_pcall(L, 3, 3, 0); 
   if (t != LUA_OK) { 
     LOG("engine.import() failed\n"); 
     LOGstack(L);
     lua_settop(L, 0);
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED; 
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED; 
   } 
 
   *ok = lua_toboolean(L, -3);
@@ -1012,15 +1453,31 @@ int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname,
   return SUCCESS;
 }
 
+/* ----------------------------------------------------------------------------------------
+ * Matching files
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "matchfile.c"
+
 /* FUTURE: Expose engine_process_file() ? */
 
-/* N.B. Client must free err */
+/* When the encoder needs no Lua processing, the file is matched by
+ * the native loop in matchfile.c.  Otherwise, engine.matchfile() does
+ * the work.  When outfilename (or errfilename) is NULL, the matches
+ * (or the lines that did not match) are counted but not written, so
+ * that with both NULL, only the counts are returned.
+ *
+ * N.B. Client must free err
+ */
 EXPORT
 int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
 		    char *infilename, char *outfilename, char *errfilename,
 		    int *cin, int *cout, int *cerr,
 		    str *err) {
-  int t;
+  int t, encoder_code;
+  prefilter pf;
+  custom_encoder *custom;
   unsigned char *temp_str;
   size_t temp_len;
   lua_State *L = e->L;
@@ -1028,7 +1485,7 @@ int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
   (*err).len = 0;
 
   ACQUIRE_ENGINE_LOCK(e);
-  collect_if_needed(L);
+  collect_if_needed(e);
   get_registry(engine_key);
   t = lua_getfield(L, -1, "matchfile");
   CHECK_TYPE("engine.matchfile()", t, LUA_TFUNCTION);
@@ -1055,20 +1512,38 @@ int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
     return SUCCESS;
   }
 
+  custom = find_custom_encoder(e, encoder);
+  encoder_code = encoder_name_to_code(custom ? "byte" : encoder);
+  if (encoder_code) {
+    prefilter_get(L, -1, &pf);
+    t = lua_getfield(L, -1, "pattern");
+    CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
+    t = lua_getfield(L, -1, "peg");
+    CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+    t = matchfile_native(L, encoder_code, custom, NULL, &pf, wholefileflag,
+			 infilename, outfilename, errfilename,
+			 cin, cout, cerr, err);
+    stats_prefiltered(e->stats, pf.rejected);
+    if (t == SUCCESS) stats_file(e->stats, *cin, *cout, *cerr);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return t;
+  }
+
   lua_pushstring(L, infilename);  /* arg 3 */
   lua_pushstring(L, outfilename); /* arg 4 */
   lua_pushstring(L, errfilename); /* arg 5 */
   lua_pushstring(L, encoder);	  /* arg 6 */
   lua_pushboolean(L, wholefileflag); /* arg 7 */
 
-  t = lua_pcall(L, 7, 3, 0); 
+  t = capped_pcall(L, 7, 3, 0); 
   if (t != LUA_OK) {  
     LOG("matchfile() failed\n");  
     LOGstack(L); 
     /* FUTURE: return the error, if there's a situation where it may help */
     lua_settop(L, 0); 
     RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;  
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;
   }  
 
   if (lua_isnil(L, -1)) {
@@ -1090,12 +1565,57 @@ int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
   (*cin) = lua_tointeger(L, -3);  /* cerr */
   (*cout) = lua_tointeger(L, -2); /* cout, or error code if error */
   (*cerr) = lua_tointeger(L, -1); /* cin, or -1 if error */
+  stats_file(e->stats, *cin, *cout, *cerr);
   
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
 }
 
+/* Like rosie_matchfile() with the byte encoder, except that the
+ * captures named in names are written to outfilename as blocks of
+ * columns (see columns.c), and cout is the number of lines that
+ * matched.
+ *
+ * N.B. Client must free err
+ */
+EXPORT
+int rosie_matchfile_columns(Engine *e, int pat, int ncols, char **names, int wholefileflag,
+			    char *infilename, char *outfilename, char *errfilename,
+			    int *cin, int *cout, int *cerr,
+			    str *err) {
+  int t;
+  prefilter pf;
+  columns *cols;
+  lua_State *L = e->L;
+  (*err).ptr = NULL;
+  (*err).len = 0;
+  if (ncols < 0) return ERR_ENGINE_CALL_FAILED;
+  cols = columns_new(ncols, names);
+  if (!cols) return ERR_OUT_OF_MEMORY;
+
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(e);
+  if (!push_peg(L, pat, &pf)) {
+    LOGf("rosie_matchfile_columns() called with invalid compiled pattern reference: %d\n", pat);
+    (*cin) = -1;
+    (*cout) = ERR_NO_PATTERN;
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    columns_free(cols);
+    return SUCCESS;
+  }
+  t = matchfile_native(L, encoder_name_to_code("byte"), NULL, cols, &pf, wholefileflag,
+		       infilename, outfilename, errfilename,
+		       cin, cout, cerr, err);
+  stats_prefiltered(e->stats, pf.rejected);
+  if (t == SUCCESS) stats_file(e->stats, *cin, *cout, *cerr);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  columns_free(cols);
+  return t;
+}
+
 /* N.B. Client must free options */
 EXPORT
 int rosie_read_rcfile(Engine *e, str *filename, int *file_exists, str *options) {
@@ -1258,7 +1778,10 @@ void rosie_finalize(Engine *e) {
     lua_pop(L, 1); 
   } 
   LOGf("Finalizing engine %p\n", L);
-  lua_close(L);
+  engine_lua_close(L);
+  free(e->stats->pat_matches);
+  free(e->stats);
+  free_custom_encoders(e);
   /*
    * We do not RELEASE_ENGINE_LOCK(e) here because a waiting thread
    * would then have access to an engine which we have closed, and
@@ -1271,12 +1794,46 @@ void rosie_finalize(Engine *e) {
    * creating and destroying its own engines.  In that scenario, a
    * thread's engine should be private to that thread.
    * 
-   * Alternatively, an engine pool could be created (in the client
-   * code).  The pool manager would be responsible for calling
-   * rosie_finalize() when there is no danger of any thread attempting
-   * to use the engine being destroyed.
+   * Alternatively, an engine pool can be used (see rosie_pool_new()).
+   * The pool manager is responsible for calling rosie_finalize() when
+   * there is no danger of any thread attempting to use the engine
+   * being destroyed.
    *
    */
   free(e);
 }
 
+/* ----------------------------------------------------------------------------------------
+ * Sharing compiled patterns between engines
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "share.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Saving compiled packages (the rplc Lua module)
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "rplc.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Cloning engines
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "clone.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Engine pools
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "pool.c"
+
+/* ----------------------------------------------------------------------------------------
+ * Asynchronous matching
+ * ----------------------------------------------------------------------------------------
+ */
+
+#include "async.c"
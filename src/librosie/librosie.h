@@ -18,6 +18,7 @@
 #define ERR_OUT_OF_MEMORY -2
 #define ERR_SYSCALL_FAILED -3
 #define ERR_ENGINE_CALL_FAILED -4
+#define ERR_BAD_MATCH_DATA -5	/* for rosie_walk_match() */
 
 /* These codes are returned in the length field of an str whose ptr is
  * NULL as a cheap way to give the caller an explanation when an error
@@ -28,6 +29,7 @@
 #define ERR_NO_ENCODER 2	/* also used for "no trace style" */
 #define ERR_NO_FILE 3		/* no such file or directory */
 #define ERR_NO_PATTERN 4
+#define ERR_BUFFER_TOO_SMALL 5	/* for rosie_match_into() */
 
 
 #include <stdint.h>
@@ -39,9 +41,12 @@
 typedef struct rosie_engine {
      lua_State *L;
      pthread_mutex_t lock;
+     struct engine_stats *stats;
+     struct custom_encoder *encoders; /* see rosie_register_encoder */
 } Engine;
 
 typedef struct rosie_string str;
+typedef struct rosie_pool Pool;
 
 typedef struct rosie_matchresult {
      str data;
@@ -51,6 +56,38 @@ typedef struct rosie_matchresult {
      int tmatch;
 } match;
 
+/* A completed asynchronous match (see rosie_pool_submit) */
+typedef struct rosie_completion {
+     void *tag;
+     int status;
+     match match;
+} rosie_completion;
+
+/* A sink receives match data, which is only valid during the call */
+typedef void (*rosie_sink)(void *context, byte_ptr data, size_t len);
+
+/* A custom output encoder (see rosie_register_encoder) is given the
+ * input and its byte-encoded match data, and writes its output with
+ * rosie_encoder_write().  It returns SUCCESS, or an error code that is
+ * returned to the client.  An encoder registered with a pool, or with
+ * an engine that is cloned, is called by many threads at once, with
+ * the same userdata, so it must be reentrant and thread-safe.
+ */
+typedef struct rosie_encoder_output rosie_encoder_output;
+typedef int (*rosie_encoder)(void *userdata, str *input, str *matchdata, rosie_encoder_output *out);
+
+/* One capture of a match, as given by rosie_walk_match() */
+typedef struct rosie_capture {
+     str name;
+     str text;			/* the matched input, or the value of a constant capture */
+     int start;			/* 1-based position of the first byte matched */
+     int end;			/* 1-based position after the last byte matched */
+     int depth;			/* 0 for the whole match */
+} rosie_capture;
+
+/* A visitor returns zero to continue the walk */
+typedef int (*rosie_capture_visitor)(void *context, rosie_capture *capture);
+
 
 str rosie_new_string(byte_ptr msg, size_t len);
 str *rosie_new_string_ptr(byte_ptr msg, size_t len);
@@ -60,23 +97,71 @@ void rosie_free_string(str s);
 void rosie_free_string_ptr(str *s);
 
 Engine *rosie_new(str *messages);
+Engine *rosie_clone(Engine *e, str *messages);
 void rosie_finalize(Engine *e);
 int rosie_libpath(Engine *e, str *newpath);
 int rosie_alloc_limit(Engine *e, int *newlimit, int *usage);
+int rosie_alloc_cap(Engine *e, int *newcap, int *high_water);
 int rosie_config(Engine *e, str *retvals);
+int rosie_stats(Engine *e, str *stats);
 int rosie_compile(Engine *e, str *expression, int *pat, str *messages);
+int rosie_compile_projected(Engine *e, str *expression, int ncaptures, char **captures,
+			    int *pat, str *messages);
 int rosie_free_rplx(Engine *e, int pat);
+int rosie_rplx_share(Engine *src, int pat, Engine *dst, int *dst_pat);
 int rosie_match(Engine *e, int pat, int start, char *encoder, str *input, match *match);
+int rosie_match_into(Engine *e, int pat, int start, char *encoder, str *input, match *match,
+		     byte_ptr buffer, size_t bufsize, size_t *needed);
+int rosie_match_sink(Engine *e, int pat, int start, char *encoder, str *input, match *match,
+		     rosie_sink sink, void *context);
+int rosie_match_batch(Engine *e, int pat, char *encoder, int n,
+		      int *starts, str *inputs, match *matches);
 int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
 		    char *infilename, char *outfilename, char *errfilename,
 		    int *cin, int *cout, int *cerr,
 		    str *err);
+int rosie_match_columns(Engine *e, int pat, int ncols, char **names, int n,
+			int *starts, str *inputs, match *matches, str *block);
+int rosie_matchfile_columns(Engine *e, int pat, int ncols, char **names, int wholefileflag,
+			    char *infilename, char *outfilename, char *errfilename,
+			    int *cin, int *cout, int *cerr,
+			    str *err);
+int rosie_register_encoder(Engine *e, const char *name, rosie_encoder fn, void *userdata);
+int rosie_encoder_write(rosie_encoder_output *out, byte_ptr data, size_t len);
+int rosie_walk_match(str *input, str *matchdata, rosie_capture_visitor visitor, void *context);
 int rosie_trace(Engine *e, int pat, int start, char *trace_style, str *input, int *matched, str *trace);
 int rosie_load(Engine *e, int *ok, str *src, str *pkgname, str *messages);
 int rosie_loadfile(Engine *e, int *ok, str *fn, str *pkgname, str *messages);
 int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages);
 int rosie_read_rcfile(Engine *e, str *filename, int *file_exists, str *options);
 int rosie_execute_rcfile(Engine *e, str *filename, int *file_exists, int *no_errors);
+
+Pool *rosie_pool_new(int nthreads, str *messages);
+void rosie_pool_finalize(Pool *p);
+int rosie_pool_size(Pool *p);
+int rosie_pool_libpath(Pool *p, str *newpath);
+int rosie_pool_alloc_limit(Pool *p, int *newlimit, int *usage);
+int rosie_pool_alloc_cap(Pool *p, int *newcap, int *high_water);
+int rosie_pool_load(Pool *p, int *ok, str *src, str *pkgname, str *messages);
+int rosie_pool_loadfile(Pool *p, int *ok, str *fn, str *pkgname, str *messages);
+int rosie_pool_import(Pool *p, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages);
+int rosie_pool_replay(Pool *p, Engine *e, int *ok, str *messages);
+int rosie_pool_compile(Pool *p, str *expression, int *pat, str *messages);
+int rosie_pool_compile_projected(Pool *p, str *expression, int ncaptures, char **captures,
+				 int *pat, str *messages);
+int rosie_pool_free_rplx(Pool *p, int pat);
+int rosie_pool_match(Pool *p, int pat, int start, char *encoder, str *input, match *match);
+int rosie_pool_match_batch(Pool *p, int pat, char *encoder, int n,
+			   int *starts, str *inputs, match *matches);
+int rosie_pool_matchfile(Pool *p, int pat, char *encoder, int wholefileflag,
+			 char *infilename, char *outfilename, char *errfilename,
+			 int *cin, int *cout, int *cerr,
+			 str *err);
+int rosie_pool_register_encoder(Pool *p, const char *name, rosie_encoder fn, void *userdata);
+int rosie_pool_stats(Pool *p, str *stats);
+int rosie_pool_submit(Pool *p, int pat, int start, char *encoder, str *input, void *tag);
+int rosie_pool_poll(Pool *p, int max, rosie_completion *completions, int *n);
+int rosie_pool_completion_fd(Pool *p, int *fd);
 /*
 
 Administrative:
@@ -85,8 +170,13 @@ Administrative:
 +  status:int, desc:string = config(void *engine)
 *  status:int = setlibpath(void *engine, const char *libpath)
 +  set soft memory limit to m MB, with optional logging of when it is hit
++  set hard memory cap to m MB (alloc_cap)
   logging level (to stderr)?
-  clone an engine?  (to avoid setup cost; but cloned engine must be in new Lua state)
++  engine:void* = clone(void *engine)
++  status:int, stats:string = stats(void *engine)
++  pool:void* = pool_new(int nthreads)
++  pool_finalize(void *pool)
++  status:int, stats:string = pool_stats(void *pool)
 
 
 RPL:
@@ -98,9 +188,25 @@ RPL:
 
 Match/trace:
 +  status:int, pat:int, errors:strings = compile(void *engine, const char *expression)
++  status:int, pat:int, errors:strings = compile_projected(void *engine, const char *expression,
+		int ncaptures, char **captures)
 +  status:int = free_rplx(void *engine, int pat)
++  status:int, dst_pat:int = rplx_share(void *src_engine, int pat, void *dst_engine)
 +  status:int = match(void *engine, int pat, int start, str *encoder,
 		str *input, match *match);
++  status:int = match_into(void *engine, int pat, int start, str *encoder,
+		str *input, match *match, byte *buffer, size_t bufsize, size_t *needed);
++  status:int = match_sink(void *engine, int pat, int start, str *encoder,
+		str *input, match *match, sink_fn sink, void *context);
++  status:int = match_batch(void *engine, int pat, str *encoder, int n,
+		int *starts, str *inputs, match *matches);
++  status:int, block:buffer = match_columns(void *engine, int pat, int ncols, char **names, int n,
+		int *starts, str *inputs, match *matches);
++  status:int = pool_submit(void *pool, int pat, int start, str *encoder, str *input, void *tag)
++  status:int, n:int = pool_poll(void *pool, int max, completion *completions)
++  status:int, fd:int = pool_completion_fd(void *pool)
++  status:int = register_encoder(void *engine, const char *name, encoder_fn fn, void *userdata)
++  status:int = walk_match(str *input, str *matchdata, visitor_fn visitor, void *context)
 +  status:int, tracestring:*buffer = trace(void *engine, int pat, buffer *input, int start, int encoder, int tracestyle)
 
   status:int, cin:int, cout:int, cerr:int, errors:strings =
@@ -108,6 +214,10 @@ Match/trace:
        const char *infilename, const char *outfilename, const char *errfilename, 
        int start, int encoder, int wholefile)
 
++  status:int, cin:int, cout:int, cerr:int, errors:strings =
+    matchfile_columns(void *engine, int pat, int ncols, char **names, int wholefile,
+       const char *infilename, const char *outfilename, const char *errfilename)
+
   status:int, cin:int, cout:int, cerr:int, errors:strings =
     tracefile(void *engine, void pat, 
        const char *infilename, const char *outfilename, const char *errfilename, 
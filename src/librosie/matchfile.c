@@ -0,0 +1,500 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  matchfile.c  Part of librosie.c                                          */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Native matchfile loop
+ *
+ * When the output encoder needs no Lua processing (see
+ * encoder_name_to_code()), rosie_matchfile() does not go through
+ * engine_process_file(), which makes a Lua string for every line of
+ * input and does a write for every result.  Instead, the input file
+ * is mapped into memory (or, when it cannot be mapped, as with a
+ * pipe, it is read in large chunks), newlines are found with
+ * memchr(), and each line is matched in place by r_match_C().
+ * Results are collected in large buffers, which are written out with
+ * write(2) when they fill up.
+ *
+ * The output and the counts are the same as engine_process_file()
+ * produces: a line ends with a newline, and a final line that has no
+ * newline is matched if it is not empty.
+ *
+ * rosie_matchfile_columns() uses the same loop, and writes blocks of
+ * columns (see columns.c) instead of a line for each match.
+ *
+ * When the output (or error) file name is NULL, no file is opened,
+ * and the matches (or the lines that did not match) are only counted.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MATCHFILE_CHUNK_SIZE (1024 * 1024) /* bytes read at once when input is not mapped */
+#define MATCHFILE_OUTBUF_SIZE (256 * 1024) /* output is written in blocks about this size */
+
+typedef struct line_buffer {
+  char *ptr;
+  size_t len;
+  size_t size;
+  int fd;			/* when not -1, flush to fd when full */
+  int discard;			/* when set, lines are counted but not kept */
+} line_buffer;
+
+typedef struct matchfile_state {
+  int encoder;			/* must be non-zero (see r_match_C) */
+  custom_encoder *custom;	/* when set, encoder is the byte encoder */
+  columns *cols;		/* when set, out gets blocks of columns (see columns.c) */
+  int blocks;			/* the number of blocks written */
+  int wholefileflag;		/* when set, input is one item */
+  str input;			/* the lines to be matched */
+  line_buffer out, err;		/* match data, and the lines that did not match */
+  int nin, nout, nerr;		/* on error, nin is -1 and nout has the error code */
+  int status;			/* SUCCESS, or the error from writing output */
+  prefilter pf;			/* lines without a required literal are not matched */
+} matchfile_state;
+
+static int write_all(int fd, const char *data, size_t len) {
+  ssize_t n;
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return ERR_SYSCALL_FAILED;
+    }
+    data += n;
+    len -= n;
+  }
+  return SUCCESS;
+}
+
+static int buffer_flush(line_buffer *b) {
+  int r = SUCCESS;
+  if ((b->fd != -1) && (b->len > 0)) r = write_all(b->fd, b->ptr, b->len);
+  b->len = 0;
+  return r;
+}
+
+/* Append data and a newline */
+static int buffer_add_line(line_buffer *b, const char *data, size_t len) {
+  if (b->discard) return SUCCESS;
+  if ((b->fd != -1) && (b->len + len + 1 > MATCHFILE_OUTBUF_SIZE)) {
+    int r = buffer_flush(b);
+    if (r != SUCCESS) return r;
+  }
+  if (b->len + len + 1 > b->size) {
+    size_t newsize = b->size ? b->size : ((b->fd != -1) ? MATCHFILE_OUTBUF_SIZE : 4096);
+    while (b->len + len + 1 > newsize) newsize *= 2;
+    char *newptr = realloc(b->ptr, newsize);
+    if (!newptr) return ERR_OUT_OF_MEMORY;
+    b->ptr = newptr;
+    b->size = newsize;
+  }
+  memcpy(b->ptr + b->len, data, len);
+  b->ptr[b->len + len] = '\n';
+  b->len += len + 1;
+  return SUCCESS;
+}
+
+/* Write the columns collected so far to s->out as one block */
+static int columns_flush(matchfile_state *s) {
+  size_t size = columns_size(s->cols);
+  if (size > UINT32_MAX) return ERR_OUT_OF_MEMORY;
+  if (size > s->out.size) {
+    char *newptr = realloc(s->out.ptr, size);
+    if (!newptr) return ERR_OUT_OF_MEMORY;
+    s->out.ptr = newptr;
+    s->out.size = size;
+  }
+  columns_write(s->cols, s->out.ptr);
+  s->out.len = size;
+  columns_clear(s->cols);
+  s->blocks++;
+  return buffer_flush(&s->out);
+}
+
+/* Returns FALSE when matching should stop */
+static int matchfile_line(lua_State *L, matchfile_state *s, char *data, size_t len) {
+  int t, code;
+  rBuffer *buf;
+  str line;
+  if (len > UINT32_MAX) return luaL_error(L, "input line too long");
+  line.ptr = (byte_ptr) data;
+  line.len = (uint32_t) len;
+  if (!prefilter_pass(&s->pf, line.ptr, len, 1)) {
+    s->status = buffer_add_line(&s->err, data, len);
+    s->nerr++;
+    s->nin++;
+    return (s->status == SUCCESS);
+  }
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushlightuserdata(L, &line);
+  lua_pushinteger(L, 1);
+  lua_pushinteger(L, s->encoder);
+  lua_call(L, 4, 5);
+  lua_pop(L, 4);
+  t = lua_type(L, -1);
+  switch (t) {
+  case LUA_TUSERDATA: {
+    if (s->cols) {
+      buf = lua_touserdata(L, -1);
+      code = columns_add(s->cols, s->nin, &line, buf->data, buf->n);
+      if (code != SUCCESS) {
+	s->nin = -1;
+	s->nout = code;
+	lua_pop(L, 1);
+	return FALSE;
+      }
+      if (columns_size(s->cols) >= MATCHFILE_OUTBUF_SIZE) s->status = columns_flush(s);
+    } else if (s->custom && !s->out.discard) {
+      code = custom_encode(L, s->custom, &line);
+      if (code != SUCCESS) {
+	s->nin = -1;
+	s->nout = code;
+	lua_pop(L, 1);
+	return FALSE;
+      }
+      s->status = buffer_add_line(&s->out, s->custom->out.ptr ? s->custom->out.ptr : "",
+				  s->custom->out.len);
+    } else {
+      buf = lua_touserdata(L, -1);
+      s->status = buffer_add_line(&s->out, buf->data, buf->n);
+    }
+    s->nout++;
+    break;
+  }
+  case LUA_TNUMBER: {
+    code = lua_tointeger(L, -1);
+    if (code == 0) {
+      s->status = buffer_add_line(&s->err, data, len);
+      s->nerr++;
+    } else if (code == MATCH_WITHOUT_DATA) {
+      /* Like engine_process_file(), which writes the code returned by the encoder */
+      s->status = buffer_add_line(&s->out, "1", 1);
+      s->nout++;
+    } else {
+      s->nin = -1;
+      s->nout = code;
+      lua_pop(L, 1);
+      return FALSE;
+    }
+    break;
+  }
+  default:
+    return luaL_error(L, "invalid return type from rmatch (%d)", t);
+  }
+  lua_pop(L, 1);
+  s->nin++;
+  return (s->status == SUCCESS);
+}
+
+/* Called (via lua_pcall) with this stack:
+ *   1: r_match_C
+ *   2: the peg
+ *   3: lightuserdata pointing to the matchfile_state
+ */
+static int matchfile_C(lua_State *L) {
+  matchfile_state *s = lua_touserdata(L, 3);
+  char *pos = (char *) s->input.ptr;
+  char *end = pos + s->input.len;
+  char *nl;
+  if (s->wholefileflag) {
+    matchfile_line(L, s, pos, s->input.len);
+    return 0;
+  }
+  while (pos < end) {
+    nl = memchr(pos, '\n', end - pos);
+    if (!matchfile_line(L, s, pos, (nl ? nl : end) - pos)) break;
+    pos = nl ? nl + 1 : end;
+  }
+  return 0;
+}
+
+/* Push the peg for pattern pat, or return FALSE if there is none.
+ * When pf is not NULL, it is set to the prefilter of pat.
+ */
+static int push_peg(lua_State *L, int pat, prefilter *pf) {
+  int t;
+  if (!pat) return FALSE;
+  get_registry(rplx_table_key);
+  t = lua_rawgeti(L, -1, pat);
+  lua_remove(L, -2);
+  if (t != LUA_TTABLE) {
+    lua_pop(L, 1);
+    return FALSE;
+  }
+  if (pf) prefilter_get(L, -1, pf);
+  t = lua_getfield(L, -1, "pattern");
+  CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
+  t = lua_getfield(L, -1, "peg");
+  CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return TRUE;
+}
+
+/* Match the lines in s->input with the peg on top of the stack, which
+ * is popped.  The caller holds the engine lock.
+ */
+static int match_lines(lua_State *L, matchfile_state *s) {
+  int t;
+  lua_pushcfunction(L, matchfile_C);
+  lua_insert(L, -2);
+  lua_pushcfunction(L, r_match_C);
+  lua_insert(L, -2);
+  lua_pushlightuserdata(L, s);
+  t = capped_pcall(L, 3, 0, 0);
+  if (t != LUA_OK) {
+    LOG("matchfile loop failed\n");
+    LOGstack(L);
+    lua_pop(L, 1);
+    return (t == LUA_ERRMEM) ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;
+  }
+  return s->status;
+}
+
+/* Read the next chunk of input into a new buffer.  A chunk ends with
+ * a newline, unless it is the last one.  The bytes read after the
+ * last newline are kept in carry, to start the next chunk.  At the end
+ * of the input, the chunk is empty.
+ */
+static int read_chunk(int fd, line_buffer *carry, str *chunk, int *eof) {
+  ssize_t n;
+  char *nl = NULL;
+  size_t len = carry->len;
+  size_t size = (len < MATCHFILE_CHUNK_SIZE) ? MATCHFILE_CHUNK_SIZE : 2 * len;
+  char *buf = malloc(size);
+  if (!buf) return ERR_OUT_OF_MEMORY;
+  if (len) memcpy(buf, carry->ptr, len);
+  carry->len = 0;
+  for (;;) {
+    while (!*eof && (len < size)) {
+      n = read(fd, buf + len, size - len);
+      if (n < 0) {
+	if (errno == EINTR) continue;
+	free(buf);
+	return ERR_SYSCALL_FAILED;
+      }
+      if (n == 0) *eof = TRUE;
+      len += n;
+    }
+    if (*eof) break;
+    /* memrchr() is not available everywhere */
+    for (nl = buf + len; (nl > buf) && (*(nl - 1) != '\n'); nl--);
+    if (nl > buf) {
+      nl--;
+      break;
+    }
+    nl = NULL;
+    /* No newline yet, so the current line is longer than the buffer */
+    char *newbuf = realloc(buf, 2 * size);
+    if (!newbuf) {
+      free(buf);
+      return ERR_OUT_OF_MEMORY;
+    }
+    buf = newbuf;
+    size = 2 * size;
+  }
+  if (nl) {
+    size_t keep = (nl + 1) - buf;
+    if (len - keep > carry->size) {
+      char *newcarry = realloc(carry->ptr, len - keep);
+      if (!newcarry) {
+	free(buf);
+	return ERR_OUT_OF_MEMORY;
+      }
+      carry->ptr = newcarry;
+      carry->size = len - keep;
+    }
+    memcpy(carry->ptr, buf + keep, len - keep);
+    carry->len = len - keep;
+    len = keep;
+  }
+  chunk->ptr = (byte_ptr) buf;
+  chunk->len = len;
+  return SUCCESS;
+}
+
+/* Read all of the input into a new buffer */
+static int read_all(int fd, str *input) {
+  ssize_t n;
+  size_t len = 0, size = MATCHFILE_CHUNK_SIZE;
+  char *newbuf, *buf = malloc(size);
+  if (!buf) return ERR_OUT_OF_MEMORY;
+  for (;;) {
+    if (len == size) {
+      newbuf = realloc(buf, 2 * size);
+      if (!newbuf) {
+	free(buf);
+	return ERR_OUT_OF_MEMORY;
+      }
+      buf = newbuf;
+      size = 2 * size;
+    }
+    n = read(fd, buf + len, size - len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      free(buf);
+      return ERR_SYSCALL_FAILED;
+    }
+    if (n == 0) break;
+    len += n;
+  }
+  input->ptr = (byte_ptr) buf;
+  input->len = len;
+  return SUCCESS;
+}
+
+/* The peg is on top of the stack, and the input is read from infd.
+ * A regular file is mapped, and matched in one pass.  Other input is
+ * matched a chunk at a time.
+ */
+static int matchfile_fd(lua_State *L, matchfile_state *s, int infd) {
+  struct stat st;
+  void *mapping;
+  int eof = FALSE, r = SUCCESS;
+  line_buffer carry = {NULL, 0, 0, -1};
+  if ((fstat(infd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, infd, 0);
+    if (mapping != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+#endif
+      s->input.ptr = mapping;
+      s->input.len = st.st_size;
+      if ((off_t) s->input.len != st.st_size) {
+	/* Too large for one str, so fall through to chunked reading */
+	munmap(mapping, st.st_size);
+      } else {
+	r = match_lines(L, s);
+	munmap(mapping, st.st_size);
+	return r;
+      }
+    }
+  }
+  if (s->wholefileflag) {
+    r = read_all(infd, &s->input);
+    if (r != SUCCESS) {
+      lua_pop(L, 1);
+      return r;
+    }
+    r = match_lines(L, s);
+    free(s->input.ptr);
+    return r;
+  }
+  while ((r == SUCCESS) && (s->nin != -1)) {
+    r = read_chunk(infd, &carry, &s->input, &eof);
+    if (r != SUCCESS) break;
+    if (s->input.len == 0) {
+      free(s->input.ptr);
+      break;
+    }
+    lua_pushvalue(L, -1);
+    r = match_lines(L, s);
+    free(s->input.ptr);
+  }
+  free(carry.ptr);
+  lua_pop(L, 1);
+  return r;
+}
+
+static int matchfile_no_file(char *filename, int *cin, int *cout, str *err) {
+  char msg[MAXPATHLEN + 16];
+  int len = snprintf(msg, sizeof(msg), "No such file %s", filename);
+  (*cin) = -1;
+  (*cout) = ERR_NO_FILE;
+  *err = rosie_new_string((byte_ptr) msg, (len < (int) sizeof(msg)) ? len : (int) sizeof(msg) - 1);
+  return SUCCESS;
+}
+
+/* Open the files named, where an empty name means stdin, stdout, or
+ * stderr, as with engine_process_file().  When outfilename or
+ * errfilename is NULL, its file descriptor is -1.  Returns FALSE,
+ * after setting the counts and err, if a file cannot be opened.
+ */
+static int matchfile_open(char *infilename, char *outfilename, char *errfilename,
+			  int *infd, int *outfd, int *errfd,
+			  int *cin, int *cout, str *err) {
+  *infd = *infilename ? open(infilename, O_RDONLY) : STDIN_FILENO;
+  if (*infd < 0) {
+    matchfile_no_file(infilename, cin, cout, err);
+    return FALSE;
+  }
+  *outfd = -1;
+  if (outfilename) {
+    *outfd = *outfilename ? open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+    if (*outfd < 0) {
+      if (*infd != STDIN_FILENO) close(*infd);
+      matchfile_no_file(outfilename, cin, cout, err);
+      return FALSE;
+    }
+  }
+  *errfd = -1;
+  if (errfilename) {
+    *errfd = *errfilename ? open(errfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDERR_FILENO;
+    if (*errfd < 0) {
+      if (*infd != STDIN_FILENO) close(*infd);
+      if ((*outfd != STDOUT_FILENO) && (*outfd != -1)) close(*outfd);
+      matchfile_no_file(errfilename, cin, cout, err);
+      return FALSE;
+    }
+  }
+  /* We write to the file descriptors directly */
+  fflush(stdout);
+  fflush(stderr);
+  return TRUE;
+}
+
+static void matchfile_close(int infd, int outfd, int errfd) {
+  if (infd != STDIN_FILENO) close(infd);
+  if ((outfd != STDOUT_FILENO) && (outfd != -1)) close(outfd);
+  if ((errfd != STDERR_FILENO) && (errfd != -1)) close(errfd);
+}
+
+/* Called by rosie_matchfile() and rosie_matchfile_columns(), with the
+ * engine locked and the peg on top of the stack.  The literals of pf
+ * must stay alive during the call.
+ */
+static int matchfile_native(lua_State *L, int encoder, custom_encoder *custom, columns *cols,
+			    prefilter *pf, int wholefileflag,
+			    char *infilename, char *outfilename, char *errfilename,
+			    int *cin, int *cout, int *cerr,
+			    str *err) {
+  int r, infd, outfd, errfd;
+  matchfile_state s;
+  if (!matchfile_open(infilename, outfilename, errfilename,
+		      &infd, &outfd, &errfd, cin, cout, err)) {
+    lua_pop(L, 1);
+    return SUCCESS;
+  }
+  memset(&s, 0, sizeof(matchfile_state));
+  s.encoder = encoder;
+  s.custom = custom;
+  s.cols = cols;
+  s.pf = *pf;
+  s.wholefileflag = wholefileflag;
+  s.out.fd = outfd;
+  s.out.discard = (outfd == -1);
+  s.err.fd = errfd;
+  s.err.discard = (errfd == -1);
+  r = matchfile_fd(L, &s, infd);
+  /* The last block, which is written even when empty if it is the only one */
+  if (cols && (r == SUCCESS) && (s.nin != -1) && (columns_count(cols) || !s.blocks))
+    r = columns_flush(&s);
+  if (r == SUCCESS) r = buffer_flush(&s.out);
+  if (r == SUCCESS) r = buffer_flush(&s.err);
+  free(s.out.ptr);
+  free(s.err.ptr);
+  matchfile_close(infd, outfd, errfd);
+  (*cin) = s.nin;
+  (*cout) = s.nout;
+  (*cerr) = s.nerr;
+  pf->rejected = s.pf.rejected;
+  return r;
+}
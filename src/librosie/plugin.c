@@ -0,0 +1,240 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  plugin.c  Part of librosie.c                                             */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Custom output encoders
+ *
+ * An output encoder written in Lua (see common.add_encoder) is called
+ * through rplx.Cmatch for every match.  A client that needs its own
+ * output format can instead register a C function with an engine,
+ * using rosie_register_encoder().  The encoder is then used by name,
+ * like the built-in encoders, in rosie_match() (and _into and _sink),
+ * rosie_match_batch(), rosie_matchfile(), and the pool functions.
+ *
+ * The pattern is matched with the "byte" encoder, and the callback is
+ * given the input and the byte-encoded match data (the format is
+ * described in encode.c).  It can read the match data directly, or
+ * call rosie_walk_match() to visit each capture in order, with its
+ * name, position, and text.  It writes its output with
+ * rosie_encoder_write(), into a buffer that is reused from one match
+ * to the next.
+ *
+ * The callback runs while the engine is locked, so it must not call
+ * into the same engine.  A registered name hides a built-in or Lua
+ * encoder of the same name.
+ *
+ * Only one thread at a time uses an engine, but the engines of a pool
+ * (see rosie_pool_register_encoder) and the clones of an engine (see
+ * clone.c) share the callback and its userdata, and run in parallel.
+ * Such a callback must be reentrant and thread-safe, e.g. it must not
+ * change state in userdata without locking.  Its output buffer
+ * belongs to the engine, so writing output needs no locking.
+ */
+
+struct rosie_encoder_output {
+  char *ptr;
+  size_t len;
+  size_t size;
+  int status;			/* ERR_OUT_OF_MEMORY after a failed write */
+};
+
+typedef struct custom_encoder {
+  char name[MAX_ENCODER_NAME_LENGTH + 1];
+  rosie_encoder fn;
+  void *userdata;
+  rosie_encoder_output out;
+  struct custom_encoder *next;
+} custom_encoder;
+
+static custom_encoder *find_custom_encoder(Engine *e, const char *name) {
+  custom_encoder *c;
+  if (!name) return NULL;
+  for (c = e->encoders; c; c = c->next)
+    if (!strncmp(name, c->name, MAX_ENCODER_NAME_LENGTH)) return c;
+  return NULL;
+}
+
+/* Called with the engine lock held */
+static int register_encoder(Engine *e, const char *name, rosie_encoder fn, void *userdata) {
+  custom_encoder *c = find_custom_encoder(e, name);
+  if (!c) {
+    c = calloc(1, sizeof(custom_encoder));
+    if (!c) return ERR_OUT_OF_MEMORY;
+    strcpy(c->name, name);
+    c->next = e->encoders;
+    e->encoders = c;
+  }
+  c->fn = fn;
+  c->userdata = userdata;
+  return SUCCESS;
+}
+
+static void free_custom_encoders(Engine *e) {
+  custom_encoder *c, *next;
+  for (c = e->encoders; c; c = next) {
+    next = c->next;
+    free(c->out.ptr);
+    free(c);
+  }
+  e->encoders = NULL;
+}
+
+/* Give clone the encoders registered with e, which the caller has locked */
+static int clone_custom_encoders(Engine *e, Engine *clone) {
+  custom_encoder *c;
+  int r;
+  for (c = e->encoders; c; c = c->next) {
+    r = register_encoder(clone, c->name, c->fn, c->userdata);
+    if (r != SUCCESS) return r;
+  }
+  return SUCCESS;
+}
+
+/* Run the encoder c on the byte-encoded match data in the rBuffer on
+ * the top of the stack.  On SUCCESS, the output is in c->out.
+ */
+static int custom_encode(lua_State *L, custom_encoder *c, str *input) {
+  int r;
+  str matchdata;
+  rBuffer *buf = lua_touserdata(L, -1);
+  matchdata.ptr = (byte_ptr) buf->data;
+  matchdata.len = buf->n;
+  c->out.len = 0;
+  c->out.status = SUCCESS;
+  r = c->fn(c->userdata, input, &matchdata, &(c->out));
+  return (r != SUCCESS) ? r : c->out.status;
+}
+
+/* Like custom_encode(), but replace the match data on the top of the
+ * stack with a Lua string holding the output
+ */
+static int custom_encode_to_string(lua_State *L, custom_encoder *c, str *input) {
+  int r = custom_encode(L, c, input);
+  if (r != SUCCESS) return r;
+  lua_pop(L, 1);
+  lua_pushlstring(L, c->out.ptr ? c->out.ptr : "", c->out.len);
+  return SUCCESS;
+}
+
+/* Register fn as the output encoder called name in engine e.  A NULL
+ * fn removes the encoder of that name.  Returns ERR_NO_ENCODER when
+ * the name is empty or longer than MAX_ENCODER_NAME_LENGTH.
+ */
+EXPORT
+int rosie_register_encoder(Engine *e, const char *name, rosie_encoder fn, void *userdata) {
+  int r = SUCCESS;
+  custom_encoder **prev, *c;
+  if (!name || !*name || (strnlen(name, MAX_ENCODER_NAME_LENGTH + 1) > MAX_ENCODER_NAME_LENGTH))
+    return ERR_NO_ENCODER;
+  ACQUIRE_ENGINE_LOCK(e);
+  if (fn) {
+    r = register_encoder(e, name, fn, userdata);
+  } else {
+    for (prev = &(e->encoders); (c = *prev); prev = &(c->next)) {
+      if (!strcmp(name, c->name)) {
+	*prev = c->next;
+	free(c->out.ptr);
+	free(c);
+	break;
+      }
+    }
+  }
+  RELEASE_ENGINE_LOCK(e);
+  return r;
+}
+
+/* Append data to the output of a custom encoder */
+EXPORT
+int rosie_encoder_write(rosie_encoder_output *out, byte_ptr data, size_t len) {
+  if (out->status != SUCCESS) return out->status;
+  if (out->len + len > out->size) {
+    size_t newsize = out->size ? out->size : 256;
+    while (out->len + len > newsize) newsize *= 2;
+    char *newptr = realloc(out->ptr, newsize);
+    if (!newptr) return (out->status = ERR_OUT_OF_MEMORY);
+    out->ptr = newptr;
+    out->size = newsize;
+  }
+  memcpy(out->ptr + out->len, data, len);
+  out->len += len;
+  return SUCCESS;
+}
+
+/* Call visitor for each capture in the byte-encoded matchdata, in the
+ * order in which they start (the whole match first).  Returns SUCCESS
+ * after visiting every capture, the first non-zero value returned by
+ * visitor, or ERR_BAD_MATCH_DATA.
+ */
+
+#define WALK_STACK_CAPTURES 64	/* walks with more captures than this use malloc */
+
+EXPORT
+int rosie_walk_match(str *input, str *matchdata, rosie_capture_visitor visitor, void *context) {
+  capture_reader r;
+  capture_node node;
+  rosie_capture stack_captures[WALK_STACK_CAPTURES], *captures = stack_captures;
+  int stack_open[WALK_STACK_CAPTURES], *open = stack_open;
+  int n = 0, nopen = 0, i, result = SUCCESS;
+  int32_t pos;
+  /* Count the captures */
+  r.pos = (const char *) matchdata->ptr;
+  r.end = r.pos + matchdata->len;
+  while (r.pos < r.end) {
+    if (sub_follows(&r)) {
+      if (!read_node_header(&r, &node)) return ERR_BAD_MATCH_DATA;
+      n++;
+    } else if (!read_int32(&r, &pos)) {
+      return ERR_BAD_MATCH_DATA;
+    }
+  }
+  if (n > WALK_STACK_CAPTURES) {
+    captures = malloc(n * sizeof(rosie_capture));
+    open = malloc(n * sizeof(int));
+    if (!captures || !open) {
+      result = ERR_OUT_OF_MEMORY;
+      goto done;
+    }
+  }
+  /* Fill in each capture, setting its end and text when it closes */
+  r.pos = (const char *) matchdata->ptr;
+  for (i = 0; r.pos < r.end; ) {
+    if (sub_follows(&r)) {
+      read_node_header(&r, &node);
+      captures[i].name.ptr = (byte_ptr) node.name;
+      captures[i].name.len = node.namelen;
+      captures[i].text.ptr = (byte_ptr) node.data;
+      captures[i].text.len = node.datalen;
+      captures[i].start = node.s;
+      captures[i].depth = nopen;
+      open[nopen++] = i++;
+    } else {
+      read_int32(&r, &pos);
+      if ((nopen == 0) || (pos < captures[open[nopen-1]].start) || ((uint32_t) (pos - 1) > input->len)) {
+	result = ERR_BAD_MATCH_DATA;
+	goto done;
+      }
+      rosie_capture *c = &captures[open[--nopen]];
+      c->end = pos;
+      if (!c->text.ptr) {
+	c->text.ptr = input->ptr + c->start - 1;
+	c->text.len = c->end - c->start;
+      }
+    }
+  }
+  if (nopen != 0) {
+    result = ERR_BAD_MATCH_DATA;
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    result = visitor(context, &captures[i]);
+    if (result) break;
+  }
+ done:
+  if (captures != stack_captures) free(captures);
+  if (open != stack_open) free(open);
+  return result;
+}
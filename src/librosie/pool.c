@@ -0,0 +1,1028 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  pool.c  Part of librosie.c                                               */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Engine pools
+ *
+ * A pool owns N worker threads, and each worker owns one engine.
+ * RPL is loaded/imported into every engine in the pool.  A pattern is
+ * compiled by one engine and shared with the others (see share.c),
+ * and the client gets back a single pool-wide handle.
+ *
+ * Work is dispatched through one deque per worker.  Submitted jobs
+ * are spread round-robin across the deques.  A worker takes jobs
+ * from the head of its own deque, and when that is empty, it steals
+ * from the tail of another worker's deque.  Owner and thieves work
+ * at opposite ends, so they rarely contend for the same job, and a
+ * burst of work landing on one deque is quickly spread over all of
+ * the workers.
+ *
+ * The pool functions are synchronous: each returns when its work is
+ * done.  Many client threads may call into the same pool at once.
+ * Unlike rosie_match(), the match data returned by the pool functions
+ * is a fresh copy which the client must free.  For asynchronous
+ * matching, see async.c.
+ */
+
+#include <time.h>
+
+#define POOL_INITIAL_QUEUE 16
+#define POOL_INITIAL_PATS 32
+#define POOL_BATCH_CHUNKS_PER_WORKER 4
+#define POOL_CHUNKS_PER_WORKER 2	/* matchfile jobs in flight per worker */
+
+enum pool_job_kind {
+  POOL_JOB_MATCH,
+  POOL_JOB_MATCH_BATCH,
+  POOL_JOB_MATCHFILE,
+  POOL_JOB_MATCHCHUNK,
+};
+
+typedef struct pool_job {
+  enum pool_job_kind kind;
+  int *pats;			/* per-worker pattern handles */
+  char *encoder;
+  int start;
+  str *input;
+  match *match;
+  int n;			/* batch: number of inputs */
+  int *starts;			/* batch: NULL means start at 1 */
+  str *inputs;
+  match *matches;
+  int wholefileflag;		/* matchfile arguments */
+  char *infilename, *outfilename, *errfilename;
+  int *cin, *cout, *cerr;
+  str *err;
+  matchfile_state lines;	/* matchchunk input, results, and counts */
+  int status;			/* return code from the librosie call */
+  int done;
+  pthread_cond_t *finished;	/* signaled (under pool lock) when done */
+  void (*complete)(struct rosie_pool *p, struct pool_job *job); /* if set, called instead */
+} pool_job;
+
+typedef struct pool_worker {
+  int id;
+  struct rosie_pool *pool;
+  Engine *engine;
+  pthread_t thread;
+  pthread_mutex_t qlock;	/* protects the deque and the counters */
+  pool_job **queue;		/* circular buffer */
+  int qhead, qcount, qcap;
+  uint64_t jobs, stolen;
+  uint64_t busy_ns, idle_ns;
+} pool_worker;
+
+struct rosie_pool {
+  int n;
+  pool_worker *workers;
+  pthread_mutex_t lock;		/* protects everything below */
+  pthread_cond_t work_available;
+  int pending;			/* jobs submitted but not yet taken */
+  int shutdown;
+  unsigned int next;		/* round-robin submission */
+  int **pats;			/* pool handle -> per-worker handles */
+  int npats;
+  struct timespec created;
+  pthread_mutex_t async_lock;	/* protects the completion queue (see async.c) */
+  struct async_job *completed, *completed_tail;
+  int wakefd[2];		/* readable while completions are queued */
+};
+
+static void async_finalize(Pool *p); /* async.c */
+
+#define POOL_MUTEX_LOCK(m) do {					    \
+    int r = pthread_mutex_lock(m);				    \
+    if (r) {                                                        \
+        fprintf(stderr, "pthread_mutex_lock failed with %d\n", r);  \
+        abort();                                                    \
+    }                                                               \
+} while (0)
+#define POOL_MUTEX_UNLOCK(m) do {				    \
+    int r = pthread_mutex_unlock(m);				    \
+    if (r) {                                                        \
+        fprintf(stderr, "pthread_mutex_unlock failed with %d\n", r);\
+        abort();                                                    \
+    }                                                               \
+} while (0)
+
+/* Unlike the engine locks, these are not timed (see stats.c) */
+#define ACQUIRE_POOL_LOCK(p) POOL_MUTEX_LOCK(&((p)->lock))
+#define RELEASE_POOL_LOCK(p) POOL_MUTEX_UNLOCK(&((p)->lock))
+#define ACQUIRE_QUEUE_LOCK(w) POOL_MUTEX_LOCK(&((w)->qlock))
+#define RELEASE_QUEUE_LOCK(w) POOL_MUTEX_UNLOCK(&((w)->qlock))
+
+/* ----------------------------------------------------------------------------------------
+ * Deques
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Caller must hold w->qlock */
+static int queue_push(pool_worker *w, pool_job *job) {
+  if (w->qcount == w->qcap) {
+    int newcap = w->qcap * 2;
+    pool_job **newq = malloc(newcap * sizeof(pool_job *));
+    if (!newq) return ERR_OUT_OF_MEMORY;
+    for (int i = 0; i < w->qcount; i++)
+      newq[i] = w->queue[(w->qhead + i) % w->qcap];
+    free(w->queue);
+    w->queue = newq;
+    w->qhead = 0;
+    w->qcap = newcap;
+  }
+  w->queue[(w->qhead + w->qcount) % w->qcap] = job;
+  w->qcount++;
+  return SUCCESS;
+}
+
+static pool_job *queue_take_head(pool_worker *w) {
+  pool_job *job = NULL;
+  ACQUIRE_QUEUE_LOCK(w);
+  if (w->qcount > 0) {
+    job = w->queue[w->qhead];
+    w->qhead = (w->qhead + 1) % w->qcap;
+    w->qcount--;
+  }
+  RELEASE_QUEUE_LOCK(w);
+  return job;
+}
+
+static pool_job *queue_take_tail(pool_worker *w) {
+  pool_job *job = NULL;
+  ACQUIRE_QUEUE_LOCK(w);
+  if (w->qcount > 0) {
+    w->qcount--;
+    job = w->queue[(w->qhead + w->qcount) % w->qcap];
+  }
+  RELEASE_QUEUE_LOCK(w);
+  return job;
+}
+
+static pool_job *steal(pool_worker *w) {
+  Pool *p = w->pool;
+  pool_job *job;
+  for (int i = 1; i < p->n; i++) {
+    job = queue_take_tail(&p->workers[(w->id + i) % p->n]);
+    if (job) return job;
+  }
+  return NULL;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Workers
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Match each line of a chunk of input, producing the same output (and
+ * counts) that engine_process_file() does for those lines.  Encoders
+ * that need no Lua processing use the native loop from matchfile.c,
+ * and the others go through rosie_match_batch().  On error, nin is -1
+ * and nout has the error code, as with rosie_matchfile().
+ */
+static int match_chunk(Engine *e, int pat, pool_job *job) {
+  matchfile_state *s = &job->lines;
+  char *data = (char *) s->input.ptr;
+  char *end = data + s->input.len;
+  char *nl;
+  int i, r, n = 0;
+  s->out.fd = -1;
+  s->err.fd = -1;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  s->custom = find_custom_encoder(e, job->encoder);
+  s->encoder = encoder_name_to_code(s->custom ? "byte" : job->encoder);
+  if (s->encoder) {
+    collect_if_needed(e);
+    if (push_peg(L, pat, &s->pf)) {
+      r = match_lines(L, s);
+      stats_file(e->stats, s->nin, s->nout, s->nerr);
+      stats_prefiltered(e->stats, s->pf.rejected);
+    } else {
+      s->nin = -1;
+      s->nout = ERR_NO_PATTERN;
+      r = SUCCESS;
+    }
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return r;
+  }
+  RELEASE_ENGINE_LOCK(e);
+  for (char *pos = data; pos < end; n++) {
+    nl = memchr(pos, '\n', end - pos);
+    pos = nl ? nl + 1 : end;
+  }
+  str *lines = malloc(n * sizeof(str));
+  match *matches = malloc(n * sizeof(match));
+  if ((n > 0) && (!lines || !matches)) {
+    r = ERR_OUT_OF_MEMORY;
+    goto done;
+  }
+  char *pos = data;
+  for (i = 0; i < n; i++) {
+    nl = memchr(pos, '\n', end - pos);
+    lines[i].ptr = (byte_ptr) pos;
+    lines[i].len = (nl ? nl : end) - pos;
+    pos = nl ? nl + 1 : end;
+  }
+  r = rosie_match_batch(e, pat, job->encoder, n, NULL, lines, matches);
+  for (i = 0; (r == SUCCESS) && (i < n); i++) {
+    match *m = &matches[i];
+    if (m->data.ptr) {
+      r = buffer_add_line(&s->out, (char *) m->data.ptr, m->data.len);
+      s->nout++;
+    } else if (m->data.len == 0) {
+      r = buffer_add_line(&s->err, (char *) lines[i].ptr, lines[i].len);
+      s->nerr++;
+    } else if (m->data.len == MATCH_WITHOUT_DATA) {
+      /* Like engine_process_file(), which writes the code returned by the encoder */
+      r = buffer_add_line(&s->out, "1", 1);
+      s->nout++;
+    } else {
+      s->nin = -1;
+      s->nout = m->data.len;
+      goto done;
+    }
+    s->nin++;
+  }
+ done:
+  free(lines);
+  free(matches);
+  return r;
+}
+
+/* The match data returned by rosie_match() lives in the engine, and
+ * is overwritten by the next match, so the pool hands out copies.
+ */
+static void copy_match_data(match *m) {
+  if (m->data.ptr) {
+    str copy = rosie_new_string(m->data.ptr, m->data.len);
+    m->data = copy;
+    if (!copy.ptr) set_match_error(m, ERR_OUT_OF_MEMORY);
+  }
+}
+
+static void run_job(pool_worker *w, pool_job *job) {
+  int pat = job->pats[w->id];
+  switch (job->kind) {
+  case POOL_JOB_MATCH:
+    job->status = rosie_match(w->engine, pat, job->start, job->encoder, job->input, job->match);
+    if (job->status == SUCCESS) copy_match_data(job->match);
+    break;
+  case POOL_JOB_MATCH_BATCH:
+    job->status = rosie_match_batch(w->engine, pat, job->encoder, job->n,
+				    job->starts, job->inputs, job->matches);
+    if (job->status == SUCCESS)
+      for (int i = 0; i < job->n; i++) copy_match_data(&job->matches[i]);
+    break;
+  case POOL_JOB_MATCHFILE:
+    job->status = rosie_matchfile(w->engine, pat, job->encoder, job->wholefileflag,
+				  job->infilename, job->outfilename, job->errfilename,
+				  job->cin, job->cout, job->cerr, job->err);
+    break;
+  case POOL_JOB_MATCHCHUNK:
+    job->status = match_chunk(w->engine, pat, job);
+    break;
+  }
+}
+
+static void *worker_main(void *arg) {
+  pool_worker *w = (pool_worker *) arg;
+  Pool *p = w->pool;
+  pool_job *job;
+  int stolen;
+  uint64_t t0, t1;
+  for (;;) {
+    stolen = FALSE;
+    job = queue_take_head(w);
+    if (!job) {
+      job = steal(w);
+      stolen = (job != NULL);
+    }
+    if (job) {
+      ACQUIRE_POOL_LOCK(p);
+      p->pending--;
+      RELEASE_POOL_LOCK(p);
+      t0 = now_ns();
+      run_job(w, job);
+      t1 = now_ns();
+      ACQUIRE_QUEUE_LOCK(w);
+      w->jobs++;
+      if (stolen) w->stolen++;
+      w->busy_ns += t1 - t0;
+      RELEASE_QUEUE_LOCK(w);
+      if (job->complete) {
+	job->complete(p, job);
+	continue;
+      }
+      ACQUIRE_POOL_LOCK(p);
+      job->done = TRUE;
+      pthread_cond_broadcast(job->finished);
+      RELEASE_POOL_LOCK(p);
+      continue;
+    }
+    /* Nothing to do.  A job counted in 'pending' is in some deque,
+       or is about to be pushed onto one, so we only sleep when there
+       are none. */
+    t0 = now_ns();
+    ACQUIRE_POOL_LOCK(p);
+    while ((p->pending == 0) && !p->shutdown)
+      pthread_cond_wait(&p->work_available, &p->lock);
+    if (p->shutdown && (p->pending == 0)) {
+      RELEASE_POOL_LOCK(p);
+      break;
+    }
+    RELEASE_POOL_LOCK(p);
+    t1 = now_ns();
+    ACQUIRE_QUEUE_LOCK(w);
+    w->idle_ns += t1 - t0;
+    RELEASE_QUEUE_LOCK(w);
+  }
+  return NULL;
+}
+
+/* Queue one job.  The job's 'finished' condition or 'complete'
+ * function must be set.
+ */
+static int pool_submit(Pool *p, pool_job *job) {
+  int r, w;
+  job->done = FALSE;
+  /* Count the job before it is queued, so that the worker that takes
+     it can never see 'pending' go below zero */
+  ACQUIRE_POOL_LOCK(p);
+  w = p->next++ % p->n;
+  p->pending++;
+  RELEASE_POOL_LOCK(p);
+  ACQUIRE_QUEUE_LOCK(&p->workers[w]);
+  r = queue_push(&p->workers[w], job);
+  RELEASE_QUEUE_LOCK(&p->workers[w]);
+  ACQUIRE_POOL_LOCK(p);
+  if (r != SUCCESS) {
+    p->pending--;
+    RELEASE_POOL_LOCK(p);
+    return r;
+  }
+  pthread_cond_signal(&p->work_available);
+  RELEASE_POOL_LOCK(p);
+  return SUCCESS;
+}
+
+static void pool_wait(Pool *p, pool_job *job) {
+  ACQUIRE_POOL_LOCK(p);
+  while (!job->done) pthread_cond_wait(job->finished, &p->lock);
+  RELEASE_POOL_LOCK(p);
+}
+
+/* Queue the jobs and wait for all of them to finish */
+static int pool_run(Pool *p, pool_job *jobs, int njobs) {
+  pthread_cond_t finished;
+  int i, r = SUCCESS;
+  pthread_cond_init(&finished, NULL);
+  for (i = 0; i < njobs; i++) {
+    jobs[i].finished = &finished;
+    r = pool_submit(p, &jobs[i]);
+    /* The jobs already queued still refer to our caller's jobs */
+    if (r != SUCCESS) break;
+  }
+  njobs = i;
+  for (i = 0; i < njobs; i++) pool_wait(p, &jobs[i]);
+  pthread_cond_destroy(&finished);
+  return r;
+}
+
+/* Returns NULL for an invalid pool pattern handle */
+static int *pool_pats(Pool *p, int pat) {
+  int *pats = NULL;
+  ACQUIRE_POOL_LOCK(p);
+  if ((pat > 0) && (pat < p->npats)) pats = p->pats[pat];
+  RELEASE_POOL_LOCK(p);
+  return pats;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Exported functions
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* When nthreads is not positive, the pool has one worker per online
+ * cpu.  On failure, NULL is returned, and messages may explain why
+ * (in which case the client must free messages).
+ */
+EXPORT
+Pool *rosie_pool_new(int nthreads, str *messages) {
+  int i, r;
+  if (nthreads <= 0) nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0) nthreads = 1;
+  Pool *p = calloc(1, sizeof(Pool));
+  if (!p) {
+    *messages = rosie_new_string_from_const("not enough memory for pool");
+    return NULL;
+  }
+  p->n = nthreads;
+  p->npats = POOL_INITIAL_PATS;
+  p->pats = calloc(p->npats, sizeof(int *));
+  p->workers = calloc(nthreads, sizeof(pool_worker));
+  if (!p->pats || !p->workers) {
+    *messages = rosie_new_string_from_const("not enough memory for pool");
+    goto fail_pool;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_available, NULL);
+  pthread_mutex_init(&p->async_lock, NULL);
+  p->wakefd[0] = p->wakefd[1] = -1;
+  clock_gettime(CLOCK_MONOTONIC, &p->created);
+  for (i = 0; i < nthreads; i++) {
+    pool_worker *w = &p->workers[i];
+    w->id = i;
+    w->pool = p;
+    w->engine = rosie_new(messages);
+    if (!w->engine) {
+      LOGf("pool engine %d failed to initialize\n", i);
+      goto fail_engines;
+    }
+    w->qcap = POOL_INITIAL_QUEUE;
+    w->queue = malloc(w->qcap * sizeof(pool_job *));
+    if (!w->queue) {
+      rosie_finalize(w->engine);
+      *messages = rosie_new_string_from_const("not enough memory for pool");
+      goto fail_engines;
+    }
+    pthread_mutex_init(&w->qlock, NULL);
+  }
+  for (i = 0; i < nthreads; i++) {
+    r = pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]);
+    if (r) {
+      LOGf("pthread_create failed with %d\n", r);
+      *messages = rosie_new_string_from_const("could not create pool threads");
+      ACQUIRE_POOL_LOCK(p);
+      p->shutdown = TRUE;
+      pthread_cond_broadcast(&p->work_available);
+      RELEASE_POOL_LOCK(p);
+      while (i-- > 0) pthread_join(p->workers[i].thread, NULL);
+      i = nthreads;
+      goto fail_engines;
+    }
+  }
+  LOGf("Created pool %p with %d workers\n", (void *) p, nthreads);
+  return p;
+
+ fail_engines:
+  while (i-- > 0) {
+    rosie_finalize(p->workers[i].engine);
+    free(p->workers[i].queue);
+  }
+ fail_pool:
+  free(p->workers);
+  free(p->pats);
+  free(p);
+  return NULL;
+}
+
+EXPORT
+int rosie_pool_size(Pool *p) {
+  return p->n;
+}
+
+/* Get the libpath (when newpath->ptr is NULL) from the first engine,
+ * or set it in every engine.
+ */
+EXPORT
+int rosie_pool_libpath(Pool *p, str *newpath) {
+  int r;
+  if (!newpath->ptr) return rosie_libpath(p->workers[0].engine, newpath);
+  for (int i = 0; i < p->n; i++) {
+    r = rosie_libpath(p->workers[i].engine, newpath);
+    if (r != SUCCESS) return r;
+  }
+  return SUCCESS;
+}
+
+/* Registers the encoder in every engine.  The workers call fn with
+ * the same userdata, in parallel, so fn must be reentrant and
+ * thread-safe (see plugin.c).
+ */
+EXPORT
+int rosie_pool_register_encoder(Pool *p, const char *name, rosie_encoder fn, void *userdata) {
+  int r;
+  for (int i = 0; i < p->n; i++) {
+    r = rosie_register_encoder(p->workers[i].engine, name, fn, userdata);
+    if (r != SUCCESS) return r;
+  }
+  return SUCCESS;
+}
+
+/* Sets the limit in every engine, and reports the total usage */
+EXPORT
+int rosie_pool_alloc_limit(Pool *p, int *newlimit, int *usage) {
+  int r, limit = *newlimit, engine_usage;
+  *usage = 0;
+  for (int i = 0; i < p->n; i++) {
+    limit = *newlimit;
+    r = rosie_alloc_limit(p->workers[i].engine, &limit, &engine_usage);
+    if (r != SUCCESS) return r;
+    *usage += engine_usage;
+  }
+  *newlimit = limit;
+  return SUCCESS;
+}
+
+/* Sets the cap in every engine, and reports the total high water mark */
+EXPORT
+int rosie_pool_alloc_cap(Pool *p, int *newcap, int *high_water) {
+  int r, cap = *newcap, engine_high_water;
+  *high_water = 0;
+  for (int i = 0; i < p->n; i++) {
+    cap = *newcap;
+    r = rosie_alloc_cap(p->workers[i].engine, &cap, &engine_high_water);
+    if (r != SUCCESS) return r;
+    *high_water += engine_high_water;
+  }
+  *newcap = cap;
+  return SUCCESS;
+}
+
+/* The RPL functions below run in every engine.  The results reported
+ * are those of the first engine, unless some other engine failed, in
+ * which case its results are reported.
+ */
+
+/* Keep the outputs of the engine that is to be reported, and free the rest */
+static void pool_keep_outputs(int i, int *ok, int engine_ok,
+			      str *name, str *engine_name,
+			      str *messages, str *engine_messages) {
+  if ((i == 0) || (*ok && !engine_ok)) {
+    if (i != 0) {
+      rosie_free_string(*name);
+      rosie_free_string(*messages);
+    }
+    *ok = engine_ok;
+    *name = *engine_name;
+    *messages = *engine_messages;
+  } else {
+    rosie_free_string(*engine_name);
+    rosie_free_string(*engine_messages);
+  }
+}
+
+/* N.B. Client must free 'messages' */
+EXPORT
+int rosie_pool_load(Pool *p, int *ok, str *src, str *pkgname, str *messages) {
+  int r, engine_ok;
+  str engine_pkgname, engine_messages;
+  for (int i = 0; i < p->n; i++) {
+    r = rosie_load(p->workers[i].engine, &engine_ok, src, &engine_pkgname, &engine_messages);
+    if (r != SUCCESS) return r;
+    pool_keep_outputs(i, ok, engine_ok, pkgname, &engine_pkgname, messages, &engine_messages);
+  }
+  return SUCCESS;
+}
+
+/* N.B. Client must free 'messages' */
+EXPORT
+int rosie_pool_loadfile(Pool *p, int *ok, str *fn, str *pkgname, str *messages) {
+  int r, engine_ok;
+  str engine_pkgname, engine_messages;
+  for (int i = 0; i < p->n; i++) {
+    r = rosie_loadfile(p->workers[i].engine, &engine_ok, fn, &engine_pkgname, &engine_messages);
+    if (r != SUCCESS) return r;
+    pool_keep_outputs(i, ok, engine_ok, pkgname, &engine_pkgname, messages, &engine_messages);
+  }
+  return SUCCESS;
+}
+
+/* N.B. Client must free 'messages' */
+EXPORT
+int rosie_pool_import(Pool *p, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages) {
+  int r, engine_ok;
+  str engine_pkgname, engine_messages;
+  for (int i = 0; i < p->n; i++) {
+    r = rosie_import(p->workers[i].engine, &engine_ok, pkgname, as, &engine_pkgname, &engine_messages);
+    if (r != SUCCESS) return r;
+    pool_keep_outputs(i, ok, engine_ok, actual_pkgname, &engine_pkgname, messages, &engine_messages);
+  }
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Replaying an engine's history in the pool engines
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Bring every engine in the pool to the state recorded in the history
+ * table at idx in fromL (see engine.replay).  On failure, messages
+ * may be set (and the client must free it).
+ */
+static int pool_replay_history(Pool *p, lua_State *fromL, int idx, int *ok, str *messages) {
+  int t;
+  messages->ptr = NULL;
+  messages->len = 0;
+  *ok = TRUE;
+  for (int i = 0; i < p->n; i++) {
+    Engine *e = p->workers[i].engine;
+    lua_State *L = e->L;
+    ACQUIRE_ENGINE_LOCK(e);
+    get_registry(engine_key);
+    t = lua_getfield(L, -1, "replay");
+    CHECK_TYPE("engine.replay()", t, LUA_TFUNCTION);
+    lua_pushvalue(L, -2);
+    copy_value(fromL, idx, L, 0);
+    t = lua_pcall(L, 2, 2, 0);
+    if (t != LUA_OK) {
+      LOG("engine.replay() failed\n");
+      LOGstack(L);
+      lua_settop(L, 0);
+      RELEASE_ENGINE_LOCK(e);
+      return ERR_ENGINE_CALL_FAILED;
+    }
+    if (!lua_toboolean(L, -2)) {
+      *ok = FALSE;
+      t = strip_violation_messages(L);
+      if (t == LUA_OK) to_json_string(L, -1, messages);
+      lua_settop(L, 0);
+      RELEASE_ENGINE_LOCK(e);
+      return (t == LUA_OK) ? SUCCESS : ERR_ENGINE_CALL_FAILED;
+    }
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+  }
+  return SUCCESS;
+}
+
+/* Replay in every pool engine what was loaded, imported, and
+ * configured in engine e, so that the pool can compile the same
+ * expressions that e can.
+ *
+ * N.B. Client must free 'messages'
+ */
+EXPORT
+int rosie_pool_replay(Pool *p, Engine *e, int *ok, str *messages) {
+  int t, r;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "history");
+  CHECK_TYPE("engine.history", t, LUA_TTABLE);
+  r = pool_replay_history(p, L, -1, ok, messages);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return r;
+}
+
+/* Called with captures == NULL to keep all of the captures */
+static int pool_compile(Pool *p, str *expression, int ncaptures, char **captures,
+			int *pat, str *messages) {
+  int i, r, slot;
+  str engine_messages;
+  int *pats = calloc(p->n, sizeof(int));
+  if (!pats) return ERR_OUT_OF_MEMORY;
+  *pat = 0;
+  for (i = 0; i < p->n; i++) {
+    /* Compile once, and share the compiled pattern with the other engines */
+    if (i > 0) {
+      r = rosie_rplx_share(p->workers[0].engine, pats[0], p->workers[i].engine, &pats[i]);
+      if (r != SUCCESS) goto fail_compile;
+      if (pats[i]) continue;
+    }
+    r = captures
+      ? rosie_compile_projected(p->workers[i].engine, expression, ncaptures, captures,
+				&pats[i], &engine_messages)
+      : rosie_compile(p->workers[i].engine, expression, &pats[i], &engine_messages);
+    if (r != SUCCESS) goto fail_compile;
+    if (!pats[i]) {
+      /* Compilation failed, and will fail in every engine */
+      if (i > 0) rosie_free_string(*messages);
+      *messages = engine_messages;
+      r = SUCCESS;
+      goto fail_compile;
+    }
+    if (i == 0) *messages = engine_messages;
+    else rosie_free_string(engine_messages);
+  }
+  ACQUIRE_POOL_LOCK(p);
+  for (slot = 1; slot < p->npats; slot++)
+    if (!p->pats[slot]) break;
+  if (slot == p->npats) {
+    int **newpats = realloc(p->pats, 2 * p->npats * sizeof(int *));
+    if (!newpats) {
+      RELEASE_POOL_LOCK(p);
+      rosie_free_string(*messages);
+      messages->ptr = NULL;
+      r = ERR_OUT_OF_MEMORY;
+      goto fail_compile;
+    }
+    memset(newpats + p->npats, 0, p->npats * sizeof(int *));
+    p->pats = newpats;
+    p->npats = 2 * p->npats;
+  }
+  p->pats[slot] = pats;
+  RELEASE_POOL_LOCK(p);
+  *pat = slot;
+  return SUCCESS;
+
+ fail_compile:
+  while (i-- > 0) rosie_free_rplx(p->workers[i].engine, pats[i]);
+  free(pats);
+  return r;
+}
+
+/* N.B. Client must free 'messages' */
+EXPORT
+int rosie_pool_compile(Pool *p, str *expression, int *pat, str *messages) {
+  return pool_compile(p, expression, 0, NULL, pat, messages);
+}
+
+/* Like rosie_compile_projected(), for every engine in the pool.
+ * N.B. Client must free 'messages'
+ */
+EXPORT
+int rosie_pool_compile_projected(Pool *p, str *expression, int ncaptures, char **captures,
+				 int *pat, str *messages) {
+  static char *no_captures[1] = {NULL};
+  if ((ncaptures < 0) || (ncaptures && !captures)) return ERR_ENGINE_CALL_FAILED;
+  return pool_compile(p, expression, ncaptures, captures ? captures : no_captures, pat, messages);
+}
+
+/* The client must ensure that no match using pat is in progress */
+EXPORT
+int rosie_pool_free_rplx(Pool *p, int pat) {
+  int *pats;
+  ACQUIRE_POOL_LOCK(p);
+  if ((pat <= 0) || (pat >= p->npats) || !p->pats[pat]) {
+    RELEASE_POOL_LOCK(p);
+    return SUCCESS;
+  }
+  pats = p->pats[pat];
+  p->pats[pat] = NULL;
+  RELEASE_POOL_LOCK(p);
+  for (int i = 0; i < p->n; i++) rosie_free_rplx(p->workers[i].engine, pats[i]);
+  free(pats);
+  return SUCCESS;
+}
+
+/* N.B. Client must free match->data */
+EXPORT
+int rosie_pool_match(Pool *p, int pat, int start, char *encoder, str *input, match *match) {
+  pool_job job;
+  memset(&job, 0, sizeof(pool_job));
+  job.pats = pool_pats(p, pat);
+  if (!job.pats) {
+    set_match_error(match, ERR_NO_PATTERN);
+    return SUCCESS;
+  }
+  job.kind = POOL_JOB_MATCH;
+  job.encoder = encoder;
+  job.start = start;
+  job.input = input;
+  job.match = match;
+  int r = pool_run(p, &job, 1);
+  return (r == SUCCESS) ? job.status : r;
+}
+
+/* The batch is split into chunks which are matched in parallel.
+ * N.B. Client must free the data of each match.
+ */
+EXPORT
+int rosie_pool_match_batch(Pool *p, int pat, char *encoder, int n,
+			   int *starts, str *inputs, match *matches) {
+  int i, r, chunk, njobs;
+  int *pats = pool_pats(p, pat);
+  if (!pats) {
+    for (i = 0; i < n; i++) set_match_error(&matches[i], ERR_NO_PATTERN);
+    return SUCCESS;
+  }
+  if (n <= 0) return SUCCESS;
+  njobs = p->n * POOL_BATCH_CHUNKS_PER_WORKER;
+  chunk = (n + njobs - 1) / njobs;
+  njobs = (n + chunk - 1) / chunk;
+  pool_job *jobs = calloc(njobs, sizeof(pool_job));
+  if (!jobs) return ERR_OUT_OF_MEMORY;
+  for (i = 0; i < njobs; i++) {
+    jobs[i].kind = POOL_JOB_MATCH_BATCH;
+    jobs[i].pats = pats;
+    jobs[i].encoder = encoder;
+    jobs[i].n = ((i + 1) * chunk <= n) ? chunk : n - i * chunk;
+    jobs[i].starts = starts ? &starts[i * chunk] : NULL;
+    jobs[i].inputs = &inputs[i * chunk];
+    jobs[i].matches = &matches[i * chunk];
+  }
+  r = pool_run(p, jobs, njobs);
+  for (i = 0; (r == SUCCESS) && (i < njobs); i++) r = jobs[i].status;
+  free(jobs);
+  return r;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Parallel matchfile
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* The input is read in chunks that end on line boundaries, and a
+ * window of chunks is matched in parallel.  Results are written in
+ * input order as each chunk at the front of the window finishes.
+ */
+static int pool_matchfile_chunks(Pool *p, int *pats, char *encoder,
+				 int infd, int outfd, int errfd,
+				 int *cin, int *cout, int *cerr) {
+  int window = p->n * POOL_CHUNKS_PER_WORKER;
+  long next_read = 0, next_write = 0;
+  int eof = FALSE, failed = FALSE, r = SUCCESS;
+  line_buffer carry = {NULL, 0, 0, -1};
+  pool_job *job;
+  pthread_cond_t finished;
+  pool_job *jobs = calloc(window, sizeof(pool_job));
+  if (!jobs) return ERR_OUT_OF_MEMORY;
+  pthread_cond_init(&finished, NULL);
+  (*cin) = 0;
+  (*cout) = 0;
+  (*cerr) = 0;
+  for (;;) {
+    while (!eof && !failed && (next_read - next_write < window)) {
+      job = &jobs[next_read % window];
+      memset(job, 0, sizeof(pool_job));
+      r = read_chunk(infd, &carry, &job->lines.input, &eof);
+      if (r != SUCCESS) {
+	failed = TRUE;
+	break;
+      }
+      if (job->lines.input.len == 0) {
+	free(job->lines.input.ptr);
+	break;
+      }
+      job->kind = POOL_JOB_MATCHCHUNK;
+      job->pats = pats;
+      job->encoder = encoder;
+      job->lines.out.discard = (outfd == -1);
+      job->lines.err.discard = (errfd == -1);
+      job->finished = &finished;
+      r = pool_submit(p, job);
+      if (r != SUCCESS) {
+	free(job->lines.input.ptr);
+	failed = TRUE;
+	break;
+      }
+      next_read++;
+    }
+    if (next_write == next_read) break;
+    job = &jobs[next_write % window];
+    pool_wait(p, job);
+    next_write++;
+    if (!failed) {
+      if (job->status != SUCCESS) {
+	r = job->status;
+	failed = TRUE;
+      } else if (job->lines.nin == -1) {
+	(*cin) = -1;
+	(*cout) = job->lines.nout;
+	failed = TRUE;
+      } else {
+	if (outfd != -1) r = write_all(outfd, job->lines.out.ptr, job->lines.out.len);
+	if ((r == SUCCESS) && (errfd != -1))
+	  r = write_all(errfd, job->lines.err.ptr, job->lines.err.len);
+	if (r != SUCCESS) failed = TRUE;
+	(*cin) += job->lines.nin;
+	(*cout) += job->lines.nout;
+	(*cerr) += job->lines.nerr;
+      }
+    }
+    free(job->lines.input.ptr);
+    free(job->lines.out.ptr);
+    free(job->lines.err.ptr);
+  }
+  pthread_cond_destroy(&finished);
+  free(carry.ptr);
+  free(jobs);
+  return r;
+}
+
+/* Input is split into chunks on line boundaries, which are matched in
+ * parallel, and the output is written in input order.  The counts in
+ * cin, cout, and cerr are the same as rosie_matchfile() would give.
+ * When wholefileflag is set, the file is a single input, and it is
+ * matched by one worker.  Empty file names mean stdin, stdout, and
+ * stderr, and a NULL output or error file name means that those lines
+ * are only counted, as with rosie_matchfile().
+ *
+ * N.B. Client must free err
+ */
+EXPORT
+int rosie_pool_matchfile(Pool *p, int pat, char *encoder, int wholefileflag,
+			 char *infilename, char *outfilename, char *errfilename,
+			 int *cin, int *cout, int *cerr,
+			 str *err) {
+  int r, infd, outfd, errfd;
+  int *pats;
+  pool_job job;
+  (*err).ptr = NULL;
+  (*err).len = 0;
+  pats = pool_pats(p, pat);
+  if (!pats) {
+    (*cin) = -1;
+    (*cout) = ERR_NO_PATTERN;
+    return SUCCESS;
+  }
+  if (!encoder) {
+    LOG("rosie_pool_matchfile() called with null encoder name\n");
+    (*cin) = -1;
+    (*cout) = ERR_NO_ENCODER;
+    return SUCCESS;
+  }
+  if (wholefileflag) {
+    memset(&job, 0, sizeof(pool_job));
+    job.kind = POOL_JOB_MATCHFILE;
+    job.pats = pats;
+    job.encoder = encoder;
+    job.wholefileflag = wholefileflag;
+    job.infilename = infilename;
+    job.outfilename = outfilename;
+    job.errfilename = errfilename;
+    job.cin = cin;
+    job.cout = cout;
+    job.cerr = cerr;
+    job.err = err;
+    r = pool_run(p, &job, 1);
+    return (r == SUCCESS) ? job.status : r;
+  }
+  if (!matchfile_open(infilename, outfilename, errfilename,
+		      &infd, &outfd, &errfd, cin, cout, err))
+    return SUCCESS;
+  r = pool_matchfile_chunks(p, pats, encoder, infd, outfd, errfd, cin, cout, cerr);
+  matchfile_close(infd, outfd, errfd);
+  return r;
+}
+
+#define POOL_STATS_WORKER_SIZE 256 /* bytes for the record of one worker */
+
+/* Per-worker utilisation, as JSON:
+ *   {"workers": N, "uptime_ms": T, "pending": P,
+ *    "stats": [{"worker": i, "jobs": j, "stolen": s,
+ *               "busy_ms": b, "idle_ms": d, "utilization": u}, ...]}
+ * where utilization is the fraction of the pool's uptime spent
+ * running jobs.  N.B. Client must free stats.
+ */
+EXPORT
+int rosie_pool_stats(Pool *p, str *stats) {
+  struct timespec ts;
+  uint64_t uptime_ns, jobs, stolen, busy_ns, idle_ns;
+  int pending, len = 0;
+  size_t size = 128 + POOL_STATS_WORKER_SIZE * p->n;
+  char *buf = malloc(size);
+  if (!buf) return ERR_OUT_OF_MEMORY;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uptime_ns = (uint64_t) (ts.tv_sec - p->created.tv_sec) * 1000000000
+    + (ts.tv_nsec - p->created.tv_nsec);
+  ACQUIRE_POOL_LOCK(p);
+  pending = p->pending;
+  RELEASE_POOL_LOCK(p);
+  stats_append(buf, size, &len,
+	       "{\"workers\":%d,\"uptime_ms\":%.3f,\"pending\":%d,\"stats\":[",
+	       p->n, uptime_ns / 1e6, pending);
+  for (int i = 0; i < p->n; i++) {
+    pool_worker *w = &p->workers[i];
+    ACQUIRE_QUEUE_LOCK(w);
+    jobs = w->jobs;
+    stolen = w->stolen;
+    busy_ns = w->busy_ns;
+    idle_ns = w->idle_ns;
+    RELEASE_QUEUE_LOCK(w);
+    stats_append(buf, size, &len,
+		 "%s{\"worker\":%d,\"jobs\":%llu,\"stolen\":%llu,"
+		 "\"busy_ms\":%.3f,\"idle_ms\":%.3f,\"utilization\":%.4f}",
+		 (i == 0) ? "" : ",", i,
+		 (unsigned long long) jobs, (unsigned long long) stolen,
+		 busy_ns / 1e6, idle_ns / 1e6,
+		 uptime_ns ? (double) busy_ns / uptime_ns : 0.0);
+  }
+  stats_append(buf, size, &len, "]}");
+  stats->ptr = (byte_ptr) buf;
+  stats->len = len;
+  return SUCCESS;
+}
+
+/* Stops the workers (after they finish any queued work), and destroys
+ * the engines.  As with rosie_finalize(), the client must ensure that
+ * no thread uses the pool during or after this call.
+ */
+EXPORT
+void rosie_pool_finalize(Pool *p) {
+  int i;
+  ACQUIRE_POOL_LOCK(p);
+  p->shutdown = TRUE;
+  pthread_cond_broadcast(&p->work_available);
+  RELEASE_POOL_LOCK(p);
+  for (i = 0; i < p->n; i++) pthread_join(p->workers[i].thread, NULL);
+  for (i = 0; i < p->n; i++) {
+    rosie_finalize(p->workers[i].engine);
+    pthread_mutex_destroy(&p->workers[i].qlock);
+    free(p->workers[i].queue);
+  }
+  for (i = 1; i < p->npats; i++) free(p->pats[i]);
+  async_finalize(p);
+  LOGf("Finalized pool %p\n", (void *) p);
+  pthread_cond_destroy(&p->work_available);
+  pthread_mutex_destroy(&p->lock);
+  free(p->pats);
+  free(p->workers);
+  free(p);
+}
@@ -0,0 +1,84 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  prefilter.c  Part of librosie.c                                          */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Literal prefilter
+ *
+ * When a pattern is compiled, the compiler looks for a short list of
+ * literals, one of which every match must contain (see
+ * required_literals in compile.lua).  The list is kept in the
+ * "prefilter" slot of the rplx pattern.  Before an input is given to
+ * the matching vm, it is searched for those literals with memchr() or
+ * memmem(), which the C library implements with vector instructions.
+ * An input that contains none of them cannot match, so the vm is not
+ * run, and the result is the same as a failed match.  When most inputs
+ * do not match, as when searching a large file for a rare pattern,
+ * most of them are rejected this way.
+ */
+
+#define PREFILTER_MAX 8		/* same as in compile.lua */
+
+typedef struct prefilter {
+  int n;			/* 0 when every input must be matched */
+  const char *lits[PREFILTER_MAX];
+  size_t lens[PREFILTER_MAX];
+  uint64_t rejected;		/* inputs that prefilter_pass() rejected */
+} prefilter;
+
+/* Read the prefilter of the rplx at idx.  The literals are Lua
+ * strings held by the rplx, which the caller must keep alive while
+ * the prefilter is in use.
+ */
+static void prefilter_get(lua_State *L, int idx, prefilter *pf) {
+  int i, n;
+  pf->n = 0;
+  pf->rejected = 0;
+  idx = lua_absindex(L, idx);
+  if (lua_getfield(L, idx, "pattern") == LUA_TTABLE) {
+    if (lua_getfield(L, -1, "prefilter") == LUA_TTABLE) {
+      n = (int) lua_rawlen(L, -1);
+      for (i = 0; (i < n) && (n <= PREFILTER_MAX); i++) {
+	lua_rawgeti(L, -1, i + 1);
+	pf->lits[i] = lua_tolstring(L, -1, &(pf->lens[i]));
+	lua_pop(L, 1);
+	if (!pf->lits[i]) break;
+      }
+      if (i == n) pf->n = n;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+/* Returns FALSE when input, from start, contains none of the literals */
+static int prefilter_pass(prefilter *pf, byte_ptr input, size_t len, int start) {
+  const char *data = (const char *) input;
+  if (pf->n == 0) return TRUE;
+  /* The vm deals with a start position that is out of range */
+  if ((start < 1) || ((size_t) (start - 1) > len)) return TRUE;
+  data += start - 1;
+  len -= start - 1;
+  for (int i = 0; i < pf->n; i++) {
+    if (pf->lens[i] == 1) {
+      if (memchr(data, pf->lits[i][0], len)) return TRUE;
+    } else if (memmem(data, len, pf->lits[i], pf->lens[i])) {
+      return TRUE;
+    }
+  }
+  pf->rejected++;
+  return FALSE;
+}
+
+/* Set the results of a match that the prefilter rejected */
+static void prefilter_no_match(match *m, size_t len, int start) {
+  (*m).data.ptr = NULL;
+  (*m).data.len = 0;
+  (*m).leftover = (int) (len - (start - 1));
+  (*m).abend = FALSE;
+  (*m).ttotal = 0;
+  (*m).tmatch = 0;
+}
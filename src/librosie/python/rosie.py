@@ -22,6 +22,7 @@ from __future__ import unicode_literals
 from cffi import FFI
 import os
 import json
+import struct
 
 ffi = FFI()
 
@@ -43,22 +44,64 @@ typedef struct rosie_matchresult {
      int tmatch;
 } match;
 
+typedef void (*rosie_sink)(void *context, byte_ptr data, size_t len);
+
+typedef struct rosie_encoder_output rosie_encoder_output;
+typedef int (*rosie_encoder)(void *userdata, str *input, str *matchdata, rosie_encoder_output *out);
+
+typedef struct rosie_capture {
+     str name;
+     str text;
+     int start;
+     int end;
+     int depth;
+} rosie_capture;
+
+typedef int (*rosie_capture_visitor)(void *context, rosie_capture *capture);
+
+typedef struct rosie_completion {
+     void *tag;
+     int status;
+     match match;
+} rosie_completion;
+
 str *rosie_string_ptr_from(byte_ptr msg, size_t len);
 void rosie_free_string_ptr(str *s);
 void rosie_free_string(str s);
 
 void *rosie_new(str *errors);
+void *rosie_clone(void *L, str *errors);
 void rosie_finalize(void *L);
 int rosie_libpath(void *L, str *newpath);
 int rosie_alloc_limit(void *L, int *newlimit, int *usage);
+int rosie_alloc_cap(void *L, int *newcap, int *high_water);
 int rosie_config(void *L, str *retvals);
+int rosie_stats(void *L, str *stats);
 int rosie_compile(void *L, str *expression, int *pat, str *errors);
+int rosie_compile_projected(void *L, str *expression, int ncaptures, char **captures,
+			    int *pat, str *errors);
 int rosie_free_rplx(void *L, int pat);
+int rosie_rplx_share(void *src, int pat, void *dst, int *dst_pat);
 int rosie_match(void *L, int pat, int start, char *encoder, str *input, match *match);
+int rosie_match_into(void *L, int pat, int start, char *encoder, str *input, match *match,
+		     byte_ptr buffer, size_t bufsize, size_t *needed);
+int rosie_match_sink(void *L, int pat, int start, char *encoder, str *input, match *match,
+		     rosie_sink sink, void *context);
+int rosie_match_batch(void *L, int pat, char *encoder, int n,
+		      int *starts, str *inputs, match *matches);
 int rosie_matchfile(void *L, int pat, char *encoder, int wholefileflag,
 		    char *infilename, char *outfilename, char *errfilename,
 		    int *cin, int *cout, int *cerr,
 		    str *err);
+int rosie_match_columns(void *L, int pat, int ncols, char **names, int n,
+			int *starts, str *inputs, match *matches, str *block);
+int rosie_matchfile_columns(void *L, int pat, int ncols, char **names, int wholefileflag,
+			    char *infilename, char *outfilename, char *errfilename,
+			    int *cin, int *cout, int *cerr,
+			    str *err);
+int rosie_register_encoder(void *L, const char *name, rosie_encoder fn, void *userdata);
+int rosie_encoder_write(rosie_encoder_output *out, byte_ptr data, size_t len);
+int rosie_walk_match(str *input, str *matchdata, rosie_capture_visitor visitor, void *context);
 int rosie_trace(void *L, int pat, int start, char *trace_style, str *input, int *matched, str *trace);
 int rosie_load(void *L, int *ok, str *src, str *pkgname, str *errors);
 int rosie_loadfile(void *e, int *ok, str *fn, str *pkgname, str *errors);
@@ -66,6 +109,31 @@ int rosie_import(void *e, int *ok, str *pkgname, str *as, str *actual_pkgname, s
 int rosie_read_rcfile(void *e, str *filename, int *file_exists, str *options);
 int rosie_execute_rcfile(void *e, str *filename, int *file_exists, int *no_errors);
 
+void *rosie_pool_new(int nthreads, str *messages);
+void rosie_pool_finalize(void *p);
+int rosie_pool_size(void *p);
+int rosie_pool_libpath(void *p, str *newpath);
+int rosie_pool_load(void *p, int *ok, str *src, str *pkgname, str *messages);
+int rosie_pool_loadfile(void *p, int *ok, str *fn, str *pkgname, str *messages);
+int rosie_pool_import(void *p, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages);
+int rosie_pool_replay(void *p, void *e, int *ok, str *messages);
+int rosie_pool_compile(void *p, str *expression, int *pat, str *messages);
+int rosie_pool_compile_projected(void *p, str *expression, int ncaptures, char **captures,
+				 int *pat, str *messages);
+int rosie_pool_free_rplx(void *p, int pat);
+int rosie_pool_match(void *p, int pat, int start, char *encoder, str *input, match *match);
+int rosie_pool_match_batch(void *p, int pat, char *encoder, int n,
+			   int *starts, str *inputs, match *matches);
+int rosie_pool_matchfile(void *p, int pat, char *encoder, int wholefileflag,
+			 char *infilename, char *outfilename, char *errfilename,
+			 int *cin, int *cout, int *cerr,
+			 str *err);
+int rosie_pool_register_encoder(void *p, const char *name, rosie_encoder fn, void *userdata);
+int rosie_pool_stats(void *p, str *stats);
+int rosie_pool_submit(void *p, int pat, int start, char *encoder, str *input, void *tag);
+int rosie_pool_poll(void *p, int max, rosie_completion *completions, int *n);
+int rosie_pool_completion_fd(void *p, int *fd);
+
 void free(void *obj);
 
 """)
@@ -82,6 +150,13 @@ def new_rplx(engine):
     obj = ffi.new("int *")
     return ffi.gc(obj, free_rplx)
 
+def new_pool_rplx(pool):
+    def free_rplx(obj):
+        if obj[0] and pool.pool:
+            lib.rosie_pool_free_rplx(pool.pool, obj[0])
+    obj = ffi.new("int *")
+    return ffi.gc(obj, free_rplx)
+
 def free_cstr_ptr(local_cstr_obj):
     lib.rosie_free_string(local_cstr_obj[0])
 
@@ -106,6 +181,132 @@ def read_cstr(cstr_ptr):
     else:
         return bytes(ffi.buffer(cstr_ptr.ptr, cstr_ptr.len)[:])
 
+def read_match(Cmatch):
+    left = Cmatch.leftover
+    abend = Cmatch.abend
+    ttotal = Cmatch.ttotal
+    tmatch = Cmatch.tmatch
+    if Cmatch.data.ptr == ffi.NULL:
+        if Cmatch.data.len == 0:
+            return None, left, abend, ttotal, tmatch
+        elif Cmatch.data.len == 1:
+            return True, left, abend, ttotal, tmatch
+        elif Cmatch.data.len == 2:
+            raise ValueError("invalid output encoder")
+        elif Cmatch.data.len == 4:
+            raise ValueError("invalid compiled pattern (already freed?)")
+    data = read_cstr(Cmatch.data)
+    return data, left, abend, ttotal, tmatch
+
+# The pool functions return match data that the caller must free
+def read_pool_match(Cmatch):
+    try:
+        return read_match(Cmatch)
+    finally:
+        lib.rosie_free_string(Cmatch.data)
+
+def load_librosie(librosie_directory=None):
+    global lib
+    ostype = os.uname()[0]
+    if ostype=="Darwin":
+        libname = "librosie.dylib"
+    else:
+        libname = "librosie.so"
+    if not lib:
+        if librosie_directory:
+           libpath = os.path.join(librosie_directory, libname)
+           if not os.path.isfile(libpath):
+               raise RuntimeError("Cannot find librosie at " + libpath)
+        else:
+            libpath = libname
+        lib = ffi.dlopen(libpath, ffi.RTLD_LAZY | ffi.RTLD_GLOBAL)
+
+def new_inputs(inputs):
+    n = len(inputs)
+    Cinputs = ffi.new("struct rosie_string[]", n)
+    Cbuffers = []           # keeps the input buffers alive during the call
+    for i, input in enumerate(inputs):
+        Cbuffer = ffi.from_buffer(input)
+        Cbuffers.append(Cbuffer)
+        Cinputs[i].ptr = ffi.cast("byte_ptr", Cbuffer)
+        Cinputs[i].len = len(input)
+    return Cinputs, Cbuffers
+
+def matchfile_results(ok, Ccin, Ccout, Ccerr, Cerrmsg):
+    if ok != 0:
+        raise RuntimeError("matchfile() failed: " + str(read_cstr(Cerrmsg)))
+    if Ccin[0] == -1:       # Error occurred
+        if Ccout[0] == 2:
+            raise ValueError("invalid encoder")
+        elif Ccout[0] == 3:
+            raise ValueError(str(read_cstr(Cerrmsg))) # file i/o error
+        elif Ccout[0] == 4:
+            raise ValueError("invalid compiled pattern (already freed?)")
+        else:
+            raise ValueError("unknown error caused matchfile to fail")
+    return Ccin[0], Ccout[0], Ccerr[0]
+
+def read_str(Cstr):
+    return ffi.buffer(Cstr.ptr, Cstr.len)[:] if Cstr.len else b""
+
+# Append each capture visited by rosie_walk_match() to a list
+@ffi.callback("int(void *, rosie_capture *)")
+def visit_capture(context, Ccap):
+    ffi.from_handle(context).append((read_str(Ccap.name), read_str(Ccap.text),
+                                     Ccap.start, Ccap.end, Ccap.depth))
+    return 0
+
+# Custom encoders are never freed, because an engine and its clones
+# may call them at any time.
+encoder_callbacks = []
+
+# Make a C encoder from fn, which is called with the input and a list
+# of the captures of a match (name, text, start, end, depth), in the
+# order in which they start, and returns the encoded match as bytes.
+def new_encoder(fn):
+    @ffi.callback("int(void *, str *, str *, rosie_encoder_output *)", error=-4)
+    def Cencoder(userdata, Cinput, Cmatchdata, Cout):
+        captures = []
+        ok = lib.rosie_walk_match(Cinput, Cmatchdata, visit_capture, ffi.new_handle(captures))
+        if ok != 0:
+            return ok
+        output = fn(read_str(Cinput[0]), captures)
+        Coutput = ffi.from_buffer(output)
+        return lib.rosie_encoder_write(Cout, ffi.cast("byte_ptr", Coutput), len(output))
+    encoder_callbacks.append(Cencoder)
+    return Cencoder
+
+# Read the blocks of columns in data (see columns.c in librosie) into
+# a dictionary that maps each capture name to a list of (record,
+# start, end, text) for every capture of that name.
+def read_columns(data):
+    columns = {}
+    pos = 0
+    while pos < len(data):
+        magic, size, ncols = struct.unpack_from("=4sII", data, pos)
+        if magic != b"RCOL":
+            raise ValueError("invalid block of columns")
+        end = pos + 8 + size
+        pos = pos + 12
+        for i in range(ncols):
+            namelen, = struct.unpack_from("=I", data, pos)
+            name = data[pos+4:pos+4+namelen]
+            pos = pos + 4 + ((namelen + 3) & ~3)
+            count, = struct.unpack_from("=I", data, pos)
+            pos = pos + 4
+            records = struct.unpack_from("=%di" % count, data, pos)
+            starts = struct.unpack_from("=%di" % count, data, pos + 4*count)
+            ends = struct.unpack_from("=%di" % count, data, pos + 8*count)
+            offsets = struct.unpack_from("=%dI" % (count + 1), data, pos + 12*count)
+            pos = pos + 16*count + 4
+            heap = data[pos:pos+offsets[count]]
+            pos = pos + ((offsets[count] + 3) & ~3)
+            column = columns.setdefault(name, [])
+            for k in range(count):
+                column.append((records[k], starts[k], ends[k], heap[offsets[k]:offsets[k+1]]))
+        pos = end
+    return columns
+
 # -----------------------------------------------------------------------------
 
 class engine ():
@@ -117,26 +318,24 @@ class engine ():
     '''
 
     def __init__(self, librosie_directory=None):
-        global lib
-        ostype = os.uname()[0]
-        if ostype=="Darwin":
-            libname = "librosie.dylib"
-        else:
-            libname = "librosie.so"
-        if not lib:
-            if librosie_directory:
-               libpath = os.path.join(librosie_directory, libname)
-               if not os.path.isfile(libpath):
-                   raise RuntimeError("Cannot find librosie at " + libpath)
-            else:
-                libpath = libname
-            lib = ffi.dlopen(libpath, ffi.RTLD_LAZY | ffi.RTLD_GLOBAL)
+        load_librosie(librosie_directory)
         Cerrs = new_cstr()
         self.engine = lib.rosie_new(Cerrs)
         if self.engine == ffi.NULL:
             raise RuntimeError("librosie: " + str23(read_cstr(Cerrs)))
         return
 
+    # Make a new engine that has the packages, configuration, and
+    # compiled patterns of this one.  A pattern compiled by this engine
+    # can be used with the clone, too.
+    def clone(self):
+        Cerrs = new_cstr()
+        e = engine.__new__(engine)
+        e.engine = lib.rosie_clone(self.engine, Cerrs)
+        if e.engine == ffi.NULL:
+            raise RuntimeError("librosie: " + str23(read_cstr(Cerrs)))
+        return e
+
     def config(self):
         Cresp = new_cstr()
         ok = lib.rosie_config(self.engine, Cresp)
@@ -145,17 +344,46 @@ class engine ():
         resp = read_cstr(Cresp)
         return resp
 
-    def compile(self, exp):
+    # Returns a dictionary of the engine's cumulative match statistics
+    def stats(self):
+        Cstats = new_cstr()
+        ok = lib.rosie_stats(self.engine, Cstats)
+        if ok != 0:
+            raise RuntimeError("stats() failed (please report this as a bug)")
+        return json.loads(read_cstr(Cstats))
+
+    # When captures (a list of capture names) is given, the matches
+    # contain only those captures, under the top-level one.
+    def compile(self, exp, captures=None):
         Cerrs = new_cstr()
         Cexp = new_cstr(exp)
         Cpat = new_rplx(self)
-        ok = lib.rosie_compile(self.engine, Cexp, Cpat, Cerrs)
+        if captures is None:
+            ok = lib.rosie_compile(self.engine, Cexp, Cpat, Cerrs)
+        else:
+            Ccaptures = [ffi.new("char[]", name) for name in captures]
+            ok = lib.rosie_compile_projected(self.engine, Cexp, len(captures),
+                                             ffi.new("char *[]", Ccaptures), Cpat, Cerrs)
         if ok != 0:
             raise RuntimeError("compile() failed (please report this as a bug)")
         if Cpat[0] == 0:
             Cpat = None
         return Cpat, read_cstr(Cerrs)
 
+    # Give engine other the use of Cpat, which was compiled by this
+    # engine, without compiling it again.  Returns a compiled pattern
+    # for use with other, or None if Cpat cannot be shared.
+    def share(self, Cpat, other):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        Cshared = new_rplx(other)
+        ok = lib.rosie_rplx_share(self.engine, Cpat[0], other.engine, Cshared)
+        if ok != 0:
+            raise RuntimeError("share() failed (please report this as a bug)")
+        if Cshared[0] == 0:
+            Cshared = None
+        return Cshared
+
     def load(self, src):
         Cerrs = new_cstr()
         Csrc = new_cstr(src)
@@ -204,21 +432,93 @@ class engine ():
         ok = lib.rosie_match(self.engine, Cpat[0], start, encoder, Cinput, Cmatch)
         if ok != 0:
             raise RuntimeError("match() failed (please report this as a bug)")
-        left = Cmatch.leftover
-        abend = Cmatch.abend
-        ttotal = Cmatch.ttotal
-        tmatch = Cmatch.tmatch
-        if Cmatch.data.ptr == ffi.NULL:
-            if Cmatch.data.len == 0:
-                return None, left, abend, ttotal, tmatch
-            elif Cmatch.data.len == 1:
-                return True, left, abend, ttotal, tmatch
-            elif Cmatch.data.len == 2:
-                raise ValueError("invalid output encoder")
-            elif Cmatch.data.len == 4:
-                raise ValueError("invalid compiled pattern (already freed?)")
-        data = read_cstr(Cmatch.data)
-        return data, left, abend, ttotal, tmatch
+        return read_match(Cmatch)
+
+    # Match into buffer, a bytearray, which is grown when it is too
+    # small to hold the match data.  Returns the same values as
+    # match(), except that the first is the length of the data now at
+    # the start of buffer (or None or True, as with match()).
+    def match_into(self, Cpat, input, start, encoder, buffer):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        Cmatch = ffi.new("struct rosie_matchresult *")
+        Cinput = new_cstr(input)
+        Cneeded = ffi.new("size_t *")
+        while True:
+            Cbuffer = ffi.from_buffer(buffer)
+            ok = lib.rosie_match_into(self.engine, Cpat[0], start, encoder, Cinput, Cmatch,
+                                      ffi.cast("byte_ptr", Cbuffer), len(buffer), Cneeded)
+            del Cbuffer     # release the bytearray, so that it can be resized
+            if ok != 0:
+                raise RuntimeError("match_into() failed (please report this as a bug)")
+            if Cmatch.data.ptr != ffi.NULL or Cmatch.data.len != 5:
+                break
+            buffer.extend(bytes(Cneeded[0] - len(buffer)))
+        if Cmatch.data.ptr != ffi.NULL:
+            return Cneeded[0], Cmatch.leftover, Cmatch.abend, Cmatch.ttotal, Cmatch.tmatch
+        return read_match(Cmatch)
+
+    # Call sink with the match data (as a cffi buffer, which is only
+    # valid during the call).  Returns the same values as match(),
+    # except that the first is True for a match.
+    def match_sink(self, Cpat, input, start, encoder, sink):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        @ffi.callback("void(void *, byte_ptr, size_t)")
+        def Csink(context, data, length):
+            sink(ffi.buffer(data, length))
+        Cmatch = ffi.new("struct rosie_matchresult *")
+        Cinput = new_cstr(input)
+        ok = lib.rosie_match_sink(self.engine, Cpat[0], start, encoder, Cinput, Cmatch,
+                                  Csink, ffi.NULL)
+        if ok != 0:
+            raise RuntimeError("match_sink() failed (please report this as a bug)")
+        return read_match(Cmatch)
+
+    # Register fn (see new_encoder) as an output encoder called name,
+    # for use by all of the match functions.  When fn is None, the
+    # encoder is removed.
+    def register_encoder(self, name, fn):
+        Cencoder = new_encoder(fn) if fn else ffi.NULL
+        ok = lib.rosie_register_encoder(self.engine, name, Cencoder, ffi.NULL)
+        if ok != 0:
+            raise ValueError("invalid encoder name")
+
+    # Match each of the inputs against Cpat, returning a list of
+    # results in the same form as match().  The optional list of starts
+    # gives the start position for each input (default is 1).
+    def match_batch(self, Cpat, inputs, starts=None, encoder=b"json"):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        n = len(inputs)
+        if starts is not None and len(starts) != n:
+            raise ValueError("length of starts does not match the number of inputs")
+        Cinputs, Cbuffers = new_inputs(inputs)
+        Cstarts = ffi.new("int[]", starts) if starts is not None else ffi.NULL
+        Cmatches = ffi.new("struct rosie_matchresult[]", n)
+        ok = lib.rosie_match_batch(self.engine, Cpat[0], encoder, n, Cstarts, Cinputs, Cmatches)
+        if ok != 0:
+            raise RuntimeError("match_batch() failed (please report this as a bug)")
+        return [read_match(Cmatches[i]) for i in range(n)]
+
+    # Like match_batch() with the byte encoder, but return only the
+    # captures with the given names, as read_columns() does.
+    def match_columns(self, Cpat, names, inputs, starts=None):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        n = len(inputs)
+        if starts is not None and len(starts) != n:
+            raise ValueError("length of starts does not match the number of inputs")
+        Cnames = [ffi.new("char[]", name) for name in names]
+        Cinputs, Cbuffers = new_inputs(inputs)
+        Cstarts = ffi.new("int[]", starts) if starts is not None else ffi.NULL
+        Cmatches = ffi.new("struct rosie_matchresult[]", n)
+        Cblock = new_cstr()
+        ok = lib.rosie_match_columns(self.engine, Cpat[0], len(names), ffi.new("char *[]", Cnames),
+                                     n, Cstarts, Cinputs, Cmatches, Cblock)
+        if ok != 0:
+            raise RuntimeError("match_columns() failed (please report this as a bug)")
+        return read_columns(read_cstr(Cblock))
 
     def trace(self, Cpat, input, start, style):
         if Cpat[0] == 0:
@@ -258,19 +558,24 @@ class engine ():
                                  outfile or b"",
                                  errfile or b"",
                                  Ccin, Ccout, Ccerr, Cerrmsg)
-        if ok != 0:
-            raise RuntimeError("matchfile() failed: " + str(read_cstr(Cerrmsg)))
+        return matchfile_results(ok, Ccin, Ccout, Ccerr, Cerrmsg)
 
-        if Ccin[0] == -1:       # Error occurred
-            if Ccout[0] == 2:
-                raise ValueError("invalid encoder")
-            elif Ccout[0] == 3:
-                raise ValueError(str(read_cstr(Cerrmsg))) # file i/o error
-            elif Ccout[0] == 4:
-                raise ValueError("invalid compiled pattern (already freed?)")
-            else:
-                raise ValueError("unknown error caused matchfile to fail")
-        return Ccin[0], Ccout[0], Ccerr[0]
+    # Like matchfile() with the byte encoder, except that the output
+    # is blocks of columns holding the captures with the given names
+    # (see read_columns).
+    def matchfile_columns(self, Cpat, names, infile=None, outfile=None, errfile=None, wholefile=False):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        Cnames = [ffi.new("char[]", name) for name in names]
+        Ccin = ffi.new("int *")
+        Ccout = ffi.new("int *")
+        Ccerr = ffi.new("int *")
+        Cerrmsg = new_cstr()
+        ok = lib.rosie_matchfile_columns(self.engine, Cpat[0], len(names), ffi.new("char *[]", Cnames),
+                                         1 if wholefile else 0,
+                                         infile or b"", outfile or b"", errfile or b"",
+                                         Ccin, Ccout, Ccerr, Cerrmsg)
+        return matchfile_results(ok, Ccin, Ccout, Ccerr, Cerrmsg)
 
     def read_rcfile(self, filename=None):
         Cfile_exists = ffi.new("int *")
@@ -326,6 +631,22 @@ class engine ():
             raise RuntimeError("alloc_limit() failed (please report this as a bug)")
         return limit_arg[0], usage_arg[0]
 
+    # A hard cap on the engine's memory, in KB.  Returns the cap and the
+    # engine's high water mark.
+    def alloc_cap(self, newcap=None):
+        cap_arg = ffi.new("int *")
+        high_water_arg = ffi.new("int *")
+        if newcap is None:
+            cap_arg[0] = -1     # query
+        else:
+            if (newcap != 0) and (newcap < 8192):
+                raise ValueError("new allocation cap must be 8192 KB or higher (or zero for no cap)")
+            cap_arg[0] = newcap
+        ok = lib.rosie_alloc_cap(self.engine, cap_arg, high_water_arg)
+        if ok != 0:
+            raise RuntimeError("alloc_cap() failed (please report this as a bug)")
+        return cap_arg[0], high_water_arg[0]
+
     def __del__(self):
         if hasattr(self, 'engine') and (self.engine != ffi.NULL):
             lib.rosie_finalize(self.engine)
@@ -333,3 +654,185 @@ class engine ():
 
 
     
+
+# -----------------------------------------------------------------------------
+
+class pool ():
+    '''
+    Create a pool of Rosie engines, each owned by a worker thread.
+    RPL is loaded (and patterns compiled) into every engine in the pool,
+    and matches are spread across the workers.  When nthreads is 0, the
+    pool has one worker per cpu.
+    '''
+
+    def __init__(self, nthreads=0, librosie_directory=None):
+        load_librosie(librosie_directory)
+        Cerrs = new_cstr()
+        self.pool = lib.rosie_pool_new(nthreads, Cerrs)
+        if self.pool == ffi.NULL:
+            raise RuntimeError("librosie: " + str23(read_cstr(Cerrs)))
+        return
+
+    def size(self):
+        return lib.rosie_pool_size(self.pool)
+
+    def compile(self, exp, captures=None):
+        Cerrs = new_cstr()
+        Cexp = new_cstr(exp)
+        Cpat = new_pool_rplx(self)
+        if captures is None:
+            ok = lib.rosie_pool_compile(self.pool, Cexp, Cpat, Cerrs)
+        else:
+            Ccaptures = [ffi.new("char[]", name) for name in captures]
+            ok = lib.rosie_pool_compile_projected(self.pool, Cexp, len(captures),
+                                                  ffi.new("char *[]", Ccaptures), Cpat, Cerrs)
+        if ok != 0:
+            raise RuntimeError("compile() failed (please report this as a bug)")
+        if Cpat[0] == 0:
+            Cpat = None
+        return Cpat, read_cstr(Cerrs)
+
+    def load(self, src):
+        Cerrs = new_cstr()
+        Csrc = new_cstr(src)
+        Csuccess = ffi.new("int *")
+        Cpkgname = new_cstr()
+        ok = lib.rosie_pool_load(self.pool, Csuccess, Csrc, Cpkgname, Cerrs)
+        if ok != 0:
+            raise RuntimeError("load() failed (please report this as a bug)")
+        return Csuccess[0], read_cstr(Cpkgname), read_cstr(Cerrs)
+
+    def loadfile(self, fn):
+        Cerrs = new_cstr()
+        Cfn = new_cstr(fn)
+        Csuccess = ffi.new("int *")
+        Cpkgname = new_cstr()
+        ok = lib.rosie_pool_loadfile(self.pool, Csuccess, Cfn, Cpkgname, Cerrs)
+        if ok != 0:
+            raise RuntimeError("loadfile() failed (please report this as a bug)")
+        return Csuccess[0], read_cstr(Cpkgname), read_cstr(Cerrs)
+
+    def import_pkg(self, pkgname, as_name=None):
+        Cerrs = new_cstr()
+        Cas_name = new_cstr(as_name) if as_name else ffi.NULL
+        Cpkgname = new_cstr(pkgname)
+        Cactual_pkgname = new_cstr()
+        Csuccess = ffi.new("int *")
+        ok = lib.rosie_pool_import(self.pool, Csuccess, Cpkgname, Cas_name, Cactual_pkgname, Cerrs)
+        if ok != 0:
+            raise RuntimeError("import() failed (please report this as a bug)")
+        return Csuccess[0], read_cstr(Cactual_pkgname), read_cstr(Cerrs)
+
+    # Replay in the pool engines everything that was loaded, imported,
+    # and configured in the given engine
+    def replay(self, engine):
+        Cerrs = new_cstr()
+        Csuccess = ffi.new("int *")
+        ok = lib.rosie_pool_replay(self.pool, engine.engine, Csuccess, Cerrs)
+        if ok != 0:
+            raise RuntimeError("replay() failed (please report this as a bug)")
+        return Csuccess[0], read_cstr(Cerrs)
+
+    def libpath(self, libpath=None):
+        libpath_arg = new_cstr(libpath) if libpath else new_cstr()
+        ok = lib.rosie_pool_libpath(self.pool, libpath_arg)
+        if ok != 0:
+            raise RuntimeError("libpath() failed (please report this as a bug)")
+        return read_cstr(libpath_arg) if libpath is None else None
+
+    def match(self, Cpat, input, start, encoder):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        Cmatch = ffi.new("struct rosie_matchresult *")
+        Cinput = new_cstr(input)
+        ok = lib.rosie_pool_match(self.pool, Cpat[0], start, encoder, Cinput, Cmatch)
+        if ok != 0:
+            raise RuntimeError("match() failed (please report this as a bug)")
+        return read_pool_match(Cmatch)
+
+    def match_batch(self, Cpat, inputs, starts=None, encoder=b"json"):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        n = len(inputs)
+        if starts is not None and len(starts) != n:
+            raise ValueError("length of starts does not match the number of inputs")
+        Cinputs, Cbuffers = new_inputs(inputs)
+        Cstarts = ffi.new("int[]", starts) if starts is not None else ffi.NULL
+        Cmatches = ffi.new("struct rosie_matchresult[]", n)
+        ok = lib.rosie_pool_match_batch(self.pool, Cpat[0], encoder, n, Cstarts, Cinputs, Cmatches)
+        if ok != 0:
+            raise RuntimeError("match_batch() failed (please report this as a bug)")
+        return [read_pool_match(Cmatches[i]) for i in range(n)]
+
+    def matchfile(self, Cpat, encoder, infile=None, outfile=None, errfile=None, wholefile=False):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        Ccin = ffi.new("int *")
+        Ccout = ffi.new("int *")
+        Ccerr = ffi.new("int *")
+        Cerrmsg = new_cstr()
+        ok = lib.rosie_pool_matchfile(self.pool, Cpat[0], encoder, 1 if wholefile else 0,
+                                      infile or b"", outfile or b"", errfile or b"",
+                                      Ccin, Ccout, Ccerr, Cerrmsg)
+        return matchfile_results(ok, Ccin, Ccout, Ccerr, Cerrmsg)
+
+    # Queue a match and return at once.  The integer tag identifies the
+    # match in the results of poll().
+    def submit(self, Cpat, input, tag, start=1, encoder=b"json"):
+        if Cpat[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        Cinput = new_cstr(input)
+        ok = lib.rosie_pool_submit(self.pool, Cpat[0], start, encoder, Cinput, ffi.cast("void *", tag))
+        if ok != 0:
+            raise RuntimeError("submit() failed (please report this as a bug)")
+
+    # Returns a list of (tag, result) for up to max completed matches,
+    # without waiting.  A result is what match() would return, or the
+    # ValueError that match() would raise.
+    def poll(self, max=64):
+        Ccompletions = ffi.new("struct rosie_completion[]", max)
+        Cn = ffi.new("int *")
+        ok = lib.rosie_pool_poll(self.pool, max, Ccompletions, Cn)
+        if ok != 0:
+            raise RuntimeError("poll() failed (please report this as a bug)")
+        results = []
+        for i in range(Cn[0]):
+            tag = int(ffi.cast("uintptr_t", Ccompletions[i].tag))
+            try:
+                result = read_pool_match(ffi.addressof(Ccompletions[i], "match"))
+            except ValueError as e:
+                result = e
+            results.append((tag, result))
+        return results
+
+    # A file descriptor that is readable while completed matches are
+    # waiting to be polled, for use with select() and friends
+    def completion_fd(self):
+        Cfd = ffi.new("int *")
+        ok = lib.rosie_pool_completion_fd(self.pool, Cfd)
+        if ok != 0:
+            raise RuntimeError("completion_fd() failed")
+        return Cfd[0]
+
+    # Register fn as an output encoder in every engine of the pool (see
+    # engine.register_encoder).  It may be called by several workers at
+    # once.
+    def register_encoder(self, name, fn):
+        Cencoder = new_encoder(fn) if fn else ffi.NULL
+        ok = lib.rosie_pool_register_encoder(self.pool, name, Cencoder, ffi.NULL)
+        if ok != 0:
+            raise ValueError("invalid encoder name")
+
+    # Returns a dictionary with per-worker utilisation figures
+    def stats(self):
+        Cstats = new_cstr()
+        ok = lib.rosie_pool_stats(self.pool, Cstats)
+        if ok != 0:
+            raise RuntimeError("stats() failed (please report this as a bug)")
+        return json.loads(read_cstr(Cstats))
+
+    def __del__(self):
+        if hasattr(self, 'pool') and (self.pool != ffi.NULL):
+            p = self.pool
+            self.pool = ffi.NULL
+            lib.rosie_pool_finalize(p)
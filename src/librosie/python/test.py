@@ -6,7 +6,7 @@
 from __future__ import unicode_literals
 
 import unittest
-import sys, os, json
+import sys, os, json, select
 import rosie
 
 # Notes
@@ -174,6 +174,41 @@ class RosieAlloclimitTest(unittest.TestCase):
         limit, usage = self.engine.alloc_limit()
         self.assertTrue(limit == 8199)
 
+class RosieAlloccapTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        cap, high_water = self.engine.alloc_cap()
+        self.assertTrue(cap == 0)
+        self.assertTrue(high_water > 0)
+        with self.assertRaises(ValueError):
+            self.engine.alloc_cap(8191) # too low
+        stats = self.engine.stats()['alloc']
+        self.assertTrue(stats['footprint_kb'] >= stats['in_use_kb'] > 0)
+        self.assertTrue(0 <= stats['fragmentation'] < 1)
+
+        # An rpl source that needs more memory than the cap allows
+        cap, high_water = self.engine.alloc_cap(stats['footprint_kb'] + 8192)
+        self.assertTrue(cap == stats['footprint_kb'] + 8192)
+        src = b'package big\n' + b''.join([b'p%d = "%d" [:alpha:]+ {[:digit:] "x"}*\n' % (i, i) for i in range(50000)])
+        with self.assertRaises(RuntimeError):
+            self.engine.load(src)
+        self.assertTrue(self.engine.stats()['alloc']['failures'] > 0)
+
+        # The engine is still usable
+        b, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(b[0] > 0)
+        m, left, abend, tt, tm = self.engine.match(b, b"321", 1, b"json")
+        self.assertTrue(json.loads(m)['data'] == "321")
+        self.engine.alloc_cap(0)
+
 class RosieImportTest(unittest.TestCase):
 
     engine = None
@@ -322,7 +357,313 @@ class RosieMatchTest(unittest.TestCase):
 
         self.assertRaises(ValueError, self.engine.match, b, inp, 1, b"this_is_not_a_valid_encoder_name")
 
-            
+        # Matching into a buffer, which starts out too small for the data
+        buffer = bytearray(8)
+        for encoder in [b"json", b"color"]:
+            expected, left, abend, tt, tm = self.engine.match(b, inp, 1, encoder)
+            n, left, abend, tt, tm = self.engine.match_into(b, inp, 1, encoder, buffer)
+            self.assertTrue(n == len(expected))
+            self.assertTrue(bytes(buffer[0:n]) == expected)
+            self.assertTrue(left == 3)
+        m, left, abend, tt, tm = self.engine.match_into(b, b"xyz", 1, b"json", buffer)
+        self.assertTrue(m == None)
+        self.assertTrue(left == 3)
+        m, left, abend, tt, tm = self.engine.match_into(b, inp, 1, b"bool", buffer)
+        self.assertIs(m, True)
+        self.assertRaises(ValueError, self.engine.match_into, b, inp, 1, b"this_is_not_a_valid_encoder_name", buffer)
+
+        # Matching with a sink
+        expected, left, abend, tt, tm = self.engine.match(b, inp, 1, b"json")
+        received = []
+        m, left, abend, tt, tm = self.engine.match_sink(b, inp, 1, b"json", lambda data: received.append(data[:]))
+        self.assertIs(m, True)
+        self.assertTrue(len(received) == 1)
+        self.assertTrue(received[0] == expected)
+        self.assertTrue(left == 3)
+        m, left, abend, tt, tm = self.engine.match_sink(b, b"xyz", 1, b"json", lambda data: received.append(data[:]))
+        self.assertTrue(m == None)
+        self.assertTrue(len(received) == 1)
+
+
+class RosieShareTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        b, errs = self.engine.compile(b"net.any")
+        self.assertTrue(b)
+
+        # The other engines have not imported net, and do not compile anything
+        others = [rosie.engine(librosiedir) for i in range(3)]
+        shared = [self.engine.share(b, other) for other in others]
+        for other, s in zip(others, shared):
+            self.assertTrue(s)
+            self.assertTrue(s[0] > 0)
+        inputs = [b"1.2.3.4", b"Hello, world!", b"www.google.com:443 and more"]
+        for input in inputs:
+            for encoder in [b"json", b"line", b"color"]:
+                expected = self.engine.match(b, input, 1, encoder)
+                for other, s in zip(others, shared):
+                    m, left, abend, tt, tm = other.match(s, input, 1, encoder)
+                    self.assertTrue((m, left, abend) == expected[0:3])
+
+        # A shared pattern stays usable after the original is freed
+        b = None
+        shared[1] = None
+        m, left, abend, tt, tm = others[0].match(shared[0], b"1.2.3.4", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(json.loads(m)['type'] == "net.any")
+
+        # A shared pattern can be shared again
+        again = others[0].share(shared[0], others[1])
+        self.assertTrue(again)
+        m, left, abend, tt, tm = others[1].match(again, b"1.2.3.4", 1, b"json")
+        self.assertTrue(m)
+
+        self.assertRaises(RuntimeError, self.engine.share, again, self.engine)
+
+class RosieCloneTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        self.engine.load(b'digits = [:digit:]+')
+        unused, errs = self.engine.compile(b"[:alpha:]+")
+        self.assertTrue(unused)
+        b, errs = self.engine.compile(b"net.any")
+        self.assertTrue(b)
+        d, errs = self.engine.compile(b"digits")
+        self.assertTrue(d)
+        unused = None           # leave a free slot in the rplx table
+        libpath = self.engine.libpath()
+
+        clone = self.engine.clone()
+        self.assertTrue(clone.libpath() == libpath)
+        for pat, input in [(b, b"1.2.3.4"), (b, b"www.google.com:443"), (d, b"1234x")]:
+            for encoder in [b"json", b"line", b"byte"]:
+                expected = self.engine.match(pat, input, 1, encoder)
+                m, left, abend, tt, tm = clone.match(pat, input, 1, encoder)
+                self.assertTrue((m, left, abend) == expected[0:3])
+
+        # The clone has the packages and bindings of the original
+        c, errs = clone.compile(b"net.ipv4 digits")
+        self.assertTrue(c)
+        m, left, abend, tt, tm = clone.match(c, b"1.2.3.4 42", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        # New compiled patterns in the clone do not reuse the numbers in use
+        self.assertTrue(c[0] != b[0] and c[0] != d[0])
+
+        # The clone is independent of the original
+        self.engine.load(b'digits = [:alpha:]+')
+        m, left, abend, tt, tm = clone.match(d, b"1234x", 1, b"line")
+        self.assertTrue(m == b"1234x")
+        m, left, abend, tt, tm = clone.match(b, b"1.2.3.4", 1, b"json")
+        self.assertTrue(json.loads(m)['type'] == "net.any")
+
+        # A clone of a clone
+        clone2 = clone.clone()
+        m, left, abend, tt, tm = clone2.match(c, b"1.2.3.4 42", 1, b"json")
+        self.assertTrue(m)
+
+class RosieMatchBatchTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        b, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(b[0] > 0)
+        self.assertTrue(errs == None)
+
+        inputs = [b"321", b"xyz", b"12ab", b""]
+        results = self.engine.match_batch(b, inputs)
+        self.assertTrue(len(results) == 4)
+        m, left, abend, tt, tm = results[0]
+        m = json.loads(m)
+        self.assertTrue(m['s'] == 1)
+        self.assertTrue(m['e'] == 4)
+        self.assertTrue(m['data'] == "321")
+        self.assertTrue(left == 0)
+        self.assertTrue(abend == False)
+        m, left, abend, tt, tm = results[1]
+        self.assertTrue(m == None)
+        self.assertTrue(left == 3)
+        m, left, abend, tt, tm = results[2]
+        self.assertTrue(json.loads(m)['data'] == "12")
+        self.assertTrue(left == 2)
+        m, left, abend, tt, tm = results[3]
+        self.assertTrue(m == None)
+
+        # Every result must agree with a call to match()
+        for inp, result in zip(inputs, results):
+            self.assertTrue(result[0:3] == self.engine.match(b, inp, 1, b"json")[0:3])
+
+        results = self.engine.match_batch(b, [b"321", b"321"], starts=[2, 3])
+        self.assertTrue(json.loads(results[0][0])['data'] == "21")
+        self.assertTrue(json.loads(results[1][0])['data'] == "1")
+
+        # Encoders implemented in Lua take a different path through librosie
+        results = self.engine.match_batch(b, [b"321", b"xyz"], encoder=b"bool")
+        self.assertIs(results[0][0], True)
+        self.assertTrue(results[1][0] == None)
+        results = self.engine.match_batch(b, [b"321", b"xyz"], encoder=b"color")
+        self.assertTrue(str23(results[0][0])[0] == '\x1B')
+        self.assertTrue(results[1][0] == None)
+
+        self.assertTrue(self.engine.match_batch(b, []) == [])
+        self.assertRaises(ValueError, self.engine.match_batch, b, [b"321"], None, b"this_is_not_a_valid_encoder_name")
+        self.assertRaises(ValueError, self.engine.match_batch, b, [b"321"], [1, 2])
+
+
+class RosieStatsTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        stats = self.engine.stats()
+        self.assertTrue(stats['matches'] == 0)
+        self.assertTrue(stats['patterns'] == {})
+
+        b, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(b[0] > 0)
+        self.engine.match(b, b"321", 1, b"json")
+        self.engine.match(b, b"xyz", 1, b"json")
+        self.engine.match_batch(b, [b"1", b"22", b"a"])
+
+        stats = self.engine.stats()
+        self.assertTrue(stats['matches'] == 5)
+        self.assertTrue(stats['matched'] == 3)
+        self.assertTrue(stats['unmatched'] == 2)
+        self.assertTrue(stats['errors'] == 0)
+        self.assertTrue(stats['bytes'] == 9)
+        self.assertTrue(sum(stats['match_us_histogram']) == 5)
+        self.assertTrue(stats['match_ms'] > 0)
+        self.assertTrue(stats['vm_ms'] >= 0 and stats['encode_ms'] >= 0)
+        self.assertTrue(stats['patterns'] == {str(b[0]): 5})
+        self.assertTrue(stats['heap_kb'] > 0)
+        self.assertTrue(stats['prefiltered'] == 0)
+
+        # Inputs without "GET" or "PUT" are rejected before matching
+        b2, errs = self.engine.compile(b'{"GET" / "PUT"} [:space:]+ [:alpha:]+')
+        self.assertTrue(b2[0] > 0)
+        m = self.engine.match(b2, b"GET abc", 1, b"json")
+        self.assertTrue(m)
+        m = self.engine.match(b2, b"POST abc", 1, b"json")
+        self.assertFalse(m)
+        m = self.engine.match(b2, b"xGET abc", 1, b"json")
+        self.assertFalse(m)
+        stats = self.engine.stats()
+        self.assertTrue(stats['prefiltered'] == 1)
+        self.assertTrue(stats['unmatched'] == 4)
+
+        # A freed pattern number starts counting again
+        pat = b[0]
+        b = None
+        stats = self.engine.stats()
+        self.assertTrue(str(pat) not in stats['patterns'])
+
+
+class RosiePoolTest(unittest.TestCase):
+
+    pool = None
+
+    def setUp(self):
+        self.pool = rosie.pool(3, librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        self.assertTrue(self.pool.size() == 3)
+
+        ok, pkgname, errs = self.pool.load(b'package x; foo = "foo"')
+        self.assertTrue(ok)
+        self.assertTrue(pkgname == b"x")
+
+        b, errs = self.pool.compile(b"x.foo")
+        self.assertTrue(b[0] > 0)
+        bad, errs = self.pool.compile(b"x.bar")
+        self.assertTrue(bad == None)
+        self.assertTrue(errs != None)
+
+        ok, pkgname, errs = self.pool.import_pkg(b"num")
+        self.assertTrue(ok)
+        d, errs = self.pool.compile(b"num.int")
+        self.assertTrue(d[0] > 0)
+
+        m, left, abend, tt, tm = self.pool.match(b, b"foobar", 1, b"json")
+        m = json.loads(m)
+        self.assertTrue(m['data'] == "foo")
+        self.assertTrue(left == 3)
+        m, left, abend, tt, tm = self.pool.match(b, b"bar", 1, b"json")
+        self.assertTrue(m == None)
+        self.assertRaises(ValueError, self.pool.match, b, b"foo", 1, b"this_is_not_a_valid_encoder_name")
+
+        inputs = [str(i).encode() + b"x" for i in range(100)]
+        results = self.pool.match_batch(d, inputs)
+        self.assertTrue(len(results) == 100)
+        for i, result in enumerate(results):
+            self.assertTrue(json.loads(result[0])['data'] == str(i))
+            self.assertTrue(result[1] == 1)
+
+        stats = self.pool.stats()
+        self.assertTrue(stats['workers'] == 3)
+        self.assertTrue(len(stats['stats']) == 3)
+        self.assertTrue(sum([w['jobs'] for w in stats['stats']]) > 0)
+        for w in stats['stats']:
+            self.assertTrue(0 <= w['utilization'] <= 1)
+
+        # Asynchronous matching
+        fd = self.pool.completion_fd()
+        for i in range(100):
+            self.pool.submit(d, str(i).encode() + b"x", i)
+        self.pool.submit(b, b"foo", 100, encoder=b"this_is_not_a_valid_encoder_name")
+        results = {}
+        while len(results) < 101:
+            readable, _, _ = select.select([fd], [], [], 10)
+            self.assertTrue(readable == [fd])
+            for tag, result in self.pool.poll(16):
+                results[tag] = result
+        for i in range(100):
+            self.assertTrue(json.loads(results[i][0])['data'] == str(i))
+            self.assertTrue(results[i][1] == 1)
+        self.assertTrue(isinstance(results[100], ValueError))
+        readable, _, _ = select.select([fd], [], [], 0)
+        self.assertTrue(readable == [])
+        self.assertTrue(self.pool.poll() == [])
+
+
 class RosieTraceTest(unittest.TestCase):
 
     engine = None
@@ -353,6 +694,175 @@ class RosieTraceTest(unittest.TestCase):
         self.assertTrue(len(trace) > 0)
 
 
+class RosieEncoderTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        # One line per capture: depth, name, start, end, and text
+        def tsv(input, captures):
+            return b"".join([(b"%d\t%s\t%d\t%d\t%s\n" % (depth, name, s, e, text))
+                             for name, text, s, e, depth in captures])
+
+        self.engine.register_encoder(b"tsv", tsv)
+        ok, pkgname, errs = self.engine.load(b"d = [:digit:]+; pair = d \",\" d")
+        self.assertTrue(ok)
+        b, errs = self.engine.compile(b"pair")
+        self.assertTrue(b[0] > 0)
+
+        m, left, abend, tt, tm = self.engine.match(b, b"12,345x", 1, b"tsv")
+        self.assertTrue(m == b"0\tpair\t1\t7\t12,345\n1\td\t1\t3\t12\n1\td\t4\t7\t345\n")
+        self.assertTrue(left == 1)
+        m, left, abend, tt, tm = self.engine.match(b, b"12;345", 1, b"tsv")
+        self.assertTrue(m == None)
+        self.assertTrue(left == 6)
+
+        results = self.engine.match_batch(b, [b"1,2", b"x", b"12,345"], encoder=b"tsv")
+        self.assertTrue(results[0][0] == b"0\tpair\t1\t4\t1,2\n1\td\t1\t2\t1\n1\td\t3\t4\t2\n")
+        self.assertTrue(results[1][0] == None)
+        self.assertTrue(results[2][0] == self.engine.match(b, b"12,345", 1, b"tsv")[0])
+
+        # A registered encoder is used by matchfile, and by a clone
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        net_any, errs = self.engine.compile(b"findall:net.any")
+        self.engine.register_encoder(b"names", lambda input, captures: b" ".join([c[0] for c in captures]))
+        cin, cout, cerr = self.engine.matchfile(net_any, b"names",
+                                                b"../../../test/resolv.conf",
+                                                b"/tmp/resolv.out", b"/dev/null")
+        self.assertTrue((cin, cout, cerr) == (10, 5, 5))
+        out = b""
+        for line in open("../../../test/resolv.conf", "rb").read().split(b'\n')[:-1]:
+            m, left, abend, tt, tm = self.engine.match(net_any, line, 1, b"names")
+            if m: out = out + m + b'\n'
+        self.assertTrue(open("/tmp/resolv.out", "rb").read() == out)
+        e2 = self.engine.clone()
+        self.assertTrue(e2.match(b, b"12,345", 1, b"tsv")[0] == self.engine.match(b, b"12,345", 1, b"tsv")[0])
+
+        # A registered encoder hides a built-in one until it is removed
+        self.engine.register_encoder(b"json", lambda input, captures: b"not json")
+        self.assertTrue(self.engine.match(b, b"1,2", 1, b"json")[0] == b"not json")
+        self.engine.register_encoder(b"json", None)
+        self.assertTrue(json.loads(self.engine.match(b, b"1,2", 1, b"json")[0])['type'] == "pair")
+        self.assertTrue(e2.match(b, b"1,2", 1, b"tsv")[0] != None)
+
+        self.assertRaises(ValueError, self.engine.register_encoder, b"", tsv)
+        self.assertRaises(ValueError, self.engine.register_encoder, b"x" * 100, tsv)
+
+
+class RosieColumnsTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        ok, pkgname, errs = self.engine.load(b"d = [:digit:]+; pair = d \",\" d")
+        self.assertTrue(ok)
+        b, errs = self.engine.compile(b"pair")
+        self.assertTrue(b[0] > 0)
+
+        cols = self.engine.match_columns(b, [b"d", b"pair", b"missing"], [b"1,2", b"x", b"12,345"])
+        self.assertTrue(cols[b"d"] == [(0, 1, 2, b"1"), (0, 3, 4, b"2"), (2, 1, 3, b"12"), (2, 4, 7, b"345")])
+        self.assertTrue(cols[b"pair"] == [(0, 1, 4, b"1,2"), (2, 1, 7, b"12,345")])
+        self.assertTrue(cols[b"missing"] == [])
+        cols = self.engine.match_columns(b, [b"d"], [b"x1,2", b"xx1,2"], starts=[2, 3])
+        self.assertTrue(cols[b"d"] == [(0, 2, 3, b"1"), (0, 4, 5, b"2"), (1, 3, 4, b"1"), (1, 5, 6, b"2")])
+        self.assertTrue(self.engine.match_columns(b, [b"d"], []) == {b"d": []})
+
+        # The columns of a file hold the same captures as the json output
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        net_any, errs = self.engine.compile(b"findall:net.any")
+        names = [b"net.ipv4", b"net.fqdn"]
+        cin, cout, cerr = self.engine.matchfile_columns(net_any, names,
+                                                        b"../../../test/resolv.conf",
+                                                        b"/tmp/resolv.cols", b"/tmp/resolv.err")
+        self.assertTrue((cin, cout, cerr) == (10, 5, 5))
+        expected = dict([(name, []) for name in names])
+        def walk(record, m):
+            if m['type'].encode() in expected:
+                expected[m['type'].encode()].append((record, m['s'], m['e'], m['data'].encode()))
+            for sub in m.get('subs', []):
+                walk(record, sub)
+        lines = open("../../../test/resolv.conf", "rb").read().split(b'\n')[:-1]
+        for i, line in enumerate(lines):
+            m, left, abend, tt, tm = self.engine.match(net_any, line, 1, b"json")
+            if m: walk(i, json.loads(m))
+        self.assertTrue(rosie.read_columns(open("/tmp/resolv.cols", "rb").read()) == expected)
+        self.assertTrue(len(expected[b"net.ipv4"]) > 0)
+
+        cin, cout, cerr = self.engine.matchfile_columns(net_any, names,
+                                                        b"../../../test/resolv.conf",
+                                                        b"/tmp/resolv.cols", b"/dev/null",
+                                                        wholefile=True)
+        self.assertTrue((cin, cout, cerr) == (1, 1, 0))
+        cols = rosie.read_columns(open("/tmp/resolv.cols", "rb").read())
+        self.assertTrue(len(cols[b"net.ipv4"]) == len(expected[b"net.ipv4"]))
+        self.assertTrue(all([c[0] == 0 for c in cols[b"net.ipv4"]]))
+        self.assertRaises(ValueError, self.engine.matchfile_columns, net_any, names, b"this_file_does_not_exist")
+
+
+class RosieProjectionTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        self.engine = rosie.engine(librosiedir)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        def names(m):
+            return [m['type']] + sum([names(sub) for sub in m.get('subs', [])], [])
+
+        ok, pkgname, errs = self.engine.load(b"d = [:digit:]+; pair = d \",\" d; alias w = [:alpha:]+; rec = w pair")
+        self.assertTrue(ok)
+        full, errs = self.engine.compile(b"rec")
+        only_d, errs = self.engine.compile(b"rec", [b"d"])
+        self.assertTrue(only_d[0] > 0)
+        none, errs = self.engine.compile(b"rec", [])
+        self.assertTrue(none[0] > 0)
+        for data in [b"ab 1,2", b"ab 1,", b"1,2", b"ab 12,345 x"]:
+            m, left, abend, tt, tm = self.engine.match(full, data, 1, b"json")
+            m_d, left_d, abend, tt, tm = self.engine.match(only_d, data, 1, b"json")
+            m_none, left_none, abend, tt, tm = self.engine.match(none, data, 1, b"json")
+            self.assertTrue((m is None) == (m_d is None) == (m_none is None))
+            self.assertTrue(left == left_d == left_none)
+            if m:
+                self.assertTrue(names(json.loads(m)) == ['rec', 'pair', 'd', 'd'])
+                self.assertTrue(names(json.loads(m_d)) == ['rec', 'd', 'd'])
+                self.assertTrue(names(json.loads(m_none)) == ['rec'])
+                self.assertTrue(json.loads(m_d)['e'] == json.loads(m)['e'])
+
+        # An expression that is not a reference, and a grammar
+        b, errs = self.engine.compile(b"pair pair", [b"pair"])
+        m, left, abend, tt, tm = self.engine.match(b, b"1,2 3,4", 1, b"json")
+        self.assertTrue(names(json.loads(m)) == ['*', 'pair', 'pair'])
+        ok, pkgname, errs = self.engine.load(b"grammar item = d in list = item {\",\" list}? end")
+        self.assertTrue(ok)
+        b, errs = self.engine.compile(b"list", [b"d"])
+        m, left, abend, tt, tm = self.engine.match(b, b"1,22,333", 1, b"json")
+        self.assertTrue(names(json.loads(m)) == ['list', 'd', 'd', 'd'])
+        b, errs = self.engine.compile(b"findall:pair", [b"d"])
+        m, left, abend, tt, tm = self.engine.match(b, b"x 1,2 y 3,4", 1, b"json")
+        self.assertTrue(names(json.loads(m)) == ['*', 'd', 'd', 'd', 'd'])
+
+
 class RosieMatchFileTest(unittest.TestCase):
 
     engine = None
@@ -391,6 +901,45 @@ class RosieMatchFileTest(unittest.TestCase):
         self.assertTrue(cout == 0)
         self.assertTrue(cerr == 1)
 
+        # The json, line, and byte encoders use the native matchfile
+        # loop, which must give the same output as matching each line
+        lines = open("../../../test/resolv.conf", "rb").read().split(b'\n')[:-1]
+        for encoder in [b"json", b"line", b"byte"]:
+            cin, cout, cerr = self.engine.matchfile(self.findall_net_any, encoder,
+                                                    b"../../../test/resolv.conf",
+                                                    b"/tmp/resolv.out", b"/tmp/resolv.err")
+            out, err = b"", b""
+            for line in lines:
+                m, left, abend, tt, tm = self.engine.match(self.findall_net_any, line, 1, encoder)
+                if m: out = out + m + b'\n'
+                else: err = err + line + b'\n'
+            self.assertTrue((cin, cout, cerr) == (10, 5, 5))
+            self.assertTrue(open("/tmp/resolv.out", "rb").read() == out)
+            self.assertTrue(open("/tmp/resolv.err", "rb").read() == err)
+        cin, cout, cerr = self.engine.matchfile(self.findall_net_any, b"line",
+                                                b"../../../test/resolv.conf",
+                                                b"/dev/null", b"/dev/null",
+                                                wholefile=True)
+        self.assertTrue((cin, cout, cerr) == (1, 1, 0))
+
+        # A pool matches chunks of the file in parallel, with the same results
+        p = rosie.pool(2, librosiedir)
+        ok, errs = p.replay(self.engine)
+        self.assertTrue(ok)
+        pat, errs = p.compile(b"findall:net.any")
+        self.assertTrue(pat)
+        for encoder in [b"json", b"color", b"line"]:
+            serial = self.engine.matchfile(self.findall_net_any, encoder,
+                                           b"../../../test/resolv.conf",
+                                           b"/tmp/resolv.out", b"/tmp/resolv.err")
+            parallel = p.matchfile(pat, encoder,
+                                   b"../../../test/resolv.conf",
+                                   b"/tmp/resolv.pool.out", b"/tmp/resolv.pool.err")
+            self.assertTrue(serial == parallel)
+            self.assertTrue(open("/tmp/resolv.out", "rb").read() == open("/tmp/resolv.pool.out", "rb").read())
+            self.assertTrue(open("/tmp/resolv.err", "rb").read() == open("/tmp/resolv.pool.err", "rb").read())
+        self.assertRaises(ValueError, p.matchfile, pat, b"json", b"this_file_does_not_exist")
+
 class RosieReadRcfileTest(unittest.TestCase):
 
     engine = None
@@ -21,6 +21,8 @@ enum KEYS {
   alloc_actual_limit_key,
   prev_string_result_key,
   violation_strip_key,
+  batch_results_key,
+  shared_code_key,
   KEY_ARRAY_SIZE
 };
 
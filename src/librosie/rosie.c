@@ -30,6 +30,99 @@ static void pushargs(lua_State *L, int argc, char **argv) {
 
 int luaopen_readline (lua_State *L); /* will dynamically load the system libreadline/libedit */
 
+/* ----------------------------------------------------------------------------------------
+ * Parallel matching (rosie match --threads N)
+ * ----------------------------------------------------------------------------------------
+ */
+
+static Pool *cli_pool = NULL;
+static int cli_pool_pat = 0;
+
+static int pool_error(lua_State *L, const char *msg, str *messages) {
+  if (messages->ptr) {
+    lua_pushfstring(L, "%s: %s", msg, lua_pushlstring(L, (const char *)messages->ptr, messages->len));
+    rosie_free_string(*messages);
+  } else {
+    lua_pushstring(L, msg);
+  }
+  return lua_error(L);
+}
+
+/* Lua: cin, cout, cerr = cli_parallel_matchfile(nthreads, history, expression,
+ *                                               infilename, outfilename, errfilename, encoder,
+ *                                               optional_captures)
+ *
+ * On the first call, a pool is created, the engine history is replayed
+ * in the pool engines, and the expression is compiled (keeping only the
+ * captures in the optional list, if given).  The pool is used for the
+ * rest of the files named on the command line.  As with
+ * engine.matchfile(), a nil outfilename or errfilename means that those
+ * lines are only counted.
+ */
+static int cli_parallel_matchfile(lua_State *L) {
+  int r, ok, cin, cout, cerr;
+  size_t len;
+  str messages, err, expression;
+  int nthreads = luaL_checkinteger(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  const char *exp = luaL_checklstring(L, 3, &len);
+  char *infilename = (char *) luaL_checkstring(L, 4);
+  char *outfilename = (char *) luaL_optstring(L, 5, NULL);
+  char *errfilename = (char *) luaL_optstring(L, 6, NULL);
+  char *encoder = (char *) luaL_checkstring(L, 7);
+  messages.ptr = NULL;
+  if (!cli_pool) {
+    cli_pool = rosie_pool_new(nthreads, &messages);
+    if (!cli_pool) return pool_error(L, "cannot create engines for parallel matching", &messages);
+    r = pool_replay_history(cli_pool, L, 2, &ok, &messages);
+    if ((r != SUCCESS) || !ok)
+      return pool_error(L, "cannot set up engines for parallel matching", &messages);
+    expression = rosie_string_from((byte_ptr) exp, len);
+    if (lua_istable(L, 8)) {
+      int i, ncaptures = (int) luaL_len(L, 8);
+      char **captures = malloc((ncaptures + 1) * sizeof(char *));
+      if (!captures) return luaL_error(L, "out of memory");
+      for (i = 0; i < ncaptures; i++) {
+	lua_rawgeti(L, 8, i + 1);
+	/* A string in the table stays alive after it is popped */
+	captures[i] = (lua_type(L, -1) == LUA_TSTRING) ? (char *) lua_tostring(L, -1) : NULL;
+	lua_pop(L, 1);
+	if (!captures[i]) {
+	  free(captures);
+	  return luaL_error(L, "capture name is not a string");
+	}
+      }
+      r = rosie_pool_compile_projected(cli_pool, &expression, ncaptures, captures,
+				       &cli_pool_pat, &messages);
+      free(captures);
+    } else {
+      r = rosie_pool_compile(cli_pool, &expression, &cli_pool_pat, &messages);
+    }
+    if ((r != SUCCESS) || !cli_pool_pat)
+      return pool_error(L, "cannot compile pattern for parallel matching", &messages);
+    rosie_free_string(messages);
+  }
+  r = rosie_pool_matchfile(cli_pool, cli_pool_pat, encoder, FALSE,
+			   infilename, outfilename, errfilename,
+			   &cin, &cout, &cerr, &err);
+  if (r != SUCCESS) return luaL_error(L, "parallel matchfile failed (%d)", r);
+  if (cin == -1) {
+    /* Same results as engine.matchfile() */
+    lua_pushnil(L);
+    if (err.ptr) {
+      lua_pushlstring(L, (const char *)err.ptr, err.len);
+      rosie_free_string(err);
+    } else {
+      lua_pushinteger(L, cout);
+    }
+    return 2;
+  }
+  lua_pushinteger(L, cin);
+  lua_pushinteger(L, cout);
+  lua_pushinteger(L, cerr);
+  return 3;
+}
+
 static int rosie_exec_cli(Engine *e, int argc, char **argv, char **err) {
   char fname[MAXPATHLEN];
   size_t len = strnlen(rosiehome, MAXPATHLEN);
@@ -45,6 +138,7 @@ static int rosie_exec_cli(Engine *e, int argc, char **argv, char **err) {
 
   get_registry(engine_key);
   lua_setglobal(L, "cli_engine");
+  lua_register(L, "cli_parallel_matchfile", cli_parallel_matchfile);
   
   pushargs(L, argc, argv);
 
@@ -136,6 +230,7 @@ int main (int argc, char **argv) {
 #endif
   }
 
+  if (cli_pool) rosie_pool_finalize(cli_pool);
   rosie_finalize(e);
   return status;
 }
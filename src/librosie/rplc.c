@@ -0,0 +1,116 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rplc.c  Part of librosie.c                                               */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* The "rplc" Lua module, used by pkgcache.lua to save compiled packages
+ * in .rplc files and to read them back.
+ *
+ * A peg is saved as its tree, which lpeg keeps in one block with no
+ * pointers in it, and its ktable (the capture names and other
+ * constants that the tree refers to by index).  The code for a peg is
+ * not saved, because lpeg generates it the first time the peg is
+ * used.  Because the tree is saved as it is laid out in memory, a
+ * .rplc file can only be read by the same build of librosie on the
+ * same platform.  rplc.signature() identifies the layout, and
+ * pkgcache.lua rejects files with a different signature.
+ */
+
+#include "lptree.h"		/* Pattern, TTree */
+#include "lpvm.h"		/* Instruction */
+
+/* rplc.dump(peg) returns the tree of peg as a string, and its ktable
+ * (or nil).  Returns nothing if the ktable holds values other than
+ * strings, numbers, and booleans.
+ */
+static int rplc_dump(lua_State *L) {
+  int t;
+  size_t size;
+  Pattern *p;
+  luaL_Buffer b;
+  luaL_checkudata(L, 1, PATTERN_T);
+  size = lua_rawlen(L, 1);
+  lua_getuservalue(L, 1);
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      t = lua_type(L, -1);
+      if ((t != LUA_TSTRING) && (t != LUA_TNUMBER) && (t != LUA_TBOOLEAN)) return 0;
+      lua_pop(L, 1);
+    }
+  }
+  p = (Pattern *) luaL_buffinitsize(L, &b, size);
+  memcpy(p, lua_touserdata(L, 1), size);
+  p->code = NULL;
+  p->codesize = 0;
+  luaL_pushresultsize(&b, size);
+  lua_insert(L, 2);
+  return 2;
+}
+
+/* rplc.load(tree, ktable) returns a new peg made from the results of
+ * rplc.dump()
+ */
+static int rplc_load(lua_State *L) {
+  size_t size;
+  Pattern *p;
+  const char *tree = luaL_checklstring(L, 1, &size);
+  if ((size < sizeof(Pattern)) || ((size - sizeof(Pattern)) % sizeof(TTree)))
+    return luaL_error(L, "invalid pattern tree");
+  if (lua_isnoneornil(L, 2)) {
+    lua_settop(L, 1);
+    lua_newtable(L);
+  } else {
+    luaL_checktype(L, 2, LUA_TTABLE);
+  }
+  p = lua_newuserdata(L, size);
+  memcpy(p, tree, size);
+  p->code = NULL;
+  p->codesize = 0;
+  luaL_getmetatable(L, PATTERN_T);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 2);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+/* rplc.hash(s) returns the 64-bit FNV-1a hash of s as a hex string */
+static int rplc_hash(lua_State *L) {
+  size_t len;
+  const unsigned char *s = (const unsigned char *) luaL_checklstring(L, 1, &len);
+  uint64_t h = 0xcbf29ce484222325ULL;
+  char hex[17];
+  for (size_t i = 0; i < len; i++) {
+    h ^= s[i];
+    h *= 0x100000001b3ULL;
+  }
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) h);
+  lua_pushstring(L, hex);
+  return 1;
+}
+
+/* rplc.signature() identifies the layout of the saved trees */
+static int rplc_signature(lua_State *L) {
+  const uint16_t one = 1;
+  lua_pushfstring(L, "%d.%d.%d.%s",
+		  (int) sizeof(Pattern), (int) sizeof(TTree), (int) sizeof(Instruction),
+		  (*(const char *) &one) ? "le" : "be");
+  return 1;
+}
+
+static const luaL_Reg rplc_functions[] = {
+  {"dump", rplc_dump},
+  {"load", rplc_load},
+  {"hash", rplc_hash},
+  {"signature", rplc_signature},
+  {NULL, NULL}
+};
+
+int luaopen_rplc(lua_State *L) {
+  luaL_newlib(L, rplc_functions);
+  return 1;
+}
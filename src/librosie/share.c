@@ -0,0 +1,315 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  share.c  Part of librosie.c                                              */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Sharing compiled patterns between engines
+ *
+ * rosie_rplx_share() gives one engine the use of a pattern compiled by
+ * another, without parsing, expanding, and compiling it again.  The
+ * matching program (the lpeg code) is copied once, out of the Lua heap
+ * of the engine that compiled it, into a block that is never modified
+ * and is reference counted.  Every engine that the pattern is shared
+ * with gets its own small peg: a copy of the pattern header and tree
+ * (which contain no pointers) whose code is the shared block, and a
+ * copy of the pattern's capture name table (its ktable).  The list of
+ * literals used by the prefilter (see prefilter.c) is copied, too.
+ *
+ * Each reference to a shared block is held by a guard, which is a
+ * userdata stored (in a weak table) under the peg that uses the block.
+ * The guard of a peg is created after the peg, so Lua finalizes it
+ * before the peg.  The guard takes the shared code away from the peg,
+ * so that lpeg does not try to free it, and drops the reference.
+ *
+ * A shared pattern can be used for matching, but not for tracing,
+ * because the engine it is shared with has no ast for it.
+ */
+
+#include "lptree.h"		/* Pattern */
+#include "lpvm.h"		/* Instruction */
+
+#define SHARED_GUARD_T "rosie-shared-code"
+
+typedef struct shared_code {
+  int refcount;			/* protected by shared_code_lock */
+  int codesize;			/* number of instructions */
+  Instruction code[1];
+} shared_code;
+
+typedef struct shared_guard {
+  shared_code *sc;
+} shared_guard;
+
+static pthread_mutex_t shared_code_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_COPY_DEPTH 16
+
+/* Push onto 'to' a copy of the value at idx in 'from'.  Tables,
+ * strings, numbers, and booleans are copied, and anything else
+ * arrives as nil.
+ */
+static void copy_value(lua_State *from, int idx, lua_State *to, int depth) {
+  size_t len;
+  const char *s;
+  idx = lua_absindex(from, idx);
+  switch (lua_type(from, idx)) {
+  case LUA_TSTRING:
+    s = lua_tolstring(from, idx, &len);
+    lua_pushlstring(to, s, len);
+    break;
+  case LUA_TNUMBER:
+    if (lua_isinteger(from, idx)) lua_pushinteger(to, lua_tointeger(from, idx));
+    else lua_pushnumber(to, lua_tonumber(from, idx));
+    break;
+  case LUA_TBOOLEAN:
+    lua_pushboolean(to, lua_toboolean(from, idx));
+    break;
+  case LUA_TTABLE:
+    if (depth >= MAX_COPY_DEPTH) {
+      lua_pushnil(to);
+      break;
+    }
+    lua_newtable(to);
+    lua_pushnil(from);
+    while (lua_next(from, idx)) {
+      copy_value(from, -2, to, depth + 1);
+      copy_value(from, -1, to, depth + 1);
+      if (lua_isnil(to, -2)) lua_pop(to, 2);
+      else lua_rawset(to, -3);
+      lua_pop(from, 1);
+    }
+    break;
+  default:
+    lua_pushnil(to);
+  }
+}
+
+static void shared_code_retain(shared_code *sc) {
+  pthread_mutex_lock(&shared_code_lock);
+  sc->refcount++;
+  pthread_mutex_unlock(&shared_code_lock);
+}
+
+static void shared_code_release(shared_code *sc) {
+  int last;
+  pthread_mutex_lock(&shared_code_lock);
+  last = (--sc->refcount == 0);
+  pthread_mutex_unlock(&shared_code_lock);
+  if (last) free(sc);
+}
+
+static int shared_guard_gc(lua_State *L) {
+  shared_guard *g = luaL_checkudata(L, 1, SHARED_GUARD_T);
+  Pattern *p;
+  if (g->sc) {
+    lua_getuservalue(L, 1);
+    p = lua_touserdata(L, -1);
+    if (p && (p->code == g->sc->code)) {
+      p->code = NULL;
+      p->codesize = 0;
+    }
+    shared_code_release(g->sc);
+    g->sc = NULL;
+  }
+  return 0;
+}
+
+/* Push the table in which guards are stored under their pegs */
+static void push_guard_table(lua_State *L) {
+  get_registry(shared_code_key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    set_registry(shared_code_key);
+  }
+}
+
+/* Make a guard holding a reference to sc for the peg at pegidx */
+static void add_guard(lua_State *L, int pegidx, shared_code *sc) {
+  shared_guard *g;
+  pegidx = lua_absindex(L, pegidx);
+  push_guard_table(L);
+  lua_pushvalue(L, pegidx);
+  g = lua_newuserdata(L, sizeof(shared_guard));
+  g->sc = NULL;
+  if (luaL_newmetatable(L, SHARED_GUARD_T)) {
+    lua_pushcfunction(L, shared_guard_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, pegidx);
+  lua_setuservalue(L, -2);
+  shared_code_retain(sc);
+  g->sc = sc;
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* Return the shared code for the peg at pegidx, making it if needed */
+static shared_code *get_shared_code(lua_State *L, int pegidx) {
+  shared_code *sc;
+  shared_guard *g;
+  Pattern *p = lua_touserdata(L, pegidx);
+  pegidx = lua_absindex(L, pegidx);
+  push_guard_table(L);
+  lua_pushvalue(L, pegidx);
+  lua_rawget(L, -2);
+  g = lua_touserdata(L, -1);
+  lua_pop(L, 2);
+  if (g) return g->sc;
+  sc = malloc(sizeof(shared_code) + (p->codesize - 1) * sizeof(Instruction));
+  if (!sc) return NULL;
+  sc->refcount = 0;
+  sc->codesize = p->codesize;
+  memcpy(sc->code, p->code, p->codesize * sizeof(Instruction));
+  add_guard(L, pegidx, sc);
+  return sc;
+}
+
+/* A ktable can be copied to another engine if it holds only strings,
+ * numbers, and booleans (e.g. no functions, as for a Cmt capture).
+ */
+static int ktable_is_copyable(lua_State *L, int idx) {
+  int t, ok = TRUE;
+  idx = lua_absindex(L, idx);
+  if (lua_isnil(L, idx)) return TRUE;
+  if (!lua_istable(L, idx)) return FALSE;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    t = lua_type(L, -1);
+    if ((t != LUA_TSTRING) && (t != LUA_TNUMBER) && (t != LUA_TBOOLEAN)) ok = FALSE;
+    lua_pop(L, 1);
+  }
+  return ok;
+}
+
+/* Push the prefilter literals of pat, which push_peg() has found, or nil */
+static void push_prefilter(lua_State *L, int pat) {
+  get_registry(rplx_table_key);
+  lua_rawgeti(L, -1, pat);
+  lua_getfield(L, -1, "pattern");
+  lua_getfield(L, -1, "prefilter");
+  lua_replace(L, -4);
+  lua_pop(L, 2);
+}
+
+/* Leave on the stack of e the peg for pat, its ktable, and its
+ * prefilter literals, and return the shared code, or NULL if the
+ * pattern cannot be shared.
+ */
+static shared_code *share_from(Engine *e, int pat) {
+  int t;
+  Pattern *p;
+  lua_State *L = e->L;
+  if (!push_peg(L, pat, NULL)) {
+    LOGf("rosie_rplx_share() called with invalid compiled pattern reference: %d\n", pat);
+    return NULL;
+  }
+  p = lua_touserdata(L, -1);
+  if (!p->code) {
+    /* lpeg generates the code the first time a pattern is used */
+    t = lua_getfield(L, -1, "match");
+    CHECK_TYPE("peg:match()", t, LUA_TFUNCTION);
+    lua_pushvalue(L, -2);
+    lua_pushliteral(L, "");
+    t = lua_pcall(L, 2, 0, 0);
+    if ((t != LUA_OK) || !p->code) {
+      LOG("could not generate code for pattern to be shared\n");
+      return NULL;
+    }
+  }
+  lua_getuservalue(L, -1);
+  if (!ktable_is_copyable(L, -1)) {
+    LOG("pattern to be shared has captures that cannot be copied to another engine\n");
+    return NULL;
+  }
+  push_prefilter(L, pat);
+  return get_shared_code(L, -3);
+}
+
+/* Push onto the stack of e a new rplx for a peg made from the peg,
+ * ktable, and prefilter on the stack of from, using the shared code.
+ */
+static int push_shared_rplx(Engine *e, lua_State *from, shared_code *sc) {
+  int t;
+  size_t size = lua_rawlen(from, -3);
+  Pattern *p;
+  lua_State *L = e->L;
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "attach");
+  CHECK_TYPE("engine.attach()", t, LUA_TFUNCTION);
+  lua_insert(L, -2);
+  p = lua_newuserdata(L, size);
+  memcpy(p, lua_touserdata(from, -3), size);
+  p->code = sc->code;
+  p->codesize = sc->codesize;
+  luaL_getmetatable(L, PATTERN_T);
+  lua_setmetatable(L, -2);
+  copy_value(from, -2, L, 0);
+  lua_setuservalue(L, -2);
+  add_guard(L, -1, sc);
+  lua_pushnil(L);		/* name */
+  copy_value(from, -1, L, 0);
+  t = lua_pcall(L, 4, 1, 0);
+  if (t != LUA_OK) {
+    LOG("engine.attach() failed\n");
+    LOGstack(L);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  CHECK_TYPE("new rplx object", lua_type(L, -1), LUA_TTABLE);
+  return SUCCESS;
+}
+
+/* Store in e a new rplx made from the peg, ktable, and prefilter on
+ * the stack of from, using the shared code.
+ */
+static int share_to(Engine *e, lua_State *from, shared_code *sc, int *pat) {
+  int r;
+  lua_State *L = e->L;
+  get_registry(rplx_table_key);
+  r = push_shared_rplx(e, from, sc);
+  if (r != SUCCESS) return r;
+  *pat = luaL_ref(L, -2);
+  if (*pat == LUA_REFNIL) {
+    LOG("error storing rplx object\n");
+    *pat = 0;
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  return SUCCESS;
+}
+
+/* Give engine dst the use of the pattern pat that was compiled in
+ * engine src.  The new pattern, in *dst_pat, is freed with
+ * rosie_free_rplx(dst, *dst_pat), independently of the original.
+ * When the pattern cannot be shared, *dst_pat is 0, and the client
+ * can compile the expression in dst instead.
+ */
+EXPORT
+int rosie_rplx_share(Engine *src, int pat, Engine *dst, int *dst_pat) {
+  int r = SUCCESS;
+  shared_code *sc;
+  *dst_pat = 0;
+  if (src == dst) return ERR_ENGINE_CALL_FAILED;
+  /* Take the locks in a fixed order so that two calls cannot deadlock */
+  if (src < dst) {
+    ACQUIRE_ENGINE_LOCK(src);
+    ACQUIRE_ENGINE_LOCK(dst);
+  } else {
+    ACQUIRE_ENGINE_LOCK(dst);
+    ACQUIRE_ENGINE_LOCK(src);
+  }
+  sc = share_from(src, pat);
+  if (sc) r = share_to(dst, src->L, sc, dst_pat);
+  lua_settop(src->L, 0);
+  lua_settop(dst->L, 0);
+  RELEASE_ENGINE_LOCK(dst);
+  RELEASE_ENGINE_LOCK(src);
+  return r;
+}
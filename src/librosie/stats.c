@@ -0,0 +1,216 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  stats.c  Part of librosie.c                                              */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* Engine statistics
+ *
+ * Each engine keeps cumulative counters of its matches: how many,
+ * how many bytes of input, how long the matches took, and how much
+ * of that time was spent in the matching vm (tmatch) and in encoding
+ * the results (ttotal - tmatch).  It also counts the garbage
+ * collections done by collect_if_needed(), the time spent waiting for
+ * the engine lock, and the number of matches made with each compiled
+ * pattern.  rosie_stats() returns them as json, along with the
+ * figures kept by the engine's allocator (see alloc.c).
+ *
+ * The counters are only updated by a thread holding the engine lock,
+ * so they need no locking of their own.  The cost of keeping them is
+ * two reads of the monotonic clock per match, and a timed wait only
+ * when the engine lock is contended.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#define STATS_BUCKETS 24	/* histogram buckets, by powers of 2 of usec */
+
+typedef struct engine_stats {
+  uint64_t matches, matched, unmatched, errors;
+  uint64_t prefiltered;		/* unmatched without running the vm */
+  uint64_t bytes;
+  uint64_t match_ns;		/* measured around each match */
+  uint64_t vm_us, encode_us;	/* from tmatch and ttotal */
+  uint64_t gc_runs, gc_ns;
+  uint64_t lock_waits, lock_wait_ns;
+  uint64_t match_hist[STATS_BUCKETS];
+  uint64_t lock_wait_hist[STATS_BUCKETS];
+  uint64_t *pat_matches;	/* indexed by compiled pattern number */
+  int npats;
+} engine_stats;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Bucket 0 counts times under 1us, bucket i times in [2^(i-1), 2^i)
+ * us, and the last bucket counts everything longer.
+ */
+static void stats_histogram(uint64_t *hist, uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int i = us ? 64 - __builtin_clzll(us) : 0;
+  if (i >= STATS_BUCKETS) i = STATS_BUCKETS - 1;
+  hist[i]++;
+}
+
+/* Called instead of pthread_mutex_lock when the engine lock is busy */
+static int wait_for_engine_lock(Engine *e) {
+  uint64_t t0 = now_ns();
+  int r = pthread_mutex_lock(&(e->lock));
+  if (r == 0) {
+    uint64_t ns = now_ns() - t0;
+    e->stats->lock_waits++;
+    e->stats->lock_wait_ns += ns;
+    stats_histogram(e->stats->lock_wait_hist, ns);
+  }
+  return r;
+}
+
+/* Count one match with pattern pat.  The outcome is the match code
+ * (0 for no match), or -1 when there is match data.
+ */
+static void stats_match(engine_stats *s, int pat, size_t len, match *m, int outcome, uint64_t ns) {
+  s->matches++;
+  s->bytes += len;
+  if (outcome < 0) s->matched++;
+  else if (outcome == 0) s->unmatched++;
+  else s->errors++;
+  s->match_ns += ns;
+  stats_histogram(s->match_hist, ns);
+  if ((m->ttotal > 0) && (m->tmatch > 0)) {
+    s->vm_us += m->tmatch;
+    if (m->ttotal > m->tmatch) s->encode_us += m->ttotal - m->tmatch;
+  }
+  if (pat <= 0) return;
+  if (pat >= s->npats) {
+    int n = (pat < 2 * s->npats) ? 2 * s->npats : pat + 1;
+    uint64_t *grown = realloc(s->pat_matches, n * sizeof(uint64_t));
+    if (!grown) return;		/* the count for pat is lost */
+    memset(grown + s->npats, 0, (n - s->npats) * sizeof(uint64_t));
+    s->pat_matches = grown;
+    s->npats = n;
+  }
+  s->pat_matches[pat]++;
+}
+
+/* Count the lines of a file matched by rosie_matchfile() */
+static void stats_file(engine_stats *s, int cin, int cout, int cerr) {
+  if (cin < 0) return;
+  s->matches += cin;
+  s->matched += cout;
+  s->unmatched += cerr;
+}
+
+static void stats_prefiltered(engine_stats *s, uint64_t n) {
+  s->prefiltered += n;
+}
+
+static void stats_gc(engine_stats *s, uint64_t ns) {
+  s->gc_runs++;
+  s->gc_ns += ns;
+}
+
+/* Pattern numbers are reused, so the count starts over when pat is freed */
+static void stats_free_pattern(engine_stats *s, int pat) {
+  if ((pat > 0) && (pat < s->npats)) s->pat_matches[pat] = 0;
+}
+
+#define STATS_PATTERN_SIZE 40	/* bytes for ,"<pat>":<count> in "patterns" */
+
+/* Append to the json in buf, which holds size bytes, of which *len are
+ * in use.  Output that does not fit is truncated, so *len never
+ * reaches size, and buf stays nul-terminated.
+ */
+static void stats_append(char *buf, size_t size, int *len, const char *fmt, ...) {
+  va_list args;
+  int n;
+  if ((size_t) *len + 1 >= size) return;
+  va_start(args, fmt);
+  n = vsnprintf(buf + *len, size - *len, fmt, args);
+  va_end(args);
+  if (n < 0) return;
+  *len = ((size_t) *len + n < size) ? *len + n : (int) (size - 1);
+}
+
+static void stats_print_histogram(char *buf, size_t size, int *len,
+				  const char *name, uint64_t *hist) {
+  stats_append(buf, size, len, ",\"%s\":[", name);
+  for (int i = 0; i < STATS_BUCKETS; i++)
+    stats_append(buf, size, len, "%s%llu", (i == 0) ? "" : ",",
+		 (unsigned long long) hist[i]);
+  stats_append(buf, size, len, "]");
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Exported functions
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Returns the statistics of engine e as json:
+ *   {"matches":N, "matched":N, "unmatched":N, "errors":N, "prefiltered":N,
+ *    "bytes":N, "match_ms":T, "vm_ms":T, "encode_ms":T, "gc_runs":N, "gc_ms":T,
+ *    "lock_waits":N, "lock_wait_ms":T, "heap_kb":N,
+ *    "alloc":{"in_use_kb":N, "footprint_kb":N, "high_water_kb":N,
+ *             "cap_kb":N, "failures":N, "fragmentation":F},
+ *    "match_us_histogram":[...], "lock_wait_us_histogram":[...],
+ *    "patterns":{"<pat>":N, ...}}
+ * where the histograms are described at stats_histogram(), and
+ * "patterns" gives the number of matches made with each compiled
+ * pattern.  "prefiltered" counts the unmatched inputs that the
+ * prefilter rejected (see prefilter.c).  The fragmentation is the
+ * fraction of the footprint that is not in use.  N.B. Client must free
+ * stats.
+ */
+EXPORT
+int rosie_stats(Engine *e, str *stats) {
+  int len = 0;
+  size_t size;
+  char *buf;
+  engine_stats *s = e->stats;
+  engine_alloc *a = engine_allocator(e->L);
+  ACQUIRE_ENGINE_LOCK(e);
+  size = 1024 + 2 * STATS_BUCKETS * 24 + s->npats * STATS_PATTERN_SIZE;
+  buf = malloc(size);
+  if (!buf) {
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_OUT_OF_MEMORY;
+  }
+  stats_append(buf, size, &len,
+	       "{\"matches\":%llu,\"matched\":%llu,\"unmatched\":%llu,\"errors\":%llu,"
+	       "\"prefiltered\":%llu,\"bytes\":%llu,\"match_ms\":%.3f,\"vm_ms\":%.3f,\"encode_ms\":%.3f,"
+	       "\"gc_runs\":%llu,\"gc_ms\":%.3f,\"lock_waits\":%llu,\"lock_wait_ms\":%.3f,"
+	       "\"heap_kb\":%d",
+	       (unsigned long long) s->matches, (unsigned long long) s->matched,
+	       (unsigned long long) s->unmatched, (unsigned long long) s->errors,
+	       (unsigned long long) s->prefiltered, (unsigned long long) s->bytes,
+	       s->match_ns / 1e6, s->vm_us / 1e3, s->encode_us / 1e3,
+	       (unsigned long long) s->gc_runs, s->gc_ns / 1e6,
+	       (unsigned long long) s->lock_waits, s->lock_wait_ns / 1e6,
+	       lua_gc(e->L, LUA_GCCOUNT, 0));
+  stats_append(buf, size, &len,
+	       ",\"alloc\":{\"in_use_kb\":%llu,\"footprint_kb\":%llu,\"high_water_kb\":%llu,"
+	       "\"cap_kb\":%llu,\"failures\":%llu,\"fragmentation\":%.4f}",
+	       (unsigned long long) a->in_use / 1024, (unsigned long long) a->footprint / 1024,
+	       (unsigned long long) a->high_water / 1024, (unsigned long long) a->cap / 1024,
+	       (unsigned long long) a->failures,
+	       a->footprint ? 1.0 - (double) a->in_use / a->footprint : 0.0);
+  stats_print_histogram(buf, size, &len, "match_us_histogram", s->match_hist);
+  stats_print_histogram(buf, size, &len, "lock_wait_us_histogram", s->lock_wait_hist);
+  stats_append(buf, size, &len, ",\"patterns\":{");
+  for (int pat = 1, first = TRUE; pat < s->npats; pat++) {
+    if (!s->pat_matches[pat]) continue;
+    stats_append(buf, size, &len, "%s\"%d\":%llu", first ? "" : ",",
+		 pat, (unsigned long long) s->pat_matches[pat]);
+    first = FALSE;
+  }
+  stats_append(buf, size, &len, "}}");
+  RELEASE_ENGINE_LOCK(e);
+  stats->ptr = (byte_ptr) buf;
+  stats->len = len;
+  return SUCCESS;
+}
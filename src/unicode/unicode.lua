@@ -58,11 +58,13 @@ function populate_property_db()
 	 -- A property by the same name exists, but we can merge them if the value sets
 	 -- for each are unique
 	 local existing = property_db[property_name]
+	 local existing_source = source_property_db[property_name]
 	 for value, pattern in pairs(new) do
 	    if existing[value] then
 	       error("Value collision for " .. property_name .. ": " .. value)
 	    else
 	       existing[value] = pattern
+	       existing_source[value] = new_source[value]
 	    end
 	 end
       end
@@ -192,11 +194,56 @@ function write(optional_directory)
       if not f then error(err); end
       f:write(header, "\n")
       f:write("package ", propname, "\n\n")
-      for patname, patsource in pairs(patterns) do
-	 f:write(patname, " = ", patsource, "\n")
+      local patnames = {}
+      for patname in pairs(patterns) do table.insert(patnames, patname); end
+      table.sort(patnames)
+      for _, patname in ipairs(patnames) do
+	 f:write(patname, " = ", patterns[patname], "\n")
       end
       f:close()
    end
 end
 
 
+
+-- -----------------------------------------------------------------------------
+-- Simple case folding, used by the ci macro: write_casefold()
+-- -----------------------------------------------------------------------------
+
+CaseFoldingFile = "CaseFolding.txt"
+
+-- Write a Lua module that maps each codepoint to its simple case folding (the mappings with
+-- status C or S in CaseFolding.txt).  Codepoints that fold to themselves are omitted.
+function write_casefold(optional_filename)
+   optional_filename = optional_filename or "/tmp/casefold.lua"
+   local folds = {}
+   local nl = util.make_nextline_function(CaseFoldingFile)
+   local line = nl()
+   while line do
+      local cp, status, folded = line:match("^(%x+); ([CS]); (%x+);")
+      if cp then
+	 table.insert(folds, string.format("[0x%s]=0x%s,", cp, folded))
+      end
+      line = nl()
+   end
+   print("Writing " .. optional_filename)
+   local f, err = io.open(optional_filename, 'w')
+   if not f then error(err); end
+   f:write("-- -*- Mode: Lua; -*-\n",
+	   "--\n",
+	   "-- casefold.lua    Unicode simple case folding\n",
+	   "--\n",
+	   "-- DO NOT EDIT. THIS FILE WAS GENERATED FROM ", CaseFoldingFile,
+	   " (Unicode ", UNICODE_VERSION, ")\n",
+	   "-- by write_casefold() in src/unicode/unicode.lua.\n",
+	   "--\n",
+	   "-- This file © Copyright IBM, 2018.\n",
+	   "-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)\n",
+	   "\n",
+	   "return {\n")
+   for i = 1, #folds, 8 do
+      f:write(table.concat(folds, " ", i, math.min(i+7, #folds)), "\n")
+   end
+   f:write("}\n")
+   f:close()
+end
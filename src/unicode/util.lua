@@ -28,6 +28,43 @@ end
 -- Compile the ranges
 -- -----------------------------------------------------------------------------
 
+-- The rpl source for a set of codepoint ranges is a single character set expression, e.g.
+-- [[\u0370-\u0373][\u0376-\u0377][\u0375\u037f]], with adjacent ranges merged and the
+-- single codepoints collected into one list.  The compiler turns the whole bracket into one
+-- byte-range automaton, so the source stays small and a match costs a few byte tests.
+
+local function codepoint_escape(cp)
+   if cp < 0x80 then return string.format("\\x%02x", cp)
+   elseif cp <= 0xFFFF then return string.format("\\u%04x", cp)
+   else return string.format("\\U%08x", cp); end
+end
+
+function util.ranges_to_rpl(ranges)
+   local sorted = {}
+   for _, range in ipairs(ranges) do table.insert(sorted, {range[1], range[2]}); end
+   table.sort(sorted, function(r1, r2) return r1[1] < r2[1]; end)
+   local merged = {}
+   for _, range in ipairs(sorted) do
+      local last = merged[#merged]
+      if last and (range[1] <= last[2] + 1) then
+	 last[2] = math.max(last[2], range[2])
+      else
+	 table.insert(merged, range)
+      end
+   end
+   local items, singles = {}, {}
+   for _, range in ipairs(merged) do
+      if range[1] == range[2] then
+	 table.insert(singles, codepoint_escape(range[1]))
+      else
+	 table.insert(items, "[" .. codepoint_escape(range[1]) .. "-" .. codepoint_escape(range[2]) .. "]")
+      end
+   end
+   if singles[1] then table.insert(items, "[" .. table.concat(singles) .. "]"); end
+   if #items == 1 then return items[1]; end
+   return "[" .. table.concat(items) .. "]"
+end
+
 function util.compile_all_ranges(range_table, as_peg)
    local patterns = {}
    for cat, ranges in pairs(range_table) do
@@ -36,7 +73,11 @@ function util.compile_all_ranges(range_table, as_peg)
 	 table.insert(utf8_range, codepoint_range(range[1], range[2]))
       end
       if #ranges > 0 then
-	 patterns[cat] = compile_codepoint_range(utf8_range, as_peg)
+	 if as_peg then
+	    patterns[cat] = compile_codepoint_range(utf8_range, as_peg)
+	 else
+	    patterns[cat] = util.ranges_to_rpl(ranges)
+	 end
       else
 	 print("ERROR", cat, "has no ranges")
       end
@@ -25,6 +25,7 @@ test.dofile(TEST_HOME .. "/rpl-core-test.lua")
 test.dofile(TEST_HOME .. "/rpl-mod-test.lua")
 test.dofile(TEST_HOME .. "/rpl-appl-test.lua")
 test.dofile(TEST_HOME .. "/rpl-future-test.lua")
+test.dofile(TEST_HOME .. "/rpl-optimize-test.lua")
 
 test.dofile(TEST_HOME .. "/trace-test.lua")
 
@@ -274,6 +274,171 @@ if (#results <=0) or (code ~= 0) then
    print(cmd)
 end
 
+---------------------------------------------------------------------------------------------------
+test.heading("Parallel matching")
+
+-- The output (and the summary printed by --verbose) with --threads must be the same as without it,
+-- byte for byte, for encoders written in C (json, line, byte) and in Lua (bool, color)
+for _, args in ipairs{"match -o json net.any",
+		      "match -a -o json net.any",
+		      "match -o byte net.any",
+		      "match -o bool net.any",
+		      "match -a -o bool net.any",
+		      "match -o color net.any",
+		      "match --verbose net.any",
+		      "grep -o line net.ipv4",
+		      "--rpl 'x = {net.any \" \"}' match x",
+		      "-f test/ok.rpl match -o json num.int"} do
+   local parallel_args = args:gsub("(match)", "%1 --threads 3"):gsub("(grep)", "%1 --threads 3")
+   for _, redirect in ipairs{" 2>/dev/null", " 2>&1 >/dev/null"} do
+      local serial_cmd = rosie_cmd .. " " .. args .. " test/resolv.conf" .. redirect
+      local parallel_cmd = rosie_cmd .. " " .. parallel_args .. " test/resolv.conf" .. redirect
+      local serial_results, status, serial_code = util.os_execute_capture(serial_cmd, nil)
+      local parallel_results, status, parallel_code = util.os_execute_capture(parallel_cmd, nil)
+      check(serial_code == parallel_code, "return codes differ for: " .. parallel_cmd)
+      check(table.concat(serial_results, '\n') == table.concat(parallel_results, '\n'),
+	    "output differs for: " .. parallel_cmd)
+   end
+end
+
+---------------------------------------------------------------------------------------------------
+test.heading("Profiling")
+
+-- The output with --profile must be the same as without it, and the profile goes to stderr
+cmd = rosie_cmd .. " match -o json net.any test/resolv.conf 2>/dev/null"
+plain_results = util.os_execute_capture(cmd, nil)
+for _, args in ipairs{"--profile", "--profile --profile-rate 3", "--profile --profile-format folded"} do
+   cmd = rosie_cmd .. " match " .. args .. " -o json net.any test/resolv.conf 2>/dev/null"
+   results, status, code = util.os_execute_capture(cmd, nil)
+   check(code == 0, "return should have been zero for: " .. cmd)
+   check(table.concat(results, '\n') == table.concat(plain_results, '\n'),
+	 "output differs for: " .. cmd)
+end
+
+cmd = rosie_cmd .. " match --profile -o json net.any test/resolv.conf 2>&1 >/dev/null"
+results, status, code = util.os_execute_capture(cmd, nil)
+results_txt = table.concat(results, '\n')
+check(not results_txt:find("traceback"))
+check(results_txt:find("Profile of %d+ inputs"))
+check(results_txt:find(" net.ipv4 %(.*net.rpl:%d+%)"))
+
+cmd = rosie_cmd .. " match --profile --profile-format folded net.any test/resolv.conf 2>&1 >/dev/null"
+results, status, code = util.os_execute_capture(cmd, nil)
+for _, line in ipairs(results) do
+   check(line:find("^%*[^ ]* %d+$"), "not a folded stack: " .. line)
+end
+
+---------------------------------------------------------------------------------------------------
+test.heading("Capture projection")
+
+-- With --captures, the same lines match, and only the listed captures are output
+for _, command in ipairs{"match", "grep"} do
+   cmd = rosie_cmd .. " " .. command .. " -o line net.any test/resolv.conf"
+   plain_results = util.os_execute_capture(cmd, nil)
+   cmd = rosie_cmd .. " " .. command .. " --captures net.ipv4 -o line net.any test/resolv.conf"
+   results, status, code = util.os_execute_capture(cmd, nil)
+   check(code == 0, "return should have been zero for: " .. cmd)
+   check(table.concat(results, '\n') == table.concat(plain_results, '\n'),
+	 "output differs for: " .. cmd)
+end
+
+cmd = rosie_cmd .. " match --captures net.ipv4,net.fqdn -o json net.any test/resolv.conf"
+results, status, code = util.os_execute_capture(cmd, nil)
+check(code == 0, "return should have been zero for: " .. cmd)
+found = false
+for _, line in ipairs(results) do
+   for t in line:gmatch('"type":"([^"]*)"') do
+      found = found or (t == "net.ipv4")
+      check((t == "net.any") or (t == "net.ipv4") or (t == "net.fqdn"), "unexpected capture: " .. t)
+   end
+end
+check(found, "no net.ipv4 captures in: " .. cmd)
+parallel_cmd = cmd:gsub("match", "match --threads 3")
+parallel_results = util.os_execute_capture(parallel_cmd, nil)
+check(table.concat(results, '\n') == table.concat(parallel_results, '\n'),
+      "output differs for: " .. parallel_cmd)
+
+---------------------------------------------------------------------------------------------------
+test.heading("Counting matches")
+
+-- With --count, the number of matching lines is output, and nothing else
+for _, command in ipairs{"match", "grep"} do
+   cmd = rosie_cmd .. " " .. command .. " -o line net.any test/resolv.conf"
+   plain_results = util.os_execute_capture(cmd, nil, "l")
+   -- The lines that do not match are not output, even with --all
+   for _, option in ipairs{"--count", "-c --threads 2", "--count -a", "-c -a --threads 2"} do
+      cmd = rosie_cmd .. " " .. command .. " " .. option .. " net.any test/resolv.conf 2>&1"
+      results, status, code = util.os_execute_capture(cmd, nil, "l")
+      check(code == 0, "return should have been zero for: " .. cmd)
+      check(#results == 1, "expected one line of output from: " .. cmd)
+      check(results[1] == tostring(#plain_results), "wrong count from: " .. cmd)
+   end
+   -- Without --count, the bool encoder still writes a line for each match
+   cmd = rosie_cmd .. " " .. command .. " -o bool net.any test/resolv.conf"
+   results, status, code = util.os_execute_capture(cmd, nil, "l")
+   check(code == 0, "return should have been zero for: " .. cmd)
+   check(#results == #plain_results, "expected one line for each match from: " .. cmd)
+   check(results[1] == "1", "expected 1 for a match from: " .. cmd)
+end
+
+cmd = rosie_cmd .. " match --count net.ipv4 test/resolv.conf test/resolv.conf"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code == 0, "return should have been zero for: " .. cmd)
+check(#results == 2, "expected one line for each file from: " .. cmd)
+check(results[1] and results[1]:match("^test/resolv.conf:%d+$"), "expected filename and count from: " .. cmd)
+
+-- With --all, there are lines that do not match, but --count outputs only the count
+cmd = rosie_cmd .. " match -a -o line net.ipv4 test/resolv.conf 2>/dev/null"
+plain_results = util.os_execute_capture(cmd, nil, "l")
+cmd = rosie_cmd .. " match -a -o line net.ipv4 test/resolv.conf 2>&1 >/dev/null"
+results = util.os_execute_capture(cmd, nil, "l")
+check(#results > 0, "expected lines that do not match from: " .. cmd)
+cmd = rosie_cmd .. " match --count -a net.ipv4 test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code == 0, "return should have been zero for: " .. cmd)
+check(#results == 1, "expected only the count from: " .. cmd)
+check(results[1] == tostring(#plain_results), "wrong count from: " .. cmd)
+
+---------------------------------------------------------------------------------------------------
+test.heading("Fixed strings from a file")
+
+local fixed_file = os.tmpname()
+local f = assert(io.open(fixed_file, "w"))
+f:write("nameserver\n", "domain\n")
+f:close()
+
+-- There is no pattern argument, so the first argument is an input file, and without one, the
+-- input is stdin
+for _, input in ipairs{" test/resolv.conf", " < test/resolv.conf"} do
+   cmd = rosie_cmd .. " grep --fixed-file " .. fixed_file .. input
+   results, status, code = util.os_execute_capture(cmd, nil, "l")
+   check(code == 0, "return should have been zero for: " .. cmd)
+   check(#results == 5, "expected 5 matching lines from: " .. cmd)
+   check(results[1] == "domain abc.aus.example.com", "wrong first line from: " .. cmd)
+end
+
+-- A pattern given with --fixed-file is taken to be an input file
+cmd = rosie_cmd .. " grep --fixed-file " .. fixed_file .. " net.any test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(#results == 7, "expected an error, the file name, and 5 lines from: " .. cmd)
+check(results[1] == "net.any: No such file", "expected an error for net.any from: " .. cmd)
+check(results[2] == "test/resolv.conf:", "expected the file name from: " .. cmd)
+
+-- The strings in the file have no source text for the pool engines to compile
+cmd = rosie_cmd .. " grep --threads 2 --fixed-file " .. fixed_file .. " test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil)
+check(code ~= 0, "return code should not be zero for: " .. cmd)
+check(results[1] and results[1]:find("--threads", 1, true), "expected an error from: " .. cmd)
+
+-- Without --fixed-file, the pattern is required
+cmd = rosie_cmd .. " grep 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil)
+check(code ~= 0, "return code should not be zero for: " .. cmd)
+check(results[1] and results[1]:find("missing argument 'pattern'", 1, true),
+      "expected an error from: " .. cmd)
+
+os.remove(fixed_file)
+
 ---------------------------------------------------------------------------------------------------
 test.heading("Error reporting")
 
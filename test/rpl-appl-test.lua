@@ -301,6 +301,34 @@ for line in lines do
    i = i + 1
 end
 
+subheading("Find with skipping")
+-- The search loop skips bytes that cannot begin a match, including the continuation bytes of
+-- multi-byte characters, and must stop at the same position as the unoptimized loop.
+input = "αβγ x éfoo ☃ foo"
+p = e:compile('keepto:{"foo" [:digit:]*}')
+ok, m, leftover = e:match(p, input)
+check(ok and m)
+check(leftover==#" ☃ foo")
+check(m.subs and m.subs[1] and m.subs[1].s==1 and m.subs[1].e==#"αβγ x é"+1)
+check(m.subs and m.subs[2] and m.subs[2].data=="foo")
+
+p = e:compile('findall:{[x☃] / {"fo" "o"}}')
+ok, m, leftover = e:match(p, input)
+check(ok and m)
+check(leftover==0)
+check(m.subs and #m.subs==4)
+check(m.subs[1].data=="x" and m.subs[2].data=="foo")
+check(m.subs[3].data=="☃" and m.subs[4].data=="foo")
+
+p = e:compile('find:{. "o"}')
+ok, m, leftover = e:match(p, input)
+check(ok and m)
+check(m.subs and m.subs[1] and m.subs[1].data=="fo")
+
+p = e:compile('find:{[:digit:] "x"}')
+ok, m, leftover = e:match(p, input)
+check(ok and (not m))
+
 
 ----------------------------------------------------------------------------------------
 heading("Message and halt")
@@ -565,6 +593,30 @@ ok = e:load('grammar foobar = ci:{"foo" / "bar"} end')
 assert(ok)
 test_foobar()
 
+subheading("ci (utf-8 and escapes)")
+
+function check_ci(exp, inputs, expectation)
+   local p, errs = e:compile(exp)
+   check(p, "failed to compile " .. exp, 1)
+   if not p then return; end
+   for _, input in ipairs(inputs) do
+      local m, leftover = p:match(input)
+      check((not (not m)) == expectation and ((not m) or leftover==0),
+	    "ci mismatch on " .. exp .. " against: " .. input, 1)
+   end
+end
+
+check_ci('ci:"été"', {"été", "ÉTÉ", "Été", "éTé"}, true)
+check_ci('ci:"été"', {"ete", "ÉTE"}, false)
+-- Simple case folding only: ß and ẞ are the same, but "ss" is not
+check_ci('ci:"straße"', {"STRAẞE", "Straße"}, true)
+check_ci('ci:"straße"', {"STRASSE"}, false)
+check_ci('ci:"k"', {"k", "K", "\u{212A}"}, true)
+check_ci('ci:"σ"', {"Σ", "σ", "ς"}, true)
+-- Escapes in the literal are preserved
+check_ci('ci:"a\\"b\\x41\\n"', {'A"bA\n', 'a"Ba\n'}, true)
+check_ci('ci:"a\\"b\\x41\\n"', {'A"bA'}, false)
+
 --[[
 subheading("ci (deep test)")
 
@@ -543,6 +543,49 @@ for _,char in ipairs{"abc", "aè", "eè", "iè", "Øè", "ßè"} do
 end
 
 
+subheading("Byte-range compilation of character sets")
+
+-- Ranges that cross the boundaries between encoding lengths, and between lead bytes
+for _, r in ipairs{{0x400, 0x4FF}, {0x7F0, 0x810}, {0xFFA0, 0x10010}, {0x3F, 0x3000}} do
+   set_expression(string.format('[\\U%08x-\\U%08x]', r[1], r[2]))
+   for _, cp in ipairs{r[1], r[1]+1, (r[1]+r[2])//2, r[2]-1, r[2]} do
+      check_match(global_rplx, utf8.char(cp), true, 0)
+      check_match(global_rplx, utf8.char(cp) .. "x", true, 1)
+   end
+   for _, cp in ipairs{r[1]-1, r[2]+1} do
+      check_match(global_rplx, utf8.char(cp), false)
+   end
+end
+
+-- A union of lists and ranges is compiled as one set, and its complement is still one character
+set_expression('[[a-c][\\u00e8-\\u00ea][x\\u0416][:digit:]]')
+for _, char in ipairs{"a", "c", "x", "7", utf8.char(0xE8), utf8.char(0xEA), utf8.char(0x416)} do
+   check_match(global_rplx, char, true, 0)
+end
+for _, char in ipairs{"d", "y", utf8.char(0xE7), utf8.char(0xEB), utf8.char(0x417), ""} do
+   check_match(global_rplx, char, false)
+end
+set_expression('[^[a-c][\\u00e8-\\u00ea][x\\u0416][:digit:]]')
+for _, char in ipairs{"d", "y", utf8.char(0xE7), utf8.char(0xEB), utf8.char(0x417)} do
+   check_match(global_rplx, char .. "a", true, 1)
+end
+for _, char in ipairs{"a", "c", "x", "7", utf8.char(0xE8), utf8.char(0x416), ""} do
+   check_match(global_rplx, char, false)
+end
+
+-- A single byte from \x80 to \xFF is a prefix of a multi-byte character, so the alternatives are
+-- tried in the order written
+for _, exp in ipairs{'[[\\xc3][\\u00e9]]', '[[\\x80-\\xff][\\u00e9]]', '[\\xc3\\u00e9]'} do
+   set_expression(exp)
+   check_match(global_rplx, utf8.char(0xE9), true, 1)
+end
+for _, exp in ipairs{'[[\\u00e9][\\xc3]]', '[[\\u00e9][\\x80-\\xff]]', '[\\u00e9\\xc3]'} do
+   set_expression(exp)
+   check_match(global_rplx, utf8.char(0xE9), true, 0)
+   check_match(global_rplx, "\xc3x", true, 1)
+end
+
+
 ----------------------------------------------------------------------------------------
 heading("Literal strings with escape sequences")
 ----------------------------------------------------------------------------------------
@@ -695,6 +738,27 @@ m, leftover = rplx:match(text)
 check(m)
 check(leftover==0)
 
+subheading("Codepoint range tables")
+
+-- Each class is one bracket of codepoint ranges, compiled as a single character set
+set_expression('Script.Greek')
+for _, cp in ipairs{0x370, 0x373, 0x375, 0x37F, 0x3A3, 0x1FFE, 0x2126, 0x10140, 0x1018E, 0x101A0} do
+   check_match(global_rplx, utf8.char(cp), true, 0)
+end
+for _, cp in ipairs{0x36F, 0x374, 0x3A2, 0x1FFF, 0x2127, 0x1013F, 0x1018F, 0x41} do
+   check_match(global_rplx, utf8.char(cp), false)
+end
+
+ok, pkgname, errs = e:import('Unicode/Property')
+check(ok)
+-- Values from both PropList.txt and DerivedBinaryProperties.txt are bound
+for _, name in ipairs{"White_Space", "Bidi_Mirrored"} do
+   set_expression('Property.' .. name)
+end
+check_match(global_rplx, "(", true, 0)
+check_match(global_rplx, utf8.char(0x2208), true, 0)
+check_match(global_rplx, "a", false)
+
 
 
 ----------------------------------------------------------------------------------------
@@ -1756,6 +1756,22 @@ end
 check_choice4("{(a ~) / b}")
 check_choice4("{ {a ~} / b }")
 
+-- A choice of many literals is compiled as a trie, which must keep the ordered choice semantics
+words = {'"abc"', '"a"', '"ab"', '"abcd"', '"b"', '"ba"', '"xyz"', '"xy"', '"x\\"y"',
+	 '"é"', '"éa"', '"q1"', '"q2"', '"q3"', '"q4"', '"q5"', '"q6"', '"a"'}
+exp = "{" .. table.concat(words, " / ") .. "}"
+check_match(exp, "abcd", true, 1, "abc")
+check_match(exp, "abd", true, 2, "a")
+check_match(exp, "ba", true, 1, "b")
+check_match(exp, "xyz", true, 0, "xyz")
+check_match(exp, "xyw", true, 1, "xy")
+check_match(exp, 'x"yz', true, 1, 'x"y')
+check_match(exp, "éab", true, 2, "é")
+check_match(exp, "q6", true, 0, "q6")
+check_match(exp, "q7", false)
+check_match(exp, "", false)
+check_match(exp, "c", false)
+
 subheading("Sequences and choices")
 
 function check_chs1(exp)
@@ -2209,6 +2225,156 @@ check_match('.* & {"a"{3} "b"}', "aaab", true, 0)
 check_match('.* & {"a"{3} "b"}', "aaabdef", true, 3)
 check_match('.* & {"a"{3} "b"}', "xaaab", false)
 
+heading("Prefilter")
+function check_prefilter(exp, expected)
+   set_expression(exp)
+   local pf = global_rplx.pattern.prefilter
+   local ok = (pf == expected)
+   if pf and expected then
+      ok = (#pf == #expected)
+      for i = 1, #expected do ok = ok and (pf[i] == expected[i]); end
+   end
+   check(ok, "unexpected prefilter for " .. exp .. ": " ..
+	 ((pf and table.concat(pf, ", ")) or tostring(pf)), 1)
+end
+
+check_prefilter('"abc"', {"abc"})
+check_prefilter('{"a" "bcd" "ef"}', {"abcdef"})	    -- adjacent literals are fused
+check_prefilter('{"a" [:digit:] "bcd" [:digit:] "ef"}', {"bcd"})
+check_prefilter('{"GET" / "PUT"} [:space:]+', {"GET", "PUT"})
+check_prefilter('"GET" / [:digit:]', false)
+check_prefilter('"x"*', false)
+check_prefilter('"xy"+', {"xy"})
+check_prefilter('!"xy" .', false)
+check_prefilter('>"xy" .', {"xy"})
+check_prefilter('[abc]', {"a", "b", "c"})
+check_prefilter('[^abc]', false)
+
+check_match('{"GET" / "PUT"} [:space:]+', "PUT  ", true, 0)
+check_match('{"GET" / "PUT"} [:space:]+', "POST ", false)
+check_match('{"a" "bcd"}', "abcd", true, 0)
+check_match('{"a" "bcd"}', "abce bcd", false)
+
+heading("Output encoders")
+-- The default and color encoders are written in C when librosie provides the rencode module.
+-- Their output must be the same as that of the Lua encoders.
+color = import "color"
+function same_match(m1, m2)
+   if type(m1) ~= "table" or type(m2) ~= "table" then return m1 == m2; end
+   if (m1.type ~= m2.type) or (m1.s ~= m2.s) or (m1.e ~= m2.e) or (m1.data ~= m2.data) then
+      return false
+   end
+   if (m1.subs == nil) ~= (m2.subs == nil) then return false; end
+   if m1.subs then
+      if #m1.subs ~= #m2.subs then return false; end
+      for i = 1, #m1.subs do
+	 if not same_match(m1.subs[i], m2.subs[i]) then return false; end
+      end
+   end
+   return true
+end
+
+function check_encoders(exp, inputs, colors_list)
+   set_expression(exp)
+   for _, input in ipairs(inputs) do
+      local m = global_rplx.pattern.peg:rmatch(input, 1, common.BYTE_ENCODING)
+      if m ~= 0 then
+	 common.native_encoders = false
+	 local lua_table = common.byte_to_lua(m, input)
+	 local lua_colors = map(function(colors) return color.encode(m, input, colors); end,
+				colors_list)
+	 common.native_encoders = true
+	 local c_table = common.byte_to_lua(m, input)
+	 check(same_match(c_table, lua_table), "default output differs for " .. exp .. " on " .. input, 1)
+	 for i, colors in ipairs(colors_list) do
+	    check(color.encode(m, input, colors) == lua_colors[i],
+		  "color output differs for " .. exp .. " on " .. input ..
+		     " with colors " .. tostring(colors), 1)
+	 end
+      end
+   end
+end
+
+if not common.rencode then
+   print("Skipping tests of the C output encoders, because the rencode module is not available")
+else
+   e:load('import net, num, word')
+   colors_list = {false, "*=green", "word.*=red:num.int=blue", "net.*=red:net.ipv4=cyan;bold"}
+   check_encoders('findall:{net.any / num.int / word.any}',
+		  {"a 1 b", "host 10.0.0.1 port 80", "x.y.com and ::1", "   "},
+		  colors_list)
+   check_encoders('{"ab" "cd"}', {"abcd", "abcdef"}, colors_list)
+   check_encoders('{"a" >"b"}', {"ab"}, colors_list)
+   common.native_encoders = true
+end
+
+heading("Capture projection")
+-- Compiling with a list of captures to keep must not change what matches
+function capture_names(m, names)
+   names = names or {}
+   table.insert(names, m.type)
+   for _, sub in ipairs(m.subs or {}) do capture_names(sub, names); end
+   return names
+end
+
+function check_projection(exp, captures, input, expected_names)
+   set_expression(exp)
+   local m, leftover = global_rplx:match(input)
+   local r = e:compile(exp, captures)
+   check(r, "compile with captures failed for " .. exp, 1)
+   local pm, pleftover = r:match(input)
+   check((not m) == (not pm), "projection changed the result of " .. exp .. " on " .. input, 1)
+   check(leftover == pleftover, "projection changed the leftover of " .. exp .. " on " .. input, 1)
+   if expected_names then
+      local names = table.concat(capture_names(pm), " ")
+      check(names == expected_names, "unexpected captures for " .. exp .. ": " .. names, 1)
+   end
+end
+
+e:load('d = [:digit:]+; pair = d "," d; alias w = [:alpha:]+; rec = w pair; rec2 = rec')
+check_projection('rec', {"d"}, "ab 1,2", "rec d d")
+check_projection('rec', {}, "ab 12,345 x", "rec")
+check_projection('rec', {"pair"}, "ab 1,", nil)
+check_projection('rec2', {"d"}, "ab 1,2", "rec2 d d")
+check_projection('rec2', {"pair"}, "ab 1,2", "rec2 pair")
+check_projection('w', {}, "ab", "*")
+check_projection('pair pair', {"pair"}, "1,2 3,4", "* pair pair")
+check_projection('{pair / w}+', {"d"}, "1,2ab3,4", "* d d d d")
+check_projection('!pair .', {}, "1,2", nil)
+check_projection('>pair .', {}, "1,2", "*")
+check_projection('findall:pair', {"d"}, "x 1,2 y 3,4", "* d d d d")
+e:load('grammar item = d in list = item {"," list}? end')
+check_projection('list', {"d"}, "1,22,333", "list d d d")
+check_projection('list', {"list.item"}, "1,22,333", "list list.item list.item list.item")
+check_projection('{list}', {}, "1,2", "*")
+
+heading("Matching without captures")
+-- The 'bool' encoder matches a copy of the pattern that makes only the top-level capture
+function check_nocap(exp, input)
+   set_expression(exp)
+   local m, leftover = global_rplx:match(input, 1, "line")
+   local b, bleftover = global_rplx:match(input, 1, "bool")
+   check((not m) == (not b), "bool result differs for " .. exp .. " on " .. input, 1)
+   check(leftover == bleftover, "bool leftover differs for " .. exp .. " on " .. input, 1)
+   local nocap = global_rplx.pattern.nocap
+   check(nocap, "no peg without captures was made for " .. exp, 1)
+   if m and nocap then
+      local nm = e:attach(nocap, "nocap"):match(input)
+      local names = table.concat(capture_names(nm), " ")
+      check(not names:find(" "), "unexpected captures for " .. exp .. ": " .. names, 1)
+   end
+end
+
+check_nocap('rec', "ab 12,345 x")
+check_nocap('rec', "ab 1,")
+check_nocap('rec2', "ab 1,2")
+check_nocap('w', "ab")
+check_nocap('pair pair', "1,2 3,4")
+check_nocap('{pair / w}+', "1,2ab3,4")
+check_nocap('!pair .', "1,2")
+check_nocap('findall:pair', "x 1,2 y 3,4")
+check_nocap('list', "1,22,333")
+check_nocap('{list}', "1,2")
 
 -- return the test results in case this file is being called by another one which is collecting
 -- up all the results:
@@ -12,6 +12,7 @@ list = import "list"
 map = assert(list.map)
 environment = import "environment"
 common = import "common"
+util = import "util"
 violation = import "violation"
 
 check = test.check
@@ -201,6 +202,65 @@ check(ok)
 check(pkgname=="mod8")
 msg = table.concat(map(violation.tostring, msgs), "\n")
 
+subheading("Compiled package files")
+pkgcache = import "pkgcache"
+if not pkgcache.enabled then
+   print("Skipping tests of .rplc files, because the rplc module is not available")
+else
+   tmp = os.tmpname()
+   dir, modname = tmp:match("^(.*)/([^/]+)$")
+   function write_module(src)
+      local f = assert(io.open(tmp .. ".rpl", "w"))
+      f:write("package cachetest\nimport num\n", src)
+      f:close()
+   end
+   function cache_engine()
+      local en = rosie.engine.new()
+      en:set_libpath(dir .. common.pathsep .. en:get_libpath())
+      return en
+   end
+   write_module('d = num.int "!"\n')
+   e1 = cache_engine()
+   ok, pkgname, msgs = e1:import(modname)
+   check(ok)
+   check(pkgname=="cachetest")
+   check(io.open(tmp .. ".rplc"), "expected a .rplc file to be written")
+   hits, misses = pkgcache.hits, pkgcache.misses
+   e2 = cache_engine()
+   ok, pkgname, msgs = e2:import(modname)
+   check(ok)
+   check(pkgname=="cachetest")
+   check(pkgcache.hits > hits)		    -- cachetest, and num if its .rplc was written
+   check(pkgcache.misses==misses)
+   for _, input in ipairs{"42!", "-1!", "x!", "42"} do
+      ok1, m1, left1 = e1:match("cachetest.d", input)
+      ok2, m2, left2 = e2:match("cachetest.d", input)
+      check(ok1 and ok2)
+      check(left1==left2)
+      check(util.table_to_pretty_string(m1 or {})==util.table_to_pretty_string(m2 or {}), input)
+   end
+   ok, tr = e2:trace("cachetest.d", "42!")
+   check(ok)
+   -- Compiling with a list of captures to keep reaches inside a cached package
+   for _, en in ipairs{e1, e2} do
+      m = en:compile("cachetest.d", {}):match("42!")
+      check(m and (m.type=="cachetest.d") and (not m.subs))
+      m = en:compile("cachetest.d", {"num.int"}):match("42!")
+      check(m and m.subs and (#m.subs==1) and (m.subs[1].type=="num.int"))
+   end
+   -- A change to the source makes the .rplc file invalid
+   write_module('d = num.int "?"\n')
+   misses = pkgcache.misses
+   e3 = cache_engine()
+   ok, pkgname, msgs = e3:import(modname)
+   check(ok)
+   check(pkgcache.misses > misses)
+   ok, m = e3:match("cachetest.d", "42?")
+   check(ok and m and m.type=="cachetest.d")
+   os.remove(tmp .. ".rplc")
+   os.remove(tmp .. ".rpl")
+   os.remove(tmp)
+end
 
 -- return the test results in case this file is being called by another one which is collecting
 -- up all the results:
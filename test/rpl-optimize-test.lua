@@ -0,0 +1,204 @@
+-- -*- Mode: Lua; -*-
+--
+-- rpl-optimize-test.lua
+--
+-- © Copyright IBM Corporation 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+assert(TEST_HOME, "TEST_HOME is not set")
+
+list = import "list"
+map = list.map
+common = import "common"
+violation = import "violation"
+ast = import "ast"
+expand = import "expand"
+optimize = import "optimize"
+pkgcache = import "pkgcache"
+environment = import "environment"
+ustring = import "ustring"
+
+check = test.check
+heading = test.heading
+subheading = test.subheading
+
+test.start(test.current_filename())
+
+e = rosie.engine.new("optimize test engine")
+check(rosie.engine.is(e))
+
+-- Return the expression exp after syntax expansion, and after optimization
+function optimized(exp)
+   local errs = {}
+   local a = e.compiler.parse_expression(common.source.new{text=exp}, errs)
+   assert(a, "parse failed: " .. exp)
+   a = expand.expression(ast.ambient_cook_exp(a), e.env, errs)
+   assert(a, "expand failed: " .. exp)
+   return a, optimize.expression(a, e.env)
+end
+
+function unwrap(a)
+   while ast.sequence.is(a) and (#a.exps == 1) do a = a.exps[1]; end
+   return a
+end
+
+-- Check that exp gives the same output on each input with and without optimization
+function check_same(exp, inputs)
+   for _, input in ipairs(inputs) do
+      optimize.enabled = false
+      local ok1, m1, left1 = e:match(exp, input, 1, "json")
+      optimize.enabled = true
+      local ok2, m2, left2 = e:match(exp, input, 1, "json")
+      check(ok1 and ok2 and (m1 == m2) and (left1 == left2),
+	    "optimized output differs for " .. exp .. " on input '" .. input .. "'", 1)
+   end
+end
+
+heading("Optimizer rewrites")
+
+subheading("Literal fusion")
+before, after = optimized('{"ab" "cd" "e"}')
+check(ast.literal.is(unwrap(after)))
+check(ustring.unescape_string(unwrap(after).value) == "abcde")
+check(optimize.size(after) < optimize.size(before))
+before, after = optimized('{"a\\"" "\\\\b"}')
+check(ast.literal.is(unwrap(after)))
+check(ustring.unescape_string(unwrap(after).value) == 'a"\\b')
+check_same('{"ab" "cd" "e"}', {"abcde", "abcd", "abcdef", "xabcde"})
+check_same('{"a\\"" "\\\\b"}', {'a"\\b', 'a"', "a"})
+-- Literals are not fused across a token boundary
+before, after = optimized('"ab" "cd"')
+check(#unwrap(after).exps == 3)
+
+subheading("Single characters merged into sets")
+before, after = optimized('"a" / [0-9] / "-" / [:space:]')
+check(ast.bracket.is(unwrap(after)))
+check(optimize.size(after) < optimize.size(before))
+check_same('"a" / [0-9] / "-" / [:space:]', {"a", "5", "-", " ", "b", ""})
+check_same('"a" / "é" / [α-ω]', {"a", "é", "β", "e", "\xc3"})
+-- Single bytes above 0x7F are not merged with multi-byte characters
+before, after = optimized('"\\xC3" / "é"')
+check(ast.choice.is(unwrap(after)))
+check_same('"\\xC3" / "é"', {"é", "\xc3x", "e"})
+-- A choice of longer literals is left for the compiler (which may build a trie)
+before, after = optimized('"ab" / "ac"')
+check(ast.choice.is(unwrap(after)))
+
+subheading("Common prefixes factored out of choices")
+before, after = optimized('{"http:" [:digit:]} / {"https:" [:alpha:]} / "ftp"')
+check(ast.choice.is(unwrap(after)))
+check(#unwrap(after).exps == 2)
+check(optimize.size(after) < optimize.size(before))
+check_same('{"http:" [:digit:]} / {"https:" [:alpha:]} / "ftp"',
+	   {"http:1", "https:a", "http:a", "https:1", "ftp", "http", ""})
+e:load('x = [:digit:]+')
+before, after = optimized('{x "a"} / {x "b"} / "c"')
+check(ast.choice.is(unwrap(after)) and (#unwrap(after).exps == 2))
+check(ast.sequence.is(unwrap(unwrap(after).exps[1])))
+check_same('{x "a"} / {x "b"} / "c"', {"12a", "3b", "45", "c", ""})
+-- No alternative may become empty, since the order of the alternatives matters
+before, after = optimized('"ab" / {"ab" "c"}')
+check_same('"ab" / {"ab" "c"}', {"ab", "abc", "a"})
+before, after = optimized('{x} / {x "a"}')
+check(ast.choice.is(unwrap(after)))
+
+subheading("Small aliases inlined")
+e:load('alias d = [:digit:]  alias dash = "-"  alias big = {d d d d d d d d d}')
+before, after = optimized('{d dash d}')
+for _, exp in ipairs(unwrap(after).exps) do check(not ast.ref.is(unwrap(exp))); end
+check_same('{d dash d}', {"1-2", "1-", "12", "a-1"})
+before, after = optimized('{big}')
+check(ast.ref.is(unwrap(after)))
+-- A reference at top level is not changed, because it determines the name of the match
+before, after = optimized('d')
+check(after == before)
+check_same('d', {"1", "a"})
+-- Non-alias references are never inlined, because they capture
+before, after = optimized('{x x}')
+check(ast.ref.is(unwrap(after).exps[1]))
+
+subheading("Disabled")
+optimize.enabled = false
+before, after = optimized('{"ab" "cd" "e"}')
+check(after == before)
+optimize.enabled = true
+
+heading("Same output for the patterns in the rpl directory")
+
+-- The test strings of a package, which are the quoted strings on its "-- test" lines
+function test_strings(filename)
+   local f = io.open(filename, "r")
+   if not f then return {}; end
+   local strings = {}
+   for line in f:lines() do
+      if line:find("^%-%- test ") then
+	 for str in line:gmatch('"(.-[^\\])"') do
+	    local s = ustring.unescape_string(str)
+	    if s then table.insert(strings, s); end
+	 end
+      end
+   end
+   f:close()
+   return strings
+end
+
+samples = {"", " ", "a", "Z", "0", "42", "-3.14e10", "0x1F", "deadbeef", "hello world",
+	   "The quick brown fox", "2018-03-21", "Mar 21, 2018", "21 March 2018",
+	   "12:34:56.789", "12:34:56+01:00", "2018-03-21T12:34:56Z", "Wed Mar 21 12:34:56 2018",
+	   "192.168.1.1", "::1", "fe80::1ff:fe23:4567:890a", "a.b.com", "http://a.b.com:80/x?y=z",
+	   "user@example.com", "/usr/local/bin", "C:\\Windows", "a,b,c", "\"a\",\"b\"", "a|b|c",
+	   "{\"k\": [1, 2.5, true, null]}", "[]", "\"str\\\"ing\"", "123e4567-e89b-12d3-a456-426655440000",
+	   "αβγ", "été", "日本語", "Привет", "مرحبا", "\t\r\n", "\xff\xfe", "x\0y"}
+
+saved_cache_flag = pkgcache.enabled
+pkgcache.enabled = false			    -- make both engines compile from source
+
+importpaths = {"all", "csv", "date", "id", "json", "net", "num", "os", "time", "ts", "word",
+	       "Unicode/Ascii", "Unicode/Block", "Unicode/Category", "Unicode/GraphemeBreak",
+	       "Unicode/LineBreak", "Unicode/NumericType", "Unicode/Property", "Unicode/Script",
+	       "Unicode/SentenceBreak", "Unicode/WordBreak", "rosie/rpl_1_2", "rosie/rcfile"}
+
+optimize.enabled = false
+plain = rosie.engine.new("unoptimized engine")
+optimize.enabled = true
+optimized_engine = rosie.engine.new("optimized engine")
+
+for _, importpath in ipairs(importpaths) do
+   optimize.enabled = false
+   local ok1, pkgname = plain:import(importpath)
+   optimize.enabled = true
+   local ok2 = optimized_engine:import(importpath)
+   check(ok1 and ok2, "failed to import " .. importpath)
+   if ok1 and ok2 then
+      local inputs = test_strings(ROSIE_HOME .. "/rpl/" .. importpath .. ".rpl")
+      for _, s in ipairs(samples) do table.insert(inputs, s); end
+      local names = {}
+      for name in pairs(environment.exported_bindings(plain.env:lookup(pkgname))) do
+	 table.insert(names, name)
+      end
+      table.sort(names)
+      local failures = 0
+      for _, name in ipairs(names) do
+	 local exp = pkgname .. "." .. name
+	 for _, input in ipairs(inputs) do
+	    local ok1, m1, left1 = plain:match(exp, input, 1, "json")
+	    local ok2, m2, left2 = optimized_engine:match(exp, input, 1, "json")
+	    if not (ok1 and ok2 and (m1 == m2) and (left1 == left2)) then
+	       failures = failures + 1
+	       if failures <= 5 then
+		  check(false, "optimized output differs for " .. exp .. " on input '" .. input .. "'")
+	       end
+	    end
+	 end
+      end
+      check(failures == 0, importpath .. ": " .. failures .. " differences in " ..
+	    #names .. " patterns")
+   end
+end
+
+pkgcache.enabled = saved_cache_flag
+
+-- return the test results in case this file is being called by another one which is collecting
+-- up all the results:
+return test.finish()
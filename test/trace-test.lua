@@ -13,6 +13,7 @@ trace = rosie.env.trace
 ast = rosie.env.ast
 
 list = import("list")
+util = import("util")
 check = test.check
 heading = test.heading
 subheading = test.subheading
@@ -424,5 +425,83 @@ check_trace('foo', "b", false)
 check_trace('foo', "c", false)
 check_trace('foo', "d", true, 2)
 
+----------------------------------------------------------------------------------------
+heading("Memoized, bounded, and streaming traces")
+----------------------------------------------------------------------------------------
+-- Both alternatives reach the definition of 'a' at position 1, which is traced only once
+function innermost(t)
+   while t.subs and (#t.subs == 1) do t = t.subs[1]; end
+   return t
+end
+check_trace('alternate_a / a / b', "b", true, 2)
+check_structure('{alternate_a / a / b}', {false, 'alternate_a', 'a', 'b', true})
+check(innermost(lasttrace.subs[1]) == innermost(lasttrace.subs[2]))
+check(not innermost(lasttrace.subs[2]).match)
+
+r = e:compile('{a b}+')
+input = string.rep("ab", 50)
+t = trace.internal(r, input, 1, {max_nodes=5})
+check(t.match and (t.nextpos == #input + 1))	    -- the budget does not change the result
+function count_truncated(t)
+   local n = t.truncated and 1 or 0
+   for _, sub in ipairs(t.subs or {}) do n = n + count_truncated(sub); end
+   return n
+end
+check(count_truncated(t) > 0)
+t = trace.internal(r, input, 1, {max_nodes=false, max_depth=1})
+check(t.match and (#t.subs > 0) and t.subs[1].truncated)
+check(trace.tostring(t):find("Trace budget reached"))
+t = trace.internal(r, input, 1, {max_nodes=false})
+check(count_truncated(t) == 0)
+
+ok, matched, lines = e:trace('{a b}+', "abab", 1, "stream")
+check(ok and matched)
+lines = util.split(lines, "\n")
+check(#lines > 1)
+check(lines[1]:find("^Expression: "))
+check(lines[1]:find("Matched 4 chars"))
+check(lines[2]:find("^  Expression: "))
+streamed = {}
+ok, matched, lines = e:trace('alternate_a / a / b', "b", 1, "stream",
+			     function(line) table.insert(streamed, line); end)
+check(ok and matched and (lines == ""))
+memo_hits = 0
+for _, line in ipairs(streamed) do
+   if line:find("%(traced above%)$") then memo_hits = memo_hits + 1; end
+end
+check(memo_hits == 1)
+
+----------------------------------------------------------------------------------------
+heading("Profile")
+----------------------------------------------------------------------------------------
+ok, p, m, nextpos = e:profile('{{a / b}+ c}', "abac")
+check(ok and m and (nextpos == 5))
+check(p.inputs == 1)
+check(p.bindings.a.calls == 4 and p.bindings.a.matches == 2)
+check(p.bindings.a.self_steps == 6)		    -- 4 attempts and 2 bytes
+check(p.bindings.b.calls == 2 and p.bindings.b.matches == 1)
+check(p.bindings.c.calls == 1 and p.bindings.c.matches == 1)
+check(p.bindings["*"].backtracks == 3)
+check(p.bindings["*"].total_steps == 11)
+check(not p.bindings.d)
+check(p.bindings.a.location:find(":1$"))
+
+ok, p, m, nextpos = e:profile('{{a / b}+ c}', "abab", 1, p)
+check(ok and (not m))
+check(p.inputs == 2)
+check(p.bindings.c.calls == 2 and p.bindings.c.matches == 1)
+
+report = rosie.env.profile.report(p)
+check(report:find("Profile of 2 inputs"))
+check(report:find(" a "))
+folded = rosie.env.profile.folded(p, "steps")
+check(folded:find("^%*;a %d+"))
+check(folded:find("\n%*;c %d+"))
+
+-- A reference at the top level has no binding of its own in the profile
+ok, p, m, nextpos = e:profile('alternate_a', "a")
+check(ok and m and (nextpos == 2))
+check(p.bindings.a.calls == 1)
+
 
 return test.finish()